@@ -9,6 +9,10 @@
 #include <functional>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <future>
+#include <string>
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <iostream>
@@ -236,6 +240,9 @@ public:
      */
     bool join(unsigned long timeout = 0) {
         if (state == ThreadState::IDLE || state == ThreadState::STOPPED) {
+            // 任务已经结束，但std::thread仍需join，否则析构时会调用std::terminate
+            if (worker.joinable() && worker.get_id() != std::this_thread::get_id())
+                worker.join();
             return true;
         }
 
@@ -392,6 +399,499 @@ public:
 };
 
 
+
+// 线程池中一个工作线程的统计信息
+struct ThreadPoolWorkerStats {
+    size_t queueDepth = 0;      // 队列中等待的任务数
+    uint64_t executed = 0;      // 已执行的任务数
+    uint64_t steals = 0;        // 从其他工作线程窃取的任务数
+    double idleSeconds = 0;     // 没有任务可做的时间（秒）
+};
+
+// 线程池的统计信息
+struct ThreadPoolStats {
+    std::vector<ThreadPoolWorkerStats> workers;
+    uint64_t submitted = 0;     // 提交的任务数
+    uint64_t cancelled = 0;     // 因取消而丢弃的任务数
+    uint64_t helped = 0;        // 由等待中的线程通过runOne()执行的任务数
+};
+
+
+
+// 工作窃取线程池。
+// 每个工作线程有自己的双端队列：自己从队尾取任务（后进先出，缓存更热），
+// 空闲时从其他工作线程的队首窃取（先进先出，偷走最早的任务）。
+// 工作线程内部提交的任务进入自己的队列，外部提交的任务轮流分配给各工作线程。
+class ThreadPool {
+private:
+    // 队列中的任务
+    struct PoolTask {
+        std::function<void()> run;                      // 任务本身
+        std::function<void()> drop;                     // 任务因取消被丢弃时调用，可以为空
+    };
+
+    // 工作线程
+    struct Worker {
+        std::deque<PoolTask> tasks;                     // 任务队列
+        mutable std::mutex mutex;                       // 队列互斥锁
+        std::atomic<uint64_t> executed{0};              // 已执行的任务数
+        std::atomic<uint64_t> steals{0};                // 窃取的任务数
+        std::atomic<uint64_t> idleUs{0};                // 空闲时间（微秒）
+        std::thread thread;                             // 线程对象
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;       // 工作线程
+    std::mutex sleepMutex;                              // 休眠与等待用的互斥锁
+    std::condition_variable sleepCv;                    // 有新任务时唤醒工作线程
+    std::condition_variable doneCv;                     // 所有任务完成时唤醒wait()
+    std::atomic<size_t> queued{0};                      // 队列中的任务数
+    std::atomic<size_t> unfinished{0};                  // 已提交但还没有完成的任务数
+    std::atomic<size_t> nextWorker{0};                  // 外部提交时的下一个工作线程
+    std::atomic<size_t> sleeping{0};                    // 正在休眠的工作线程数
+    std::atomic<bool> cancelRequested{false};           // 取消请求标志
+    std::atomic<bool> stopping{false};                  // 线程池正在销毁
+    std::atomic<uint64_t> submittedTasks{0};
+    std::atomic<uint64_t> cancelledTasks{0};
+    std::atomic<uint64_t> helpedTasks{0};
+
+    // 当前线程所属的线程池和工作线程序号
+    static ThreadPool*& currentPool() {
+        static thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+    static size_t& currentIndex() {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    // 从自己的队尾取任务
+    bool pop(size_t index, PoolTask& task) {
+        Worker& w = *workers[index];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.tasks.empty()) return false;
+        task = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        queued--;
+        return true;
+    }
+
+    // 从其他工作线程的队首窃取任务
+    bool steal(size_t index, PoolTask& task) {
+        for (size_t i = 1; i <= workers.size(); i++) {
+            Worker& victim = *workers[(index + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    // 执行任务
+    void execute(PoolTask& task) {
+        try {
+            task.run();
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Exception from ThreadPool(%p) task:\n", (void*) this);
+            fprintf(stderr, "    %s\n", e.what());
+        } catch (...) {
+            fprintf(stderr, "Exception from ThreadPool(%p) task:\n", (void*) this);
+            fprintf(stderr, "    Unknown exception\n");
+        }
+        task = PoolTask();
+        finish(1);
+    }
+
+    // 标记任务完成
+    // 可能归零的那一次减法在锁内进行，wait()返回之后就不会再有线程访问线程池
+    void finish(size_t count) {
+        size_t left = unfinished;
+        while (left > count) {
+            if (unfinished.compare_exchange_weak(left, left - count)) return;
+        }
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        if (unfinished.fetch_sub(count) == count) doneCv.notify_all();
+    }
+
+    // 工作线程执行函数
+    void run(size_t index) {
+        currentPool() = this;
+        currentIndex() = index;
+        Worker& w = *workers[index];
+        PoolTask task;
+        while (true) {
+            if (pop(index, task)) {
+                execute(task);
+                w.executed++;
+                continue;
+            }
+            if (steal(index, task)) {
+                w.steals++;
+                execute(task);
+                w.executed++;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            if (stopping) break;
+            if (queued > 0) continue;
+            auto idleStart = std::chrono::steady_clock::now();
+            sleeping++;
+            sleepCv.wait(lock, [this]() { return stopping || queued > 0; });
+            sleeping--;
+            w.idleUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - idleStart).count();
+        }
+        currentPool() = nullptr;
+    }
+
+public:
+    /**
+     * 构造函数。
+     * @param threads 工作线程数，0表示使用CPU核心数
+     */
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back(new Worker());
+        for (size_t i = 0; i < threads; i++)
+            workers[i]->thread = std::thread(&ThreadPool::run, this, i);
+    }
+
+    // 析构函数。
+    // 等待已提交的任务完成后再停止工作线程。
+    ~ThreadPool() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        sleepCv.notify_all();
+        for (auto& w : workers) {
+            if (w->thread.joinable()) w->thread.join();
+        }
+    }
+
+    // 禁止拷贝
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * 提交任务。
+     * @param func 任务
+     * @param onDrop 任务因cancel()被丢弃时调用，可以为空
+     * @return 是否成功提交，线程池已取消时返回false，此时两个函数都不会被调用
+     */
+    bool submit(std::function<void()> func, std::function<void()> onDrop = nullptr) {
+        if (!func) return false;
+        if (cancelRequested) {
+            cancelledTasks++;
+            return false;
+        }
+        size_t index = currentPool() == this
+            ? currentIndex()
+            : nextWorker.fetch_add(1) % workers.size();
+        unfinished++;
+        submittedTasks++;
+        {
+            Worker& w = *workers[index];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.tasks.push_back({ std::move(func), std::move(onDrop) });
+            queued++;
+        }
+        // 没有休眠的工作线程时不需要通知，避免每次提交都争用sleepMutex。
+        // 工作线程先增加sleeping再检查queued，这里先增加queued再检查sleeping，两边至少有一边能看到对方。
+        if (sleeping > 0) {
+            // 先加锁再通知，避免工作线程在检查queued之后、休眠之前错过通知
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+            }
+            sleepCv.notify_one();
+        }
+        return true;
+    }
+
+    /**
+     * 提交有返回值的任务。
+     * @param func 任务
+     * @return 任务结果的future；任务被取消或没有提交成功时，get()会抛出std::future_error
+     */
+    template <typename F>
+    auto async(F&& func) -> std::future<decltype(func())> {
+        using R = decltype(func());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(func));
+        std::future<R> result = task->get_future();
+        submit([task]() { (*task)(); });
+        return result;
+    }
+
+    /**
+     * 在当前线程执行一个队列中的任务。
+     * 等待其他任务的线程可以用它帮忙，避免在工作线程中等待时占着线程不干活。
+     * @return 是否执行了任务
+     */
+    bool runOne() {
+        PoolTask task;
+        bool isWorker = currentPool() == this;
+        size_t index = isWorker ? currentIndex() : 0;
+        if (isWorker && pop(index, task)) {
+            execute(task);
+            workers[index]->executed++;
+            return true;
+        }
+        if (!steal(isWorker ? index : workers.size() - 1, task)) return false;
+        if (isWorker) workers[index]->steals++;
+        else helpedTasks++;
+        execute(task);
+        if (isWorker) workers[index]->executed++;
+        return true;
+    }
+
+    // 等待所有已提交的任务完成。
+    // 注意：不能在本线程池的任务中调用，任务中请使用runOne()或TaskGraph。
+    void wait() {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        doneCv.wait(lock, [this]() { return unfinished == 0; });
+    }
+
+    // 取消线程池。
+    // 丢弃队列中的任务（调用它们的onDrop），之后的submit()都会失败，正在执行的任务会继续执行完。
+    // 正在执行的任务可以定期检查shouldStop()来提前退出。
+    void cancel() {
+        cancelRequested = true;
+        std::vector<PoolTask> dropped;
+        for (auto& w : workers) {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            for (auto& task : w->tasks)
+                dropped.push_back(std::move(task));
+            queued -= w->tasks.size();
+            w->tasks.clear();
+        }
+        cancelledTasks += dropped.size();
+        for (auto& task : dropped) {
+            if (task.drop) task.drop();
+        }
+        if (!dropped.empty()) finish(dropped.size());
+    }
+
+    // 清除取消状态，使线程池可以重新接受任务。
+    void reset() {
+        cancelRequested = false;
+    }
+
+    // 检查是否有取消请求。
+    bool shouldStop() const {
+        return cancelRequested;
+    }
+
+    // 获取工作线程数。
+    size_t size() const {
+        return workers.size();
+    }
+
+    // 检查当前线程是否是本线程池的工作线程。
+    bool isWorkerThread() const {
+        return currentPool() == this;
+    }
+
+    // 获取统计信息。
+    ThreadPoolStats stats() const {
+        ThreadPoolStats result;
+        for (auto& w : workers) {
+            ThreadPoolWorkerStats ws;
+            {
+                std::lock_guard<std::mutex> lock(w->mutex);
+                ws.queueDepth = w->tasks.size();
+            }
+            ws.executed = w->executed;
+            ws.steals = w->steals;
+            ws.idleSeconds = w->idleUs / 1000000.0;
+            result.workers.push_back(ws);
+        }
+        result.submitted = submittedTasks;
+        result.cancelled = cancelledTasks;
+        result.helped = helpedTasks;
+        return result;
+    }
+};
+
+
+
+// 任务图（有向无环图）执行器。
+// 每个节点在它依赖的所有节点完成之后才会提交到线程池，适合“读取 → 哈希 → 压缩 → 写入”这样的流水线：
+// 给每个数据块加一串互相依赖的节点，不同数据块的节点之间可以并行。
+// 节点只能依赖已经添加的节点，因此不会出现环。
+class TaskGraph {
+public:
+    using NodeId = size_t;
+
+private:
+    // 图中的节点
+    struct Node {
+        std::string name;                               // 节点名称，用于错误信息
+        std::function<void()> func;                     // 节点任务
+        std::vector<NodeId> next;                       // 依赖本节点的节点
+        size_t depCount = 0;                            // 依赖的节点数
+        std::atomic<size_t> pending{0};                 // 还没有完成的依赖数
+    };
+
+    std::deque<Node> nodes;                             // 节点（deque保证添加节点时已有节点的地址不变）
+    std::vector<NodeId> roots;                          // 没有依赖的节点
+    std::atomic<size_t> remaining{0};                   // 还没有完成的节点数
+    std::atomic<bool> cancelRequested{false};           // 取消请求标志
+    std::atomic<size_t> skipped{0};                     // 因取消而没有执行的节点数
+    std::mutex mutex;                                   // 保护errorMessage和完成通知
+    std::condition_variable cv;                         // 所有节点完成时唤醒run()
+    std::string errorMessage;                           // 第一个抛出异常的节点的错误信息
+
+    // 提交节点。线程池拒绝时当作已取消，直接在当前线程跳过。
+    void schedule(ThreadPool& pool, NodeId id) {
+        bool ok = pool.submit(
+            [this, &pool, id]() { execute(pool, id); },
+            [this, &pool, id]() { cancelRequested = true; complete(pool, id, false); });
+        if (!ok) {
+            cancelRequested = true;
+            complete(pool, id, false);
+        }
+    }
+
+    // 执行节点
+    void execute(ThreadPool& pool, NodeId id) {
+        Node& node = nodes[id];
+        bool ran = false;
+        if (!cancelRequested && !pool.shouldStop()) {
+            try {
+                node.func();
+                ran = true;
+            } catch (const std::exception& e) {
+                fail(node.name + ": " + e.what());
+            } catch (...) {
+                fail(node.name + ": Unknown exception");
+            }
+        }
+        complete(pool, id, ran);
+    }
+
+    // 记录错误并取消剩下的节点
+    void fail(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (errorMessage.empty()) errorMessage = message;
+        cancelRequested = true;
+    }
+
+    // 节点完成（或被跳过），提交依赖已经全部完成的后继节点。
+    // 取消之后后继节点仍然会走一遍，只是不执行任务，这样remaining总能归零。
+    void complete(ThreadPool& pool, NodeId id, bool ran) {
+        if (!ran) skipped++;
+        for (NodeId next : nodes[id].next) {
+            if (--nodes[next].pending == 0) schedule(pool, next);
+        }
+        // 和ThreadPool::finish()一样，最后一次减法在锁内进行，run()返回之后不会再访问本对象
+        size_t left = remaining;
+        while (left > 1) {
+            if (remaining.compare_exchange_weak(left, left - 1)) return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--remaining == 0) cv.notify_all();
+    }
+
+public:
+    TaskGraph() = default;
+
+    // 禁止拷贝
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    /**
+     * 添加节点。
+     * @param name 节点名称
+     * @param func 节点任务，抛出异常时整个图会被取消
+     * @param deps 依赖的节点，必须是已经添加的节点
+     * @return 节点ID
+     */
+    NodeId add(const std::string& name, std::function<void()> func, const std::vector<NodeId>& deps = {}) {
+        NodeId id = nodes.size();
+        for (NodeId dep : deps) {
+            if (dep >= id) throw std::invalid_argument("TaskGraph::add: dependency of \"" + name + "\" is not added yet");
+        }
+        nodes.emplace_back();
+        Node& node = nodes.back();
+        node.name = name;
+        node.func = std::move(func);
+        node.depCount = deps.size();
+        for (NodeId dep : deps)
+            nodes[dep].next.push_back(id);
+        if (deps.empty()) roots.push_back(id);
+        return id;
+    }
+
+    /**
+     * 在线程池上执行整个图，返回时所有节点都已完成或被跳过。
+     * 在线程池的工作线程中调用时，等待期间会帮忙执行队列中的任务。
+     * @param pool 线程池
+     * @return 是否所有节点都执行成功
+     */
+    bool run(ThreadPool& pool) {
+        if (nodes.empty()) return true;
+        for (auto& node : nodes)
+            node.pending = node.depCount;
+        remaining = nodes.size();
+        skipped = 0;
+        cancelRequested = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            errorMessage.clear();
+        }
+
+        for (NodeId id : roots)
+            schedule(pool, id);
+
+        if (pool.isWorkerThread()) {
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (remaining == 0) break;
+                }
+                if (pool.runOne()) continue;
+                std::unique_lock<std::mutex> lock(mutex);
+                if (cv.wait_for(lock, std::chrono::milliseconds(1), [this]() { return remaining == 0; })) break;
+            }
+        } else {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return remaining == 0; });
+        }
+        return skipped == 0;
+    }
+
+    // 取消执行。还没有开始的节点会被跳过，正在执行的节点会继续执行完。
+    void cancel() {
+        cancelRequested = true;
+    }
+
+    // 检查是否有取消请求，节点任务可以用它来提前退出。
+    bool shouldStop() const {
+        return cancelRequested;
+    }
+
+    // 获取第一个抛出异常的节点的错误信息，没有错误时为空。
+    std::string error() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return errorMessage;
+    }
+
+    // 获取上一次run()中被跳过的节点数。
+    size_t skippedCount() const {
+        return skipped;
+    }
+
+    // 获取节点数。
+    size_t size() const {
+        return nodes.size();
+    }
+};
+
+
 DATATYPES_NAMESPACE_END
 
 #endif // THREAD_H
\ No newline at end of file
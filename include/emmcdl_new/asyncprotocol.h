@@ -0,0 +1,167 @@
+#pragma once
+
+#ifndef EMMCDL_ASYNCPROTOCOL_H
+#define EMMCDL_ASYNCPROTOCOL_H
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <functional>
+#include "emmcdl_new/protocol.h"
+#include "datatypes/bytearray.h"
+
+DATATYPES_NAMESPACE_BEGIN
+class ThreadPool;
+DATATYPES_NAMESPACE_END
+#ifdef DATATYPES_USE_INDEPENDENT_NAMESP
+using datatypes::ThreadPool;
+#endif
+class MappedImage;
+
+
+// Outcome of a queued device operation.
+// 排队的设备操作的结果。
+struct ProtocolResult {
+    int status = ERROR_SUCCESS;
+    DWORD bytes = 0;                        // Bytes read or written.           读取或写入的字节数。
+    std::shared_ptr<ByteArray> data;        // Data returned by ReadData.        ReadData返回的数据。
+};
+
+
+/**
+ * @class ProtocolOp
+ * @brief Handle of an operation queued on an AsyncProtocol. Copies share the same operation.
+ *        Continuations added with Then run only if it succeeded; a failure is passed down the
+ *        chain unchanged, so the status at the end of a chain is the first error.
+ *        AsyncProtocol上排队的操作的句柄，复制后指向同一个操作。用Then添加的后续操作只在它成功时执行；
+ *        失败的结果会原样沿着链传递下去，因此链末尾的状态就是第一个错误。
+ */
+class ProtocolOp {
+public:
+    ProtocolOp() = default;
+
+    // Whether the handle refers to an operation. 句柄是否指向一个操作。
+    bool Valid() const { return state != nullptr; }
+
+    // Whether the operation has completed. 操作是否已经完成。
+    bool Ready() const;
+
+    /**
+     * @brief Block until the operation completes.
+     *        阻塞直到操作完成。
+     * @return Result, valid as long as the handle. 结果，在句柄存在期间有效。
+     */
+    const ProtocolResult& Wait() const;
+
+    // Block and return the status code. 阻塞并返回错误代码。
+    int Status() const { return Wait().status; }
+
+    /**
+     * @brief Run host work after the operation succeeds, on the host pool, while the device
+     *        queue goes on with the next operation. E.g. compress after read.
+     *        操作成功后在主机线程池上执行主机端工作，同时设备队列继续执行下一个操作。例如读取后压缩。
+     * @param func [in] Continuation. 后续操作。
+     * @return The continuation. 后续操作的句柄。
+     */
+    ProtocolOp Then(std::function<ProtocolResult(const ProtocolResult&)> func) const;
+
+    /**
+     * @brief Queue device work after the operation succeeds. E.g. read back after write.
+     *        操作成功后把设备操作加入设备队列。例如写入后读回校验。
+     * @param func [in] Continuation, runs on the device thread. 后续操作，在设备线程上执行。
+     * @return The continuation. 后续操作的句柄。
+     */
+    ProtocolOp ThenOnDevice(std::function<ProtocolResult(Protocol&, const ProtocolResult&)> func) const;
+
+    /**
+     * @brief Call back on the host pool when the operation completes, failed or not.
+     *        操作完成时（无论成功与否）在主机线程池上回调。
+     * @param func [in] Completion callback. 完成回调。
+     */
+    void OnComplete(std::function<void(const ProtocolResult&)> func) const;
+
+    struct State;               // Defined in asyncprotocol.cpp. 在asyncprotocol.cpp中定义。
+
+private:
+    friend class AsyncProtocol;
+    std::shared_ptr<State> state;
+};
+
+
+/**
+ * @class AsyncProtocol
+ * @brief Asynchronous facade of a Protocol. Operations are queued in order and run one at a
+ *        time on a device thread, since the transport is a single serial stream; the caller gets
+ *        a ProtocolOp back at once and overlaps host work with the transfer. The blocking
+ *        Protocol methods are still what runs on the device thread, so Wait() on any operation
+ *        gives exactly what calling the method directly would. Do not call the Protocol directly
+ *        while operations are queued.
+ *        Protocol的异步外观。由于传输通道是单一的串行流，操作按顺序排队，并在设备线程上逐个执行；
+ *        调用者立即得到一个ProtocolOp，可以在传输期间进行主机端的工作。设备线程上执行的仍然是阻塞的Protocol方法，
+ *        因此对任何操作调用Wait()得到的结果与直接调用该方法完全相同。有操作在排队时不要直接调用Protocol。
+ */
+class AsyncProtocol {
+public:
+    /**
+     * @brief Constructor.
+     *        构造函数。
+     * @param proto    [in] Connected protocol, must outlive this object. 已连接的协议，生命周期必须长于本对象。
+     * @param hostPool [in] Pool for host continuations, nullptr for the shared one. 主机端后续操作使用的线程池，nullptr表示共享线程池。
+     */
+    AsyncProtocol(Protocol* proto, ThreadPool* hostPool = nullptr);
+
+    // Waits for the queued operations. 等待排队的操作完成。
+    ~AsyncProtocol();
+
+    AsyncProtocol(const AsyncProtocol&) = delete;
+    AsyncProtocol& operator=(const AsyncProtocol&) = delete;
+
+    // Protocol::WriteData; the buffer must stay valid until the operation completes.
+    // Protocol::WriteData；缓冲区在操作完成之前必须有效。
+    ProtocolOp WriteData(BYTE* writeBuffer, int64_t writeOffset, DWORD writeBytes, uint8_t partNum);
+
+    // Protocol::WriteData on a copy of the data. 对数据的副本调用Protocol::WriteData。
+    ProtocolOp WriteData(const ByteArray& writeBuffer, int64_t writeOffset, uint8_t partNum);
+
+    // Protocol::ReadData, the data is in ProtocolResult::data. Protocol::ReadData，数据在ProtocolResult::data中。
+    ProtocolOp ReadData(int64_t readOffset, DWORD readBytes, uint8_t partNum);
+
+    // Protocol::FastCopy. 调用Protocol::FastCopy。
+    ProtocolOp FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t sectorWrite, uint64_t sectors, uint8_t partNum);
+
+    // Protocol::FastCopyImage; the image must stay mapped until the operation completes.
+    // Protocol::FastCopyImage；镜像在操作完成之前必须保持映射。
+    ProtocolOp FastCopyImage(const MappedImage* image, int64_t sectorRead, int64_t sectorWrite, uint64_t sectors, uint8_t partNum);
+
+    // Protocol::DumpDiskContents by sector range. 按扇区范围调用Protocol::DumpDiskContents。
+    ProtocolOp DumpDiskContents(uint64_t start_sector, uint64_t num_sectors, const std::string& szOutFile, uint8_t partNum, const std::string& szPartName = "");
+
+    // Protocol::DumpDiskContents by partition name. 按分区名称调用Protocol::DumpDiskContents。
+    ProtocolOp DumpDiskContents(const std::string& szPartName, const std::string& szOutFile, uint8_t partNum);
+
+    /**
+     * @brief Queue any other call on the protocol, e.g. WipeDiskContents or ReadGPT.
+     *        将对协议的其他调用加入队列，例如WipeDiskContents或ReadGPT。
+     * @param func [in] Work run on the device thread. 在设备线程上执行的工作。
+     * @return Handle of the operation. 操作的句柄。
+     */
+    ProtocolOp Submit(std::function<ProtocolResult(Protocol&)> func);
+
+    // Fail the operations not started yet with ERROR_OPERATION_ABORTED. 以ERROR_OPERATION_ABORTED结束还没有开始的操作。
+    void Cancel();
+
+    // Block until every operation queued before the call has completed. Operations queued
+    // afterwards, e.g. by ThenOnDevice, are not waited for.
+    // 阻塞直到调用之前排队的所有操作都完成。之后（例如由ThenOnDevice）加入的操作不会等待。
+    void Drain();
+
+    // Operations queued or running. 正在排队或执行的操作数。
+    size_t Pending() const;
+
+    struct Queue;               // Defined in asyncprotocol.cpp. 在asyncprotocol.cpp中定义。
+
+private:
+    std::shared_ptr<Queue> queue;
+};
+
+#endif // EMMCDL_ASYNCPROTOCOL_H
@@ -0,0 +1,130 @@
+#pragma once
+
+#ifndef EMMCDL_CAPTURE_H
+#define EMMCDL_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "datatypes/bytearray.h"
+
+
+#define CAPTURE_HOST_TO_TARGET    0     // Host to target.   主机到设备。
+#define CAPTURE_TARGET_TO_HOST    1     // Target to host.   设备到主机。
+
+#define CAPTURE_FLAG_TRUNCATED    0x01  // Payload was cut to the snap length. 数据被截断到了快照长度。
+#define CAPTURE_FLAG_SAMPLED_OUT  0x02  // Payload was skipped by sampling.    数据因为采样被跳过。
+
+#define CAPTURE_RING_SIZE         0x800000  // Default ring size, must be a power of 2. 默认环形缓冲区大小，必须是2的幂。
+#define CAPTURE_LINKTYPE          147       // LINKTYPE_USER0 in pcap.                 pcap中的LINKTYPE_USER0。
+
+#pragma pack(push, 1)
+// Pseudo header placed before every payload in the capture file.
+// 捕获文件中每个数据前面的伪头部。
+typedef struct {
+    uint32_t seq;       // Record sequence number.  记录序号。
+    uint8_t  dir;       // CAPTURE_HOST_TO_TARGET / CAPTURE_TARGET_TO_HOST.
+    uint8_t  flags;     // CAPTURE_FLAG_*.
+    uint16_t port;      // Port number.             端口号。
+    int32_t  status;    // Status of the IO.        IO操作的错误代码。
+} capture_pseudo_hdr_t;
+#pragma pack(pop)
+
+
+// Asynchronous traffic capture of a port.
+// Read/Write only copy the (possibly truncated) payload into a lock-free
+// single-producer ring; a writer thread appends the records to one pcap file
+// (LINKTYPE_USER0, every payload prefixed with capture_pseudo_hdr_t).
+// Records are dropped instead of blocking when the ring is full.
+//
+// 端口通信的异步捕获。
+// Read/Write只把（可能被截断的）数据复制到无锁的单生产者环形缓冲区里，
+// 由写入线程把记录追加到同一个pcap文件中（LINKTYPE_USER0，每条数据前面带capture_pseudo_hdr_t）。
+// 缓冲区满时会丢弃记录而不是阻塞。
+class PortCapture {
+public:
+    PortCapture();
+    ~PortCapture();
+
+    /**
+     * @brief
+     * Open the capture file and start the writer thread.
+     *
+     * 打开捕获文件并启动写入线程。
+     * @param fileName    [in] Capture file path.  捕获文件路径。
+     * @param port        [in] Port number recorded in each record. 记录在每条记录里的端口号。
+     * @param snapLen     [in] Payloads longer than this are truncated. 超过这个长度的数据会被截断。
+     * @param sampleEvery [in] Only keep the payload of 1 in N truncated records (1 = keep all).
+     *                         被截断的记录中每N条只保留1条的数据（1表示全部保留）。
+     * @param traceLimit  [in] Records up to this size are also shown in the trace log by the writer thread.
+     *                         不超过这个大小的记录还会由写入线程输出到追踪日志。
+     * @param ringSize    [in] Size of the ring buffer. 环形缓冲区大小。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Start(const std::string& fileName, int port, DWORD snapLen, DWORD sampleEvery,
+              DWORD traceLimit, size_t ringSize = CAPTURE_RING_SIZE);
+
+    // Flush the remaining records and close the file.
+    // 写出剩余的记录并关闭文件。
+    void Stop();
+
+    bool IsRunning() const { return bRunning; }
+
+    /**
+     * @brief
+     * Queue one IO operation. Never blocks.
+     *
+     * 记录一次IO操作，不会阻塞。
+     * @param dir    [in] CAPTURE_HOST_TO_TARGET / CAPTURE_TARGET_TO_HOST.
+     * @param status [in] Status of the IO.  IO操作的错误代码。
+     * @param data   [in] Payload.           数据。
+     * @param length [in] Length of payload. 数据长度。
+     */
+    void Push(uint8_t dir, int status, const BYTE* data, DWORD length);
+
+    // Number of records dropped because the ring was full.
+    // 因为缓冲区满而丢弃的记录数。
+    uint64_t Dropped() const { return dropped; }
+
+private:
+    // Record header in the ring, followed by capLen bytes of payload.
+    // 环形缓冲区中的记录头，后面跟着capLen字节的数据。
+    typedef struct {
+        uint32_t recLen;    // Total length including header and padding, 0 means wrap. 包含头部和对齐的总长度，0表示回绕。
+        uint8_t  dir;
+        uint8_t  flags;
+        uint16_t reserved;
+        int32_t  status;
+        uint32_t origLen;
+        uint32_t capLen;
+        double   time;
+    } ring_rec_t;
+
+    void WriterLoop();
+    size_t Drain();
+
+    FILE* fp;
+    int portNum;
+    DWORD dwSnapLen;
+    DWORD dwSampleEvery;
+    DWORD dwTraceLimit;
+    uint32_t seq;           // Next record sequence number (writer side).  下一条记录序号（写入线程）。
+    uint64_t truncCount;    // Truncated records so far (producer side).   已截断的记录数（生产者）。
+
+    ByteArray ring;
+    size_t ringMask;
+    std::atomic<uint64_t> head;     // Written by producer. 生产者写入位置。
+    std::atomic<uint64_t> tail;     // Written by writer thread. 写入线程读取位置。
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> bRunning;
+    std::atomic<bool> bStopWriter;
+    std::thread writer;
+};
+
+#endif // EMMCDL_CAPTURE_H
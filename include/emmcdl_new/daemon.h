@@ -0,0 +1,107 @@
+#pragma once
+
+#ifndef EMMCDL_DAEMON_H
+#define EMMCDL_DAEMON_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include "emmcdl_new/serialport.h"
+#include "emmcdl_new/firehose.h"
+#include "emmcdl_new/partition.h"
+
+
+#define SESSION_DEFAULT_IDLE_SECONDS    300         // Idle time before a session is closed. 会话空闲多久后关闭。
+#define SESSION_MAX_ARGS                256         // Most arguments a client may send. 客户端最多可以发送的参数个数。
+#define SESSION_MAX_ARG_LEN             4096        // Longest argument a client may send. 客户端可以发送的最长参数。
+
+
+// A device kept open by the daemon between commands.
+// 守护进程在多条命令之间保持打开的设备。
+struct DeviceSession {
+    int port = -1;                      // COM port number.                            COM端口号。
+    SerialPort sport;                   // Open port, reused by every command.         打开的端口，每条命令都使用它。
+    bool bProgrammerLoaded = false;     // The flash programmer is running.            烧录内核正在运行。
+    std::string programmer;             // Programmer that was loaded.                 加载的烧录内核。
+    bool bConfigured = false;           // Firehose <configure> was accepted.          Firehose的<configure>已被接受。
+    uint32_t dwMaxPacketSize = 0;       // Packet size negotiated by configure.        配置时协商的数据包大小。
+    fh_configure_t cfg = {};            // Configuration that was sent.                发送的配置。
+    int sectorSize = 512;               // Sector size used for configure.             配置时使用的扇区大小。
+    std::vector<gpt_entry_t> gpt;       // Cached partition table, empty if unknown.   缓存的分区表，未知时为空。
+    double lastUsed = 0;                // Time of the last command.                   最后一条命令的时间。
+    bool bBusy = false;                 // A command is running, removals are mode switches.
+                                        // 命令正在执行，这时的设备移除是模式切换。
+    bool bGone = false;                 // The device was unplugged.                   设备已被拔出。
+
+    // Whether a command with these options can reuse the configure. 使用这些选项的命令是否可以复用配置。
+    bool SameConfigure(const fh_configure_t& other, int sector) const;
+
+    // Forget everything learned from the programmer, e.g. after a reset. 忘记烧录内核的所有状态，例如重置之后。
+    void Invalidate();
+};
+
+
+/**
+ * @class SessionDaemon
+ * @brief Serves emmcdl commands from a Unix socket and keeps one DeviceSession per port, so
+ *        consecutive commands on the same device skip opening the port, Sahara and configure,
+ *        and reuse the partition table. Sessions are closed after being idle for a while or
+ *        when the device is unplugged.
+ *        Commands run one at a time because emmcdl keeps its options in globals.
+ *        Wire format, native byte order: request = uint32 argc, then argc x (uint32 length, bytes);
+ *        reply = int32 status.
+ *        通过Unix套接字执行emmcdl命令，并为每个端口保留一个DeviceSession，同一设备上的连续命令可以跳过
+ *        打开端口、Sahara和配置，并复用分区表。会话空闲一段时间或设备被拔出后关闭。
+ *        因为emmcdl的选项保存在全局变量中，命令一次只执行一条。
+ *        传输格式（本机字节序）：请求 = uint32 参数个数，然后每个参数为 (uint32 长度, 数据)；响应 = int32 状态。
+ */
+class SessionDaemon {
+public:
+    SessionDaemon(const std::string& socketPath, int idleSeconds = SESSION_DEFAULT_IDLE_SECONDS);
+    ~SessionDaemon();
+
+    /**
+     * @brief Listen on the socket and serve clients until Stop is called.
+     *        监听套接字并为客户端服务，直到调用Stop。
+     * @return Status code. 错误代码。
+     */
+    int Run();
+
+    // Stop serving and close all sessions. 停止服务并关闭所有会话。
+    void Stop();
+
+    /**
+     * @brief Client side: send one command to a running daemon and wait for it to finish.
+     *        客户端：向正在运行的守护进程发送一条命令并等待执行完成。
+     * @param socketPath [in] Socket of the daemon. 守护进程的套接字。
+     * @param args       [in] emmcdl arguments, args[0] is the program name. emmcdl参数，args[0]为程序名。
+     * @return Status of the command, or of the connection if it failed. 命令的错误代码，连接失败时为连接的错误代码。
+     */
+    static int SendCommand(const std::string& socketPath, const std::vector<std::string>& args);
+
+private:
+    void Serve(uintptr_t client);
+    int Execute(std::vector<std::string>& args);
+    std::shared_ptr<DeviceSession> Acquire(int port);
+    void ReapIdle();
+    void CloseSession(DeviceSession& session, const char* why);
+    static int FindPort(const std::vector<std::string>& args);
+    static bool IsDeviceCommand(const std::vector<std::string>& args);
+
+    std::string path;
+    int idleSeconds;
+    uintptr_t listenSock;
+    std::atomic<bool> bStop;
+    std::mutex runMtx;                  // Serializes commands. 串行执行命令。
+    std::mutex sessionsMtx;             // Guards sessions. 保护sessions。
+    std::map<int, std::shared_ptr<DeviceSession>> sessions;
+    std::thread reaper;
+    int monitorId;
+};
+
+#endif // EMMCDL_DAEMON_H
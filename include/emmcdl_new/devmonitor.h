@@ -0,0 +1,161 @@
+#pragma once
+
+#ifndef EMMCDL_DEVMONITOR_H
+#define EMMCDL_DEVMONITOR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+#define DEVMON_FALLBACK_POLL_MS     250     // Rescan interval when no event source is available. 没有事件源时的重新扫描间隔。
+#define DEVMON_ACM_PORT_BASE        256     // Linux: ttyACMn is port BASE+n so it never collides with ttyUSBn.
+                                            // Linux下ttyACMn的端口号为BASE+n，不会和ttyUSBn冲突。
+
+
+// A USB serial device seen by the monitor.
+// 设备监视器看到的USB串口设备。
+struct UsbDeviceInfo {
+    int port;               // COM port number (n for ttyUSBn, DEVMON_ACM_PORT_BASE+n for ttyACMn on Linux), -1 if none.
+                            // COM端口号（Linux下ttyUSBn为n，ttyACMn为DEVMON_ACM_PORT_BASE+n），没有时为-1。
+    std::string name;       // Friendly name.                      友好名称。
+    uint16_t vid;           // Vendor ID.                          厂商ID。
+    uint16_t pid;           // Product ID, tells the mode apart.   产品ID，用来区分模式。
+    std::string serial;     // Serial number, or the location based instance ID when the device has none.
+                            // 序列号，设备没有序列号时为基于位置的实例ID。
+    std::string controller; // USB host controller the device hangs off, empty if unknown.
+                            // 设备所在的USB主控制器，未知时为空。
+    std::string portPath;   // Port path from the root hub, e.g. "1-2.3" on Linux, "2.3" on Windows.
+                            // 从根集线器开始的端口路径，例如Linux下为"1-2.3"，Windows下为"2.3"。
+    int speedMbps = 0;      // Negotiated link speed, 0 if unknown.  协商的链路速度，未知时为0。
+};
+
+enum device_event_e {
+    DEVICE_ARRIVED,         // Device appeared.    设备出现。
+    DEVICE_REMOVED          // Device went away.   设备消失。
+};
+
+// Which device to wait for. Empty / zero fields match anything.
+// 要等待的设备。为空或为0的字段可以匹配任何值。
+struct DeviceMatch {
+    std::string serial;
+    uint16_t vid = 0;
+    uint16_t pid = 0;
+};
+
+
+/**
+ * @class DeviceMonitor
+ * @brief Event driven list of USB serial devices.
+ *        Linux listens to kernel uevents on a netlink socket; Windows receives WM_DEVICECHANGE
+ *        on a message-only window and re-enumerates with SetupAPI. Both fall back to
+ *        rescanning every DEVMON_FALLBACK_POLL_MS when the event source cannot be created.
+ *        Sessions wait for "device X came back (in mode Y)" instead of sleeping.
+ *        事件驱动的USB串口设备列表。
+ *        Linux下通过netlink套接字监听内核uevent；Windows下用仅消息窗口接收WM_DEVICECHANGE，再用SetupAPI重新枚举。
+ *        事件源无法创建时，两者都会退回到每DEVMON_FALLBACK_POLL_MS重新扫描一次。
+ *        会话可以等待“设备X（以模式Y）重新出现”，而不是固定地等待一段时间。
+ */
+class DeviceMonitor {
+public:
+    typedef std::function<void(device_event_e, const UsbDeviceInfo&)> Callback;
+
+    // The process-wide monitor, started on first use.
+    // 进程内唯一的监视器，第一次使用时启动。
+    static DeviceMonitor& Instance();
+
+    ~DeviceMonitor();
+
+    // Current devices. 当前的设备。
+    std::vector<UsbDeviceInfo> Devices();
+
+    // Find the device behind a port. 查找端口对应的设备。
+    bool FindByPort(int port, UsbDeviceInfo* info);
+
+    /**
+     * @brief Register a callback for arrival/removal events. It runs on the monitor thread.
+     *        注册设备出现/消失事件的回调，回调在监视线程中执行。
+     * @return Id for Unsubscribe. 用于取消注册的ID。
+     */
+    int Subscribe(Callback cb);
+
+    // Remove a callback. Waits for a running call of it to return, so what it captured may be destroyed afterwards.
+    // 取消注册回调。会等正在执行的这个回调返回，之后就可以销毁它引用的对象。
+    void Unsubscribe(int id);
+
+    /**
+     * @brief Wait until a matching device arrives.
+     *        等待匹配的设备出现。
+     * @param match          [in]  Device to wait for. 要等待的设备。
+     * @param timeoutMs      [in]  Timeout. 超时时间。
+     * @param info           [out] The device, optional. 出现的设备，可选。
+     * @param bPresentCounts [in]  Whether a device that is already present satisfies the wait.
+     *                             已经存在的设备是否也算。
+     * @return Whether it arrived in time. 是否在超时前出现。
+     */
+    bool WaitForArrival(const DeviceMatch& match, int timeoutMs, UsbDeviceInfo* info = nullptr,
+                        bool bPresentCounts = false);
+
+    /**
+     * @brief Wait until a matching device is gone.
+     *        等待匹配的设备消失。
+     * @return Whether it went away in time. 是否在超时前消失。
+     */
+    bool WaitForRemoval(const DeviceMatch& match, int timeoutMs);
+
+    // Remember that the device on a port was told to switch mode / reset.
+    // 记录某个端口上的设备被要求切换模式或重置。
+    void MarkModeSwitch(int port, const char* what);
+
+    // Log the time from the last mode switch of a port (or of the device now on it) to its first command.
+    // 输出从端口（或现在位于这个端口的设备）上次切换模式到第一条命令的时间。
+    void LogFirstCommand(int port);
+
+private:
+    DeviceMonitor();
+    DeviceMonitor(const DeviceMonitor&) = delete;
+    DeviceMonitor& operator=(const DeviceMonitor&) = delete;
+
+    struct ModeSwitch {
+        double time;
+        std::string what;
+        std::string serial;
+    };
+
+    void Start();
+    void Stop();
+    void Rescan();
+    void EventLoop();
+    std::vector<UsbDeviceInfo> Enumerate();
+    static bool Matches(const DeviceMatch& match, const UsbDeviceInfo& info);
+
+#ifdef _WIN32
+    static LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+    HWND hWnd;
+#else
+    int nlSocket;
+#endif
+
+    std::mutex mtx;
+    std::condition_variable cvChange;   // Signaled after every rescan that changed something. 每次扫描发现变化后通知。
+    std::vector<UsbDeviceInfo> devices;
+    uint64_t generation;                // Bumped on every change. 每次变化时递增。
+    std::map<int, Callback> callbacks;
+    int nextCallbackId;
+    int runningCallbackId;              // Callback being run by Rescan, 0 if none. Rescan正在执行的回调，没有时为0。
+    std::condition_variable cvCallback; // Signaled when a callback returns. 回调返回时通知。
+    std::map<int, ModeSwitch> switches;
+    std::thread worker;
+    std::atomic<bool> bStop;
+};
+
+#endif // EMMCDL_DEVMONITOR_H
@@ -19,8 +19,18 @@
 #include <stdio.h>
 #include <Windows.h>
 #include <string>
+#include <vector>
 
 #define PACKET_TIMEOUT 1000
+#define STREAM_DEFAULT_BLOCK_SIZE  1024     // Stream write block size if the target doesn't report one. 设备没有给出时使用的流式写入块大小。
+#define STREAM_MAX_BLOCK_SIZE      0x8000   // Upper limit, HDLC encoding may double the size. 上限，HDLC编码后大小可能翻倍。
+#define STREAM_MAX_WINDOW          32       // Upper limit of outstanding stream writes. 同时在途的流式写入数量上限。
+#define STREAM_MAX_RETRY           5        // Retransmissions of one packet before giving up. 单个数据包放弃前的重传次数。
+#define STREAM_READ_CHUNK          0x100000 // Size of each read from the image file. 每次从镜像文件读取的大小。
+#define DLOAD_MAX_WRITE_SIZE       0x4000   // Upper limit of one CMD_WRITE_32BIT payload. 单个CMD_WRITE_32BIT数据的上限。
+#define DLOAD_WRITE_WINDOW         8        // CMD_WRITE_32BIT packets sent before waiting for ACKs. 等待ACK之前连续发送的CMD_WRITE_32BIT数量。
+#define DLOAD_HEX_CACHE_DIR        "cache/mprg" // Directory of cached programmer binaries. 烧录程序二进制缓存目录。
+#define DLOAD_HEX_CACHE_MAGIC      "MPRGBIN1"
 
 #define FEATURE_SECTOR_ADDRESSES   0x00000010
 
@@ -130,6 +140,13 @@
 #define EHOST_UNFRAMED_RSP      0x31  // Unframed streaming write response
 
 
+// An address-contiguous piece of the programmer image.
+// 烧录程序镜像中地址连续的一段。
+struct HexSegment {
+    uint32_t addr;      // Target address. 目标地址。
+    ByteArray data;     // Data.           数据。
+};
+
 /**
  * @class Dload
  * @brief DLOAD protocol implementation for Qualcomm devices.
@@ -220,9 +237,20 @@ public:
      */
     int ClosePartition();
     
+    /**
+     * @brief Set stream write block size and window, overriding the values from the Hello response.
+     *        设置流式写入的块大小和窗口大小，覆盖Hello响应中的值。
+     * @param blockSize [in] Bytes per stream write packet, rounded down to sectors. 每个流式写入包的字节数，向下取整到扇区。
+     * @param window    [in] Number of outstanding packets, 1 means stop-and-wait. 同时在途的数据包数，1表示停等。
+     */
+    void SetStreamParams(uint32_t blockSize, uint32_t window);
+
     /**
      * @brief Fast copy from serial port to disk.
+     *        Keeps up to the negotiated window of stream writes outstanding,
+     *        matches responses by address and retransmits on error or timeout.
      *        从串口快速复制到磁盘。
+     *        最多保持协商出的窗口数量的流式写入同时在途，按地址匹配响应，出错或超时会重传。
      * @param hInFile [in] Input file handle. 输入文件句柄。
      * @param sector [in] Starting sector. 起始扇区。
      * @param sectors [in] Number of sectors to copy. 要复制的扇区数。
@@ -297,6 +325,38 @@ private:
      */
     void HexTobyte(const std::string& hex, ByteArray& bin);
     
+    /**
+     * @brief Load an Intel HEX programmer as address-contiguous segments.
+     *        The parsed form is cached in DLOAD_HEX_CACHE_DIR keyed by the hash of the file,
+     *        so each programmer is only parsed once.
+     *        将Intel HEX格式的烧录程序加载为地址连续的段。
+     *        解析结果以文件哈希为键缓存在DLOAD_HEX_CACHE_DIR中，每个烧录程序只解析一次。
+     * @param szFlashPrg [in]  Path to the hex file. hex文件路径。
+     * @param segs       [out] Segments.             段列表。
+     * @param goAddr     [out] Start address.        启动地址。
+     * @return Status code. 错误代码。
+     */
+    int LoadHexImage(const std::string& szFlashPrg, std::vector<HexSegment>& segs, uint32_t& goAddr);
+
+    /**
+     * @brief Parse Intel HEX text into segments.
+     *        将Intel HEX文本解析为段。
+     * @param text   [in]  File content.  文件内容。
+     * @param segs   [out] Segments.      段列表。
+     * @param goAddr [out] Start address. 启动地址。
+     * @return Status code. 错误代码。
+     */
+    int ParseHexImage(const ByteArray& text, std::vector<HexSegment>& segs, uint32_t& goAddr);
+
+    /**
+     * @brief Write segments with CMD_WRITE_32BIT, several packets before waiting for the ACKs.
+     *        使用CMD_WRITE_32BIT写入段，等待ACK前会连续发送多个数据包。
+     * @param segs      [in] Segments.                段列表。
+     * @param writeSize [in] Max payload per command. 每个命令的最大数据长度。
+     * @return Status code. 错误代码。
+     */
+    int WriteHexSegments(const std::vector<HexSegment>& segs, uint32_t writeSize);
+
     /**
      * @brief Get the number of disk sectors.
      *        获取磁盘扇区数。
@@ -314,4 +374,7 @@ private:
 
     SerialPort* sport;
     bool bSectorAddress;
+    uint32_t dwStreamBlockSize;   // Bytes per stream write packet.              每个流式写入包的字节数。
+    uint32_t dwStreamWindow;      // Stream writes allowed to be outstanding.    允许同时在途的流式写入数量。
+    uint32_t dwMaxWriteSize;      // Max CMD_WRITE_32BIT payload from CMD_PARAMS. CMD_PARAMS给出的CMD_WRITE_32BIT最大长度。
 };
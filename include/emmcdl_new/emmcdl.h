@@ -66,7 +66,9 @@ enum emmc_cmd_e {
     EMMC_CMD_SPLIT_FFU,    // Split FFU / 分割 FFU
     EMMC_CMD_RAW,         // Raw operations / 原始操作
     EMMC_CMD_LOAD_FFU,     // Load FFU / 加载 FFU
-    EMMC_CMD_INFO         // Device info / 设备信息
+    EMMC_CMD_INFO,        // Device info / 设备信息
+    EMMC_CMD_MEMDUMP,     // RAM dump / 内存转储
+    EMMC_CMD_PROBE        // Probe port modes / 探测端口模式
 };
 
 /**
@@ -82,3 +84,20 @@ enum emmc_cmd_e {
  * @return Exit code. 退出代码。
  */
 int emmcdl_main(int argc, char *argv[]);
+
+struct DeviceSession;
+
+/**
+ * @brief Run one emmcdl command on a device session kept by the daemon.
+ *        在守护进程保留的设备会话上执行一条 emmcdl 命令。
+ *
+ * The session's port is used instead of opening a new one. If the session already runs
+ * the flash programmer, loading it is skipped and the command talks to it directly.
+ * 使用会话的端口而不是重新打开。如果会话中烧录内核已经在运行，就跳过加载直接与其通信。
+ *
+ * @param session [in] Device session, nullptr to run like emmcdl_main. 设备会话，为 nullptr 时与 emmcdl_main 相同。
+ * @param argc    [in] Argument count. 参数数量。
+ * @param argv    [in] Argument vector. 参数向量。
+ * @return Exit code. 退出代码。
+ */
+int emmcdl_session_main(DeviceSession* session, int argc, char *argv[]);
@@ -0,0 +1,46 @@
+#pragma once
+
+#ifndef EMMCDL_ERRCODES_H
+#define EMMCDL_ERRCODES_H
+
+// Status codes used by code that does not include windows.h. They are the Win32 error codes the
+// rest of emmcdl returns, so on Windows they come from winerror.h and elsewhere the ones that are
+// needed are defined here with the same values.
+// 不包含windows.h的代码使用的错误代码。它们就是emmcdl其他部分返回的Win32错误代码，
+// Windows上来自winerror.h，其他平台上在这里按相同的值定义用到的几个。
+#ifdef _WIN32
+#include <winerror.h>
+#else
+#ifndef ERROR_SUCCESS
+#define ERROR_SUCCESS               0
+#endif
+#ifndef ERROR_FILE_NOT_FOUND
+#define ERROR_FILE_NOT_FOUND        2
+#endif
+#ifndef ERROR_ACCESS_DENIED
+#define ERROR_ACCESS_DENIED         5
+#endif
+#ifndef ERROR_INVALID_HANDLE
+#define ERROR_INVALID_HANDLE        6
+#endif
+#ifndef ERROR_NOT_ENOUGH_MEMORY
+#define ERROR_NOT_ENOUGH_MEMORY     8
+#endif
+#ifndef ERROR_GEN_FAILURE
+#define ERROR_GEN_FAILURE           31
+#endif
+#ifndef ERROR_BUSY
+#define ERROR_BUSY                  170
+#endif
+#ifndef ERROR_OPERATION_ABORTED
+#define ERROR_OPERATION_ABORTED     995
+#endif
+#ifndef ERROR_DEVICE_NOT_CONNECTED
+#define ERROR_DEVICE_NOT_CONNECTED  1167
+#endif
+#ifndef ERROR_TIMEOUT
+#define ERROR_TIMEOUT               1460
+#endif
+#endif
+
+#endif // EMMCDL_ERRCODES_H
@@ -31,12 +31,35 @@
 #include "serialport.h"
 #include "protocol.h"
 #include "partition.h"
+#include "imagecache.h"
 #include "datatypes/bytearray.h"
+#include "utils/rtt_estimator.h"
 #include <stdio.h>
+#include <string>
 #include <Windows.h>
 
 #define MAX_RETRY   50  // Maximum retry count / 最大重试次数
 
+// Response timeouts before anything is measured, and their bounds. The floor has to cover one
+// port read (1s), the "long" ones cover storage init, flush after raw data and provisioning.
+// 还没有测量数据时的响应超时及其上下限。下限至少要覆盖一次端口读取（1秒），"long"用于存储初始化、
+// 原始数据之后的刷新和存储配置。
+#define FH_RTT_COMMAND_INITIAL_MS   10000
+#define FH_RTT_COMMAND_MIN_MS       2000
+#define FH_RTT_COMMAND_MAX_MS       60000
+#define FH_RTT_LONG_INITIAL_MS      50000
+#define FH_RTT_LONG_MIN_MS          5000
+#define FH_RTT_LONG_MAX_MS          300000
+
+// Waiting for a programmer that was just loaded: a NOP is sent every poll interval until the
+// programmer answers or logs something, then the port has to stay quiet before the first command,
+// so that a late NOP response is not taken for the response to that command.
+// 等待刚加载的烧录内核：每个轮询间隔发送一个NOP，直到烧录内核响应或输出日志，之后端口要静默一段时间
+// 才发送第一条命令，以免把迟到的NOP响应当作这条命令的响应。
+#define FH_READY_POLL_MS            100
+#define FH_READY_QUIET_MS           100
+#define FH_READY_TIMEOUT_MS         10000
+
 /**
  * @struct fh_configure_t
  * @brief Firehose configuration structure.
@@ -147,6 +170,27 @@ public:
      * @return Status code. 错误代码。
      */
     int FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t sectorWrite, uint64_t sectors, uint8_t partNum);
+
+    bool SupportsImageCopy(void) { return true; }
+
+    /**
+     * @brief Program sectors straight from a memory-mapped image.
+     *        直接从内存映射的镜像编程扇区。
+     * @param image [in] Mapped image. 映射的镜像。
+     * @param sectorRead [in] Sector offset in the image. 镜像中的扇区偏移量。
+     * @param sectorWrite [in] Write sector offset. 写入扇区偏移量。
+     * @param sectors [in] Number of sectors to program. 要编程的扇区数。
+     * @param partNum [in] Partition number. 分区号。
+     * @return Status code. 错误代码。
+     */
+    int FastCopyImage(const MappedImage* image, int64_t sectorRead, int64_t sectorWrite, uint64_t sectors, uint8_t partNum);
+
+    /**
+     * @brief Get the number of bytes sent to the disk so far.
+     *        获取到目前为止写入磁盘的字节数。
+     * @return Byte count. 字节数。
+     */
+    uint64_t GetBytesWritten(void);
     
     /**
      * @brief Program a patch entry.
@@ -192,6 +236,41 @@ public:
      */
     int ConnectToFlashProg(fh_configure_t* cfg);
 
+    /**
+     * @brief Reuse a programmer that was already configured by an earlier Firehose object on
+     *        the same port. Only a NOP is sent to check that the programmer is still alive.
+     *        复用同一端口上之前的 Firehose 对象已经配置好的烧录程序，只发送一个 NOP 确认烧录程序仍在运行。
+     * @param cfg [in] Firehose configuration used for that configure. 当时使用的 Firehose 配置。
+     * @param maxPacketSize [in] Packet size negotiated by that configure. 当时协商得到的数据包大小。
+     * @return Status code, ERROR_NOT_READY if the programmer did not answer. 错误代码，烧录程序没有响应时为 ERROR_NOT_READY。
+     */
+    int ResumeFlashProg(fh_configure_t* cfg, uint32_t maxPacketSize);
+
+    /**
+     * @brief Wait for a programmer that was just loaded by Sahara: follow the port if the device
+     *        re-enumerates, poll with NOPs until the programmer answers or logs something, then
+     *        wait for the port to go quiet so that the next command reads its own response.
+     *        等待刚由 Sahara 加载的烧录程序：设备重新枚举时跟随新端口，用 NOP 轮询直到烧录程序响应或输出日志，
+     *        再等端口静默，使下一条命令读到的是它自己的响应。
+     * @param timeoutMs [in] Time budget of the whole wait. 整个等待的时间。
+     * @return Status code, ERROR_NOT_READY if the programmer never answered. 错误代码，烧录程序一直没有响应时为 ERROR_NOT_READY。
+     */
+    int WaitReady(int timeoutMs = FH_READY_TIMEOUT_MS);
+
+    /**
+     * @brief Get the max packet size after configure.
+     *        获取配置后的最大数据包大小。
+     * @return Max packet size. 最大数据包大小。
+     */
+    uint32_t GetMaxPacketSize(void);
+
+    /**
+     * @brief Describe the response latency measured in this session and the timeouts derived from it.
+     *        描述本次会话测得的响应延迟以及由此得到的超时。
+     * @return Text for logs and reports. 用于日志和报告的文字。
+     */
+    std::string DescribeLatency(void) const;
+
 protected:
 
 private:
@@ -212,6 +291,42 @@ private:
      */
     int ReadStatus(void);
 
+    /**
+     * @brief Read status until a response arrives or the adaptive timeout of rtt expires,
+     *        and feed the time it took into rtt.
+     *        读取状态，直到收到响应或rtt给出的自适应超时到期，并把用时记入rtt。
+     * @param rtt [in,out] Estimator of this kind of request. 这类请求的估计器。
+     * @return Status code, ERROR_NOT_READY on timeout. 错误代码，超时时为 ERROR_NOT_READY。
+     */
+    int WaitStatus(RttEstimator& rtt);
+
+    /**
+     * @brief Send one NOP and wait up to FH_READY_POLL_MS for anything to come back.
+     *        发送一个 NOP，最多等待 FH_READY_POLL_MS 看是否有任何数据返回。
+     * @param buf [out] Scratch buffer. 临时缓冲区。
+     * @param size [in] Size of buf. buf 的大小。
+     * @return Whether the programmer answered. 烧录程序是否有响应。
+     */
+    bool PollReady(BYTE* buf, DWORD size);
+
+    /**
+     * @brief Read raw sector data, failing when the device sends nothing for a command timeout.
+     *        读取原始扇区数据，设备在一个命令超时内没有发送任何数据时失败。
+     * @param pOutBuf [out] Output buffer. 输出缓冲区。
+     * @param dwBytes [in] Bytes to read. 要读取的字节数。
+     * @return Status code. 错误代码。
+     */
+    int ReadRawData(BYTE* pOutBuf, DWORD dwBytes);
+
+    /**
+     * @brief Format a <program> command into program_pkt.
+     *        将 <program> 命令格式化到 program_pkt 中。
+     * @param sectorWrite [in] Write sector offset, negative counts from the end of the disk. 写入扇区偏移量，负数表示从磁盘末尾算起。
+     * @param sectors [in] Number of sectors. 扇区数。
+     * @param partNum [in] Partition number. 分区号。
+     */
+    void FormatProgramPacket(int64_t sectorWrite, uint64_t sectors, uint8_t partNum);
+
     SerialPort* sport;              // Serial port pointer / 串口指针
     uint64_t diskSectors;          // Disk sectors / 磁盘扇区数
     bool bSectorAddress;            // Sector address flag / 扇区地址标志
@@ -222,4 +337,7 @@ private:
     uint32_t dwMaxPacketSize;       // Maximum packet size / 最大数据包大小
     HANDLE hLog;                   // Log file handle / 日志文件句柄
     char* program_pkt;             // Program packet / 编程数据包
+    uint64_t bytesWritten;         // Bytes sent to the disk / 写入磁盘的字节数
+    RttEstimator rttCommand;       // Command to response / 命令到响应的延迟
+    RttEstimator rttLong;          // Storage init, flush and provisioning / 存储初始化、刷新和存储配置的延迟
 };
@@ -0,0 +1,91 @@
+#pragma once
+
+#ifndef EMMCDL_IMAGECACHE_H
+#define EMMCDL_IMAGECACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <map>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+// A read-only memory-mapped image file.
+// 只读内存映射的镜像文件。
+class MappedImage {
+public:
+    MappedImage();
+    ~MappedImage();
+
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    /**
+     * @brief
+     * Map the whole file into memory.
+     *
+     * 将整个文件映射到内存。
+     * @param path [in] File path. 文件路径。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Map(const std::string& path);
+
+    // Unmap the file.
+    // 解除映射。
+    void Unmap();
+
+    const uint8_t* data() const { return base; }
+    uint64_t size() const { return length; }
+    const std::string& path() const { return filePath; }
+
+private:
+    friend class ImageCache;
+
+    const uint8_t* base;        // Start of the mapping.             映射的起始地址。
+    uint64_t length;            // Size of the file.                 文件大小。
+    std::string filePath;       // Path of the file.                 文件路径。
+    int64_t mtime;              // Modification time when mapped.    映射时的修改时间。
+#ifdef _WIN32
+    HANDLE hFile;
+    HANDLE hMapping;
+#else
+    int fd;
+#endif
+};
+
+
+// Process-wide cache of mapped images, so a file is only opened once no matter how many
+// sessions or devices load it at the same time. The returned handles are reference counted:
+// a mapping is released when its last user drops the handle, the cache itself keeps none alive.
+// Entries are remapped when the file changes.
+// 进程内共享的映射镜像缓存。无论有多少个会话或设备同时加载同一个文件，文件都只打开一次。
+// 返回的句柄带引用计数：最后一个使用者释放句柄时映射就会解除，缓存本身不会让映射保持有效。
+// 文件发生变化时会重新映射。
+class ImageCache {
+public:
+    /**
+     * @brief
+     * Get the mapping of a file, mapping it on first use.
+     *
+     * 获取文件的映射，第一次使用时才会映射。
+     * @param path   [in]  File path. 文件路径。
+     * @param status [out] Status, optional. 错误代码，可选。
+     * @return
+     * The mapped image, or nullptr on failure. Release it as soon as it is no longer needed.
+     *
+     * 映射的镜像，失败时为nullptr。不再需要时应尽快释放。
+     */
+    static std::shared_ptr<MappedImage> Get(const std::string& path, int* status = nullptr);
+
+private:
+    static std::mutex mtx;
+    static std::map<std::string, std::weak_ptr<MappedImage>> images;
+};
+
+#endif // EMMCDL_IMAGECACHE_H
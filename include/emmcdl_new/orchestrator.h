@@ -0,0 +1,111 @@
+#pragma once
+
+#ifndef EMMCDL_ORCHESTRATOR_H
+#define EMMCDL_ORCHESTRATOR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "emmcdl_new/firehose.h"
+#include "emmcdl_new/usbsched.h"
+#include "emmcdl_new/imagecache.h"
+#include "emmcdl_new/reactortasks.h"
+
+
+// What to flash on every device.
+// 要在每个设备上烧录的内容。
+enum flash_job_e {
+    FLASH_JOB_RAWPROGRAM,   // rawprogram*.xml (+ patch*.xml) through Firehose.  通过Firehose烧录rawprogram*.xml（和patch*.xml）。
+    FLASH_JOB_FFU,          // FFU image through Firehose.                       通过Firehose烧录FFU镜像。
+    FLASH_JOB_SPD           // spd_dump commands on Spreadtrum devices.          在展讯设备上执行spd_dump命令。
+};
+
+struct FlashJob {
+    flash_job_e type = FLASH_JOB_RAWPROGRAM;
+    std::string programmer;                 // Firehose programmer loaded through Sahara.  通过Sahara加载的Firehose烧录内核。
+    std::vector<std::string> xmlFiles;      // rawprogram XML files, patch files are found next to them.
+                                            // rawprogram XML文件，patch文件在同一位置查找。
+    std::string ffuFile;                    // FFU image.                                  FFU镜像。
+    std::vector<std::string> spdArgs;       // spd_dump commands, eg loadfdl, exec, write_parts, reset.
+                                            // spd_dump命令，例如loadfdl、exec、write_parts、reset。
+    fh_configure_t cfg = {};                // Firehose configuration.                     Firehose配置。
+    int sectorSize = 512;                   // Disk sector size.                           磁盘扇区大小。
+    bool bVerbose = false;                  // Verbose Firehose output.                    Firehose详细输出。
+    bool bReactor = false;                  // Drive all Firehose sessions from one reactor thread once the programmers run.
+                                            // Only plain program entries qualify, other jobs use the worker threads.
+                                            // 烧录内核运行后由一个反应器线程驱动所有Firehose会话。
+                                            // 只适用于普通的program条目，其他任务仍使用工作线程。
+};
+
+// Outcome of one device.
+// 单个设备的结果。
+struct DeviceFlashResult {
+    int port = -1;                          // COM port number.                            COM端口号。
+    std::string controller;                 // USB host controller, empty if unknown.      USB主控制器，未知时为空。
+    std::string portPath;                   // USB port path.                              USB端口路径。
+    int status = ERROR_SUCCESS;             // Status of the job.                          任务的错误代码。
+    uint64_t bytes = 0;                     // Bytes written to the disk.                  写入磁盘的字节数。
+    double setupSeconds = 0;                // Open, Sahara and configure.                 打开端口、Sahara和配置的时间。
+    double queuedSeconds = 0;               // Held back by the USB scheduler.             被USB调度器推迟的时间。
+    double seconds = 0;                     // Whole job.                                  整个任务的时间。
+    std::string latency;                    // Measured response latency.                  测得的响应延迟。
+};
+
+// Outcome of the whole run.
+// 整次运行的结果。
+struct FlashReport {
+    std::vector<DeviceFlashResult> devices;
+    uint64_t totalBytes = 0;                // Sum over all devices.                       所有设备的总和。
+    double seconds = 0;                     // Wall time.                                  实际经过的时间。
+    double cpuSeconds = 0;                  // Host CPU time of the process.               进程占用的主机CPU时间。
+    int failed = 0;                         // Devices that did not succeed.               失败的设备数。
+};
+
+
+/**
+ * @class FlashOrchestrator
+ * @brief Flashes the same job to many devices at once, one worker thread per device.
+ *        Images are served from the process-wide ImageCache, so all sessions send from one
+ *        read-only mapping and every file is read from disk once however many devices there are.
+ *        Image transfers go through a UsbScheduler, so devices sharing a host controller take
+ *        turns once the controller is saturated, while Sahara and configure always run at once.
+ *        With FlashJob::bReactor, only Sahara runs on the worker threads and the Firehose sessions
+ *        of all devices then run as FirehoseProgramTasks on one Reactor; the UsbScheduler is not used then.
+ *        Reports per device and aggregate throughput, and the host CPU cost per GB.
+ *        同时向多个设备烧录相同的内容，每个设备一个工作线程。
+ *        镜像由进程内的ImageCache提供，所有会话都从同一个只读映射发送数据，无论有多少设备，每个文件都只从磁盘读取一次。
+ *        镜像传输经过UsbScheduler，共用一个主控制器的设备在它饱和后轮流传输，Sahara和配置则总是立即进行。
+ *        设置FlashJob::bReactor时，工作线程只执行Sahara，之后所有设备的Firehose会话作为FirehoseProgramTask
+ *        在一个Reactor上运行，此时不使用UsbScheduler。
+ *        报告每个设备和总体的吞吐量，以及每GB数据占用的主机CPU时间。
+ */
+class FlashOrchestrator {
+public:
+    /**
+     * @brief
+     * Run a job on all devices and wait for all of them.
+     *
+     * 在所有设备上执行任务并等待全部完成。
+     * @param ports [in] COM port numbers. COM端口号。
+     * @param job   [in] The job. 任务。
+     * @return
+     * Results, in the order of ports.
+     *
+     * 结果，顺序与端口相同。
+     */
+    static FlashReport Run(const std::vector<int>& ports, const FlashJob& job);
+
+private:
+    static void FlashOne(const FlashJob& job, UsbScheduler* scheduler, DeviceFlashResult& result);
+    static void FlashOneSpd(const FlashJob& job, UsbScheduler* scheduler, DeviceFlashResult& result);
+    static void BootOne(const FlashJob& job, UsbScheduler* scheduler, DeviceFlashResult& result);
+    static void PatchOne(const FlashJob& job, uint32_t maxPayload, DeviceFlashResult& result);
+    static int LoadProgrammer(SerialPort& sport, const FlashJob& job, DeviceFlashResult& result);
+    static int ProgramRawFiles(Firehose& fh, const FlashJob& job, bool bPatchesOnly = false);
+    static int CollectWrites(const FlashJob& job, std::vector<std::shared_ptr<MappedImage>>& images,
+        std::vector<FirehoseWrite>& writes);
+    static void RunReactor(const FlashJob& job, const std::vector<FirehoseWrite>& writes, FlashReport& report);
+    static void LogReport(const FlashReport& report);
+};
+
+#endif // EMMCDL_ORCHESTRATOR_H
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef EMMCDL_POOLBENCH_H
+#define EMMCDL_POOLBENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define POOLBENCH_DEFAULT_TASKS     4096            // Independent hash jobs.               独立的哈希任务数。
+#define POOLBENCH_JOB_SIZE          (16 * 1024)     // Bytes hashed by one job.             每个任务哈希的字节数。
+#define POOLBENCH_CHUNK_SIZE        (1024 * 1024)   // Bytes of one pipeline chunk.         流水线中每个数据块的字节数。
+#define POOLBENCH_CHUNKS            16              // Chunks going through the pipeline.   经过流水线的数据块数。
+
+
+/**
+ * @class PoolBench
+ * @brief Compares ThreadPool and TaskGraph with spawning one Thread per job, the way every
+ *        parallel stage did before: many small hash jobs, then a read -> hash -> compress ->
+ *        write pipeline over 1MB chunks where raw Threads have to wait for each stage to end.
+ *        比较ThreadPool、TaskGraph与之前每个并行阶段的做法——每个任务启动一个Thread：先是大量小的哈希任务，
+ *        然后是对1MB数据块的“读取 -> 哈希 -> 压缩 -> 写入”流水线，使用Thread时每个阶段都要等上一个阶段全部结束。
+ */
+class PoolBench {
+public:
+    /**
+     * @brief
+     * Run both workloads with raw Threads and with the pool, and log time and pool statistics.
+     *
+     * 分别用Thread和线程池运行两种负载，并输出用时和线程池的统计信息。
+     * @param tasks   [in] Independent hash jobs. 独立的哈希任务数。
+     * @param threads [in] Worker threads, 0 for the CPU count. 工作线程数，0表示CPU核心数。
+     * @return
+     * ERROR_SUCCESS if both ways produced the same results.
+     *
+     * 两种方式结果一致时返回ERROR_SUCCESS。
+     */
+    static int Run(int tasks, int threads);
+
+private:
+    static uint64_t Hash(const uint8_t* data, size_t len);
+    static size_t Compress(const uint8_t* data, size_t len, uint8_t* out);
+};
+
+#endif // EMMCDL_POOLBENCH_H
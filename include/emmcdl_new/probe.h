@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef EMMCDL_PROBE_H
+#define EMMCDL_PROBE_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include "emmcdl_new/serialport.h"
+#include "datatypes/bytearray.h"
+
+
+#define PROBE_DEFAULT_TIMEOUT   1000    // Total time for one probe run in ms. 一次探测的总时间（毫秒）。
+
+
+// Mode a port was found in.
+// 端口所处的模式。
+enum probe_mode_e {
+    PROBE_MODE_UNKNOWN,     // Nothing recognizable answered.  没有可识别的响应。
+    PROBE_MODE_SAHARA,      // Qualcomm PBL/SBL Sahara.        高通Sahara。
+    PROBE_MODE_FIREHOSE,    // Qualcomm Firehose programmer.   高通Firehose烧录程序。
+    PROBE_MODE_DLOAD,       // Qualcomm DMSS/DIAG HDLC.        高通DMSS/DIAG HDLC。
+    PROBE_MODE_SPD,         // Spreadtrum BSL / FDL.           展讯BSL / FDL。
+    PROBE_MODE_ERROR        // The port could not be opened.   端口无法打开。
+};
+
+
+// Result of probing one port. For Qualcomm modes the port stays open and can be
+// handed to Sahara / Firehose / Dload directly.
+// 单个端口的探测结果。高通的模式下端口保持打开，可以直接交给 Sahara / Firehose / Dload 使用。
+struct ProbeSession {
+    int port;                           // COM port number.                        COM端口号。
+    std::string name;                   // Friendly name of the port.              端口的友好名称。
+    probe_mode_e mode;                  // Detected mode.                          检测到的模式。
+    int status;                         // Status of opening the port.             打开端口的错误代码。
+    double elapsed;                     // Seconds until the mode was known.       识别模式所用的秒数。
+    bool bHelloRead;                    // Sahara hello was already consumed, use ConnectToDevice(false, ...).
+                                        // Sahara的Hello已经被读取，应当调用ConnectToDevice(false, ...)。
+    ByteArray response;                 // First response that identified the mode. 识别模式的第一个响应。
+    std::shared_ptr<SerialPort> sport;  // Open port, nullptr for SPD / unknown / error.
+                                        // 打开的端口，SPD / 未知 / 出错时为nullptr。
+};
+
+
+// Detects the mode of many ports at once. Every port is probed on its own thread, so a
+// run takes about one timeout no matter how many ports there are.
+// Each port is first listened to (Sahara sends hello by itself), then sent the cheapest probe
+// that cannot upset the other protocols: a SPD check-baud byte, an HDLC NOP, and a Firehose NOP.
+// 同时检测多个端口的模式。每个端口在单独的线程中探测，所以不管有多少端口，一次探测大约只需要一个超时时间。
+// 每个端口先监听（Sahara会主动发送Hello），再依次发送对其他协议影响最小的探测数据：
+// SPD的波特率检测字节、HDLC NOP、Firehose NOP。
+class PortProbe {
+public:
+    /**
+     * @brief
+     * Probe all COM ports of the system.
+     *
+     * 探测系统中的所有COM端口。
+     * @param timeoutMs [in] Time budget of the whole run. 整次探测的时间。
+     * @return
+     * One session per port.
+     *
+     * 每个端口一个结果。
+     */
+    static std::vector<ProbeSession> ProbeAll(int timeoutMs = PROBE_DEFAULT_TIMEOUT);
+
+    /**
+     * @brief
+     * Probe the given ports in parallel.
+     *
+     * 并行探测指定的端口。
+     * @param ports     [in] Port numbers. 端口号。
+     * @param names     [in] Friendly names used as hints, may be empty. 作为提示的友好名称，可以为空。
+     * @param timeoutMs [in] Time budget of the whole run. 整次探测的时间。
+     * @return
+     * One session per port, in the same order.
+     *
+     * 每个端口一个结果，顺序相同。
+     */
+    static std::vector<ProbeSession> Probe(const std::vector<int>& ports,
+                                           const std::vector<std::string>& names = {},
+                                           int timeoutMs = PROBE_DEFAULT_TIMEOUT);
+
+    // Name of a mode for logs. 模式的名称，用于日志。
+    static const char* ModeName(probe_mode_e mode);
+
+private:
+    static void ProbeOne(ProbeSession& session, double deadline);
+    static probe_mode_e Classify(const BYTE* data, DWORD length);
+    static DWORD ReadUntil(SerialPort* sport, BYTE* buf, DWORD size, double deadline, int sliceMs);
+};
+
+#endif // EMMCDL_PROBE_H
@@ -23,6 +23,11 @@
 
 #define MAX_XML_LEN         2048  // Maximum XML length / 最大 XML 长度
 #define MAX_TRANSFER_SIZE   0x100000  // Maximum transfer size / 最大传输大小
+#define GPT_CACHE_ENTRIES   128       // Entries kept by ReadGPT / ReadGPT 保存的条目数
+#define VERIFY_CHUNK_SIZE   0x100000  // Bytes read back per operation by VerifyImage / VerifyImage 每次读回的字节数
+#define VERIFY_WINDOW       4         // Read-backs queued ahead by VerifyImage / VerifyImage 提前排队的读回操作数
+
+class MappedImage;
 
 /**
  * @class Protocol
@@ -98,6 +103,20 @@ public:
      * @return Status code. 错误代码。
      */
     int ReadGPT(bool show_result);
+
+    /**
+     * @brief Seed the partition table with entries read earlier, so lookups by name skip ReadGPT.
+     *        用之前读取的条目填充分区表，按名称查找分区时就不用再调用 ReadGPT。
+     * @param entries [in] GPT_CACHE_ENTRIES entries. GPT_CACHE_ENTRIES 个条目。
+     */
+    void SetGPTCache(const gpt_entry_t* entries);
+
+    /**
+     * @brief Get the partition table read by ReadGPT.
+     *        获取 ReadGPT 读取的分区表。
+     * @return GPT_CACHE_ENTRIES entries, nullptr if none was read. GPT_CACHE_ENTRIES 个条目，未读取时为 nullptr。
+     */
+    const gpt_entry_t* GetGPTCache(void);
     
     /**
      * @brief Write GPT (GUID Partition Table) to device.
@@ -107,6 +126,16 @@ public:
      * @return Status code. 错误代码。
      */
     int WriteGPT(std::string szPartName, std::string szBinFile);
+
+    /**
+     * @brief Read a partition back and compare it with the file written by WriteGPT.
+     *        The comparison of a chunk runs on the host pool while the next chunk is read.
+     *        读回分区并与 WriteGPT 写入的文件比较。比较在主机线程池上进行，同时读取下一块。
+     * @param szPartName [in] Partition name. 分区名称。
+     * @param szBinFile [in] File that was written. 写入的文件。
+     * @return Status code, ERROR_INVALID_DATA on a mismatch. 错误代码，内容不一致时为 ERROR_INVALID_DATA。
+     */
+    int VerifyImage(std::string szPartName, std::string szBinFile);
     
     /**
      * @brief Get disk sector size.
@@ -208,6 +237,28 @@ public:
      * @return Status code. 错误代码。
      */
     virtual int FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t sectorWrite, uint64_t sectors, uint8_t partNum) = 0;
+
+    /**
+     * @brief Whether FastCopyImage is implemented, so callers only map images when it helps.
+     *        是否实现了 FastCopyImage，调用者只在有用时才映射镜像。
+     * @return True if supported. 支持时返回 true。
+     */
+    virtual bool SupportsImageCopy(void) { return false; }
+
+    /**
+     * @brief Program sectors straight from a memory-mapped image. Every session flashing the
+     *        same file shares one mapping instead of reading the file on its own.
+     *        直接从内存映射的镜像编程扇区。烧录同一文件的所有会话共享一个映射，而不是各自读取文件。
+     * @param image [in] Mapped image. 映射的镜像。
+     * @param sectorRead [in] Sector offset in the image. 镜像中的扇区偏移量。
+     * @param sectorWrite [in] Write sector offset. 写入扇区偏移量。
+     * @param sectors [in] Number of sectors, the part past the end of the image is zero. 扇区数，超出镜像末尾的部分为零。
+     * @param partNum [in] Partition number. 分区号。
+     * @return Status code. 错误代码。
+     */
+    virtual int FastCopyImage(const MappedImage* image, int64_t sectorRead, int64_t sectorWrite, uint64_t sectors, uint8_t partNum) {
+        return ERROR_NOT_SUPPORTED;
+    }
     
     /**
      * @brief Program a raw command.
@@ -0,0 +1,232 @@
+#pragma once
+
+#ifndef EMMCDL_REACTOR_H
+#define EMMCDL_REACTOR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_set>
+#include <atomic>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+#define REACTOR_TICK_MS         10          // Resolution of protocol timeouts.        协议超时的精度。
+#define REACTOR_WHEEL_SLOTS     512         // Slots of the timer wheel (~5s per turn). 时间轮的槽数（一圈约5秒）。
+#define REACTOR_READ_CHUNK      0x10000     // Bytes read per readiness/completion.    每次就绪或完成时读取的字节数。
+#define REACTOR_MAX_EVENTS      64          // Events taken per wait.                  每次等待取出的事件数。
+
+#ifdef _WIN32
+typedef HANDLE io_handle_t;
+#define INVALID_IO_HANDLE       INVALID_HANDLE_VALUE
+#else
+typedef int io_handle_t;
+#define INVALID_IO_HANDLE       (-1)
+#endif
+
+
+/**
+ * @class TimerWheel
+ * @brief Hashed timer wheel. Scheduling and cancelling are O(1) however many devices have a
+ *        timeout armed, which is what a reactor driving dozens of protocol sessions needs.
+ *        Timers due more than one turn ahead stay in their slot until their round comes.
+ *        哈希时间轮。无论多少设备设置了超时，添加和取消都是O(1)的。
+ *        超过一圈之后才到期的定时器留在槽里，直到轮到它们的那一圈。
+ */
+class TimerWheel {
+public:
+    TimerWheel(int tickMs = REACTOR_TICK_MS, int slotCount = REACTOR_WHEEL_SLOTS);
+
+    // Run cb after delayMs, rounded up to the tick. Returns an id for Cancel.
+    // 在delayMs之后（向上取整到刻度）调用cb，返回用于Cancel的id。
+    uint64_t Schedule(int delayMs, std::function<void()> cb);
+
+    // Cancel a timer that has not fired yet. Unknown ids are ignored.
+    // 取消还没触发的定时器，未知的id会被忽略。
+    void Cancel(uint64_t id);
+
+    // Fire every timer due at nowMs. Returns the number fired.
+    // 触发所有在nowMs之前到期的定时器，返回触发的数量。
+    int Advance(double nowMs);
+
+    // Milliseconds the caller may sleep before calling Advance again, at most maxMs.
+    // 调用者在下次调用Advance之前可以休眠的毫秒数，最多maxMs。
+    int NextTimeoutMs(double nowMs, int maxMs) const;
+
+    size_t Pending() const { return live.size(); }
+
+private:
+    struct Timer {
+        uint64_t id;
+        uint64_t tick;                  // Absolute tick it is due at. 到期的绝对刻度。
+        std::function<void()> cb;
+    };
+
+    int tickMs;
+    double originMs;                    // Time of tick 0.             刻度0对应的时间。
+    uint64_t current;                   // Last tick processed.        最后处理的刻度。
+    uint64_t nextId;
+    std::vector<std::vector<Timer>> slots;
+    std::unordered_set<uint64_t> live;  // Scheduled and not cancelled. 已添加且未取消的定时器。
+};
+
+
+class Reactor;
+struct ReactorChannel;
+
+enum task_state_e {
+    TASK_RUNNING,       // Waiting for data, a drained send or a timeout.  等待数据、发送完成或超时。
+    TASK_DONE           // Finished, Status() holds the result.           已结束，结果在Status()中。
+};
+
+/**
+ * @class ReactorTask
+ * @brief A protocol session written as a resumable state machine. The reactor calls it back
+ *        when bytes arrive, when everything it sent has left the host, and when its timeout
+ *        expires. No callback may block: anything that would wait becomes a new state.
+ *        以可恢复状态机形式编写的协议会话。收到数据、发送的内容全部离开主机、超时到期时，
+ *        反应器会回调它。回调中不能阻塞，任何需要等待的地方都应成为一个新的状态。
+ */
+class ReactorTask {
+public:
+    virtual ~ReactorTask() {}
+
+    // Name used in logs. 日志中使用的名称。
+    virtual std::string Name() const = 0;
+
+    // Called once when the task is added. 添加任务时调用一次。
+    virtual task_state_e Start() = 0;
+
+    // Bytes arrived from the device. 从设备收到了数据。
+    virtual task_state_e OnData(const uint8_t* data, size_t len) = 0;
+
+    // Everything queued with Send/SendRef has been handed to the driver.
+    // 用Send/SendRef排队的数据都已经交给驱动。
+    virtual task_state_e OnDrained() { return TASK_RUNNING; }
+
+    // The timeout armed with ArmTimeout expired. ArmTimeout设置的超时到期。
+    virtual task_state_e OnTimeout() = 0;
+
+    int Status() const { return status; }
+    uint64_t BytesSent() const { return bytesSent; }
+
+protected:
+    // Queue a copy of data. 复制数据并排队发送。
+    void Send(const void* data, size_t len);
+    // Queue data without copying, it must stay valid until OnDrained.
+    // 不复制地排队发送数据，数据在OnDrained之前必须保持有效。
+    void SendRef(const void* data, size_t len);
+    // (Re)arm the timeout of this task. 设置（或重新设置）这个任务的超时。
+    void ArmTimeout(int ms);
+    void CancelTimeout();
+    // Record the result and end the task. 记录结果并结束任务。
+    task_state_e Finish(int result);
+
+    int status = 0;
+
+private:
+    friend class Reactor;
+    Reactor* reactor = nullptr;
+    ReactorChannel* channel = nullptr;
+    uint64_t bytesSent = 0;
+};
+
+
+/**
+ * @class Reactor
+ * @brief Single-threaded event loop that drives many device sessions at once. Transports are
+ *        non-blocking handles: epoll watches them on Linux and an I/O completion port on Windows,
+ *        so a handful of threads serve dozens of ports instead of one blocked thread per port.
+ *        Protocol timeouts come from a TimerWheel instead of per-call read timeouts.
+ *        All callbacks of a reactor run on the thread that called Run.
+ *        同时驱动多个设备会话的单线程事件循环。传输使用非阻塞句柄，Linux上由epoll监视，
+ *        Windows上由I/O完成端口监视，因此少数几个线程就能服务几十个端口，而不是每个端口一个阻塞的线程。
+ *        协议超时来自TimerWheel，而不是每次调用的读取超时。一个反应器的所有回调都在调用Run的线程上执行。
+ */
+class Reactor {
+public:
+    Reactor();
+    ~Reactor();
+
+    /**
+     * @brief
+     * Register a handle and start a task on it. The handle must have been opened for
+     * non-blocking (Linux) or overlapped (Windows) I/O. Neither is owned by the reactor.
+     *
+     * 注册一个句柄并在上面启动任务。句柄必须以非阻塞（Linux）或重叠（Windows）方式打开。
+     * 反应器不拥有句柄和任务。
+     * @param handle [in] Transport handle. 传输句柄。
+     * @param task   [in] Task to drive.    要驱动的任务。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Add(io_handle_t handle, ReactorTask* task);
+
+    /**
+     * @brief
+     * Run the loop until every task has finished or Stop is called.
+     *
+     * 运行事件循环，直到所有任务结束或调用了Stop。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Run();
+
+    // Make Run return. Safe to call from any thread. 让Run返回，可以在任何线程调用。
+    void Stop();
+
+    // Tasks that have not finished. 还没有结束的任务数。
+    size_t Active() const { return active; }
+
+    TimerWheel& Timers() { return timers; }
+
+    // Open a COM port (numbered like DeviceMonitor on Linux) for use with Add.
+    // 打开一个COM端口（Linux上的编号方式和DeviceMonitor一致）用于Add。
+    static int OpenPort(int port, io_handle_t* handle);
+
+    // Connected pair of handles usable with Add, for simulated devices.
+    // 一对相连的、可以用于Add的句柄，用来模拟设备。
+    static int CreatePipe(io_handle_t* host, io_handle_t* device);
+
+    static void ClosePort(io_handle_t handle);
+
+private:
+    friend class ReactorTask;
+
+    void Queue(ReactorChannel* ch, const void* data, size_t len, bool bCopy);
+    void Arm(ReactorChannel* ch, int ms);
+    void Disarm(ReactorChannel* ch);
+    void Settle(ReactorChannel* ch, task_state_e state);
+    void Complete(ReactorChannel* ch);
+    void Fail(ReactorChannel* ch, int status);
+    void Flush(ReactorChannel* ch);
+#ifdef _WIN32
+    void PostRead(ReactorChannel* ch);
+    void OnCompletion(ReactorChannel* ch, OVERLAPPED* ov, DWORD bytes, bool bOk);
+#else
+    void OnReadable(ReactorChannel* ch);
+    void WantWrite(ReactorChannel* ch, bool bWant);
+#endif
+
+    TimerWheel timers;
+    std::vector<std::unique_ptr<ReactorChannel>> channels;
+    size_t active;
+    std::atomic<bool> bStop;
+#ifdef _WIN32
+    HANDLE iocp;
+#else
+    int epfd;
+    int wakeFd;
+    std::vector<uint8_t> rxBuf;
+#endif
+};
+
+#endif // EMMCDL_REACTOR_H
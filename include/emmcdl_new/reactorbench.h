@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef EMMCDL_REACTORBENCH_H
+#define EMMCDL_REACTORBENCH_H
+
+#include <stdint.h>
+
+
+#define REACTORBENCH_DEFAULT_DEVICES    32      // Simulated devices.                   模拟的设备数。
+#define REACTORBENCH_DEFAULT_MB         64      // Firehose data per device.            每个设备的Firehose数据量。
+#define REACTORBENCH_SPD_SHARE          16      // SPD sends 1/16 of it, one ACK per 528 bytes. 展讯发送其1/16，每528字节一个ACK。
+#define REACTORBENCH_SPD_SESSIONS       2       // spd_dump sessions run at once.       同时运行的spd_dump会话数。
+#define REACTORBENCH_SPD_SILENT_AFTER   8       // Frames the failing SPD target answers. 出错的展讯模拟设备应答的帧数。
+
+
+// Outcome of one protocol in the benchmark.
+// 基准测试中一个协议的结果。
+struct ReactorBenchResult {
+    int devices = 0;
+    int threads = 0;            // Host reactor threads.                主机端反应器线程数。
+    int failed = 0;
+    uint64_t bytes = 0;         // Image bytes acknowledged.            已确认的镜像字节数。
+    double seconds = 0;         // Wall time.                           实际经过的时间。
+    double cpuSeconds = 0;      // CPU time of the host reactor threads. 主机端反应器线程的CPU时间。
+};
+
+/**
+ * @class ReactorBench
+ * @brief Measures what driving many devices from a few reactor threads costs. Each simulated
+ *        device is a pipe whose far end is served by a Firehose or Spreadtrum target task on
+ *        separate simulator threads, so only the host side is counted in the CPU time.
+ *        The Spreadtrum download also runs as spd_dump sessions, one thread per device, for comparison.
+ *        测量用少数反应器线程驱动大量设备的开销。每个模拟设备是一个管道，另一端由单独的模拟线程上的
+ *        Firehose或展讯目标任务服务，因此CPU时间只统计主机端。
+ *        展讯的下载还会以spd_dump会话（每个设备一个线程）的方式运行一次，用来对比。
+ */
+class ReactorBench {
+public:
+    /**
+     * @brief
+     * Run the Firehose and the Spreadtrum benchmark and log CPU per device.
+     *
+     * 运行Firehose和展讯的基准测试，并输出每个设备的CPU开销。
+     * @param devices   [in] Simulated devices.          模拟的设备数。
+     * @param megabytes [in] Firehose data per device.   每个设备的Firehose数据量。
+     * @param threads   [in] Host reactor threads.       主机端反应器线程数。
+     * @return
+     * ERROR_SUCCESS if every session finished.
+     *
+     * 所有会话都完成时返回ERROR_SUCCESS。
+     */
+    static int Run(int devices, int megabytes, int threads);
+
+private:
+    static ReactorBenchResult RunProtocol(bool bSpd, int devices, uint64_t bytesPerDevice, int threads);
+    // spd_dump sessions, one thread each. With bFailLast the last target stops answering midway.
+    // spd_dump会话，每个一个线程。bFailLast时最后一个模拟设备中途不再应答。
+    static ReactorBenchResult RunSpdSessions(int devices, uint64_t bytesPerDevice, bool bFailLast);
+    static void LogResult(const char* protocol, const ReactorBenchResult& result);
+};
+
+#endif // EMMCDL_REACTORBENCH_H
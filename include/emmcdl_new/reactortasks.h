@@ -0,0 +1,179 @@
+#pragma once
+
+#ifndef EMMCDL_REACTORTASKS_H
+#define EMMCDL_REACTORTASKS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "emmcdl_new/reactor.h"
+#include "emmcdl_new/firehose.h"
+
+
+#define FH_TASK_TIMEOUT_MS          5000    // Firehose command response or send progress.  Firehose命令响应或发送进度的超时。
+#define FH_TASK_FLUSH_TIMEOUT_MS    30000   // Final response after the raw data.          原始数据之后最终响应的超时。
+#define SPD_TASK_TIMEOUT_MS         3000    // Spreadtrum command response.                展讯命令响应的超时。
+#define SPD_TASK_BAUD_RETRY_MS      200     // Interval between CHECK_BAUD attempts.       CHECK_BAUD重试的间隔。
+#define SPD_TASK_BAUD_RETRIES       25      // CHECK_BAUD attempts before giving up.       放弃之前CHECK_BAUD的尝试次数。
+#define SPD_TASK_DEFAULT_STEP       528     // MIDST_DATA payload used by the boot ROM.    BootROM使用的MIDST_DATA数据长度。
+
+
+// One region written by FirehoseProgramTask.
+// FirehoseProgramTask写入的一个区域。
+struct FirehoseWrite {
+    const uint8_t* data;        // Image bytes, valid while the task runs.       镜像数据，任务运行期间必须有效。
+    uint64_t size;              // Bytes of data, the last sector is zero padded. 数据字节数，最后一个扇区补零。
+    int64_t startSector;        // Negative values count from the end of the disk. 负数表示从磁盘末尾倒数。
+    uint8_t partNum;            // Physical partition.                            物理分区号。
+};
+
+/**
+ * @class FirehoseProgramTask
+ * @brief Configure and program sessions of Firehose driven by a Reactor. Does what
+ *        Firehose::ConnectToFlashProg followed by FastCopyImage does, as a state machine:
+ *        every response and every drained chunk resumes it, so a reactor thread can run many.
+ *        The programmer must have been loaded; the task polls it with NOPs until it answers.
+ *        由Reactor驱动的Firehose配置和写入会话。以状态机的形式完成Firehose::ConnectToFlashProg
+ *        加上FastCopyImage的工作：每个响应、每个发送完成的数据块都会让它继续执行，因此一个反应器线程
+ *        可以同时运行很多个。烧录内核必须已经加载，任务会用NOP轮询，直到它响应。
+ */
+class FirehoseProgramTask : public ReactorTask {
+public:
+    FirehoseProgramTask(const std::string& name, const fh_configure_t& cfg, int sectorSize,
+        const std::vector<FirehoseWrite>& writes);
+
+    std::string Name() const override { return name; }
+    task_state_e Start() override;
+    task_state_e OnData(const uint8_t* data, size_t len) override;
+    task_state_e OnDrained() override;
+    task_state_e OnTimeout() override;
+
+    // Image bytes acknowledged by the device. 设备已确认的镜像字节数。
+    uint64_t BytesWritten() const { return bytesWritten; }
+
+    // Payload size agreed with the device. 和设备协商的数据包大小。
+    uint32_t MaxPayload() const { return maxPayload; }
+
+private:
+    enum fh_task_state_e {
+        FH_TASK_READY,          // Polling the booting programmer.     轮询正在启动的烧录内核。
+        FH_TASK_SETTLE,         // Waiting for the port to go quiet.   等待端口静默。
+        FH_TASK_CONFIGURE,      // Waiting for the configure response. 等待配置的响应。
+        FH_TASK_PROGRAM,        // Waiting for the program response.   等待写入命令的响应。
+        FH_TASK_RAW,            // Sending raw data.                   正在发送原始数据。
+        FH_TASK_FLUSH           // Waiting for the final response.     等待最终响应。
+    };
+
+    task_state_e SendNop();
+    task_state_e SendConfigure();
+    task_state_e NextWrite();
+    task_state_e SendChunk();
+    task_state_e OnResponse(const std::string& xml);
+
+    std::string name;
+    fh_configure_t cfg;
+    int sectorSize;
+    uint32_t maxPayload;
+    std::vector<FirehoseWrite> writes;
+    size_t writeIndex;
+    uint64_t rawQueued;         // Raw bytes of the current write queued so far. 当前写入已排队的原始数据字节数。
+    uint64_t rawTotal;          // Raw bytes of the current write.               当前写入的原始数据总字节数。
+    uint64_t bytesWritten;
+    std::vector<uint8_t> tail;  // Zero padded last chunk.                      补零后的最后一个数据块。
+    std::string rx;             // Received bytes not parsed yet.               还没有解析的接收数据。
+    int readyPolls;             // NOPs sent while waiting for the programmer.  等待烧录内核时发送的NOP数。
+    bool bNopQueued;            // A NOP has not been handed to the driver yet. 有NOP还没有交给驱动。
+    fh_task_state_e state;
+};
+
+
+// A decoded Spreadtrum HDLC frame.
+// 解码后的展讯HDLC帧。
+struct SpdFrame {
+    int type;
+    std::vector<uint8_t> payload;
+    bool bCrc16;                // Checked with CRC16 (boot ROM) rather than the sum (FDL). 使用CRC16（BootROM）而不是校验和（FDL）校验。
+};
+
+/**
+ * @class SpdFrameCodec
+ * @brief Incremental HDLC framing of the Spreadtrum protocol. Bytes can be fed in any split,
+ *        so a reactor task never has to wait for a whole frame inside one read.
+ *        展讯协议的增量HDLC分帧。输入的数据可以任意切分，反应器任务不需要在一次读取中等待整帧。
+ */
+class SpdFrameCodec {
+public:
+    // Encode a frame with escaping, checked by CRC16 or by the FDL sum.
+    // 编码一帧并转义，使用CRC16或FDL校验和。
+    static void Encode(int type, const void* data, size_t len, bool bCrc16, std::vector<uint8_t>& out);
+
+    // Feed received bytes. 输入接收到的数据。
+    void Feed(const uint8_t* data, size_t len);
+
+    // Take the next complete frame. 取出下一个完整的帧。
+    bool Next(SpdFrame* frame);
+
+    // Frames dropped for a bad length or checksum. 因长度或校验错误丢弃的帧数。
+    int Dropped() const { return dropped; }
+
+private:
+    void EndFrame();
+
+    std::vector<uint8_t> raw;
+    bool bInFrame = false;
+    bool bEscape = false;
+    int dropped = 0;
+    std::deque<SpdFrame> frames;
+};
+
+/**
+ * @class SpdDownloadTask
+ * @brief Boot ROM download of a Spreadtrum device driven by a Reactor: CHECK_BAUD, CONNECT,
+ *        then START_DATA / MIDST_DATA / END_DATA of one buffer and optionally EXEC_DATA.
+ *        This is what spd_dump's send_buf does for FDL1, as a state machine.
+ *        由Reactor驱动的展讯BootROM下载：CHECK_BAUD、CONNECT，然后对一个缓冲区执行
+ *        START_DATA / MIDST_DATA / END_DATA，可选EXEC_DATA。即spd_dump中send_buf对FDL1的操作的状态机版本。
+ */
+class SpdDownloadTask : public ReactorTask {
+public:
+    SpdDownloadTask(const std::string& name, uint32_t addr, const uint8_t* data, uint32_t size,
+        unsigned step = SPD_TASK_DEFAULT_STEP, bool bExec = false);
+
+    std::string Name() const override { return name; }
+    task_state_e Start() override;
+    task_state_e OnData(const uint8_t* data, size_t len) override;
+    task_state_e OnTimeout() override;
+
+    uint64_t BytesWritten() const { return offset; }
+
+private:
+    enum spd_task_state_e {
+        SPD_TASK_CHECK_BAUD,
+        SPD_TASK_CONNECT,
+        SPD_TASK_START,
+        SPD_TASK_MIDST,
+        SPD_TASK_END,
+        SPD_TASK_EXEC
+    };
+
+    task_state_e SendFrame(int type, const void* payload, size_t len);
+    task_state_e OnFrame(const SpdFrame& frame);
+
+    std::string name;
+    uint32_t addr;
+    const uint8_t* data;
+    uint32_t size;
+    unsigned step;
+    bool bExec;
+    bool bCrc16;
+    uint32_t offset;            // Bytes acknowledged. 已确认的字节数。
+    uint32_t inFlight;          // Bytes of the MIDST_DATA waiting for its ACK. 等待ACK的MIDST_DATA字节数。
+    int retries;
+    int lastType;
+    std::vector<uint8_t> frame;
+    SpdFrameCodec codec;
+    spd_task_state_e state;
+};
+
+#endif // EMMCDL_REACTORTASKS_H
@@ -233,6 +233,15 @@ public:
      */
     bool CheckDevice(void);
 
+    /**
+     * @brief Collect a RAM dump from a device in memory debug mode.
+     *        从处于内存调试模式的设备收集内存转储。
+     * @param outDir [in] Output directory, partial dumps in it are resumed. 输出目录，其中不完整的转储会继续。
+     * @param writers [in] Number of writer threads. 写入线程数。
+     * @return Status code. 错误代码。
+     */
+    int CollectMemoryDump(const std::string& outDir, int writers = 2);
+
 private:
     /**
      * @brief Switch to a different mode.
@@ -326,6 +335,15 @@ private:
      */
     int PblHack(void);
 
+    /**
+     * @brief Log upload timing of one image.
+     *        输出单个镜像的上传耗时。
+     * @param id    [in] Image ID.              镜像 ID。
+     * @param bytes [in] Bytes sent.            已发送的字节数。
+     * @param start [in] Time of first request. 第一个请求的时间。
+     */
+    void LogImageTiming(uint64_t id, uint64_t bytes, double start);
+
     SerialPort* sport;
     bool bSectorAddress;
     HANDLE hLog;
@@ -0,0 +1,197 @@
+#pragma once
+
+#ifndef EMMCDL_SAHARADUMP_H
+#define EMMCDL_SAHARADUMP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include "emmcdl_new/serialport.h"
+
+
+#define SAHARA_MODE_MEMORY_DEBUG    0x2         // Hello mode of a crashed device. 设备崩溃后Hello中的模式。
+
+#define MEMDUMP_DEFAULT_CHUNK       0x100000    // Bytes per memory read request.     每个内存读取请求的字节数。
+#define MEMDUMP_MIN_CHUNK           0x1000      // Smallest chunk when backing off.    退避时最小的读取大小。
+#define MEMDUMP_DEFAULT_WRITERS     2           // Region writer threads.             区域写入线程数。
+#define MEMDUMP_MAX_QUEUED          0x4000000   // Bytes allowed to wait for writers. 允许排队等待写入的字节数。
+#define MEMDUMP_MAX_RETRY           4           // Retries of one chunk.              单个块的重试次数。
+
+#pragma pack(push, 1)
+// Sahara memory debug packet (32-bit).
+// Sahara 内存调试数据包（32位）。
+typedef struct {
+    DWORD cmd;
+    DWORD len;
+    DWORD table_addr;    // Address of the memory table / 内存表地址
+    DWORD table_len;     // Length of the memory table / 内存表长度
+} memory_debug_t;
+
+// Sahara memory debug packet (64-bit).
+// Sahara 内存调试数据包（64位）。
+typedef struct {
+    DWORD cmd;
+    DWORD len;
+    uint64_t table_addr;
+    uint64_t table_len;
+} memory_debug_64_t;
+
+// Sahara memory read request (32-bit).
+// Sahara 内存读取请求（32位）。
+typedef struct {
+    DWORD cmd;
+    DWORD len;
+    DWORD addr;
+    DWORD length;
+} memory_read_t;
+
+// Sahara memory read request (64-bit).
+// Sahara 内存读取请求（64位）。
+typedef struct {
+    DWORD cmd;
+    DWORD len;
+    uint64_t addr;
+    uint64_t length;
+} memory_read_64_t;
+
+// Memory table entry (32-bit).
+// 内存表条目（32位）。
+typedef struct {
+    DWORD save_pref;
+    DWORD mem_base;
+    DWORD length;
+    char desc[20];
+    char filename[20];
+} dload_debug_type_t;
+
+// Memory table entry (64-bit).
+// 内存表条目（64位）。
+typedef struct {
+    uint64_t save_pref;
+    uint64_t mem_base;
+    uint64_t length;
+    char desc[20];
+    char filename[20];
+} dload_debug_type_64_t;
+#pragma pack(pop)
+
+
+// Raw byte transport of a Sahara target. SerialSaharaLink wraps a SerialPort;
+// a simulated target can implement this interface to exercise SaharaMemDump without hardware.
+// Sahara 设备的原始字节传输接口。SerialSaharaLink 包装了 SerialPort；
+// 模拟的设备可以实现这个接口，这样不需要硬件也能运行 SaharaMemDump。
+class SaharaLink {
+public:
+    virtual ~SaharaLink() {}
+    virtual int Write(const BYTE* data, DWORD length) = 0;
+    // Same semantics as SerialPort::Read: length is 0 on return if nothing arrived before the timeout.
+    // 和 SerialPort::Read 的语义相同：超时前没有收到数据时返回的 length 为 0。
+    virtual int Read(BYTE* data, DWORD* length) = 0;
+    virtual int SetTimeout(int miliseconds) = 0;
+};
+
+class SerialSaharaLink : public SaharaLink {
+public:
+    SerialSaharaLink(SerialPort* port) : sport(port) {}
+    int Write(const BYTE* data, DWORD length) override { return sport->Write(data, length); }
+    int Read(BYTE* data, DWORD* length) override { return sport->Read(data, length); }
+    int SetTimeout(int miliseconds) override { return sport->SetTimeout(miliseconds); }
+private:
+    SerialPort* sport;
+};
+
+
+// One region of the memory table.
+// 内存表中的一个区域。
+struct MemRegion {
+    uint64_t base;          // Physical address.      物理地址。
+    uint64_t length;        // Length in bytes.       长度（字节）。
+    uint64_t savePref;      // Save preference.       保存偏好。
+    std::string desc;       // Description.           描述。
+    std::string filename;   // Output file name.      输出文件名。
+    uint64_t done;          // Bytes already on disk. 已写入磁盘的字节数。
+    double seconds;         // Time spent reading.    读取耗时。
+    int status;             // Result.                结果。
+};
+
+
+/**
+ * @class SaharaMemDump
+ * @brief Collects RAM dumps from a device in Sahara memory debug mode.
+ *        Regions from the memory table are read with large (64-bit when supported)
+ *        memory read requests; the data is handed to several writer threads so
+ *        file IO overlaps with USB reads. Existing partial files are resumed.
+ *        从处于 Sahara 内存调试模式的设备收集内存转储。
+ *        内存表中的区域用较大的（支持时使用64位）内存读取请求读取，数据交给多个写入线程，
+ *        让文件写入和 USB 读取同时进行。已有的不完整文件会继续写入。
+ */
+class SaharaMemDump {
+public:
+    SaharaMemDump(SaharaLink* link);
+    ~SaharaMemDump();
+
+    // Bytes per memory read request. 每个内存读取请求的字节数。
+    void SetChunkSize(uint32_t bytes);
+    // Number of writer threads. 写入线程数。
+    void SetWriterCount(int count);
+
+    /**
+     * @brief Run the whole collection: handshake, memory table, all regions and reset.
+     *        执行完整的收集过程：握手、读取内存表、转储所有区域并重置设备。
+     * @param outDir     [in] Output directory. 输出目录。
+     * @param bReadHello [in] Whether the Hello request still has to be read. 是否还需要读取Hello请求。
+     * @return Status code. 错误代码。
+     */
+    int Run(const std::string& outDir, bool bReadHello = true);
+
+    const std::vector<MemRegion>& Regions() const { return regions; }
+
+private:
+    // A block of region data waiting to be written.
+    // 等待写入的区域数据块。
+    struct WriteBlock {
+        FILE* fp;
+        std::vector<BYTE> data;
+        MemRegion* region;
+    };
+
+    // Queue of one writer thread.
+    // 单个写入线程的队列。
+    struct WriterQueue {
+        std::deque<WriteBlock> blocks;
+        std::thread worker;
+    };
+
+    int Handshake(bool bReadHello);
+    int ReadMemoryTable(uint64_t tableAddr, uint64_t tableLen);
+    int ReadMemory(uint64_t addr, BYTE* buf, uint32_t len);
+    int DumpRegion(size_t index, const std::string& outDir);
+    int ResetTarget();
+    void StartWriters();
+    void StopWriters();
+    void WriterLoop(int index);
+    void QueueBlock(int writer, WriteBlock&& block);
+
+    SaharaLink* link;
+    bool bMode64;                   // Target uses 64-bit memory debug.  设备使用64位内存调试。
+    uint32_t dwChunkSize;
+    int nWriters;
+    std::vector<MemRegion> regions;
+
+    std::mutex mtx;
+    std::condition_variable cvWork;     // Signaled when a block is queued.  有数据块入队时通知。
+    std::condition_variable cvSpace;    // Signaled when a block is written. 有数据块写完时通知。
+    std::vector<WriterQueue> writers;
+    size_t queuedBytes;
+    bool bStopWriters;
+    std::atomic<int> writeError;
+};
+
+#endif // EMMCDL_SAHARADUMP_H
@@ -8,8 +8,14 @@
 #include <vector>
 #include <stdint.h>
 #include <algorithm>
+#include <memory>
+#include <functional>
 #include "emmcdl/crc.h"
 #include "datatypes/bytearray.h"
+#include "emmcdl_new/capture.h"
+#ifdef EMMCDL_USE_LIBUSB
+#include "emmcdl_new/usbtransport.h"
+#endif
 
 
 
@@ -44,6 +50,69 @@ public:
      */
 
     int Open(int port);
+
+#ifdef EMMCDL_USE_LIBUSB
+    /**
+     * @brief
+     * Open a USB device through libusb instead of a COM port. 
+     * Read/Write/SendSync work the same way afterwards.
+     *
+     * 通过libusb打开USB设备而不是COM口，之后Read/Write/SendSync的用法不变。
+     * @param vid   [in] Vendor ID.  厂商ID。
+     * @param pid   [in] Product ID. 产品ID。
+     * @param index [in] Index among matching devices. 在匹配设备中的序号。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int OpenUsb(uint16_t vid = USB_VID_QUALCOMM, uint16_t pid = USB_PID_QDLOADER_9008, int index = 0);
+#endif
+
+    /**
+     * @brief
+     * Whether the port (or USB device) is open.
+     *
+     * 串口（或USB设备）是否已打开。
+     */
+    bool IsOpen() const;
+
+    // Port number passed to Open. Open时传入的端口号。
+    int GetPortNum() const { return portNum; }
+
+    // Timeout set by SetTimeout. SetTimeout设置的超时时间。
+    int GetTimeout() const { return timeout_ms; }
+
+    /**
+     * @brief
+     * Wait for the device to re-enumerate after a mode switch and reopen it, possibly on a new COM port.
+     * Returns as soon as the device is back. While waiting for it to leave, ready is polled and
+     * the device is taken to keep its port as soon as it answers on it, or once graceMs passed.
+     * Without a device monitor (libusb, unknown port) nothing is waited for.
+     *
+     * 等待设备在切换模式后重新枚举并重新打开（COM口号可能会变）。设备一回来就返回。
+     * 等待设备断开期间会轮询ready，设备在原端口上响应或者过了graceMs，就认为它保留了原来的端口。
+     * 没有设备监视（libusb、未知端口）时不做任何等待。
+     * @param graceMs   [in] How long to wait for the device to leave. 等待设备断开的时间。
+     * @param timeoutMs [in] How long to wait for it to come back.     等待设备重新出现的时间。
+     * @param pid       [in] Expected product ID (mode) after the switch, 0 for any. 切换后预期的产品ID（模式），0表示任意。
+     * @param ready     [in] One bounded readiness poll on the current port, may be empty. 在当前端口上进行一次有时限的就绪检查，可以为空。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int WaitReenumeration(int graceMs, int timeoutMs, uint16_t pid = 0, const std::function<bool()>& ready = nullptr);
+
+    /**
+     * @brief
+     * Send a zero length packet after writes that are a multiple of the USB packet size.
+     * Only affects the libusb backend; should match ZLPAwareHost.
+     *
+     * 在长度为USB包长整数倍的写入之后补发零长度包。只对libusb后端有效，应当和ZLPAwareHost一致。
+     * @param enable [in] Enable or disable. 是否启用。
+     */
+    void SetZlpAware(bool enable);
     /**
      * @brief
      * Get port status.
@@ -61,21 +130,26 @@ public:
     /**
      * @brief 
      * Enable binary log, which records every IO opreations.
+     * All operations of a port go into one pcap file (COMn_<time>.pcap) written by a background thread.
      * 
      * 启用串口日志（会记录所有IO操作）。
+     * 一个端口的所有操作都由后台线程写入同一个pcap文件（COMn_<时间>.pcap）。
      * @param enable         [in] Enable or disable.  是否启用。
      * @param dirName        [in] Directory to store log files.  存储日志文件的目录。
-     * @param dwLogSizeLimit [in] Limit of logging. Opreations bigger than this will not be fully shown.
-     *                              日志记录的大小限制。超过这个大小的IO操作将不会完全显示。
-     * @param dwFileSizeLimit    [in] Limit of each record. Opreations bigger than this will not be recorded. 
-     *                              每个日志文件的大小限制。超过这个大小的IO操作将不会被记录。
+     * @param dwLogSizeLimit [in] Limit of logging. Opreations bigger than this will not be shown in the trace log.
+     *                              日志记录的大小限制。超过这个大小的IO操作将不会显示在追踪日志中。
+     * @param dwFileSizeLimit    [in] Limit of each record. Opreations bigger than this will be truncated. 
+     *                              每条记录的大小限制。超过这个大小的IO操作将会被截断。
+     * @param dwSampleEvery  [in] Only keep the data of 1 in N truncated operations. 
+     *                              被截断的IO操作中每N条只保留1条的数据。
      * @return ERROR_SUCCESS
      */
 
     int EnableBinaryLog(bool enable = true, 
                         std::string dirName = "log/ports", 
                         DWORD dwLogSizeLimit = 0x1000, 
-                        DWORD dwFileSizeLimit = 0x2000000);
+                        DWORD dwFileSizeLimit = 0x10000,
+                        DWORD dwSampleEvery = 1);
     /**
      * @brief
      * Close serial port.
@@ -173,6 +247,36 @@ public:
     int SendSync(const ByteArray& out_buf, ByteArray& in_buf);
     int SendSync(BYTE *out_buf, int out_length, BYTE *in_buf, int *in_length);
 
+    /**
+     * @brief 
+     * HDLC encode a packet and send it without waiting for the response.
+     * Used together with ReadPacket to keep several packets outstanding.
+     * 
+     * HDLC编码并发送数据包，但不等待响应。和ReadPacket一起使用可以让多个数据包同时在途。
+     * @param out_buf    [in] Buffer containing data to send.  包含要发送的数据的缓冲区。
+     * @param out_length [in] Length of data to send.          要发送的数据的长度。
+     * @return 
+     * Status.
+     * 
+     * 错误代码。
+     */
+    int WritePacket(const BYTE* out_buf, int out_length);
+
+    /**
+     * @brief 
+     * Read one HDLC packet and decode it. in_length is 0 on return if nothing arrived before the timeout.
+     * 
+     * 读取并解码一个HDLC数据包。如果超时前没有收到数据，返回时in_length为0。
+     * @param in_buf    [out]    Buffer to read response into. 用于存储响应数据的缓冲区。
+     * @param in_length [in/out] Size of the buffer; on return the length of the packet.
+     *                           缓冲区的大小；返回时为数据包的长度。
+     * @return 
+     * Status.
+     * 
+     * 错误代码。
+     */
+    int ReadPacket(BYTE* in_buf, int* in_length);
+
     /**
      * @brief 
      * Set the timeout for read/write operations. 
@@ -209,7 +313,15 @@ private:
     int HDLCDecodePacket(const ByteArray& in_buf, ByteArray& out_buf);
     int HDLCDecodePacket(BYTE* in_buf, int in_length, BYTE* out_buf, int* out_length);
 
-    void WriteBinaryLog(std::string logTitle, std::string fileName, const ByteArray& data);
+    // Start capturing to a new file if binary log is enabled.
+    // 如果启用了串口日志，开始捕获到新文件。
+    void StartBinaryLog();
+
+    // Queue one IO operation for the binary log.
+    // 把一次IO操作交给串口日志。
+    void WriteBinaryLog(uint8_t dir, int status, const BYTE* data, DWORD length) {
+        if (capture) capture->Push(dir, status, data, length);
+    }
 
     int portNum;            // Serial port number. 串口号。
     HANDLE hPort;        // Serial port handle. 串口句柄。
@@ -219,5 +331,10 @@ private:
     bool bBinaryLog;     // Whether binary log is enabled. 是否启用了串口日志。
     std::string sLogDirName; // Directory to store log files. 存储日志文件的目录。
     DWORD dwLogRecordThershold; // Threshold of each record in binary log. 串口日志中每个日志文件的大小阈值。
-    DWORD dwBinaryLogSizeLimit; // Limit of each record in binary log. 串口日志中每个日志文件的大小限制。
+    DWORD dwBinaryLogSizeLimit; // Limit of each record in binary log. 串口日志中每条记录的大小限制。
+    DWORD dwBinaryLogSampleEvery; // Sampling interval of truncated records. 被截断记录的采样间隔。
+    std::shared_ptr<PortCapture> capture; // Binary log writer. 串口日志写入器。
+#ifdef EMMCDL_USE_LIBUSB
+    UsbTransport* usb;   // libusb backend, nullptr when using a COM port. libusb后端，使用COM口时为nullptr。
+#endif
 };
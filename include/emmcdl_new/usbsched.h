@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef EMMCDL_USBSCHED_H
+#define EMMCDL_USBSCHED_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+
+#define USBSCHED_INITIAL_LIMIT  2       // Bulk phases allowed per controller before anything is measured.
+                                        // 还没有测量数据时每个主控制器允许的大流量阶段数。
+#define USBSCHED_MAX_LIMIT      16      // Upper bound of the per-controller limit. 每个主控制器限制的上限。
+#define USBSCHED_MIN_GAIN       1.10    // One more bulk phase must raise the controller throughput by this factor.
+                                        // 多一个大流量阶段至少要让主控制器的吞吐量提高这个倍数。
+
+
+// Kind of work a session is doing.
+// 会话正在进行的工作类型。
+enum usb_phase_e {
+    USB_PHASE_LIGHT,        // Sahara, configure, GPT reads, resets: never held back.  Sahara、配置、读取分区表、重置：不受限制。
+    USB_PHASE_BULK          // Image transfer: limited per controller.                  镜像传输：按主控制器限制。
+};
+
+
+// A phase that was let through by UsbScheduler::Begin.
+// 由UsbScheduler::Begin放行的阶段。
+struct UsbPhaseTicket {
+    std::string controller;     // Controller of the device.          设备所在的主控制器。
+    usb_phase_e phase;          // Kind of phase.                     阶段类型。
+    int concurrency;            // Bulk phases running when it began, itself included. 开始时正在进行的大流量阶段数，包括自己。
+    double waited;              // Seconds spent waiting.             等待的秒数。
+};
+
+
+/**
+ * @class UsbScheduler
+ * @brief Limits how many bulk-heavy phases run at once on each USB host controller, so a
+ *        tray of devices behind one root port does not saturate it while other controllers
+ *        idle. The limit of each controller follows the measured throughput: it grows while
+ *        one more concurrent transfer still raises the controller total by USBSCHED_MIN_GAIN,
+ *        and shrinks back when it does not. Light phases and devices on an unknown controller
+ *        are never held back.
+ *        限制每个USB主控制器上同时进行的大流量阶段数，避免同一根端口后面的一批设备把它占满而其他主控制器空闲。
+ *        每个主控制器的限制跟随测得的吞吐量：多一个并发传输仍能让该主控制器的总吞吐量提高USBSCHED_MIN_GAIN倍时增大，
+ *        否则退回。轻量阶段和主控制器未知的设备不受限制。
+ */
+class UsbScheduler {
+public:
+    UsbScheduler(int initialLimit = USBSCHED_INITIAL_LIMIT, int maxLimit = USBSCHED_MAX_LIMIT);
+
+    /**
+     * @brief Wait until a phase may start on a controller.
+     *        等待直到可以在主控制器上开始一个阶段。
+     * @param controller [in] Controller of the device, empty if unknown. 设备所在的主控制器，未知时为空。
+     * @param phase      [in] Kind of phase. 阶段类型。
+     * @return Ticket to pass to End. 传给End的凭据。
+     */
+    UsbPhaseTicket Begin(const std::string& controller, usb_phase_e phase);
+
+    /**
+     * @brief Finish a phase started with Begin and feed its throughput back.
+     *        结束用Begin开始的阶段并反馈它的吞吐量。
+     * @param ticket  [in] Ticket returned by Begin. Begin返回的凭据。
+     * @param bytes   [in] Bytes moved in the phase. 这个阶段传输的字节数。
+     * @param seconds [in] Duration of the phase, without the wait. 阶段的时长，不含等待时间。
+     */
+    void End(const UsbPhaseTicket& ticket, uint64_t bytes, double seconds);
+
+    // Current bulk limit of a controller. 主控制器当前的大流量阶段限制。
+    int Limit(const std::string& controller);
+
+private:
+    struct Controller {
+        int active = 0;                         // Running bulk phases. 正在进行的大流量阶段数。
+        int waiting = 0;                        // Bulk phases held back. 正在等待的大流量阶段数。
+        int limit = 0;                          // Allowed bulk phases. 允许的大流量阶段数。
+        std::map<int, double> throughput;       // Smoothed controller bytes/s by concurrency. 按并发数平滑后的主控制器吞吐量。
+    };
+
+    Controller& Get(const std::string& controller);
+    void Adjust(const std::string& name, Controller& c);
+
+    int initialLimit;
+    int maxLimit;
+    std::mutex mtx;
+    std::condition_variable cvFree;
+    std::map<std::string, Controller> controllers;
+};
+
+#endif // EMMCDL_USBSCHED_H
@@ -0,0 +1,163 @@
+#pragma once
+
+#ifndef EMMCDL_USBTRANSPORT_H
+#define EMMCDL_USBTRANSPORT_H
+
+#include <stdint.h>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <libusb-1.0/libusb.h>
+#include "datatypes/bytearray.h"
+#include "emmcdl_new/errcodes.h"
+
+
+#define USB_VID_QUALCOMM        0x05C6
+#define USB_PID_QDLOADER_9008   0x9008
+
+#define USB_DEFAULT_IN_URBS     8          // Number of queued bulk-IN transfers.   排队的bulk-IN传输数量。
+#define USB_DEFAULT_OUT_URBS    8          // Number of in-flight bulk-OUT transfers. 同时在途的bulk-OUT传输数量。
+#define USB_IN_URB_SIZE         0x4000     // Size of each bulk-IN transfer.       每个bulk-IN传输的大小。
+#define USB_OUT_URB_SIZE        0x10000    // Maximum size of each bulk-OUT transfer. 每个bulk-OUT传输的最大大小。
+#define USB_RX_RING_SIZE        0x400000   // Size of the receive ring buffer.     接收环形缓冲区的大小。
+
+
+// Asynchronous libusb bulk transport.
+// Keeps several bulk-IN transfers queued at all times so the device never has
+// to wait for the host, and splits writes into several in-flight bulk-OUT
+// transfers. Used by SerialPort as an alternative backend to COM ports.
+//
+// 基于libusb异步接口的bulk传输。
+// 始终保持多个bulk-IN传输在队列中，让设备不需要等待主机；写入时拆分为多个
+// 同时在途的bulk-OUT传输。作为SerialPort除了COM口之外的另一个后端使用。
+class UsbTransport {
+public:
+    UsbTransport();
+    ~UsbTransport();
+
+    /**
+     * @brief
+     * Open the index-th device that matches vid/pid and start the transfers.
+     *
+     * 打开第index个匹配vid/pid的设备并开始传输。
+     * @param vid   [in] Vendor ID.  厂商ID。
+     * @param pid   [in] Product ID. 产品ID。
+     * @param index [in] Index among matching devices. 在匹配设备中的序号。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Open(uint16_t vid = USB_VID_QUALCOMM, uint16_t pid = USB_PID_QDLOADER_9008, int index = 0);
+
+    /**
+     * @brief
+     * Cancel all transfers and close the device.
+     *
+     * 取消所有传输并关闭设备。
+     * @return ERROR_SUCCESS
+     */
+    int Close();
+
+    bool IsOpen() const { return hDev != nullptr; }
+
+    /**
+     * @brief
+     * Write data. The data is split into transfers of at most USB_OUT_URB_SIZE
+     * bytes, up to nOutUrbs of them in flight. A zero length packet is appended
+     * when the length is a multiple of wMaxPacketSize and ZLP is enabled.
+     * Returns when all of the data has been transferred.
+     *
+     * 写入数据。数据会被拆分为不超过USB_OUT_URB_SIZE字节的传输，最多nOutUrbs个同时在途。
+     * 如果启用了ZLP且长度是wMaxPacketSize的整数倍，会在最后补一个零长度包。
+     * 所有数据传输完毕后返回。
+     * @param data         [in]  Data to write.                 要写入的数据。
+     * @param length       [in]  Length of data.                数据长度。
+     * @param bytesWritten [out] Number of bytes actually written. 实际写入的字节数。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Write(const uint8_t* data, uint32_t length, uint32_t* bytesWritten = nullptr);
+
+    /**
+     * @brief
+     * Read received data. Waits up to the timeout if nothing has arrived yet.
+     *
+     * 读取已接收的数据。如果还没有数据，最多等待超时时间。
+     * @param data   [out]    Buffer to read data into. 用于存储数据的缓冲区。
+     * @param length [in/out] Size of the buffer; on return the number of bytes read.
+     *                        缓冲区的大小；返回时为实际读取的字节数。
+     * @return
+     * Status.
+     *
+     * 错误代码。
+     */
+    int Read(uint8_t* data, uint32_t* length);
+
+    // Number of received bytes that have not been read yet.
+    // 已接收但还未读取的字节数。
+    uint32_t BytesAvailable();
+
+    // Drop all received data.
+    // 丢弃所有已接收的数据。
+    int Flush();
+
+    int SetTimeout(int miliseconds);
+
+    // Append a ZLP after writes that are a multiple of wMaxPacketSize.
+    // Should match the ZLPAwareHost setting sent to the programmer.
+    // 在长度为wMaxPacketSize整数倍的写入后补发零长度包，应当和发给烧录程序的ZLPAwareHost一致。
+    void SetZlpAware(bool enable) { bZlpAware = enable; }
+
+    // Set the number of queued transfers. Only takes effect before Open().
+    // 设置排队的传输数量，只在Open()之前调用有效。
+    void SetUrbCount(int inUrbs, int outUrbs);
+
+private:
+    static void LIBUSB_CALL InCallback(libusb_transfer* xfer);
+    static void LIBUSB_CALL OutCallback(libusb_transfer* xfer);
+    void EventLoop();
+    int FindEndpoints();
+    int SubmitIn(libusb_transfer* xfer);
+    int SubmitOut(const uint8_t* data, int length);
+    void FreeTransfers();
+
+    libusb_context* ctx;
+    libusb_device_handle* hDev;
+    int iface;                 // Claimed interface.             已声明的接口。
+    uint8_t epIn;              // Bulk-IN endpoint address.      Bulk-IN端点地址。
+    uint8_t epOut;             // Bulk-OUT endpoint address.     Bulk-OUT端点地址。
+    int wMaxPacketSize;        // Max packet size of epOut.      epOut的最大包长。
+    int nInUrbs;               // Number of queued IN transfers. 排队的IN传输数量。
+    int nOutUrbs;              // Max in-flight OUT transfers.   最多在途的OUT传输数量。
+    int timeout_ms;            // Read/write timeout.            读写超时时间。
+    bool bZlpAware;            // Whether to send ZLPs.          是否发送零长度包。
+
+    std::vector<libusb_transfer*> inXfers;
+    std::vector<uint8_t*> inBufs;
+    std::vector<libusb_transfer*> parkedIn;  // IN transfers waiting for ring space. 等待缓冲区空间的IN传输。
+    std::vector<libusb_transfer*> inFlight;  // IN transfers submitted to libusb.    已提交给libusb的IN传输。
+    std::vector<libusb_transfer*> outFlight; // OUT transfers submitted to libusb.   已提交给libusb的OUT传输。
+
+    std::mutex mtx;
+    std::condition_variable cvRx;   // Signaled when data arrives.     收到数据时通知。
+    std::condition_variable cvTx;   // Signaled when a write completes. 写入完成时通知。
+    ByteArray rxRing;               // Receive ring buffer.            接收环形缓冲区。
+    size_t rxHead;                  // Read position in rxRing.        rxRing中的读位置。
+    size_t rxCount;                 // Bytes stored in rxRing.         rxRing中的字节数。
+    int inPending;                  // IN transfers still submitted.   仍在提交中的IN传输数。
+    int outPending;                 // OUT transfers still in flight.  仍在途的OUT传输数。
+    int outError;                   // First error of current write.   当前写入的第一个错误。
+    uint32_t outDone;               // Bytes completed in current write. 当前写入已完成的字节数。
+    bool bDeviceGone;               // Device was disconnected.        设备已断开。
+    bool bClosing;                  // Close() is cancelling transfers. Close()正在取消传输。
+
+    std::atomic<bool> bRunning;
+    std::thread eventThread;
+};
+
+#endif // EMMCDL_USBTRANSPORT_H
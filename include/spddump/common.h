@@ -35,6 +35,7 @@ DWORD WINAPI ThrdFunc(LPVOID lpParam);
 #endif
 #else
 #include <dirent.h>
+unsigned long long GetTickCount64();
 #endif
 
 #if USE_LIBUSB
@@ -61,17 +62,20 @@ void usleep(unsigned int us);
 #endif
 
 #include "spd_cmd.h"
+#include "utils/rtt_estimator.h"
 
 #define FLAGS_CRC16 1
 #define FLAGS_TRANSCODE 2
 
-#if _WIN32
-#define ERR_EXIT(...) \
-	do { fprintf(stderr, __VA_ARGS__); if (m_bOpened == 1) system("pause"); exit(1); } while (0)
-#else
+// final argument of spd_checksum
+#define CHK_FIXZERO 1
+#define CHK_ORIG 2
+
+// ends the session running on this thread, see spd_session_run. exits the process outside of one
+[[noreturn]] void spd_err_exit(void);
+
 #define ERR_EXIT(...) \
-	do { fprintf(stderr, __VA_ARGS__); exit(1); } while (0)
-#endif
+	do { fprintf(stderr, __VA_ARGS__); spd_err_exit(); } while (0)
 
 #define DBG_LOG(...) fprintf(stderr, __VA_ARGS__)
 
@@ -122,27 +126,10 @@ typedef struct {
 } partition_t;
 
 typedef struct {
-	uint8_t *raw_buf, *enc_buf, *recv_buf, *temp_buf, *untranscode_buf, *send_buf;
-#if USE_LIBUSB
-	libusb_device_handle *dev_handle;
-	int endp_in, endp_out;
-	int m_dwRecvThreadID;
-#else
-	ClassHandle *handle;
-	HANDLE m_hOprEvent;
-	DWORD m_dwRecvThreadID;
-	HANDLE m_hRecvThreadState;
-	HANDLE m_hRecvThread;
-#endif
-#if _WIN32
-	DWORD iThread;
-	HANDLE hThread;
-#endif
-	int flags, recv_len, recv_pos;
-	int raw_len, enc_len, verbose, timeout;
-	partition_t *ptable;
-	int part_count;
-} spdio_t;
+	char name[36];
+	long long size;	// 0 if only existence is known
+	int exists;
+} part_cache_t;
 
 #pragma pack(1)
 typedef struct {
@@ -204,12 +191,88 @@ typedef struct {
 } bootloader_control;
 #pragma pack()
 
+typedef struct {
+	uint8_t *raw_buf, *enc_buf, *recv_buf, *temp_buf, *untranscode_buf, *send_buf;
+#if USE_LIBUSB
+	libusb_context *ctx;	// each session has its own, so its hotplug thread only serves it
+	libusb_device_handle *dev_handle;
+	int endp_in, endp_out;
+	int m_dwRecvThreadID;
+	struct recv_ring_t *recv_ring;	// IN transfers kept posted, NULL: not started
+	int recv_ring_slots;	// 0: synchronous reads
+#else
+	ClassHandle *handle;
+	HANDLE m_hOprEvent;
+	DWORD m_dwRecvThreadID;
+	HANDLE m_hRecvThreadState;
+	HANDLE m_hRecvThread;
+#endif
+#if _WIN32
+	DWORD iThread;
+	HANDLE hThread;
+#endif
+	int flags, recv_len, recv_pos;
+	int raw_len, enc_len, verbose, timeout;
+	partition_t *ptable;
+	int part_count;
+	part_cache_t *pcache;
+	int pcache_count;
+	char pcache_fn[ARGV_LEN + 96];	// empty: not saved
+	struct file_feeder_t *feed_keep;	// load_partition keeps the chunks of the image here for the next write
+	RttEstimator rtt_cmd;	// per-chunk ACK latency
+	RttEstimator rtt_long;	// per-chunk ACK latency of sparse images
+
+	// a simulated device, when set send_msg and recv_read_data use it instead of the port.
+	// sim_recv returns the bytes read, 0 after timeout ms, < 0 on error
+	int (*sim_send)(void *ctx, const uint8_t *buf, int len);
+	int (*sim_recv)(void *ctx, uint8_t *buf, int len, int timeout);
+	void *sim_ctx;
+
+	// session state, kept here so that one process can drive several devices
+	int m_bOpened;	// 1: connected, -1: the device was removed
+	int pause_on_exit;	// Windows: pause before a failed session ends, set by the command line tool while connected
+	int bListenLibusb;	// -1: not started yet
+	int fdl1_loaded, fdl2_executed;
+	int selected_ab;	// -1: not checked yet
+	int gpt_failed;
+	int recv_esc;	// recv_transcode: the last read ended with HDLC_ESCAPE
+	int recv_plen;	// RcvDataThreadProc: length of the packet being received
+	int read_window, feed_depth;
+	int part_rmw;	// w_mem_to_part_offset: 0 rewrites the whole partition, 1 up to the patch, 2 the same once probed, and verifies
+	int rmw_probed;	// 1: the FDL keeps the rest of a partition, -1: it does not, 0: not known yet
+	int progress_completed;	// print_progress_bar: width of the bar printed last
+	uint64_t progress_done;	// print_progress_bar: bytes done when it was printed
+	uint64_t fblk_size;
+	DA_INFO_T Da_Info;
+	partition_t gPartInfo;
+	char savepath[ARGV_LEN];
+	char fn_partlist[40];
 #if USE_LIBUSB
-libusb_device **FindPort(int pid);
-void startUsbEventHandle(void);
-void stopUsbEventHandle(void);
+	libusb_device *curPort;
+	char usb_path[32];	// "bus-port.port", the only port this session uses once set, see usb_bind
+#ifndef _MSC_VER
+	pthread_t hUsbEventThrd;
+	libusb_hotplug_callback_handle hHotplugCb;
+#endif
+#else
+	DWORD curPort;
+#endif
+#if _WIN32
+	BOOL interface_checked, is_diag;	// WndProc
+#endif
+} spdio_t;
+
+#if USE_LIBUSB
+libusb_device **FindPort(libusb_context *ctx, int pid);
+int usb_bind(spdio_t *io, const char *path);
+int usb_claim(spdio_t *io, libusb_device *dev);
+void usb_unbind(spdio_t *io);
+void startUsbEventHandle(spdio_t *io);
+void stopUsbEventHandle(spdio_t *io);
 void find_endpoints(libusb_device_handle *dev_handle, int result[2]);
 void call_Initialize_libusb(spdio_t *io);
+void recv_ring_stop(spdio_t *io);
+uint64_t recv_bench(spdio_t *io, const char *name, uint64_t size, unsigned step);
 #else
 DWORD *FindPort(const char *USB_DL);
 BOOL CreateRecvThread(spdio_t *io);
@@ -221,19 +284,33 @@ void ChangeMode(spdio_t *io, int ms, int bootmode, int at);
 
 spdio_t *spdio_init(int flags);
 void spdio_free(spdio_t *io);
+int spd_session_run(spdio_t *io, int (*fn)(spdio_t *io, void *arg), void *arg);
+
+typedef struct {
+	const void *base;
+	size_t len;
+} spd_iov_t;
 
+int spd_transcode(uint8_t *dst, uint8_t *src, int len);
+int spd_transcode_max(uint8_t *src, int len, int n);
+unsigned spd_crc16(unsigned crc, const void *src, unsigned len);
+unsigned spd_checksum(unsigned crc, const void *src, int len, int final);
+int spd_encode_iov(int flags, int type, const spd_iov_t *iov, int cnt, uint8_t *out);
+void encode_msg_iov(spdio_t *io, int type, const spd_iov_t *iov, int cnt);
 void encode_msg(spdio_t *io, int type, const void *data, size_t len);
 void encode_msg_nocpy(spdio_t *io, int type, size_t len);
 int send_msg(spdio_t *io);
 int recv_msg(spdio_t *io);
 int recv_msg_timeout(spdio_t *io, int timeout);
+int recv_msg_rtt(spdio_t *io, RttEstimator *rtt);
 unsigned recv_type(spdio_t *io);
 int send_and_check(spdio_t *io);
 int check_confirm(const char *name);
 uint8_t *loadfile(const char *fn, size_t *num, size_t extra);
 void send_buf(spdio_t *io, uint32_t start_addr, int end_data, unsigned step, uint8_t *mem, unsigned size);
 size_t send_file(spdio_t *io, const char *fn, uint32_t start_addr, int end_data, unsigned step, unsigned src_offs, unsigned src_size);
-FILE *my_fopen(const char *fn, const char *mode);
+FILE *my_fopen(spdio_t *io, const char *fn, const char *mode);
+void print_progress_bar(spdio_t *io, uint64_t done, uint64_t total, unsigned long long time0);
 unsigned dump_flash(spdio_t *io, uint32_t addr, uint32_t start, uint32_t len, const char *fn, unsigned step);
 unsigned dump_mem(spdio_t *io, uint32_t start, uint32_t len, const char *fn, unsigned step);
 uint64_t dump_partition(spdio_t *io, const char *name, uint64_t start, uint64_t len, const char *fn, unsigned step);
@@ -248,6 +325,11 @@ void load_partitions(spdio_t *io, const char *path, unsigned step, int force_ab)
 void load_partition_force(spdio_t *io, const int id, const char *fn, unsigned step);
 int load_partition_unify(spdio_t *io, const char *name, const char *fn, unsigned step);
 uint64_t check_partition(spdio_t *io, const char *name, int need_size);
+part_cache_t *part_cache_find(spdio_t *io, const char *name);
+void part_cache_put(spdio_t *io, const char *name, int exists, long long size);
+void part_cache_fill(spdio_t *io, const partition_t *ptable, int count, int exact);
+void part_cache_clear(spdio_t *io);
+int part_cache_bind(spdio_t *io);
 void get_partition_info(spdio_t *io, const char *name, int need_size);
 uint64_t str_to_size(const char *str);
 uint64_t str_to_size_ubi(const char *str, int *nand_info);
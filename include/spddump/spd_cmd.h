@@ -4,6 +4,12 @@
 #define FDL1_DUMP_MEM 0
 #define DEFAULT_NAND_ID 0x15
 #define DEFAULT_BLK_SIZE 0x1000
+#define DEFAULT_READ_WINDOW 4
+#define MAX_READ_WINDOW 16
+#define DEFAULT_FEED_DEPTH 4
+#define MAX_FEED_DEPTH 64
+#define DEFAULT_RECV_RING 4
+#define MAX_RECV_RING 16
 
 /*
 
@@ -0,0 +1,57 @@
+#pragma once
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <stdint.h>
+#include <string>
+
+
+#define RTT_GRANULARITY_MS  100.0   // 超时中方差项的下限，避免响应非常稳定时超时贴着平均值
+#define RTT_MAX_BACKOFF     6       // 连续超时时最多翻倍的次数
+
+
+// 往返时间估计器，算法与TCP的RFC 6298相同：
+//     SRTT   = 7/8 * SRTT + 1/8 * R
+//     RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - R|
+//     超时   = (SRTT + max(G, 4 * RTTVAR)) * 2^退避次数，限制在[minMs, maxMs]之间
+// 还没有样本时使用initialMs。成功的样本会清除退避。
+// 全零的状态等同于刚调用过Init(nullptr, 0, 0, 0)，因此可以放在用memset清零的C结构体里。
+struct RttEstimator {
+    const char* name;       // 名称，用于日志
+    double initialMs;       // 没有样本时的超时
+    double minMs;           // 超时下限，不能小于一次读取的超时
+    double maxMs;           // 超时上限
+    double srtt;            // 平滑往返时间（毫秒）
+    double rttvar;          // 往返时间的平均偏差（毫秒）
+    double lastMs;          // 最近一次样本
+    double peakMs;          // 最大的样本
+    uint64_t samples;       // 样本数
+    uint64_t timeouts;      // 超时次数
+    int backoff;            // 连续超时的次数
+
+    /**
+     * 初始化。
+     * @param name 名称，必须是静态字符串
+     * @param initialMs 没有样本时的超时
+     * @param minMs 超时下限
+     * @param maxMs 超时上限
+     */
+    void Init(const char* name, double initialMs, double minMs, double maxMs);
+
+    /**
+     * 记录一次成功的往返。
+     * @param ms 从发出请求到收到响应的时间（毫秒）
+     */
+    void Sample(double ms);
+
+    // 记录一次超时，之后的超时时间翻倍，直到下一次成功。
+    void OnTimeout();
+
+    // 获取当前的超时时间（毫秒）。
+    int TimeoutMs() const;
+
+    // 获取统计信息的文字描述，例如"SRTT=12.3ms RTTVAR=4.5ms 超时=2000ms 样本=120 超时次数=0"。
+    std::string Describe() const;
+};
+
+#endif // RTT_ESTIMATOR_H
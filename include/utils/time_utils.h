@@ -32,6 +32,20 @@ namespace time_utils {
     double get_time_ms();
 
 
+    /**
+     * 获取当前进程占用的CPU时间（用户态+内核态），单位为秒。
+     * @return CPU时间
+     */
+    double get_cpu_time();
+
+
+    /**
+     * 获取调用线程占用的CPU时间（用户态+内核态），单位为秒。
+     * @return CPU时间
+     */
+    double get_thread_cpu_time();
+
+
     /**
      * 获取当前时间字符串。
      * @param time 时间戳，单位为秒
@@ -27,8 +27,29 @@ namespace usb_utils {
     struct COMPortInfo {
         int portNumber;           // 端口号，例如1表示COM1
         std::string deviceName;   // 设备名称，例如"USB-SERIAL CH340" 或者 "Qualcomm HS-USB Diagnostics 9008"
+        std::string instanceId;   // 设备实例ID，例如"USB\VID_05C6&PID_9008\5&2C9A8E7&0&2"
+        uint16_t vid = 0;         // 厂商ID，非USB设备为0
+        uint16_t pid = 0;         // 产品ID，非USB设备为0
+        std::string controller;   // 所在的USB主控制器，例如"PCIROOT(0)#PCI(1400)#USBROOT(0)"，未知时为空
+        std::string portPath;     // 从根集线器开始的端口路径，例如"2.3"表示根端口2下的集线器的端口3
     };
 
+    /**
+     * 解析SPDRP_LOCATION_PATHS形式的位置路径，例如"PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(2)#USB(3)#USBMI(0)"。
+     * @param location 位置路径
+     * @param controller 输出主控制器部分
+     * @param portPath 输出端口路径，例如"2.3"
+     * @return 是否是USB设备的位置路径
+     */
+    bool ParseLocationPath(const std::string& location, std::string* controller, std::string* portPath);
+
+    /**
+     * 获取端口路径所在的集线器路径，例如"2.3"所在的集线器为"2"，直接接在根集线器上的设备为空。
+     * @param portPath 端口路径
+     * @return 集线器路径
+     */
+    std::string HubPath(const std::string& portPath);
+
     // 获取系统中所有可用的COM端口信息。
     std::vector<COMPortInfo> GetCOMPorts();
 
@@ -12,6 +12,7 @@
 #include <emmcdl_new/xmlparser.h>
 #include <emmcdl_new/serialport.h>
 #include <emmcdl_new/emmcdl.h>
+#include <emmcdl_new/devmonitor.h>
 
 #include <utils/logger.h>
 #include <utils/usb_utils.h>
@@ -35,7 +36,7 @@ private:
     map<int, SerialPort> portMap;
     map<int, bool> portStatus;
     ByteArray lastSent, lastReceived;
-    QTimer* updatePortListTimer;
+    int deviceMonitorId;
     QTimer* updateWindowTimer;
 
 public:
@@ -43,8 +44,6 @@ public:
         setupUi(this);
         this->setFixedSize(this->width(), this->height());
         this->setWindowTitle("测试");
-        updatePortListTimer = new QTimer(this);
-        connect(updatePortListTimer, &QTimer::timeout, this, &MainWindow::updateComboBox);
         connect(comboBox,&QComboBox::currentIndexChanged, this, &MainWindow::onPortSelIdxChanged);
         connect(pushButton, &QPushButton::clicked, this, &MainWindow::onSendButtonClicked);
         connect(pushButton_2, &QPushButton::clicked, this, &MainWindow::onRecvButtonClicked);
@@ -55,7 +54,11 @@ public:
         connect(pushButton_4, &QPushButton::clicked, this, &MainWindow::onClosePortButtonClicked);
         lastSent = "Hello, world!";
         textBrowser_2->setReadOnly(true);
-        updatePortListTimer->start(1000);
+        // 端口列表只在设备插拔时刷新，回调在监视线程里，要转到界面线程执行
+        updateComboBox();
+        deviceMonitorId = DeviceMonitor::Instance().Subscribe([this](device_event_e, const UsbDeviceInfo&) {
+            QMetaObject::invokeMethod(this, [this]() { updateComboBox(); }, Qt::QueuedConnection);
+        });
         updateWindowTimer = new QTimer(this);
         connect(updateWindowTimer, &QTimer::timeout, this, &MainWindow::update);
         updateWindowTimer->start(1000 / 15);
@@ -69,8 +72,7 @@ public:
     }
 
     ~MainWindow() {
-        updatePortListTimer->stop();
-        delete updatePortListTimer;
+        DeviceMonitor::Instance().Unsubscribe(deviceMonitorId);
         updateWindowTimer->stop();
         delete updateWindowTimer;
     }
@@ -0,0 +1,337 @@
+#include "emmcdl_new/asyncprotocol.h"
+#include "emmcdl_new/utils.h"
+#include "datatypes/thread.h"
+#include "utils/logger.h"
+#include <algorithm>
+#include <deque>
+
+using namespace std;
+
+
+struct ProtocolOp::State {
+    mutex mtx;
+    condition_variable cv;
+    bool bDone = false;
+    ProtocolResult result;
+    vector<function<void()>> continuations;     // 完成时执行，之后清空
+    ThreadPool* pool = nullptr;                 // 主机端后续操作使用的线程池
+    weak_ptr<AsyncProtocol::Queue> queue;       // ThenOnDevice使用的设备队列
+};
+
+
+struct AsyncProtocol::Queue {
+    struct Job {
+        function<ProtocolResult(Protocol&)> func;
+        shared_ptr<ProtocolOp::State> state;
+        uint64_t seq = 0;                       // 入队序号，从1开始
+    };
+
+    Protocol* proto = nullptr;
+    ThreadPool* pool = nullptr;
+    mutex mtx;
+    condition_variable cv;                      // 有新操作或正在关闭
+    condition_variable cvIdle;                  // 有操作完成
+    deque<Job> jobs;
+    uint64_t lastQueued = 0;                    // 最后入队的操作的序号
+    uint64_t doneUpTo = 0;                      // 序号不大于它的操作都已完成或取消
+    bool bRunning = false;                      // 设备线程正在执行操作
+    bool bClosing = false;                      // 不再等待新操作，执行完队列后退出
+    bool bStopped = false;                      // 设备线程已退出，不再接受操作
+    thread worker;
+
+    void Run();
+    bool Push(Job job);
+};
+
+
+// 主机端后续操作默认使用的共享线程池
+static ThreadPool& SharedHostPool() {
+    static ThreadPool pool(max(2u, thread::hardware_concurrency()));
+    return pool;
+}
+
+
+static shared_ptr<ProtocolOp::State> NewState(ThreadPool* pool, const weak_ptr<AsyncProtocol::Queue>& queue) {
+    auto s = make_shared<ProtocolOp::State>();
+    s->pool = pool;
+    s->queue = queue;
+    return s;
+}
+
+
+static ProtocolResult Aborted() {
+    ProtocolResult r;
+    r.status = ERROR_OPERATION_ABORTED;
+    return r;
+}
+
+
+// 执行操作，把异常转换为错误代码，避免异常离开设备线程或线程池
+template <typename F>
+static ProtocolResult Invoke(const char* where, F&& func) {
+    try {
+        return func();
+    } catch (const exception& e) {
+        LERROR(where, "异步操作抛出异常: %s", e.what());
+    } catch (...) {
+        LERROR(where, "异步操作抛出未知异常");
+    }
+    ProtocolResult r;
+    r.status = ERROR_GEN_FAILURE;
+    return r;
+}
+
+
+static void Complete(const shared_ptr<ProtocolOp::State>& s, ProtocolResult result) {
+    vector<function<void()>> continuations;
+    {
+        lock_guard<mutex> lock(s->mtx);
+        s->result = move(result);
+        s->bDone = true;
+        continuations.swap(s->continuations);
+    }
+    s->cv.notify_all();
+    for (auto& c : continuations) c();
+}
+
+
+// 已经完成时立即在当前线程执行，否则等完成时由完成的线程执行
+static void AddContinuation(const shared_ptr<ProtocolOp::State>& s, function<void()> func) {
+    {
+        lock_guard<mutex> lock(s->mtx);
+        if (!s->bDone) {
+            s->continuations.push_back(move(func));
+            return;
+        }
+    }
+    func();
+}
+
+
+bool ProtocolOp::Ready() const {
+    if (!state) return false;
+    lock_guard<mutex> lock(state->mtx);
+    return state->bDone;
+}
+
+
+const ProtocolResult& ProtocolOp::Wait() const {
+    static const ProtocolResult invalid = [] { ProtocolResult r; r.status = ERROR_INVALID_PARAMETER; return r; }();
+    if (!state) return invalid;
+    unique_lock<mutex> lock(state->mtx);
+    state->cv.wait(lock, [this] { return state->bDone; });
+    return state->result;
+}
+
+
+ProtocolOp ProtocolOp::Then(function<ProtocolResult(const ProtocolResult&)> func) const {
+    ProtocolOp next;
+    if (!state) return next;
+    next.state = NewState(state->pool, state->queue);
+    auto prev = state;
+    auto s = next.state;
+    AddContinuation(prev, [prev, s, func]() {
+        if (prev->result.status != ERROR_SUCCESS) {
+            Complete(s, prev->result);
+            return;
+        }
+        bool ok = prev->pool->submit(
+            [prev, s, func]() { Complete(s, Invoke("ProtocolOp::Then", [&] { return func(prev->result); })); },
+            [s]() { Complete(s, Aborted()); });
+        if (!ok) Complete(s, Aborted());
+    });
+    return next;
+}
+
+
+ProtocolOp ProtocolOp::ThenOnDevice(function<ProtocolResult(Protocol&, const ProtocolResult&)> func) const {
+    ProtocolOp next;
+    if (!state) return next;
+    next.state = NewState(state->pool, state->queue);
+    auto prev = state;
+    auto s = next.state;
+    AddContinuation(prev, [prev, s, func]() {
+        if (prev->result.status != ERROR_SUCCESS) {
+            Complete(s, prev->result);
+            return;
+        }
+        auto queue = s->queue.lock();
+        AsyncProtocol::Queue::Job job = { [prev, func](Protocol& p) { return func(p, prev->result); }, s };
+        if (!queue || !queue->Push(move(job))) Complete(s, Aborted());
+    });
+    return next;
+}
+
+
+void ProtocolOp::OnComplete(function<void(const ProtocolResult&)> func) const {
+    if (!state) return;
+    auto s = state;
+    AddContinuation(s, [s, func]() {
+        s->pool->submit([s, func]() {
+            Invoke("ProtocolOp::OnComplete", [&] { func(s->result); return ProtocolResult(); });
+        });
+    });
+}
+
+
+void AsyncProtocol::Queue::Run() {
+    while (true) {
+        Job job;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv.wait(lock, [this] { return bClosing || !jobs.empty(); });
+            if (jobs.empty()) {
+                bStopped = true;
+                break;
+            }
+            job = move(jobs.front());
+            jobs.pop_front();
+            bRunning = true;
+        }
+        // 在锁外完成，后续的ThenOnDevice会重新加锁入队
+        Complete(job.state, Invoke("AsyncProtocol::Run", [&] { return job.func(*proto); }));
+        {
+            // 按顺序执行，队首之前的操作都已经结束
+            lock_guard<mutex> lock(mtx);
+            bRunning = false;
+            doneUpTo = jobs.empty() ? lastQueued : jobs.front().seq - 1;
+        }
+        cvIdle.notify_all();
+    }
+    cvIdle.notify_all();
+}
+
+
+bool AsyncProtocol::Queue::Push(Job job) {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (bStopped) return false;
+        job.seq = ++lastQueued;
+        jobs.push_back(move(job));
+    }
+    cv.notify_one();
+    return true;
+}
+
+
+AsyncProtocol::AsyncProtocol(Protocol* proto, ThreadPool* hostPool) : queue(make_shared<Queue>()) {
+    queue->proto = proto;
+    queue->pool = hostPool != nullptr ? hostPool : &SharedHostPool();
+    Queue* q = queue.get();
+    queue->worker = thread([q] { q->Run(); });
+    LDEBUG("AsyncProtocol::AsyncProtocol", "异步协议的设备线程已启动");
+}
+
+
+AsyncProtocol::~AsyncProtocol() {
+    {
+        lock_guard<mutex> lock(queue->mtx);
+        queue->bClosing = true;
+    }
+    queue->cv.notify_all();
+    if (queue->worker.joinable()) queue->worker.join();
+    LDEBUG("AsyncProtocol::~AsyncProtocol", "异步协议的设备线程已退出");
+}
+
+
+ProtocolOp AsyncProtocol::Submit(function<ProtocolResult(Protocol&)> func) {
+    ProtocolOp op;
+    op.state = NewState(queue->pool, queue);
+    if (!queue->Push({ move(func), op.state })) Complete(op.state, Aborted());
+    return op;
+}
+
+
+ProtocolOp AsyncProtocol::WriteData(BYTE* writeBuffer, int64_t writeOffset, DWORD writeBytes, uint8_t partNum) {
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.status = p.WriteData(writeBuffer, writeOffset, writeBytes, &r.bytes, partNum);
+        return r;
+    });
+}
+
+
+ProtocolOp AsyncProtocol::WriteData(const ByteArray& writeBuffer, int64_t writeOffset, uint8_t partNum) {
+    auto data = make_shared<ByteArray>(writeBuffer);
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.status = p.WriteData(*data, writeOffset, &r.bytes, partNum);
+        return r;
+    });
+}
+
+
+ProtocolOp AsyncProtocol::ReadData(int64_t readOffset, DWORD readBytes, uint8_t partNum) {
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.data = make_shared<ByteArray>();
+        r.status = p.ReadData(*r.data, readOffset, readBytes, &r.bytes, partNum);
+        return r;
+    });
+}
+
+
+ProtocolOp AsyncProtocol::FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t sectorWrite, uint64_t sectors, uint8_t partNum) {
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.status = p.FastCopy(hRead, sectorRead, hWrite, sectorWrite, sectors, partNum);
+        return r;
+    });
+}
+
+
+ProtocolOp AsyncProtocol::FastCopyImage(const MappedImage* image, int64_t sectorRead, int64_t sectorWrite, uint64_t sectors, uint8_t partNum) {
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.status = p.FastCopyImage(image, sectorRead, sectorWrite, sectors, partNum);
+        return r;
+    });
+}
+
+
+ProtocolOp AsyncProtocol::DumpDiskContents(uint64_t start_sector, uint64_t num_sectors, const string& szOutFile, uint8_t partNum, const string& szPartName) {
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.status = p.DumpDiskContents(start_sector, num_sectors, szOutFile, partNum, szPartName);
+        return r;
+    });
+}
+
+
+ProtocolOp AsyncProtocol::DumpDiskContents(const string& szPartName, const string& szOutFile, uint8_t partNum) {
+    return Submit([=](Protocol& p) {
+        ProtocolResult r;
+        r.status = p.DumpDiskContents(szPartName, szOutFile, partNum);
+        return r;
+    });
+}
+
+
+void AsyncProtocol::Cancel() {
+    deque<Queue::Job> dropped;
+    {
+        lock_guard<mutex> lock(queue->mtx);
+        dropped.swap(queue->jobs);
+        // 正在执行的操作结束时会更新doneUpTo
+        if (!queue->bRunning) queue->doneUpTo = queue->lastQueued;
+    }
+    queue->cvIdle.notify_all();
+    if (!dropped.empty()) {
+        LINFO("AsyncProtocol::Cancel", "取消了%zu个还没有开始的操作", dropped.size());
+    }
+    for (auto& job : dropped) Complete(job.state, Aborted());
+}
+
+
+void AsyncProtocol::Drain() {
+    // 只等调用时已经入队的操作，后续操作不断入队时也不会一直阻塞
+    unique_lock<mutex> lock(queue->mtx);
+    uint64_t target = queue->lastQueued;
+    queue->cvIdle.wait(lock, [this, target] { return queue->bStopped || queue->doneUpTo >= target; });
+}
+
+
+size_t AsyncProtocol::Pending() const {
+    lock_guard<mutex> lock(queue->mtx);
+    return queue->jobs.size() + (queue->bRunning ? 1 : 0);
+}
@@ -0,0 +1,197 @@
+#include "emmcdl_new/capture.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include "utils/string_utils.h"
+
+using namespace std;
+
+
+#pragma pack(push, 1)
+// pcap文件头
+typedef struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_hdr_t;
+
+// pcap记录头
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_rec_hdr_t;
+#pragma pack(pop)
+
+
+PortCapture::PortCapture() {
+    fp = NULL;
+    portNum = 0;
+    dwSnapLen = 0;
+    dwSampleEvery = 1;
+    dwTraceLimit = 0;
+    seq = 0;
+    truncCount = 0;
+    ringMask = 0;
+    head = tail = dropped = 0;
+    bRunning = false;
+    bStopWriter = false;
+}
+
+
+PortCapture::~PortCapture() {
+    Stop();
+}
+
+
+int PortCapture::Start(const string& fileName, int port, DWORD snapLen, DWORD sampleEvery,
+                       DWORD traceLimit, size_t ringSize) {
+    Stop();
+    // 环形缓冲区大小向上取整到2的幂
+    size_t size = 0x10000;
+    while (size < ringSize) size <<= 1;
+    fp = fopen(fileName.c_str(), "wb");
+    if (!fp) {
+        LWARN("PortCapture::Start", "无法打开捕获文件: %s", fileName.c_str());
+        return ERROR_OPEN_FAILED;
+    }
+    // 写入线程是唯一写文件的地方，给一个大一点的缓冲区减少系统调用
+    setvbuf(fp, NULL, _IOFBF, 0x100000);
+
+    portNum = port;
+    // 单条记录不能超过缓冲区的1/4，否则很容易一直丢
+    dwSnapLen = min<DWORD>(snapLen, (DWORD) (size / 4 - sizeof(ring_rec_t)));
+    dwSampleEvery = max<DWORD>(sampleEvery, 1);
+    dwTraceLimit = traceLimit;
+    seq = 0;
+    truncCount = 0;
+    ring.clear();
+    ring.resize(size);
+    ringMask = size - 1;
+    head = tail = dropped = 0;
+
+    pcap_file_hdr_t hdr = {0xa1b2c3d4, 2, 4, 0, 0,
+        (uint32_t) (dwSnapLen + sizeof(capture_pseudo_hdr_t)), CAPTURE_LINKTYPE};
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    bStopWriter = false;
+    bRunning = true;
+    writer = thread(&PortCapture::WriterLoop, this);
+    LDEBUG("PortCapture::Start", "端口%d的通信捕获已启动，文件: %s，截断长度%d，采样间隔%d",
+        port, fileName.c_str(), dwSnapLen, dwSampleEvery);
+    return ERROR_SUCCESS;
+}
+
+
+void PortCapture::Stop() {
+    if (!bRunning) return;
+    bRunning = false;
+    bStopWriter = true;
+    if (writer.joinable()) writer.join();
+    if (fp) {
+        fclose(fp);
+        fp = NULL;
+    }
+    if (dropped) {
+        LWARN("PortCapture::Stop", "端口%d的通信捕获已停止，共%d条记录，因缓冲区满丢弃了%d条",
+            portNum, seq, (uint64_t) dropped);
+    } else {
+        LDEBUG("PortCapture::Stop", "端口%d的通信捕获已停止，共%d条记录", portNum, seq);
+    }
+}
+
+
+void PortCapture::Push(uint8_t dir, int status, const BYTE* data, DWORD length) {
+    if (!bRunning) return;
+    uint8_t flags = 0;
+    DWORD capLen = length;
+    if (length > dwSnapLen) {
+        flags |= CAPTURE_FLAG_TRUNCATED;
+        capLen = dwSnapLen;
+        if ((truncCount++ % dwSampleEvery) != 0) {
+            flags |= CAPTURE_FLAG_SAMPLED_OUT;
+            capLen = 0;
+        }
+    }
+    if (!data) capLen = 0;
+
+    size_t need = (sizeof(ring_rec_t) + capLen + 7) & ~(size_t) 7;
+    size_t size = ring.size();
+    uint64_t h = head.load(memory_order_relaxed);
+    uint64_t t = tail.load(memory_order_acquire);
+    size_t off = h & ringMask;
+    size_t contiguous = size - off;
+    // 放不下的时候要在末尾留一个回绕标记，然后从头开始放
+    size_t total = contiguous < need ? need + contiguous : need;
+    if (size - (size_t) (h - t) < total) {
+        dropped++;
+        return;
+    }
+    if (contiguous < need) {
+        ((ring_rec_t*) &ring[off])->recLen = 0;
+        h += contiguous;
+        off = 0;
+    }
+    ring_rec_t* rec = (ring_rec_t*) &ring[off];
+    rec->recLen = (uint32_t) need;
+    rec->dir = dir;
+    rec->flags = flags;
+    rec->reserved = 0;
+    rec->status = status;
+    rec->origLen = length;
+    rec->capLen = capLen;
+    rec->time = time_utils::get_time();
+    if (capLen) memcpy(rec + 1, data, capLen);
+    head.store(h + need, memory_order_release);
+}
+
+
+size_t PortCapture::Drain() {
+    uint64_t t = tail.load(memory_order_relaxed);
+    uint64_t h = head.load(memory_order_acquire);
+    size_t size = ring.size();
+    size_t count = 0;
+    while (t != h) {
+        size_t off = t & ringMask;
+        ring_rec_t* rec = (ring_rec_t*) &ring[off];
+        if (rec->recLen == 0) {
+            t += size - off;
+            continue;
+        }
+        capture_pseudo_hdr_t pseudo = {seq++, rec->dir, rec->flags, (uint16_t) portNum, rec->status};
+        pcap_rec_hdr_t phdr;
+        phdr.ts_sec = (uint32_t) rec->time;
+        phdr.ts_usec = (uint32_t) ((rec->time - phdr.ts_sec) * 1000000);
+        phdr.incl_len = sizeof(pseudo) + rec->capLen;
+        phdr.orig_len = sizeof(pseudo) + rec->origLen;
+        fwrite(&phdr, sizeof(phdr), 1, fp);
+        fwrite(&pseudo, sizeof(pseudo), 1, fp);
+        if (rec->capLen) fwrite(rec + 1, 1, rec->capLen, fp);
+
+        if (rec->origLen <= dwTraceLimit) {
+            LTRACE("PortCapture::Drain", "COM%d的串口日志: %s\n%s", portNum,
+                rec->dir == CAPTURE_HOST_TO_TARGET ? "HOST to TARGET  =====>" : "TARGET to HOST  <=====",
+                rec->origLen == 0 ? "  <无数据>" : string_utils::to_hex_view((char*) (rec + 1), rec->capLen).c_str());
+        }
+        t += rec->recLen;
+        tail.store(t, memory_order_release);
+        count++;
+    }
+    return count;
+}
+
+
+void PortCapture::WriterLoop() {
+    while (!bStopWriter) {
+        if (Drain() == 0) {
+            fflush(fp);
+            time_utils::sleep_ms(5);
+        }
+    }
+    Drain();
+    fflush(fp);
+}
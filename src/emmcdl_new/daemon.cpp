@@ -0,0 +1,367 @@
+#include "emmcdl_new/daemon.h"
+#include "emmcdl_new/emmcdl.h"
+#include "emmcdl_new/devmonitor.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+typedef SOCKET socket_t;
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET  (-1)
+#define closesocket     close
+#endif
+
+using namespace std;
+
+
+#define REAP_INTERVAL_MS    1000    // 检查空闲会话的间隔
+
+
+bool DeviceSession::SameConfigure(const fh_configure_t& other, int sector) const {
+    return _stricmp(cfg.MemoryName, other.MemoryName) == 0 &&
+           cfg.SkipWrite == other.SkipWrite &&
+           cfg.SkipStorageInit == other.SkipStorageInit &&
+           cfg.ZLPAwareHost == other.ZLPAwareHost &&
+           cfg.MaxPayloadSizeToTargetInBytes == other.MaxPayloadSizeToTargetInBytes &&
+           sectorSize == sector;
+}
+
+
+void DeviceSession::Invalidate() {
+    bProgrammerLoaded = false;
+    programmer.clear();
+    bConfigured = false;
+    dwMaxPacketSize = 0;
+    gpt.clear();
+}
+
+
+// 完整地发送或接收len字节，连接断开时返回false
+static bool SendAll(socket_t sock, const void* data, size_t len) {
+    const char* p = (const char*) data;
+    while (len) {
+        int n = send(sock, p, (int) len, 0);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool RecvAll(socket_t sock, void* data, size_t len) {
+    char* p = (char*) data;
+    while (len) {
+        int n = recv(sock, p, (int) len, 0);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool MakeAddress(const string& path, sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        LERROR("SessionDaemon", "套接字路径太长: \"%s\"", path.c_str());
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+static bool StartSockets() {
+#ifdef _WIN32
+    WSADATA wsa;
+    return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+    return true;
+#endif
+}
+
+static void StopSockets() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+
+SessionDaemon::SessionDaemon(const string& socketPath, int idleSeconds) :
+    path(socketPath), idleSeconds(idleSeconds), listenSock((uintptr_t) INVALID_SOCKET), bStop(false), monitorId(-1) {
+}
+
+
+SessionDaemon::~SessionDaemon() {
+    Stop();
+}
+
+
+int SessionDaemon::Run() {
+    sockaddr_un addr;
+    if (!MakeAddress(path, &addr))
+        return ERROR_INVALID_PARAMETER;
+    if (!StartSockets()) {
+        LERROR("SessionDaemon::Run", "初始化套接字失败");
+        return ERROR_NOT_READY;
+    }
+    socket_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        LERROR("SessionDaemon::Run", "创建套接字失败");
+        StopSockets();
+        return ERROR_NOT_READY;
+    }
+    // 上次异常退出可能留下了套接字文件
+    remove(path.c_str());
+    if (::bind(sock, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(sock, 8) != 0) {
+        LERROR("SessionDaemon::Run", "无法监听套接字\"%s\"", path.c_str());
+        closesocket(sock);
+        StopSockets();
+        return ERROR_ACCESS_DENIED;
+    }
+    listenSock = (uintptr_t) sock;
+    bStop = false;
+    LINFO("SessionDaemon::Run", "开始在\"%s\"上等待命令，会话空闲%d秒后关闭", path.c_str(), idleSeconds);
+
+    // 拔出的设备不能等到空闲超时才释放
+    monitorId = DeviceMonitor::Instance().Subscribe([this](device_event_e event, const UsbDeviceInfo& info) {
+        if (event != DEVICE_REMOVED) return;
+        lock_guard<mutex> lock(sessionsMtx);
+        auto it = sessions.find(info.port);
+        if (it != sessions.end() && !it->second->bBusy) {
+            it->second->bGone = true;
+        }
+    });
+    reaper = thread(&SessionDaemon::ReapIdle, this);
+
+    struct Client {
+        thread worker;
+        shared_ptr<atomic<bool>> bDone;
+    };
+    vector<Client> clients;
+    while (!bStop) {
+        socket_t client = accept(sock, nullptr, nullptr);
+        if (client == INVALID_SOCKET) {
+            if (!bStop) LWARN("SessionDaemon::Run", "接受连接失败");
+            break;
+        }
+        // 每次accept时回收已结束的连接线程，长期运行不会越积越多
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (*it->bDone) {
+                it->worker.join();
+                it = clients.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        auto bDone = make_shared<atomic<bool>>(false);
+        clients.push_back({ thread([this, client, bDone] {
+            Serve((uintptr_t) client);
+            *bDone = true;
+        }), bDone });
+    }
+    for (auto& c : clients) c.worker.join();
+    Stop();
+    StopSockets();
+    return ERROR_SUCCESS;
+}
+
+
+void SessionDaemon::Stop() {
+    bool bWasStopped = bStop.exchange(true);
+    if (!bWasStopped && listenSock != (uintptr_t) INVALID_SOCKET) {
+        // shutdown才能让阻塞的accept返回
+        shutdown((socket_t) listenSock, 2);
+        closesocket((socket_t) listenSock);
+        listenSock = (uintptr_t) INVALID_SOCKET;
+        remove(path.c_str());
+    }
+    if (reaper.joinable() && reaper.get_id() != this_thread::get_id()) {
+        reaper.join();
+    }
+    if (monitorId >= 0) {
+        DeviceMonitor::Instance().Unsubscribe(monitorId);
+        monitorId = -1;
+    }
+    lock_guard<mutex> run(runMtx);
+    lock_guard<mutex> lock(sessionsMtx);
+    for (auto& it : sessions) {
+        CloseSession(*it.second, "守护进程退出");
+    }
+    sessions.clear();
+}
+
+
+void SessionDaemon::Serve(uintptr_t client) {
+    socket_t sock = (socket_t) client;
+    uint32_t argc = 0;
+    vector<string> args;
+    bool bOk = RecvAll(sock, &argc, sizeof(argc)) && argc > 0 && argc <= SESSION_MAX_ARGS;
+    for (uint32_t i = 0; bOk && i < argc; i++) {
+        uint32_t len = 0;
+        bOk = RecvAll(sock, &len, sizeof(len)) && len <= SESSION_MAX_ARG_LEN;
+        if (bOk) {
+            string arg(len, '\0');
+            bOk = len == 0 || RecvAll(sock, &arg[0], len);
+            args.push_back(arg);
+        }
+    }
+    int32_t status = ERROR_INVALID_PARAMETER;
+    if (bOk) {
+        status = Execute(args);
+    } else {
+        LWARN("SessionDaemon::Serve", "客户端发送的命令无效");
+    }
+    SendAll(sock, &status, sizeof(status));
+    closesocket(sock);
+}
+
+
+int SessionDaemon::Execute(vector<string>& args) {
+    if (!IsDeviceCommand(args))
+        return ERROR_NOT_SUPPORTED;
+    int port = FindPort(args);
+    lock_guard<mutex> run(runMtx);
+    shared_ptr<DeviceSession> session;
+    if (port >= 0) {
+        session = Acquire(port);
+        lock_guard<mutex> lock(sessionsMtx);
+        session->bBusy = true;
+    }
+
+    vector<char*> argv;
+    for (auto& a : args) argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+    double start = time_utils::get_time();
+    int status = emmcdl_session_main(session.get(), (int) args.size(), argv.data());
+    LINFO("SessionDaemon::Execute", "命令执行完成，耗时%.3f秒，状态: %d", time_utils::get_time() - start, status);
+
+    if (session) {
+        lock_guard<mutex> lock(sessionsMtx);
+        session->bBusy = false;
+        session->lastUsed = time_utils::get_time();
+    }
+    return status;
+}
+
+
+shared_ptr<DeviceSession> SessionDaemon::Acquire(int port) {
+    lock_guard<mutex> lock(sessionsMtx);
+    auto it = sessions.find(port);
+    if (it != sessions.end()) {
+        if (!it->second->bGone) {
+            LDEBUG("SessionDaemon::Acquire", "复用COM%d的会话", port);
+            return it->second;
+        }
+        CloseSession(*it->second, "设备已被拔出");
+        sessions.erase(it);
+    }
+    auto session = make_shared<DeviceSession>();
+    session->port = port;
+    session->lastUsed = time_utils::get_time();
+    sessions[port] = session;
+    LDEBUG("SessionDaemon::Acquire", "为COM%d创建新会话", port);
+    return session;
+}
+
+
+void SessionDaemon::ReapIdle() {
+    while (!bStop) {
+        for (int waited = 0; waited < REAP_INTERVAL_MS && !bStop; waited += 100) {
+            time_utils::sleep_ms(100);
+        }
+        if (bStop) break;
+        // 持有runMtx，关闭会话时不会有命令正在使用它
+        lock_guard<mutex> run(runMtx);
+        lock_guard<mutex> lock(sessionsMtx);
+        double now = time_utils::get_time();
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            DeviceSession& s = *it->second;
+            // 设备在命令之间被拔出又插回来时端口号可能不变，但烧录内核已经不在了
+            if (s.bGone) {
+                CloseSession(s, "设备已被拔出");
+                it = sessions.erase(it);
+            } else if (now - s.lastUsed >= idleSeconds) {
+                CloseSession(s, "空闲超时");
+                it = sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+
+void SessionDaemon::CloseSession(DeviceSession& session, const char* why) {
+    LINFO("SessionDaemon::CloseSession", "关闭COM%d的会话 (%s)", session.port, why);
+    if (session.sport.IsOpen())
+        session.sport.Close();
+    session.Invalidate();
+}
+
+
+int SessionDaemon::FindPort(const vector<string>& args) {
+    // 和emmcdl_main解析-p的方式一致
+    for (size_t i = 1; i + 1 < args.size(); i++) {
+        if (_stricmp(args[i].c_str(), "-p") == 0) {
+            const char* value = args[i + 1].c_str();
+            if (_strnicmp(value, "COM", 3) == 0) value += 3;
+            return atoi(value);
+        }
+    }
+    return -1;
+}
+
+
+bool SessionDaemon::IsDeviceCommand(const vector<string>& args) {
+    // 这些命令不操作单个设备，在守护进程里执行时会一直占着runMtx：
+    // 嵌套的守护进程永远不返回，-connect连回自己会在runMtx上死锁，-ports会打开会话正在使用的端口
+    static const char* const hostOnly[] = { "-daemon", "-connect", "-ports", "-reactorbench", "-poolbench" };
+    for (size_t i = 1; i < args.size(); i++) {
+        for (const char* name : hostOnly) {
+            if (_stricmp(args[i].c_str(), name) == 0) {
+                LWARN("SessionDaemon::IsDeviceCommand", "守护进程只执行设备命令，拒绝%s", name);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+int SessionDaemon::SendCommand(const string& socketPath, const vector<string>& args) {
+    sockaddr_un addr;
+    if (!MakeAddress(socketPath, &addr))
+        return ERROR_INVALID_PARAMETER;
+    if (args.empty() || args.size() > SESSION_MAX_ARGS)
+        return ERROR_INVALID_PARAMETER;
+    if (!StartSockets())
+        return ERROR_NOT_READY;
+    socket_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET || connect(sock, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        LERROR("SessionDaemon::SendCommand", "无法连接到守护进程\"%s\"", socketPath.c_str());
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        StopSockets();
+        return ERROR_NOT_READY;
+    }
+
+    uint32_t argc = (uint32_t) args.size();
+    bool bOk = SendAll(sock, &argc, sizeof(argc));
+    for (size_t i = 0; bOk && i < args.size(); i++) {
+        uint32_t len = (uint32_t) args[i].size();
+        bOk = len <= SESSION_MAX_ARG_LEN && SendAll(sock, &len, sizeof(len)) && SendAll(sock, args[i].data(), len);
+    }
+    int32_t status = ERROR_NOT_READY;
+    if (!bOk || !RecvAll(sock, &status, sizeof(status))) {
+        LERROR("SessionDaemon::SendCommand", "与守护进程的连接中断");
+        status = ERROR_NOT_READY;
+    }
+    closesocket(sock);
+    StopSockets();
+    return status;
+}
@@ -0,0 +1,396 @@
+#include "emmcdl_new/devmonitor.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <algorithm>
+#include <chrono>
+#ifdef _WIN32
+#include <dbt.h>
+#include "utils/usb_utils.h"
+#else
+#include <filesystem>
+#include <fstream>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#endif
+
+using namespace std;
+
+
+DeviceMonitor& DeviceMonitor::Instance() {
+    static DeviceMonitor monitor;
+    return monitor;
+}
+
+
+DeviceMonitor::DeviceMonitor() {
+#ifdef _WIN32
+    hWnd = NULL;
+#else
+    nlSocket = -1;
+#endif
+    generation = 0;
+    nextCallbackId = 1;
+    runningCallbackId = 0;
+    bStop = false;
+    Start();
+}
+
+
+DeviceMonitor::~DeviceMonitor() {
+    Stop();
+}
+
+
+void DeviceMonitor::Start() {
+    devices = Enumerate();
+    worker = thread(&DeviceMonitor::EventLoop, this);
+}
+
+
+void DeviceMonitor::Stop() {
+    bStop = true;
+#ifdef _WIN32
+    if (hWnd) PostMessage(hWnd, WM_CLOSE, 0, 0);
+#endif
+    if (worker.joinable()) worker.join();
+}
+
+
+vector<UsbDeviceInfo> DeviceMonitor::Devices() {
+    lock_guard<mutex> lock(mtx);
+    return devices;
+}
+
+
+bool DeviceMonitor::FindByPort(int port, UsbDeviceInfo* info) {
+    lock_guard<mutex> lock(mtx);
+    for (auto& d : devices) {
+        if (d.port == port) {
+            if (info) *info = d;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int DeviceMonitor::Subscribe(Callback cb) {
+    lock_guard<mutex> lock(mtx);
+    int id = nextCallbackId++;
+    callbacks[id] = cb;
+    return id;
+}
+
+
+void DeviceMonitor::Unsubscribe(int id) {
+    unique_lock<mutex> lock(mtx);
+    callbacks.erase(id);
+    // 回调在锁外执行，要等它返回；回调里取消自己时不能等
+    if (this_thread::get_id() != worker.get_id()) {
+        cvCallback.wait(lock, [&] { return runningCallbackId != id; });
+    }
+}
+
+
+bool DeviceMonitor::Matches(const DeviceMatch& match, const UsbDeviceInfo& info) {
+    if (!match.serial.empty() && match.serial != info.serial) return false;
+    if (match.vid && match.vid != info.vid) return false;
+    if (match.pid && match.pid != info.pid) return false;
+    return true;
+}
+
+
+bool DeviceMonitor::WaitForArrival(const DeviceMatch& match, int timeoutMs, UsbDeviceInfo* info, bool bPresentCounts) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+    unique_lock<mutex> lock(mtx);
+    // 记下开始时已经存在的设备，它们不算新出现的
+    vector<string> present;
+    if (!bPresentCounts) {
+        for (auto& d : devices) {
+            if (Matches(match, d)) present.push_back(d.serial + "#" + to_string(d.port));
+        }
+    }
+    for (;;) {
+        for (auto& d : devices) {
+            if (!Matches(match, d)) continue;
+            if (find(present.begin(), present.end(), d.serial + "#" + to_string(d.port)) != present.end()) continue;
+            if (info) *info = d;
+            return true;
+        }
+        if (cvChange.wait_until(lock, deadline) == cv_status::timeout) {
+            // 超时前最后再检查一次
+            for (auto& d : devices) {
+                if (Matches(match, d) &&
+                    find(present.begin(), present.end(), d.serial + "#" + to_string(d.port)) == present.end()) {
+                    if (info) *info = d;
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+}
+
+
+bool DeviceMonitor::WaitForRemoval(const DeviceMatch& match, int timeoutMs) {
+    auto gone = [&] {
+        for (auto& d : devices) {
+            if (Matches(match, d)) return false;
+        }
+        return true;
+    };
+    unique_lock<mutex> lock(mtx);
+    return cvChange.wait_for(lock, chrono::milliseconds(timeoutMs), gone);
+}
+
+
+void DeviceMonitor::MarkModeSwitch(int port, const char* what) {
+    UsbDeviceInfo info = {};
+    bool known = FindByPort(port, &info);
+    lock_guard<mutex> lock(mtx);
+    switches[port] = { time_utils::get_time(), what, known ? info.serial : string() };
+}
+
+
+void DeviceMonitor::LogFirstCommand(int port) {
+    UsbDeviceInfo info = {};
+    bool known = FindByPort(port, &info);
+    lock_guard<mutex> lock(mtx);
+    auto it = switches.find(port);
+    if (it == switches.end() && known && !info.serial.empty()) {
+        // 重新枚举后端口号可能变了，按序列号查找
+        for (it = switches.begin(); it != switches.end(); ++it) {
+            if (it->second.serial == info.serial) break;
+        }
+    }
+    if (it == switches.end()) return;
+    LINFO("DeviceMonitor::LogFirstCommand", "COM%d从%s到第一条命令耗时%.3f秒",
+        port, it->second.what.c_str(), time_utils::get_time() - it->second.time);
+    switches.erase(it);
+}
+
+
+void DeviceMonitor::Rescan() {
+    vector<UsbDeviceInfo> now = Enumerate();
+    vector<pair<device_event_e, UsbDeviceInfo>> events;
+    auto same = [](const UsbDeviceInfo& a, const UsbDeviceInfo& b) {
+        return a.port == b.port && a.serial == b.serial && a.vid == b.vid && a.pid == b.pid;
+    };
+
+    vector<int> ids;
+    {
+        lock_guard<mutex> lock(mtx);
+        for (auto& old : devices) {
+            if (none_of(now.begin(), now.end(), [&](const UsbDeviceInfo& d) { return same(d, old); }))
+                events.push_back({ DEVICE_REMOVED, old });
+        }
+        for (auto& d : now) {
+            if (none_of(devices.begin(), devices.end(), [&](const UsbDeviceInfo& old) { return same(d, old); }))
+                events.push_back({ DEVICE_ARRIVED, d });
+        }
+        if (events.empty()) return;
+        devices = now;
+        generation++;
+        for (auto& kv : callbacks) ids.push_back(kv.first);
+    }
+    cvChange.notify_all();
+
+    for (auto& e : events) {
+        LDEBUG("DeviceMonitor::Rescan", "设备%s: COM%d %s (%04x:%04x, %s)",
+            e.first == DEVICE_ARRIVED ? "接入" : "移除", e.second.port, e.second.name.c_str(),
+            e.second.vid, e.second.pid, e.second.serial.c_str());
+        for (int id : ids) {
+            Callback cb;
+            {
+                // 已经取消注册的回调不再执行
+                lock_guard<mutex> lock(mtx);
+                auto it = callbacks.find(id);
+                if (it == callbacks.end()) continue;
+                cb = it->second;
+                runningCallbackId = id;
+            }
+            cb(e.first, e.second);
+            {
+                lock_guard<mutex> lock(mtx);
+                runningCallbackId = 0;
+            }
+            cvCallback.notify_all();
+        }
+    }
+}
+
+
+#ifdef _WIN32
+
+vector<UsbDeviceInfo> DeviceMonitor::Enumerate() {
+    vector<UsbDeviceInfo> list;
+    for (auto& p : usb_utils::GetCOMPorts()) {
+        // 实例ID形如 USB\VID_05C6&PID_9008\5&2C9A8E7&0&2，最后一段是序列号或位置
+        string serial = p.instanceId;
+        size_t pos = serial.rfind('\\');
+        if (pos != string::npos) serial = serial.substr(pos + 1);
+        UsbDeviceInfo info = { p.portNumber, p.deviceName, p.vid, p.pid, serial };
+        info.controller = p.controller;
+        info.portPath = p.portPath;
+        list.push_back(info);
+    }
+    return list;
+}
+
+
+LRESULT CALLBACK DeviceMonitor::WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    DeviceMonitor* self = (DeviceMonitor*) GetWindowLongPtrA(hWnd, GWLP_USERDATA);
+    switch (msg) {
+        case WM_DEVICECHANGE:
+            if (self && (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE ||
+                         wParam == DBT_DEVNODES_CHANGED)) {
+                self->Rescan();
+            }
+            return TRUE;
+        case WM_TIMER:
+            if (self) self->Rescan();
+            return 0;
+        case WM_CLOSE:
+            DestroyWindow(hWnd);
+            return 0;
+        case WM_DESTROY:
+            PostQuitMessage(0);
+            return 0;
+    }
+    return DefWindowProcA(hWnd, msg, wParam, lParam);
+}
+
+
+void DeviceMonitor::EventLoop() {
+    WNDCLASSEXA wc = { sizeof(wc) };
+    wc.lpfnWndProc = WndProc;
+    wc.hInstance = GetModuleHandleA(NULL);
+    wc.lpszClassName = "EmmcdlDeviceMonitor";
+    RegisterClassExA(&wc);
+    HWND wnd = CreateWindowExA(0, wc.lpszClassName, "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+    HDEVNOTIFY hNotify = NULL;
+    if (wnd) {
+        SetWindowLongPtrA(wnd, GWLP_USERDATA, (LONG_PTR) this);
+        DEV_BROADCAST_DEVICEINTERFACE_A filter = { sizeof(filter) };
+        filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+        filter.dbcc_classguid = GUID_DEVINTERFACE_COMPORT;
+        hNotify = RegisterDeviceNotificationA(wnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+    }
+
+    if (!wnd || !hNotify) {
+        LWARN("DeviceMonitor::EventLoop", "无法注册设备通知，改为每%d毫秒扫描一次", DEVMON_FALLBACK_POLL_MS);
+        if (wnd) DestroyWindow(wnd);
+        while (!bStop) {
+            time_utils::sleep_ms(DEVMON_FALLBACK_POLL_MS);
+            Rescan();
+        }
+        return;
+    }
+
+    hWnd = wnd;
+    // 通知偶尔会漏掉（例如驱动安装中），低频率的定时扫描作为保险
+    SetTimer(wnd, 1, 2000, NULL);
+    if (bStop) PostMessage(wnd, WM_CLOSE, 0, 0);
+    MSG msg;
+    while (GetMessageA(&msg, NULL, 0, 0) > 0) {
+        TranslateMessage(&msg);
+        DispatchMessageA(&msg);
+    }
+    UnregisterDeviceNotification(hNotify);
+    hWnd = NULL;
+}
+
+#else
+
+// 读取sysfs中的一行
+static string ReadSysfs(const filesystem::path& path) {
+    ifstream f(path);
+    string line;
+    getline(f, line);
+    return line;
+}
+
+
+vector<UsbDeviceInfo> DeviceMonitor::Enumerate() {
+    vector<UsbDeviceInfo> list;
+    error_code ec;
+    for (auto& entry : filesystem::directory_iterator("/sys/class/tty", ec)) {
+        string name = entry.path().filename().string();
+        int index;
+        if (sscanf(name.c_str(), "ttyACM%d", &index) == 1) {
+            index += DEVMON_ACM_PORT_BASE;
+        } else if (sscanf(name.c_str(), "ttyUSB%d", &index) != 1) {
+            continue;
+        }
+        // 从tty设备往上找到带有idVendor的USB设备目录
+        filesystem::path dev = filesystem::canonical(entry.path() / "device", ec);
+        if (ec) continue;
+        while (!dev.empty() && dev != dev.root_path() && !filesystem::exists(dev / "idVendor")) dev = dev.parent_path();
+        if (!filesystem::exists(dev / "idVendor")) continue;
+        UsbDeviceInfo info;
+        info.port = index;
+        info.name = ReadSysfs(dev / "product");
+        if (info.name.empty()) info.name = name;
+        info.vid = (uint16_t) strtoul(ReadSysfs(dev / "idVendor").c_str(), NULL, 16);
+        info.pid = (uint16_t) strtoul(ReadSysfs(dev / "idProduct").c_str(), NULL, 16);
+        info.serial = ReadSysfs(dev / "serial");
+        // 没有序列号时用USB拓扑位置（例如1-2.3）
+        info.portPath = dev.filename().string();
+        if (info.serial.empty()) info.serial = info.portPath;
+        info.speedMbps = atoi(ReadSysfs(dev / "speed").c_str());
+        // 往上找到根集线器usbN，它的上一级是主控制器（通常是PCI设备，USB2和USB3的根集线器共用一个）
+        for (filesystem::path p = dev; !p.empty() && p != p.root_path(); p = p.parent_path()) {
+            if (p.filename().string().rfind("usb", 0) == 0 && filesystem::exists(p / "busnum")) {
+                info.controller = p.parent_path().filename().string();
+                break;
+            }
+        }
+        list.push_back(info);
+    }
+    return list;
+}
+
+
+void DeviceMonitor::EventLoop() {
+    nlSocket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (nlSocket >= 0) {
+        sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_pid = 0;
+        addr.nl_groups = 1;     // 内核uevent组
+        if (bind(nlSocket, (sockaddr*) &addr, sizeof(addr)) != 0) {
+            close(nlSocket);
+            nlSocket = -1;
+        }
+    }
+    if (nlSocket < 0) {
+        LWARN("DeviceMonitor::EventLoop", "无法监听内核uevent，改为每%d毫秒扫描一次", DEVMON_FALLBACK_POLL_MS);
+    }
+
+    char buf[4096];
+    while (!bStop) {
+        if (nlSocket < 0) {
+            time_utils::sleep_ms(DEVMON_FALLBACK_POLL_MS);
+            Rescan();
+            continue;
+        }
+        pollfd pfd = { nlSocket, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        ssize_t len = recv(nlSocket, buf, sizeof(buf) - 1, 0);
+        if (len <= 0) continue;
+        buf[len] = 0;
+        // uevent是以\0分隔的KEY=VALUE列表，只关心tty和usb子系统
+        bool relevant = false;
+        for (char* p = buf; p < buf + len; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=tty") == 0 || strcmp(p, "SUBSYSTEM=usb") == 0) relevant = true;
+        }
+        if (relevant) Rescan();
+    }
+    close(nlSocket);
+    nlSocket = -1;
+}
+
+#endif
@@ -2,7 +2,12 @@
 #include "emmcdl_new/partition.h"
 #include "emmcdl_new/diskwriter.h"
 #include "emmcdl_new/utils.h"
+#include "emmcdl_new/devmonitor.h"
 #include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <deque>
+#include <algorithm>
+#include <filesystem>
 
 
 void Dload::HexTobyte(const char* hex, BYTE* bin, int len) {
@@ -19,6 +24,9 @@ void Dload::HexTobyte(const char* hex, BYTE* bin, int len) {
 Dload::Dload(SerialPort* port) {
     // 初始化串口
     bSectorAddress = false;
+    dwStreamBlockSize = STREAM_DEFAULT_BLOCK_SIZE;
+    dwStreamWindow = 1;
+    dwMaxWriteSize = 256;
     sport = port;
     
     if (!sport) {
@@ -28,6 +36,7 @@ Dload::Dload(SerialPort* port) {
 }
 
 int Dload::ConnectToFlashProg(BYTE ver) {
+    DeviceMonitor::Instance().LogFirstCommand(sport->GetPortNum());
 
     ByteArray bHello;
     bHello += EHOST_HELLO_REQ;
@@ -52,6 +61,17 @@ int Dload::ConnectToFlashProg(BYTE ver) {
         status = sport->SendSync(bHello, bRsp);
         if ((status == ERROR_SUCCESS) && (bRsp.size() > 0) && (bRsp[0] == EHOST_HELLO_RSP)) {
             LDEBUG("Dload::ConnectToFlashProg", "已接收到Hello响应");
+            // Hello响应: cmd(1) magic(32) ver(1) compat(1) max_block(4) flash_base(4)
+            //            flash_id_len(1) flash_id(n) window(2) ...
+            if (bRsp.size() >= 44) {
+                uint32_t maxBlock = bRsp[35] | (bRsp[36] << 8) | (bRsp[37] << 16) | ((uint32_t) bRsp[38] << 24);
+                size_t idLen = bRsp[43];
+                uint32_t window = 1;
+                if (bRsp.size() >= 44 + idLen + 2) {
+                    window = bRsp[44 + idLen] | (bRsp[45 + idLen] << 8);
+                }
+                SetStreamParams(maxBlock, window);
+            }
             break;
         }
         sport->Flush();
@@ -166,62 +186,132 @@ int Dload::ClosePartition() {
     return ERROR_SUCCESS;
 }
 
+void Dload::SetStreamParams(uint32_t blockSize, uint32_t window) {
+    // 块大小必须是整数个扇区，并且HDLC编码之后还要能放进串口的缓冲区
+    blockSize = min<uint32_t>(blockSize, STREAM_MAX_BLOCK_SIZE) / 512 * 512;
+    dwStreamBlockSize = blockSize ? blockSize : STREAM_DEFAULT_BLOCK_SIZE;
+    dwStreamWindow = max<uint32_t>(1, min<uint32_t>(window, STREAM_MAX_WINDOW));
+    LDEBUG("Dload::SetStreamParams", "流式写入块大小: %d，窗口: %d", dwStreamBlockSize, dwStreamWindow);
+}
+
 int Dload::FastCopySerial(HANDLE hInFile, uint32_t offset, uint32_t sectors) {
+    // 一个在途的流式写入包
+    struct StreamPacket {
+        uint32_t addr;      // 目标地址（扇区或字节，取决于bSectorAddress）
+        ByteArray pkt;      // 完整的EHOST_STREAM_WRITE_REQ包，重传时直接再发一次
+        int retries;        // 已重传次数
+    };
     int status = ERROR_SUCCESS;
-    BYTE rsp[32];
-    DWORD bytesRead = 0;
-    uint32_t count = 0;
-    uint32_t readSize = 1024;
+    BYTE rsp[64];
     int rspSize;
-    BYTE streamwrite[1050] = { EHOST_STREAM_WRITE_REQ, 0 };
-
-    // For now don't worry about sliding window do a write and wait for response
-    while ((status == ERROR_SUCCESS) && (count < sectors)) {
-        if ((count + 2) > sectors) {
-            readSize = 512;
-        }
+    uint64_t count = 0;
+    uint64_t bytesAcked = 0;
+    bool bEof = false;
+    bool bSrcEof = false;
+    ByteArray chunk;
+    size_t chunkPos = 0;
+    size_t chunkLen = 0;
+    std::deque<StreamPacket> inflight;
+    double startTime = time_utils::get_time();
+
+    // 从文件里一次读一大块，再切成数据包
+    chunk.resize(STREAM_READ_CHUNK + dwStreamBlockSize);
+    if (hInFile == INVALID_HANDLE_VALUE) {
         // If HANDLE value is invalid then just write 0's
-        if (hInFile != INVALID_HANDLE_VALUE) {
-            if (!ReadFile(hInFile, &streamwrite[5], readSize, &bytesRead, NULL)) {
-                status = GetLastError();
+        memset(chunk.data(), 0, chunk.size());
+    }
+
+    LDEBUG("Dload::FastCopySerial", "开始传输，块大小: %d，窗口: %d", dwStreamBlockSize, dwStreamWindow);
+    while (status == ERROR_SUCCESS) {
+        // 窗口没满就继续发送
+        while (inflight.size() < dwStreamWindow && !bEof && count < sectors) {
+            uint32_t want = (uint32_t) min<uint64_t>(dwStreamBlockSize, (sectors - count) * 512);
+            if (hInFile == INVALID_HANDLE_VALUE) {
+                chunkPos = 0;
+                chunkLen = want;
+            } else if (chunkLen - chunkPos < want && !bSrcEof) {
+                DWORD bytesRead = 0;
+                memmove(chunk.data(), chunk.data() + chunkPos, chunkLen - chunkPos);
+                chunkLen -= chunkPos;
+                chunkPos = 0;
+                if (!ReadFile(hInFile, chunk.data() + chunkLen, STREAM_READ_CHUNK, &bytesRead, NULL)) {
+                    status = GetLastError();
+                    break;
+                }
+                if (bytesRead == 0) bSrcEof = true;
+                chunkLen += bytesRead;
+            }
+            uint32_t len = (uint32_t) min<size_t>(want, chunkLen - chunkPos);
+            if (len == 0) {
+                // If we didn't read anything then break
+                bEof = true;
+                break;
             }
-        } else {
-            memset(&streamwrite[5], 0, readSize);
-            bytesRead = readSize;
-        }
 
-        count += (bytesRead / 512);
-        if (bytesRead > 0) {
-            // Write out the bytes we read to destination
-            streamwrite[1] = offset & 0xff;
-            streamwrite[2] = (offset >> 8) & 0xff;
-            streamwrite[3] = (offset >> 16) & 0xff;
-            streamwrite[4] = (offset >> 24) & 0xff;
-            rspSize = sizeof(rsp);
+            StreamPacket sp = { offset, ByteArray(), 0 };
+            sp.pkt.resize(len + 5);
+            sp.pkt[0] = EHOST_STREAM_WRITE_REQ;
+            sp.pkt[1] = offset & 0xff;
+            sp.pkt[2] = (offset >> 8) & 0xff;
+            sp.pkt[3] = (offset >> 16) & 0xff;
+            sp.pkt[4] = (offset >> 24) & 0xff;
+            memcpy(&sp.pkt[5], chunk.data() + chunkPos, len);
+            status = sport->WritePacket(sp.pkt.data(), (int) sp.pkt.size());
+            if (status != ERROR_SUCCESS) break;
+            inflight.push_back(std::move(sp));
+
+            chunkPos += len;
+            count += len / 512;
+            offset += bSectorAddress ? len / SECTOR_SIZE : len;
+        }
+        if (status != ERROR_SUCCESS || inflight.empty()) break;
 
-            sport->SendSync(streamwrite, bytesRead + 5, rsp, &rspSize);
-            if ((rspSize == 0) || (rsp[0] != EHOST_STREAM_WRITE_RSP)) {
-                LWARN("Dload::FastCopySerial", "设备返回错误: %d", rsp[0]);
-                if (rsp[0] == EHOST_LOG && rspSize >= 2) {
-                    rsp[rspSize - 2] = 0;
-                    LDEBUG("Dload::FastCopySerial", "设备日志: %s", (char*) &rsp[1]);
+        rspSize = sizeof(rsp);
+        status = sport->ReadPacket(rsp, &rspSize);
+        if (status != ERROR_SUCCESS) break;
+
+        if (rspSize == 0) {
+            // 超时了，不知道是请求还是响应丢了，把在途的包都重发一遍
+            LWARN("Dload::FastCopySerial", "等待响应超时，重传%d个在途的数据包", inflight.size());
+            for (StreamPacket& sp : inflight) {
+                if (++sp.retries > STREAM_MAX_RETRY) {
+                    status = ERROR_WRITE_FAULT;
+                    break;
                 }
-                status = ERROR_WRITE_FAULT;
+                status = sport->WritePacket(sp.pkt.data(), (int) sp.pkt.size());
+                if (status != ERROR_SUCCESS) break;
             }
-            if (bSectorAddress) {
-                offset += bytesRead / SECTOR_SIZE;
-                LDEBUG("Dload::FastCopySerial", "目标扇区: %d", (int) offset);
+        } else if (rsp[0] == EHOST_STREAM_WRITE_RSP && rspSize >= 5) {
+            // 按地址找到对应的包，重传导致的重复响应直接忽略
+            uint32_t addr = rsp[1] | (rsp[2] << 8) | (rsp[3] << 16) | ((uint32_t) rsp[4] << 24);
+            auto it = std::find_if(inflight.begin(), inflight.end(),
+                [addr](const StreamPacket& sp) { return sp.addr == addr; });
+            if (it != inflight.end()) {
+                LTRACE("Dload::FastCopySerial", "目标%s: %d 写入完成", bSectorAddress ? "扇区" : "偏移", (int) addr);
+                bytesAcked += it->pkt.size() - 5;
+                inflight.erase(it);
             } else {
-                offset += bytesRead;
-                LDEBUG("Dload::FastCopySerial", "目标偏移: %d", (int) offset);
+                LDEBUG("Dload::FastCopySerial", "收到不在窗口内的响应，地址: %d", (int) addr);
             }
+        } else if (rsp[0] == EHOST_LOG && rspSize >= 2) {
+            rsp[rspSize - 2] = 0;
+            LDEBUG("Dload::FastCopySerial", "设备日志: %s", (char*) &rsp[1]);
         } else {
-            // If we didn't read anything then break
-            break;
+            // 出错的时候设备不一定会带上地址，重传最早的那个包
+            StreamPacket& sp = inflight.front();
+            LWARN("Dload::FastCopySerial", "设备返回错误: %d，重传地址为%d的数据包 (%d/%d)", 
+                rsp[0], (int) sp.addr, sp.retries + 1, STREAM_MAX_RETRY);
+            if (++sp.retries > STREAM_MAX_RETRY) {
+                status = ERROR_WRITE_FAULT;
+            } else {
+                status = sport->WritePacket(sp.pkt.data(), (int) sp.pkt.size());
+            }
         }
     }
 
-    LDEBUG("Dload::FastCopySerial", "传输完成");
+    double elapsed = time_utils::get_time() - startTime;
+    LDEBUG("Dload::FastCopySerial", "传输完成，共%lld字节，耗时%.3fs，速度%.2fKB/s", 
+        bytesAcked, elapsed, elapsed > 0 ? bytesAcked / 1024.0 / elapsed : 0.0);
 
     // If we hit end of file that means we sent it all
     if (status == ERROR_HANDLE_EOF) status = ERROR_SUCCESS;
@@ -244,83 +334,248 @@ int Dload::LoadImageFile(const std::string& szSingleImage) {
     return status;
 }
 
-int Dload::LoadFlashProg(const std::string& szFlashPrg) {
-    BYTE write32[280] = { CMD_WRITE_32BIT, 0 };
-    BYTE* writePtr;
-    BYTE rsp[32];
-    int rspSize;
-    uint32_t goAddr = 0;
-    uint32_t targetAddr = 0;
-    uint32_t newAddr = 0;
-    uint32_t bytesRead;
-    uint32_t status = ERROR_SUCCESS;
+// FNV-1a 64位哈希，只用来给缓存文件命名
+static uint64_t HashBytes(const BYTE* data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    char hexline[128];
-    FILE* fMprgFile;
-    fopen_s(&fMprgFile, szFlashPrg.c_str(), "r");
+static int HexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
 
-    if (fMprgFile == NULL) {
-        return ERROR_OPEN_FAILED;
-    }
+int Dload::ParseHexImage(const ByteArray& text, std::vector<HexSegment>& segs, uint32_t& goAddr) {
+    const char* p = (const char*) text.data();
+    const char* end = p + text.size();
+    uint32_t baseAddr = 0;
+    BYTE rec[256 + 5];
+    int line = 0;
+
+    segs.clear();
+    goAddr = 0;
+    while (p < end) {
+        // 跳到下一条记录的开头
+        while (p < end && *p != ':') p++;
+        if (p >= end) break;
+        p++;
+        line++;
+
+        // 记录格式: len(1) addr(2) type(1) data(len) checksum(1)
+        int n = 0;
+        BYTE sum = 0;
+        for (; p + 1 < end && n < (int) sizeof(rec); p += 2) {
+            int hi = HexNibble(p[0]), lo = HexNibble(p[1]);
+            if (hi < 0 || lo < 0) break;
+            rec[n] = (BYTE) ((hi << 4) | lo);
+            sum += rec[n++];
+        }
+        if (n < 5 || n != rec[0] + 5 || sum != 0) {
+            LWARN("Dload::ParseHexImage", "第%d条记录格式或校验和错误", line);
+            return ERROR_INVALID_DATA;
+        }
 
-    while (!feof(fMprgFile)) {
-        BYTE id = 0;
-        bool bFirst = true;
-        writePtr = &write32[7];
-        for (bytesRead = 0; bytesRead < 256;) {
-            BYTE len;
-            fgets(hexline, sizeof(hexline), fMprgFile);
-            if (strlen(hexline) > 9) {
-                HexTobyte(&hexline[1], &len, 1);
-                HexTobyte(&hexline[3], rsp, 2);
-                HexTobyte(&hexline[7], &id, 1);
-
-                if (id == 0) {
-                    HexTobyte(&hexline[9], writePtr, len);
-                    if (bFirst) {
-                        bFirst = false;
-                        targetAddr = (targetAddr & 0xffff0000) + (rsp[0] << 8) + rsp[1];
-                    }
-                    writePtr += len;
-                    bytesRead += len;
-                } else if (id == 1) {
-                    break;
-                } else if (id == 5) {
-                    HexTobyte(&hexline[9], rsp, 4);
-                    goAddr = (rsp[0] << 24) + (rsp[1] << 16) + (rsp[2] << 8) + rsp[3];
-                } else if (id == 4) {
-                    HexTobyte(&hexline[9], rsp, 2);
-                    newAddr = (rsp[0] << 24) + (rsp[1] << 16);
-                    break;
+        BYTE len = rec[0];
+        uint32_t addr = baseAddr + ((rec[1] << 8) | rec[2]);
+        BYTE* data = &rec[4];
+        switch (rec[3]) {
+            case 0:
+                // 和上一段地址连续就直接接上，否则开新的一段
+                if (segs.empty() || segs.back().addr + segs.back().data.size() != addr) {
+                    segs.push_back({ addr, ByteArray() });
                 }
-            }
-
-            if (id == 4) {
+                segs.back().data.append(data, len);
+                break;
+            case 1:
+                return ERROR_SUCCESS;
+            case 2:
+                baseAddr = ((data[0] << 8) | data[1]) << 4;
+                break;
+            case 3:
+                goAddr = (((data[0] << 8) | data[1]) << 4) + ((data[2] << 8) | data[3]);
+                break;
+            case 4:
+                baseAddr = ((uint32_t) data[0] << 24) | (data[1] << 16);
+                break;
+            case 5:
+                goAddr = ((uint32_t) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+                break;
+            default:
+                LDEBUG("Dload::ParseHexImage", "忽略未知的记录类型: %d", rec[3]);
                 break;
-            }
         }
+    }
+    return ERROR_SUCCESS;
+}
 
+int Dload::LoadHexImage(const std::string& szFlashPrg, std::vector<HexSegment>& segs, uint32_t& goAddr) {
+    FILE* fp = fopen(szFlashPrg.c_str(), "rb");
+    if (fp == NULL) {
+        return ERROR_OPEN_FAILED;
+    }
+    ByteArray text;
+    fseek(fp, 0, SEEK_END);
+    text.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    text.resize(fread(text.data(), 1, text.size(), fp));
+    fclose(fp);
+
+    // 先看缓存里有没有同一个文件解析好的结果
+    uint64_t hash = HashBytes(text.data(), text.size());
+    std::string cacheFile = fmt::format("{}/{:016x}.bin", DLOAD_HEX_CACHE_DIR, hash);
+    fp = fopen(cacheFile.c_str(), "rb");
+    if (fp) {
+        char magic[8];
+        uint64_t cachedHash = 0;
+        uint32_t count = 0;
+        fseek(fp, 0, SEEK_END);
+        long fileSize = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, DLOAD_HEX_CACHE_MAGIC, 8) == 0 &&
+                  fread(&cachedHash, 8, 1, fp) == 1 && cachedHash == hash &&
+                  fread(&goAddr, 4, 1, fp) == 1 && fread(&count, 4, 1, fp) == 1;
+        segs.clear();
+        for (uint32_t i = 0; ok && i < count; i++) {
+            HexSegment seg;
+            uint32_t len = 0;
+            ok = fread(&seg.addr, 4, 1, fp) == 1 && fread(&len, 4, 1, fp) == 1;
+            // 长度来自文件本身，超过剩下的字节数说明文件损坏，不能按它分配内存
+            if (ok && len > (uint64_t) (fileSize - ftell(fp)))
+                ok = false;
+            if (!ok) break;
+            seg.data.resize(len);
+            ok = fread(seg.data.data(), 1, len, fp) == len;
+            segs.push_back(std::move(seg));
+        }
+        fclose(fp);
+        if (ok) {
+            LDEBUG("Dload::LoadHexImage", "使用缓存的烧录程序: %s，%d段", cacheFile.c_str(), count);
+            return ERROR_SUCCESS;
+        }
+        LWARN("Dload::LoadHexImage", "缓存文件已损坏，重新解析: %s", cacheFile.c_str());
+    }
 
-        if (bytesRead > 0) {
+    int status = ParseHexImage(text, segs, goAddr);
+    if (status != ERROR_SUCCESS) return status;
+
+    // 写缓存失败不影响加载
+    std::error_code ec;
+    std::filesystem::create_directories(DLOAD_HEX_CACHE_DIR, ec);
+    fp = fopen(cacheFile.c_str(), "wb");
+    if (fp) {
+        uint32_t count = (uint32_t) segs.size();
+        fwrite(DLOAD_HEX_CACHE_MAGIC, 1, 8, fp);
+        fwrite(&hash, 8, 1, fp);
+        fwrite(&goAddr, 4, 1, fp);
+        fwrite(&count, 4, 1, fp);
+        for (const HexSegment& seg : segs) {
+            uint32_t len = (uint32_t) seg.data.size();
+            fwrite(&seg.addr, 4, 1, fp);
+            fwrite(&len, 4, 1, fp);
+            fwrite(seg.data.data(), 1, len, fp);
+        }
+        fclose(fp);
+    } else {
+        LDEBUG("Dload::LoadHexImage", "无法写入缓存文件: %s", cacheFile.c_str());
+    }
+    return ERROR_SUCCESS;
+}
+
+int Dload::WriteHexSegments(const std::vector<HexSegment>& segs, uint32_t writeSize) {
+    std::deque<ByteArray> outstanding;
+    size_t window = DLOAD_WRITE_WINDOW;
+    size_t segIdx = 0;
+    size_t segPos = 0;
+    BYTE rsp[32];
+    int rspSize;
+    int status = ERROR_SUCCESS;
+
+    while (status == ERROR_SUCCESS) {
+        // 在等待ACK之前先把窗口填满
+        while (outstanding.size() < window && segIdx < segs.size()) {
+            const HexSegment& seg = segs[segIdx];
+            uint32_t targetAddr = seg.addr + (uint32_t) segPos;
+            uint32_t len = (uint32_t) min<size_t>(writeSize, seg.data.size() - segPos);
+            ByteArray write32;
+            write32.resize(len + 7);
+            write32[0] = CMD_WRITE_32BIT;
             write32[1] = (targetAddr >> 24) & 0xff;
             write32[2] = (targetAddr >> 16) & 0xff;
             write32[3] = (targetAddr >> 8) & 0xff;
             write32[4] = targetAddr & 0xff;
-            write32[5] = (bytesRead >> 8) & 0xff;
-            write32[6] = bytesRead & 0xff;
+            write32[5] = (len >> 8) & 0xff;
+            write32[6] = len & 0xff;
+            memcpy(&write32[7], seg.data.data() + segPos, len);
+            LTRACE("Dload::WriteHexSegments", "编程地址: 0x%x 长度: %d", targetAddr, len);
+            status = sport->WritePacket(write32.data(), (int) write32.size());
+            if (status != ERROR_SUCCESS) break;
+            outstanding.push_back(std::move(write32));
+            segPos += len;
+            if (segPos >= seg.data.size()) {
+                segIdx++;
+                segPos = 0;
+            }
+        }
+        if (status != ERROR_SUCCESS || outstanding.empty()) break;
+
+        rspSize = sizeof(rsp);
+        status = sport->ReadPacket(rsp, &rspSize);
+        if (status != ERROR_SUCCESS) break;
+        if ((rspSize > 0) && (rsp[0] == CMD_ACK)) {
+            outstanding.pop_front();
+            continue;
+        }
+        if (window == 1) {
+            status = ERROR_WRITE_FAULT;
+            break;
+        }
+        // 设备可能不支持连续发送，清掉残留的响应后逐个重发还没确认的包
+        // 写的是内存，重复写入同一个地址没有副作用
+        LWARN("Dload::WriteHexSegments", "设备未确认连续发送的写入(响应码%d)，改为逐包确认", rspSize > 0 ? rsp[0] : -1);
+        window = 1;
+        sport->Flush();
+        while (!outstanding.empty()) {
             rspSize = sizeof(rsp);
-            LDEBUG("Dload::LoadMprgFile", "编程地址: 0x%x 长度: %d", targetAddr, bytesRead);
-            sport->SendSync(write32, bytesRead + 7, rsp, &rspSize);
-            if ((rspSize == 0) || (rsp[0] != CMD_ACK)) {
+            status = sport->SendSync(outstanding.front().data(), (int) outstanding.front().size(), rsp, &rspSize);
+            if (status != ERROR_SUCCESS || (rspSize == 0) || (rsp[0] != CMD_ACK)) {
                 status = ERROR_WRITE_FAULT;
                 break;
             }
+            outstanding.pop_front();
         }
+    }
+    return status;
+}
 
-        targetAddr = newAddr;
+int Dload::LoadFlashProg(const std::string& szFlashPrg) {
+    std::vector<HexSegment> segs;
+    uint32_t goAddr = 0;
+    BYTE rsp[32];
+    int rspSize;
+    double startTime = time_utils::get_time();
+
+    int status = LoadHexImage(szFlashPrg, segs, goAddr);
+    if (status != ERROR_SUCCESS) {
+        return status;
     }
-    fclose(fMprgFile);
 
+    // 问设备一次能写多长，问不到就用原来的256字节
+    if (GetDloadParams(rsp, sizeof(rsp)) != ERROR_SUCCESS) {
+        LDEBUG("Dload::LoadMprgFile", "获取DLOAD参数失败，使用默认写入长度%d", dwMaxWriteSize);
+        sport->Flush();
+    }
+    uint32_t writeSize = min<uint32_t>(dwMaxWriteSize, DLOAD_MAX_WRITE_SIZE);
+    size_t total = 0;
+    for (const HexSegment& seg : segs) total += seg.data.size();
+    LDEBUG("Dload::LoadMprgFile", "烧录程序共%d段，%d字节，每次写入%d字节", segs.size(), total, writeSize);
+
+    status = WriteHexSegments(segs, writeSize);
 
     if (status == ERROR_SUCCESS) {
         BYTE gocmd[5] = { CMD_GO, 0 };
@@ -333,11 +588,13 @@ int Dload::LoadFlashProg(const std::string& szFlashPrg) {
         rspSize = sizeof(rsp);
         sport->SendSync(gocmd, sizeof(gocmd), rsp, &rspSize);
         if ((rspSize > 0) && (rsp[0] == CMD_ACK)) {
+            DeviceMonitor::Instance().MarkModeSwitch(sport->GetPortNum(), "Dload加载烧录程序");
             status = ERROR_SUCCESS;
         } else {
             status = ERROR_WRITE_FAULT;
         }
     }
+    LDEBUG("Dload::LoadMprgFile", "烧录程序加载完成，耗时%.3fs", time_utils::get_time() - startTime);
 
     return status;
 }
@@ -351,6 +608,12 @@ int Dload::GetDloadParams(BYTE* rsp, int len) {
     }
     sport->SendSync(params, sizeof(params), rsp, &bytesRead);
     if ((bytesRead > 0) && (rsp[0] == CMD_PARAMS)) {
+        // CMD_PARAMS: cmd(1) version(1) min_version(1) max_write_size(2, 大端) ...
+        if (bytesRead >= 5) {
+            uint32_t maxWrite = (rsp[3] << 8) | rsp[4];
+            if (maxWrite > 0) dwMaxWriteSize = maxWrite;
+            LDEBUG("Dload::GetDloadParams", "设备支持的最大写入长度: %d", dwMaxWriteSize);
+        }
         return ERROR_SUCCESS;
     }
     return -2;
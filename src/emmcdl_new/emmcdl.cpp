@@ -32,6 +32,11 @@
 #include "emmcdl_new/serialport.h"
 #include "emmcdl_new/firehose.h"
 #include "emmcdl_new/ffu.h"
+#include "emmcdl_new/probe.h"
+#include "emmcdl_new/daemon.h"
+#include "emmcdl_new/orchestrator.h"
+#include "emmcdl_new/reactorbench.h"
+#include "emmcdl_new/poolbench.h"
 #include "utils/logger.h"
 #include "utils/string_utils.h"
 #include <winerror.h>
@@ -43,8 +48,64 @@ static int m_chipset = 8974;
 static int m_sector_size = 512;
 static bool m_emergency = false;
 static bool m_verbose = false;
-static SerialPort m_port;
-static fh_configure_t m_cfg = { 4, "emmc", false, false, true, -1, 1024 * 1024 };
+static bool m_verify = false;
+static SerialPort m_defaultPort;
+static SerialPort* m_port = &m_defaultPort;
+static DeviceSession* m_session = nullptr;
+static const fh_configure_t m_defaultCfg = { 4, "emmc", false, false, true, -1, 1024 * 1024 };
+static fh_configure_t m_cfg = m_defaultCfg;
+
+
+/**
+ * @brief       Connects a Firehose object to the programmer. Inside a daemon session the
+ *              configure negotiated by an earlier command is reused, so only a NOP is sent.
+ * @param fh    Firehose object on m_port
+ * @return      Status code
+ */
+static int ConnectFirehose(Firehose& fh) {
+    fh.SetDiskSectorSize(m_sector_size);
+    if (m_verbose)
+        fh.EnableVerbose();
+    if (m_session != nullptr && m_session->bConfigured) {
+        if (!m_session->SameConfigure(m_cfg, m_sector_size)) {
+            LINFO("ConnectFirehose", "配置参数和会话中的不同，重新发送配置");
+        } else if (fh.ResumeFlashProg(&m_cfg, m_session->dwMaxPacketSize) == ERROR_SUCCESS) {
+            if (!m_session->gpt.empty())
+                fh.SetGPTCache(m_session->gpt.data());
+            LDEBUG("ConnectFirehose", "复用会话中的配置, 最大数据包大小: %d", m_session->dwMaxPacketSize);
+            return ERROR_SUCCESS;
+        } else {
+            LWARN("ConnectFirehose", "会话中的烧录内核没有响应，重新发送配置");
+        }
+        m_session->bConfigured = false;
+        m_session->gpt.clear();
+    }
+    int status = fh.ConnectToFlashProg(&m_cfg);
+    if (status == ERROR_SUCCESS && m_session != nullptr) {
+        m_session->bConfigured = true;
+        m_session->dwMaxPacketSize = fh.GetMaxPacketSize();
+        m_session->cfg = m_cfg;
+        m_session->sectorSize = m_sector_size;
+    }
+    return status;
+}
+
+/**
+ * @brief       Keeps the partition table read by a command in the daemon session, so later
+ *              commands that address partitions by name skip ReadGPT.
+ * @param fh    Firehose object that ran the command
+ * @param bDirty Whether the command may have changed the partition table
+ */
+static void SaveSessionGPT(Firehose& fh, bool bDirty) {
+    if (m_session == nullptr)
+        return;
+    const gpt_entry_t* entries = fh.GetGPTCache();
+    if (bDirty || entries == nullptr) {
+        m_session->gpt.clear();
+    } else {
+        m_session->gpt.assign(entries, entries + GPT_CACHE_ENTRIES);
+    }
+}
 
 
 /**
@@ -55,6 +116,8 @@ int PrintHelp() {
     printf("       Options:\n");
     printf("       -l                             List available mass storage devices\n");
     printf("       -info                          List HW information about device attached to COM (eg -p COM8 -info)\n");
+    printf("       -memdump <dir>                 Collect RAM dump from device in Sahara memory debug mode into dir\n");
+    printf("       -probe                         Detect the mode of all COM ports in parallel (Sahara/Firehose/Dload/SPD)\n");
     printf("       -MaxPayloadSizeToTargetInBytes The max bytes in firehose mode (DDR or large IMEM use 16384, default=8192)\n");
     printf("       -SkipWrite                     Do not write actual data to disk (use this for UFS provisioning)\n");
     printf("       -SkipStorageInit               Do not initialize storage device (use this for UFS provisioning)\n");
@@ -67,12 +130,16 @@ int PrintHelp() {
     printf("       -e <PartName>                  Erase the entire partition specified\n");
     printf("       -s <sectors>                   Number of sectors in disk image\n");
     printf("       -p <port or disk>              Port or disk to program to (eg COM8, for PhysicalDrive1 use 1)\n");
+    printf("       -ports <COMa,COMb,...>         Flash -x or -ffu to all these ports in parallel (needs -f)\n");
+    printf("       -reactor                       With -ports and -x, drive the Firehose sessions of all ports from one thread\n");
+    printf("       -spd \"<spd_dump commands>\"     With -ports, run the commands on all these Spreadtrum ports in parallel\n");
     printf("       -o <filename>                  Output filename\n");
     printf("       -x <*.xml>                     Program XML file to output type -o (output) -p (port or disk)\n");
     printf("       -f <flash programmer>          Flash programmer to load to IMEM eg MPRG8960.hex\n");
     printf("       -i <singleimage>               Single image to load at offset 0 eg 8960_msimage.mbn\n");
     printf("       -t                             Run performance tests\n");
     printf("       -b <prtname> <binfile>         Write <binfile> to GPT <prtname>\n");
+    printf("       -verify                        Read the partition back after -b and compare it with <binfile>\n");
     printf("       -g GPP1 GPP2 GPP3 GPP4         Create GPP partitions with sizes in MB\n");
     printf("       -gq                            Do not prompt when creating GPP (quiet)\n");
     printf("       -r                             Reset device\n");
@@ -83,6 +150,10 @@ int PrintHelp() {
     printf("       -gpt                           Dump the GPT from the connected device\n");
     printf("       -raw                           Send and receive RAW data to serial port 0x75 0x25 0x10\n");
     printf("       -verbose                       Enable verbose output\n");
+    printf("       -daemon <socket> [idle secs]   Keep device sessions open and serve commands from a Unix socket\n");
+    printf("       -connect <socket> <options>    Run the options in the daemon listening on socket\n");
+    printf("       -reactorbench [devs] [MB] [thr] Measure host CPU per device of the reactor on simulated devices\n");
+    printf("       -poolbench [tasks] [threads]   Compare the work-stealing pool and task graph with one Thread per job\n");
     printf("\n\n\nExamples:");
     printf(" emmcdl -p COM8 -info\n");
     printf(" emmcdl -p COM8 -gpt\n");
@@ -95,6 +166,13 @@ int PrintHelp() {
     printf(" emmcdl -p COM8 -f prog_emmc_firehose_8994_lite.mbn -e 0 100\n");
     printf(" emmcdl -p COM8 -f prog_emmc_firehose_8994_lite.mbn -e MODEM_FSG\n");
     printf(" emmcdl -p COM8 -f prog_emmc_firehose_8994_lite.mbn -raw 0x75 0x25 0x10\n");
+    printf(" emmcdl -ports COM8,COM9,COM10 -f prog_emmc_firehose_8994_lite.mbn -x rawprogram0.xml\n");
+    printf(" emmcdl -ports COM8,COM9,COM10 -reactor -f prog_emmc_firehose_8994_lite.mbn -x rawprogram0.xml\n");
+    printf(" emmcdl -ports COM8,COM9 -spd \"loadfdl fdl1-0x5500.bin loadfdl fdl2-0x9efffe00.bin exec write_parts images reset\"\n");
+    printf(" emmcdl -daemon emmcdl.sock 300\n");
+    printf(" emmcdl -connect emmcdl.sock -p COM8 -f prog_emmc_firehose_8994_lite.mbn -gpt\n");
+    printf(" emmcdl -reactorbench 64 32 1\n");
+    printf(" emmcdl -poolbench 4096 8\n");
     return -1;
 }
 
@@ -134,7 +212,8 @@ int RawSerialSend(int dnum, char** szSerialData, int len) {
         return ERROR_INVALID_PARAMETER;
     }
 
-    m_port.Open(dnum);
+    if (!m_port->IsOpen())
+        m_port->Open(dnum);
     StringToByte(szSerialData, data, len);
     LTRACE("RawSerialSend", "向串口发送数据:");
     string line((char*) data, len);
@@ -143,11 +222,11 @@ int RawSerialSend(int dnum, char** szSerialData, int len) {
     } catch (const std::exception& e) {
         fmt::print(log_utils::Logger::TRACE.message_display_color, "  (无法显示数据)\n");
     }
-    status = m_port.Write(data, len);
+    status = m_port->Write(data, len);
     BYTE rsp[2048];
     DWORD rsp_len;
     LTRACE("RawSerialSend", "等待响应...");
-    status = m_port.Read(rsp, &rsp_len);
+    status = m_port->Read(rsp, &rsp_len);
     LTRACE("RawSerialSend", "等待响应完成，状态: %s", 
             getErrorDescription(status).c_str());
     LTRACE("RawSerialSend", "接收到的响应: \n%s", string((char*) rsp, rsp_len).c_str());
@@ -158,7 +237,7 @@ int LoadFlashProg(const char* mprgFile) {
     int status = ERROR_SUCCESS;
 
     if (m_chipset == 8974) {
-        Sahara sh(&m_port);
+        Sahara sh(m_port);
         if (status != ERROR_SUCCESS)
             return status;
         status = sh.ConnectToDevice(true, 0);
@@ -168,8 +247,13 @@ int LoadFlashProg(const char* mprgFile) {
         status = sh.LoadFlashProg(mprgFile);
         if (status != ERROR_SUCCESS)
             return status;
+        // 等到烧录内核响应NOP再返回，端口可能在这期间重新枚举
+        Firehose fh(m_port);
+        status = fh.WaitReady(FH_READY_TIMEOUT_MS);
+        if (status != ERROR_SUCCESS)
+            return status;
     } else {
-        Dload dl(&m_port);
+        Dload dl(m_port);
         if (status != ERROR_SUCCESS)
             return status;
         status = dl.IsDeviceInDload();
@@ -187,15 +271,14 @@ int EraseDisk(uint64_t start, uint64_t num, int dnum, const char* szPartName) {
     int status = ERROR_SUCCESS;
 
     if (m_emergency) {
-        Firehose fh(&m_port);
-        fh.SetDiskSectorSize(m_sector_size);
-        if (m_verbose)
-            fh.EnableVerbose();
-        status = fh.ConnectToFlashProg(&m_cfg);
+        Firehose fh(m_port);
+        status = ConnectFirehose(fh);
         if (status != ERROR_SUCCESS)
             return status;
         LINFO("EraseDisk", "连接到烧录内核，开始擦除磁盘");
         fh.WipeDiskContents(start, num, szPartName);
+        // 按扇区擦除可能擦到分区表
+        SaveSessionGPT(fh, szPartName == nullptr);
     } else {
         DiskWriter dw;
         dw.InitDiskList(false);
@@ -213,7 +296,7 @@ int EraseDisk(uint64_t start, uint64_t num, int dnum, const char* szPartName) {
 
 int DumpDeviceInfo(void) {
     int status = ERROR_SUCCESS;
-    Sahara sh(&m_port);
+    Sahara sh(m_port);
     if (m_protocol == FIREHOSE_PROTOCOL) {
         pbl_info_t pbl_info;
         status = sh.DumpDeviceInfo(&pbl_info);
@@ -232,6 +315,29 @@ int DumpDeviceInfo(void) {
     return status;
 }
 
+int CollectMemoryDump(int dnum, const char* szDir) {
+    // 崩溃的设备不会加载烧录内核，端口需要在这里打开
+    if (!m_port->IsOpen()) {
+        int status = m_port->Open(dnum);
+        if (status != ERROR_SUCCESS) {
+            LWARN("CollectMemoryDump", fmt::format("端口COM{}打开失败, 状态: {}",
+                dnum, getErrorDescription(status)));
+            return status;
+        }
+    }
+    Sahara sh(m_port);
+    LINFO("CollectMemoryDump", "开始收集内存转储到: %s", szDir);
+    return sh.CollectMemoryDump(szDir);
+}
+
+int ProbePorts(void) {
+    auto sessions = PortProbe::ProbeAll();
+    for (auto& s : sessions) {
+        LINFO("ProbePorts", "COM%-3d %-10s %s", s.port, PortProbe::ModeName(s.mode), s.name.c_str());
+    }
+    return ERROR_SUCCESS;
+}
+
 int WipeDisk(int dnum) {
     DiskWriter dw;
     int status;
@@ -252,7 +358,7 @@ int CreateGPP(DWORD dwGPP1, DWORD dwGPP2, DWORD dwGPP3, DWORD dwGPP4) {
     int status = ERROR_SUCCESS;
 
     if (m_protocol == STREAMING_PROTOCOL) {
-        Dload dl(&m_port);
+        Dload dl(m_port);
 
         status = dl.ConnectToFlashProg(4);
         if (status != ERROR_SUCCESS)
@@ -263,16 +369,14 @@ int CreateGPP(DWORD dwGPP1, DWORD dwGPP2, DWORD dwGPP3, DWORD dwGPP4) {
         LINFO("CreateGPP", "连接到烧录内核，开始创建GPP分区");
         status = dl.CreateGPP(dwGPP1, dwGPP2, dwGPP3, dwGPP4);
     } else if (m_protocol == FIREHOSE_PROTOCOL) {
-        Firehose fh(&m_port);
-        fh.SetDiskSectorSize(m_sector_size);
-        if (m_verbose)
-            fh.EnableVerbose();
-        status = fh.ConnectToFlashProg(&m_cfg);
+        Firehose fh(m_port);
+        status = ConnectFirehose(fh);
         if (status != ERROR_SUCCESS)
             return status;
         LINFO("CreateGPP", "连接到烧录内核，开始创建GPP分区");
         status = fh.CreateGPP(dwGPP1 / 2, dwGPP2 / 2, dwGPP3 / 2, dwGPP4 / 2);
         status = fh.SetActivePartition(1);
+        SaveSessionGPT(fh, true);
     }
 
     return status;
@@ -282,15 +386,13 @@ int ReadGPT(int dnum) {
     int status;
 
     if (m_emergency) {
-        Firehose fh(&m_port);
-        fh.SetDiskSectorSize(m_sector_size);
-        if (m_verbose)
-            fh.EnableVerbose();
-        status = fh.ConnectToFlashProg(&m_cfg);
+        Firehose fh(m_port);
+        status = ConnectFirehose(fh);
         if (status != ERROR_SUCCESS)
             return status;
         LINFO("ReadGPT", "连接到烧录内核，开始读取分区表");
         fh.ReadGPT(true);
+        SaveSessionGPT(fh, false);
     } else {
         DiskWriter dw;
         dw.InitDiskList();
@@ -309,15 +411,16 @@ int WriteGPT(int dnum, const char* szPartName, const char* szBinFile) {
     int status;
 
     if (m_emergency) {
-        Firehose fh(&m_port);
-        fh.SetDiskSectorSize(m_sector_size);
-        if (m_verbose)
-            fh.EnableVerbose();
-        status = fh.ConnectToFlashProg(&m_cfg);
+        Firehose fh(m_port);
+        status = ConnectFirehose(fh);
         if (status != ERROR_SUCCESS)
             return status;
         LINFO("WriteGPT", "连接到烧录内核，开始写入分区表");
         status = fh.WriteGPT(szPartName, szBinFile);
+        if (status == ERROR_SUCCESS && m_verify) {
+            status = fh.VerifyImage(szPartName, szBinFile);
+        }
+        SaveSessionGPT(fh, true);
     } else {
         DiskWriter dw;
         dw.InitDiskList();
@@ -331,7 +434,7 @@ int WriteGPT(int dnum, const char* szPartName, const char* szBinFile) {
 }
 
 int ResetDevice() {
-    Dload dl(&m_port);
+    Dload dl(m_port);
     int status = ERROR_SUCCESS;
     if (status != ERROR_SUCCESS)
         return status;
@@ -342,11 +445,11 @@ int ResetDevice() {
 int FFUProgram(const char* szFFUFile) {
     FFUImage ffu;
     int status = ERROR_SUCCESS;
-    Firehose fh(&m_port);
-    fh.SetDiskSectorSize(m_sector_size);
-    status = fh.ConnectToFlashProg(&m_cfg);
+    Firehose fh(m_port);
+    status = ConnectFirehose(fh);
     if (status != ERROR_SUCCESS)
         return status;
+    SaveSessionGPT(fh, true);
     LINFO("DownloadFFU", "正在尝试打开FFU文件");
     status = ffu.PreLoadImage(szFFUFile);
     if (status != ERROR_SUCCESS)
@@ -389,8 +492,8 @@ int FFURawProgram(const char* szFFUFile, const char* szOutputFile) {
 
 int EDownloadProgram(const char* szSingleImage, char** szXMLFile) {
     int status = ERROR_SUCCESS;
-    Dload dl(&m_port);
-    Firehose fh(&m_port);
+    Dload dl(m_port);
+    Firehose fh(m_port);
     BYTE prtn = 0;
 
     if (szSingleImage != NULL) {
@@ -428,12 +531,11 @@ int EDownloadProgram(const char* szSingleImage, char** szXMLFile) {
             dl.DeviceReset();
             dl.ClosePartition();
         } else if (m_protocol == FIREHOSE_PROTOCOL) {
-            fh.SetDiskSectorSize(m_sector_size);
-            if (m_verbose)
-                fh.EnableVerbose();
-            status = fh.ConnectToFlashProg(&m_cfg);
+            status = ConnectFirehose(fh);
             if (status != ERROR_SUCCESS)
                 return status;
+            // rawprogram通常会重写分区表
+            SaveSessionGPT(fh, true);
             LINFO("EDownloadProgram", "连接到烧录内核，开始下载");
 
             for (int i = 0; szXMLFile[i] != NULL; i++) {
@@ -519,17 +621,13 @@ int RawDiskDump(uint64_t start, uint64_t num, const char* oFile, int dnum, const
         LINFO("RawDiskDump", "开始转储数据, 起始扇区=%lld, 扇区总数=%lld, 保存到\"%s\"\n", start, num, oFile);
     }
     if (m_emergency) {
-        Firehose fh(&m_port);
-        fh.SetDiskSectorSize(m_sector_size);
-        if (m_verbose)
-            fh.EnableVerbose();
-        if (status != ERROR_SUCCESS)
-            return status;
-        status = fh.ConnectToFlashProg(&m_cfg);
+        Firehose fh(m_port);
+        status = ConnectFirehose(fh);
         if (status != ERROR_SUCCESS)
             return status;
         LINFO("RawDiskDump", "成功连接到烧录内核, 开始下载数据");
         status = fh.DumpDiskContents(start, num, oFile, 0, szPartName);
+        SaveSessionGPT(fh, false);
     } else {
         dw.InitDiskList();
         status = dw.OpenDevice(dnum);
@@ -551,6 +649,17 @@ int DiskList() {
 
 
 
+int emmcdl_session_main(DeviceSession* session, int argc, char* argv[]) {
+    m_session = session;
+    m_port = session != nullptr ? &session->sport : &m_defaultPort;
+    int status = emmcdl_main(argc, argv);
+    m_session = nullptr;
+    m_port = &m_defaultPort;
+    return status;
+}
+
+
+
 int emmcdl_main(int argc, char* argv[]) {
     int dnum = -1;
     int status = 0;
@@ -564,6 +673,10 @@ int emmcdl_main(int argc, char* argv[]) {
     char* szFlashProg = NULL;
     char* szSingleImage = NULL;
     char* szPartName = NULL;
+    char* szMemDumpDir = NULL;
+    vector<int> multiPorts;
+    vector<string> spdArgs;
+    bool bReactor = false;
     emmc_cmd_e cmd = EMMC_CMD_NONE;
     uint64_t uiStartSector = 0;
     uint64_t uiNumSectors = 0;
@@ -584,6 +697,48 @@ int emmcdl_main(int argc, char* argv[]) {
         return PrintHelp();
     }
 
+    // 守护进程里会连续执行多条命令，上一条命令的选项不能带到下一条
+    m_protocol = FIREHOSE_PROTOCOL;
+    m_chipset = 8974;
+    m_sector_size = 512;
+    m_emergency = false;
+    m_verbose = false;
+    m_verify = false;
+    m_cfg = m_defaultCfg;
+
+    if (_stricmp(argv[1], "-daemon") == 0) {
+        if (m_session != nullptr || argc < 3) {
+            LERROR("emmcdl_main", "-daemon参数需要指定套接字路径，且不能在守护进程中使用");
+            return PrintHelp();
+        }
+        int idle = argc > 3 ? atoi(argv[3]) : SESSION_DEFAULT_IDLE_SECONDS;
+        SessionDaemon daemon(argv[2], idle > 0 ? idle : SESSION_DEFAULT_IDLE_SECONDS);
+        return daemon.Run();
+    }
+    if (_stricmp(argv[1], "-reactorbench") == 0) {
+        int devices = argc > 2 ? atoi(argv[2]) : REACTORBENCH_DEFAULT_DEVICES;
+        int megabytes = argc > 3 ? atoi(argv[3]) : REACTORBENCH_DEFAULT_MB;
+        int threads = argc > 4 ? atoi(argv[4]) : 1;
+        return ReactorBench::Run(devices, megabytes, threads);
+    }
+    if (_stricmp(argv[1], "-poolbench") == 0) {
+        int tasks = argc > 2 ? atoi(argv[2]) : POOLBENCH_DEFAULT_TASKS;
+        int threads = argc > 3 ? atoi(argv[3]) : 0;
+        return PoolBench::Run(tasks, threads);
+    }
+    if (_stricmp(argv[1], "-connect") == 0) {
+        if (m_session != nullptr || argc < 4) {
+            LERROR("emmcdl_main", "-connect参数需要指定套接字路径和要执行的命令，且不能在守护进程中使用");
+            return PrintHelp();
+        }
+        vector<string> args = { argv[0] };
+        for (int i = 3; i < argc; i++)
+            args.push_back(argv[i]);
+        status = SessionDaemon::SendCommand(argv[2], args);
+        LINFO("emmcdl_main", fmt::format("守护进程执行完成, 状态: {}", getErrorDescription(status)));
+        return status;
+    }
+
     for (int i = 1; i < argc; i++) {
         if (_stricmp(argv[i], "-l") == 0) {
             LINFO("emmcdl_main", "开始列出所有可用的存储设备");
@@ -662,6 +817,26 @@ int emmcdl_main(int argc, char* argv[]) {
             }
         }
 
+        if (_stricmp(argv[i], "-ports") == 0 && (i + 1) < argc) {
+            string list = argv[++i];
+            size_t pos = 0;
+            while (pos < list.size()) {
+                size_t end = list.find(',', pos);
+                if (end == string::npos) end = list.size();
+                string item = list.substr(pos, end - pos);
+                const char* value = item.c_str();
+                if (_strnicmp(value, "COM", 3) == 0) value += 3;
+                if (*value) multiPorts.push_back(atoi(value));
+                pos = end + 1;
+            }
+            LINFO("emmcdl_main", "设置并行烧录的端口: %s (%d个)", list.c_str(), (int) multiPorts.size());
+        }
+
+        if (_stricmp(argv[i], "-reactor") == 0) {
+            bReactor = true;
+            LINFO("emmcdl_main", "由反应器线程驱动所有端口的Firehose会话");
+        }
+
         if (_stricmp(argv[i], "-s") == 0) {
             uiNumSectors = atoi(argv[++i]);
             LINFO("emmcdl_main", "设置镜像的扇区数: %lld", uiNumSectors);
@@ -722,6 +897,11 @@ int emmcdl_main(int argc, char* argv[]) {
             }
         }
 
+        if (_stricmp(argv[i], "-verify") == 0) {
+            m_verify = true;
+            LINFO("emmcdl_main", "设置为写入后读回校验");
+        }
+
         if (_stricmp(argv[i], "-gpt") == 0) {
             cmd = EMMC_CMD_GPT;
             LINFO("emmcdl_main", "将命令设置为读取分区表信息");
@@ -732,6 +912,35 @@ int emmcdl_main(int argc, char* argv[]) {
             LINFO("emmcdl_main", "将命令设置为读取设备信息");
         }
 
+        if (_stricmp(argv[i], "-probe") == 0) {
+            cmd = EMMC_CMD_PROBE;
+            LINFO("emmcdl_main", "将命令设置为探测端口模式");
+        }
+
+        if (_stricmp(argv[i], "-memdump") == 0) {
+            if ((i + 1) < argc) {
+                szMemDumpDir = argv[++i];
+                cmd = EMMC_CMD_MEMDUMP;
+                LINFO("emmcdl_main", "将命令设置为收集内存转储: \"%s\"", szMemDumpDir);
+            } else {
+                LERROR("emmcdl_main", "-memdump参数需要指定输出目录");
+                return PrintHelp();
+            }
+        }
+
+        if (_stricmp(argv[i], "-spd") == 0 && (i + 1) < argc) {
+            // 整个命令行作为一个参数，按空格拆分
+            string commands = argv[++i];
+            size_t pos = 0;
+            while (pos < commands.size()) {
+                size_t end = commands.find(' ', pos);
+                if (end == string::npos) end = commands.size();
+                if (end > pos) spdArgs.push_back(commands.substr(pos, end - pos));
+                pos = end + 1;
+            }
+            LINFO("emmcdl_main", "设置展讯设备上执行的spd_dump命令: %s", commands.c_str());
+        }
+
         if (_stricmp(argv[i], "-ffu") == 0) {
             if ((i + 1) < argc) {
                 szFFUImage = argv[++i];
@@ -885,10 +1094,47 @@ int emmcdl_main(int argc, char* argv[]) {
         }
     }
 
-    if (szFlashProg != NULL) {
+    if (!multiPorts.empty()) {
+        FlashJob job;
+        if (!spdArgs.empty()) {
+            // 展讯设备不经过Sahara，不需要-f
+            job.type = FLASH_JOB_SPD;
+            job.spdArgs = spdArgs;
+            FlashReport report = FlashOrchestrator::Run(multiPorts, job);
+            return report.failed ? ERROR_GEN_FAILURE : ERROR_SUCCESS;
+        }
+        if (szXMLFile[0] != NULL) {
+            job.type = FLASH_JOB_RAWPROGRAM;
+            for (DWORD j = 0; j < dwXMLCount; j++)
+                job.xmlFiles.push_back(szXMLFile[j]);
+        } else if (cmd == EMMC_CMD_LOAD_FFU) {
+            job.type = FLASH_JOB_FFU;
+            job.ffuFile = szFFUImage;
+        }
+        if (szFlashProg == NULL || (job.xmlFiles.empty() && job.ffuFile.empty())) {
+            LERROR("emmcdl_main", "-ports需要同时指定烧录内核 (-f) 和要烧录的内容 (-x 或 -ffu)");
+            return PrintHelp();
+        }
+        job.programmer = szFlashProg;
+        job.cfg = m_cfg;
+        job.sectorSize = m_sector_size;
+        job.bVerbose = m_verbose;
+        job.bReactor = bReactor;
+        FlashReport report = FlashOrchestrator::Run(multiPorts, job);
+        return report.failed ? ERROR_GEN_FAILURE : ERROR_SUCCESS;
+    }
+
+    if (m_session != nullptr && m_session->bProgrammerLoaded) {
+        // 会话里的烧录内核还在运行，不用再走一遍Sahara，也不要求客户端再指定-f
+        if (szFlashProg != NULL && m_session->programmer != szFlashProg)
+            LWARN("emmcdl_main", "会话中已经运行了烧录内核\"%s\"，忽略\"%s\"", m_session->programmer.c_str(), szFlashProg);
+        LINFO("emmcdl_main", "COM%d的会话中烧录内核已在运行，跳过加载", dnum);
+        m_emergency = true;
+        bEmergdl = true;
+    } else if (szFlashProg != NULL) {
         LINFO("emmcdl_main", "当前指定了烧录内核，尝试写入烧录内核");
         LINFO("emmcdl_main", "尝试打开端口COM%d", dnum);
-        int open_res = m_port.Open(dnum);
+        int open_res = m_port->IsOpen() ? ERROR_SUCCESS : m_port->Open(dnum);
         if (open_res != ERROR_SUCCESS) {
             LWARN("emmcdl_main", fmt::format("端口COM{}打开失败, 状态: {}", 
                 dnum, getErrorDescription(open_res)));
@@ -899,8 +1145,11 @@ int emmcdl_main(int argc, char* argv[]) {
         LINFO("emmcdl_main", "尝试加载烧录内核", dnum);
         status = LoadFlashProg(szFlashProg);
         if (status == ERROR_SUCCESS) {
-            LINFO("emmcdl_main", "等待烧录内核启动");
-            Sleep(2000);
+            // Sahara加载的烧录内核在LoadFlashProg里已经确认就绪，Dload的烧录内核由ConnectToFlashProg重试连接
+            if (m_session != nullptr) {
+                m_session->bProgrammerLoaded = true;
+                m_session->programmer = szFlashProg;
+            }
         } else {
             LWARN("emmcdl_main", fmt::format("烧录内核加载失败, 状态: {}", getErrorDescription(status)));
             LWARN("emmcdl_main", "!!!!!!!! 警告: 烧录内核加载失败, 将会尝试继续执行 !!!!!!!!");
@@ -991,6 +1240,14 @@ int emmcdl_main(int argc, char* argv[]) {
             }
             break;
 
+        case EMMC_CMD_PROBE:
+            status = ProbePorts();
+            break;
+
+        case EMMC_CMD_MEMDUMP:
+            status = CollectMemoryDump(dnum, szMemDumpDir);
+            break;
+
         case EMMC_CMD_WIPE:
             if (m_emergency) {
                 LINFO("emmcdl_main", "当前指定了烧录内核，尝试擦除磁盘布局");
@@ -1014,6 +1271,9 @@ int emmcdl_main(int argc, char* argv[]) {
         case EMMC_CMD_RESET:
             LINFO("emmcdl_main", "尝试重置设备");
             status = ResetDevice();
+            // 重置后烧录内核就不在了
+            if (m_session != nullptr)
+                m_session->Invalidate();
             break;
 
         case EMMC_CMD_RAW:
@@ -28,6 +28,7 @@
 #include "emmcdl_new/xmlparser.h"
 #include "emmcdl_new/utils.h"
 #include "emmcdl_new/partition.h"
+#include "emmcdl_new/devmonitor.h"
 #include <exception>
 
 Firehose::~Firehose() {
@@ -51,6 +52,9 @@ Firehose::Firehose(SerialPort* port, HANDLE hLogFile) {
     program_pkt = NULL;
     m_buffer_len = 0;
     m_buffer_ptr = NULL;
+    bytesWritten = 0;
+    rttCommand.Init("命令", FH_RTT_COMMAND_INITIAL_MS, FH_RTT_COMMAND_MIN_MS, FH_RTT_COMMAND_MAX_MS);
+    rttLong.Init("存储操作", FH_RTT_LONG_INITIAL_MS, FH_RTT_LONG_MIN_MS, FH_RTT_LONG_MAX_MS);
 }
 
 int Firehose::ReadData(BYTE* pOutBuf, DWORD dwBufSize, bool bXML) {
@@ -137,6 +141,7 @@ int Firehose::ConnectToFlashProg(fh_configure_t* cfg) {
         }
     }
     memset(m_payload, 0, dwMaxPacketSize);
+    DeviceMonitor::Instance().LogFirstCommand(sport->GetPortNum());
     dwBytesRead = ReadData((BYTE*) m_payload, dwMaxPacketSize, false);
 
     if ((_stricmp(cfg->MemoryName, "ufs") == 0) && (DISK_SECTOR_SIZE == 512)) {
@@ -154,11 +159,16 @@ int Firehose::ConnectToFlashProg(fh_configure_t* cfg) {
         cfg->MemoryName, cfg->ZLPAwareHost, cfg->SkipStorageInit, cfg->SkipWrite, dwMaxPacketSize);
     LTRACE("Firehose::ConnectToFlashProg", "正在发送配置数据包: \n%s", 
         string_utils::to_hex_view((char*) program_pkt, strnlen_s(program_pkt, MAX_XML_LEN)));
+    sport->SetZlpAware(cfg->ZLPAwareHost);
     status = sport->Write((BYTE*) program_pkt, strnlen_s(program_pkt, MAX_XML_LEN));
     if (status == ERROR_SUCCESS) {
+        // 配置时会初始化存储，按存储操作的超时等待
+        double start = time_utils::get_time_ms();
+        int timeout = rttLong.TimeoutMs();
         for (; retry < MAX_RETRY; retry++) {
             status = ReadStatus();
             if (status == ERROR_SUCCESS) {
+                rttLong.Sample(time_utils::get_time_ms() - start);
                 break;
             } else if (status == ERROR_INVALID_DATA) {
                 XMLParser xmlparse;
@@ -172,9 +182,14 @@ int Firehose::ConnectToFlashProg(fh_configure_t* cfg) {
                     return ConnectToFlashProg(cfg);
                 }
             }
+            if (time_utils::get_time_ms() - start >= timeout) {
+                retry = MAX_RETRY;
+                break;
+            }
         }
 
         if (retry == MAX_RETRY) {
+            rttLong.OnTimeout();
             LWARN("Firehose::ConnectToFlashProg", "错误: 设备未响应配置数据包 (固定返回 %d)", ERROR_NOT_READY);
             return ERROR_NOT_READY;
         }
@@ -187,6 +202,165 @@ int Firehose::ConnectToFlashProg(fh_configure_t* cfg) {
     return status;
 }
 
+void Firehose::FormatProgramPacket(int64_t sectorWrite, uint64_t sectors, uint8_t partNum) {
+    memset(program_pkt, 0, MAX_XML_LEN);
+    if (sectorWrite < 0) {
+        sprintf_s(program_pkt, MAX_XML_LEN,
+            "<?xml version=\"1.0\" ?>\n"
+            "<data>\n"
+            "    <program SECTOR_SIZE_IN_BYTES=\"%d\" num_partition_sectors=\"%d\" physical_partition_number=\"%d\" start_sector=\"NUM_DISK_SECTORS%d\"/>\n"
+            "</data>\n",
+            DISK_SECTOR_SIZE, (int) sectors, partNum, (int) sectorWrite);
+    } else {
+        sprintf_s(program_pkt, MAX_XML_LEN,
+            "<?xml version=\"1.0\" ?>\n"
+            "<data>\n"
+            "    <program SECTOR_SIZE_IN_BYTES=\"%d\" num_partition_sectors=\"%d\" physical_partition_number=\"%d\" start_sector=\"%d\"/>\n"
+            "</data>\n",
+            DISK_SECTOR_SIZE, (int) sectors, partNum, (int) sectorWrite);
+    }
+}
+
+int Firehose::FastCopyImage(const MappedImage* image, int64_t sectorRead, int64_t sectorWrite, uint64_t sectors, uint8_t partNum) {
+    uint64_t offset = (uint64_t) sectorRead * DISK_SECTOR_SIZE;
+    if (image == nullptr || offset > image->size()) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    LDEBUG("Firehose::FastCopyImage", "从映射的镜像\"%s\"写入: 读取偏移=0x%llx, 写入偏移=0x%llx, 扇区数=%llu, 分区号=%d",
+        image->path().c_str(), sectorRead, sectorWrite, sectors, partNum);
+
+    FormatProgramPacket(sectorWrite, sectors, partNum);
+    LTRACE("Firehose::FastCopyImage", "正在发送的数据包: \n%s", string_utils::to_hex_view((string) (char*) program_pkt));
+    int status = sport->Write((BYTE*) program_pkt, strlen(program_pkt));
+    if (status != ERROR_SUCCESS)
+        return status;
+    status = WaitStatus(rttCommand);
+
+    if (status == ERROR_SUCCESS) {
+        double st = time_utils::get_time();
+        uint64_t remain = sectors * DISK_SECTOR_SIZE;
+        while (remain > 0) {
+            DWORD bytes = (DWORD) min<uint64_t>(remain, dwMaxPacketSize);
+            uint64_t avail = image->size() - min(offset, image->size());
+            if (avail >= bytes) {
+                // 直接从映射发送，烧录同一镜像的所有设备共享同一份页缓存
+                status = sport->Write(image->data() + offset, bytes);
+            } else {
+                // 镜像末尾不足一个数据包的部分补零
+                memset(m_payload, 0, bytes);
+                memcpy(m_payload, image->data() + offset, (size_t) avail);
+                status = sport->Write(m_payload, bytes);
+            }
+            if (status != ERROR_SUCCESS)
+                break;
+            offset += bytes;
+            remain -= bytes;
+            bytesWritten += bytes;
+        }
+        LDEBUG("Firehose::FastCopyImage", "写入完成, 总大小%llu字节, 速度%.3fKB/s",
+            sectors * DISK_SECTOR_SIZE,
+            (sectors * DISK_SECTOR_SIZE / 1024.0) / max(time_utils::get_time() - st, 0.0001));
+
+        if (status == ERROR_SUCCESS) {
+            status = WaitStatus(rttLong);
+        } else {
+            // 数据没有发完，设备可能已经回了NAK，读掉这个响应，免得下一条命令读到它
+            WaitStatus(rttCommand);
+        }
+    }
+    if (status != ERROR_SUCCESS)
+        LWARN("Firehose::FastCopyImage", "从映射的镜像写入时出现错误, 状态: %s", getErrorDescription(status).c_str());
+    return status;
+}
+
+uint64_t Firehose::GetBytesWritten(void) {
+    return bytesWritten;
+}
+
+int Firehose::ResumeFlashProg(fh_configure_t* cfg, uint32_t maxPacketSize) {
+    char nop_pkt[] = "<?xml version=\"1.0\" ?><data><nop /></data>";
+
+    if (maxPacketSize == 0)
+        return ERROR_INVALID_PARAMETER;
+    dwMaxPacketSize = maxPacketSize;
+    if (m_payload == NULL || program_pkt == NULL || m_buffer == NULL) {
+        m_payload = (BYTE*) malloc(dwMaxPacketSize);
+        program_pkt = (char*) malloc(MAX_XML_LEN);
+        m_buffer = (BYTE*) malloc(dwMaxPacketSize);
+        if (m_payload == NULL || program_pkt == NULL || m_buffer == NULL) {
+            return ERROR_OUTOFMEMORY;
+        }
+    }
+    memset(m_payload, 0, dwMaxPacketSize);
+    if ((_stricmp(cfg->MemoryName, "ufs") == 0) && (DISK_SECTOR_SIZE == 512))
+        DISK_SECTOR_SIZE = 4096;
+    sport->SetZlpAware(cfg->ZLPAwareHost);
+
+    // 配置已经在之前的命令里发送过，只需要确认烧录内核还活着
+    LTRACE("Firehose::ResumeFlashProg", "正在发送的数据包: \n%s", string_utils::to_hex_view((string) nop_pkt));
+    int status = sport->Write((BYTE*) nop_pkt, sizeof(nop_pkt) - 1);
+    if (status != ERROR_SUCCESS) {
+        LWARN("Firehose::ResumeFlashProg", "发送NOP时出现错误: %s", getErrorDescription(status).c_str());
+        return status;
+    }
+    status = WaitStatus(rttCommand);
+    if (status != ERROR_SUCCESS)
+        return ERROR_NOT_READY;
+    LDEBUG("Firehose::ResumeFlashProg", "烧录内核仍在运行，使用之前协商的最大数据包大小%d", dwMaxPacketSize);
+    return ERROR_SUCCESS;
+}
+
+int Firehose::WaitReady(int timeoutMs) {
+    BYTE buf[MAX_XML_LEN];
+    double start = time_utils::get_time_ms();
+    int savedTimeout = sport->GetTimeout();
+    bool bAnswered = false;
+    auto poll = [&] { return bAnswered = PollReady(buf, sizeof(buf)); };
+
+    int status = sport->WaitReenumeration(timeoutMs, timeoutMs, 0, poll);
+    if (status != ERROR_SUCCESS) {
+        sport->SetTimeout(savedTimeout);
+        return status;
+    }
+    while (!bAnswered && time_utils::get_time_ms() - start < timeoutMs)
+        poll();
+    if (!bAnswered) {
+        sport->SetTimeout(savedTimeout);
+        LWARN("Firehose::WaitReady", "烧录内核在%d毫秒内没有响应", timeoutMs);
+        return ERROR_NOT_READY;
+    }
+
+    // 丢掉NOP的响应和启动日志，直到端口静默一段时间
+    sport->SetTimeout(FH_READY_QUIET_MS);
+    DWORD len;
+    do {
+        len = sizeof(buf);
+    } while (sport->Read(buf, &len) == ERROR_SUCCESS && len > 0 && time_utils::get_time_ms() - start < timeoutMs);
+    sport->SetTimeout(savedTimeout);
+    LDEBUG("Firehose::WaitReady", "烧录内核已就绪，耗时%.0f毫秒", time_utils::get_time_ms() - start);
+    return ERROR_SUCCESS;
+}
+
+bool Firehose::PollReady(BYTE* buf, DWORD size) {
+    char nop_pkt[] = "<?xml version=\"1.0\" ?><data><nop /></data>";
+    sport->SetTimeout(FH_READY_POLL_MS);
+    if (sport->Write((BYTE*) nop_pkt, sizeof(nop_pkt) - 1) != ERROR_SUCCESS) {
+        // 端口暂时不可用（设备可能正在断开），等一个轮询间隔再试
+        Sleep(FH_READY_POLL_MS);
+        return false;
+    }
+    DWORD len = size;
+    return sport->Read(buf, &len) == ERROR_SUCCESS && len > 0;
+}
+
+uint32_t Firehose::GetMaxPacketSize(void) {
+    return dwMaxPacketSize;
+}
+
+std::string Firehose::DescribeLatency(void) const {
+    return std::string(rttCommand.name) + ": " + rttCommand.Describe() + "; " + rttLong.name + ": " + rttLong.Describe();
+}
+
 int Firehose::DeviceReset() {
     int status = ERROR_SUCCESS;
     char reset_pkt[] = "<?xml version=\"1.0\" ?>\n"
@@ -198,6 +372,8 @@ int Firehose::DeviceReset() {
     status = sport->Write((BYTE*) reset_pkt, sizeof(reset_pkt));
     if (status != ERROR_SUCCESS)
         LWARN("Firehose::DeviceReset", "发送重置命令时出现错误: %s", getErrorDescription(status).c_str());
+    else
+        DeviceMonitor::Instance().MarkModeSwitch(sport->GetPortNum(), "Firehose重置");
     return status;
 }
 
@@ -216,6 +392,40 @@ int Firehose::ReadStatus(void) {
     return ERROR_NOT_READY;
 }
 
+int Firehose::WaitStatus(RttEstimator& rtt) {
+    double start = time_utils::get_time_ms();
+    int timeout = rtt.TimeoutMs();
+    int status;
+    while ((status = ReadStatus()) == ERROR_NOT_READY) {
+        if (time_utils::get_time_ms() - start >= timeout) {
+            rtt.OnTimeout();
+            LWARN("Firehose::WaitStatus", "设备在%d毫秒内没有响应(%s), 下次等待%d毫秒", timeout, rtt.name, rtt.TimeoutMs());
+            return ERROR_NOT_READY;
+        }
+    }
+    // NAK也是设备的响应，同样计入延迟
+    rtt.Sample(time_utils::get_time_ms() - start);
+    return status;
+}
+
+int Firehose::ReadRawData(BYTE* pOutBuf, DWORD dwBytes) {
+    DWORD offset = 0;
+    double last = time_utils::get_time_ms();
+    while (offset < dwBytes) {
+        DWORD dwBytesRead = ReadData(&pOutBuf[offset], dwBytes - offset, false);
+        double now = time_utils::get_time_ms();
+        if (dwBytesRead > 0) {
+            offset += dwBytesRead;
+            last = now;
+        } else if (now - last >= rttCommand.TimeoutMs()) {
+            rttCommand.OnTimeout();
+            LWARN("Firehose::ReadRawData", "设备在%.0f毫秒内没有发送数据, 已读取%d/%d字节", now - last, (int) offset, (int) dwBytes);
+            return ERROR_NOT_READY;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
 int Firehose::ProgramPatchEntry(PartitionEntry pe, const std::string& key) {
     UNREFERENCED_PARAMETER(pe);
     char tmp_key[MAX_STRING_LEN];
@@ -239,7 +449,7 @@ int Firehose::ProgramPatchEntry(PartitionEntry pe, const std::string& key) {
         return status;
     }
 
-    int status2 = ReadStatus();
+    int status2 = WaitStatus(rttCommand);
     if (status2 != ERROR_SUCCESS) {
         LWARN("Firehose::ProgramPatchEntry", "检查设备状态出现异常: %s", getErrorDescription(status2).c_str());
         return status2;
@@ -283,7 +493,8 @@ int Firehose::WriteData(BYTE* writeBuffer, int64_t writeOffset, DWORD writeBytes
 
     double st = time_utils::get_time();
 
-    if (ReadStatus() != ERROR_SUCCESS)
+    status = WaitStatus(rttCommand);
+    if (status != ERROR_SUCCESS)
         goto WriteSectorsExit;
 
     dwBytesRead = dwMaxPacketSize;
@@ -307,7 +518,7 @@ int Firehose::WriteData(BYTE* writeBuffer, int64_t writeOffset, DWORD writeBytes
         (int) writeBytes, (double) ((writeBytes / 1024.0) / (max(time_utils::get_time() - st, 0.0001))));
 
     LDEBUG("Firehose::WriteData", "等待设备响应");
-    status = ReadStatus();
+    status = WaitStatus(rttLong);
     LDEBUG("Firehose::WriteData", "设备响应完成, 状态: %s",
         getErrorDescription(status).c_str());
 
@@ -346,11 +557,11 @@ int Firehose::ReadData(BYTE* readBuffer, int64_t readOffset, DWORD readBytes, DW
 
     status = sport->Write((BYTE*) program_pkt, strlen(program_pkt));
 
-    while ((status = ReadStatus()) == ERROR_NOT_READY);
+    status = WaitStatus(rttCommand);
     double st = time_utils::get_time();
     DWORD bytesToRead = dwMaxPacketSize;
 
-    if (status == ERROR_INVALID_DATA)
+    if (status != ERROR_SUCCESS)
         goto ReadSectorsExit;
 
     for (uint32_t tmp_sectors = (uint32_t) readBytes / DISK_SECTOR_SIZE; tmp_sectors > 0; tmp_sectors -= (bytesToRead / DISK_SECTOR_SIZE)) {
@@ -360,11 +571,9 @@ int Firehose::ReadData(BYTE* readBuffer, int64_t readOffset, DWORD readBytes, DW
             bytesToRead = dwMaxPacketSize;
         }
 
-        DWORD offset = 0;
-        while (offset < bytesToRead) {
-            dwBytesRead = ReadData(&readBuffer[offset], bytesToRead - offset, false);
-            offset += dwBytesRead;
-        }
+        status = ReadRawData(readBuffer, bytesToRead);
+        if (status != ERROR_SUCCESS)
+            goto ReadSectorsExit;
 
         readBuffer += bytesToRead;
         *bytesRead += bytesToRead;
@@ -379,7 +588,7 @@ int Firehose::ReadData(BYTE* readBuffer, int64_t readOffset, DWORD readBytes, DW
         (int) readBytes, (double) ((readBytes / 1024.0) / max(time_utils::get_time() - st, 0.0001)));
 
     LTRACE("Firehose::ReadData", "等待设备响应");
-    status = ReadStatus();
+    status = WaitStatus(rttCommand);
     LTRACE("Firehose::ReadData", "设备响应完成, 状态: %s",
         getErrorDescription(status).c_str());
 
@@ -425,7 +634,7 @@ int Firehose::CreateGPP(DWORD dwGPP1, DWORD dwGPP2, DWORD dwGPP3, DWORD dwGPP4)
 
     status = sport->Write((BYTE*) program_pkt, strlen(program_pkt));
 
-    status = ReadStatus();
+    status = WaitStatus(rttLong);
 
     if (ReadData(m_payload, dwMaxPacketSize, false) > 0)
         LTRACE("Firehose::CreateGPP", "设备响应: \n%s", (char*) m_payload);
@@ -448,7 +657,7 @@ int Firehose::SetActivePartition(int prtn_num) {
     status = sport->Write((BYTE*) program_pkt, strlen(program_pkt));
 
     LTRACE("Firehose::SetActivePartition", "等待设备响应");
-    status = ReadStatus();
+    status = WaitStatus(rttCommand);
     LDEBUG("Firehose::SetActivePartition", "设备响应完成, 状态: %s",
         getErrorDescription(status).c_str());
 
@@ -507,21 +716,7 @@ int Firehose::FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t
 
     memset(program_pkt, 0, MAX_XML_LEN);
     if (hWrite == hDisk) {
-        if (sectorWrite < 0) {
-            sprintf_s(program_pkt, MAX_XML_LEN,
-                "<?xml version=\"1.0\" ?>\n"
-                "<data>\n"
-                "    <program SECTOR_SIZE_IN_BYTES=\"%d\" num_partition_sectors=\"%d\" physical_partition_number=\"%d\" start_sector=\"NUM_DISK_SECTORS%d\"/>\n"
-                "</data>\n",
-                DISK_SECTOR_SIZE, (int) sectors, partNum, (int) sectorWrite);
-        } else {
-            sprintf_s(program_pkt, MAX_XML_LEN,
-                "<?xml version=\"1.0\" ?>\n"
-                "<data>\n"
-                "    <program SECTOR_SIZE_IN_BYTES=\"%d\" num_partition_sectors=\"%d\" physical_partition_number=\"%d\" start_sector=\"%d\"/>\n"
-                "</data>\n",
-                DISK_SECTOR_SIZE, (int) sectors, partNum, (int) sectorWrite);
-        }
+        FormatProgramPacket(sectorWrite, sectors, partNum);
     } else {
         sprintf_s(program_pkt, MAX_XML_LEN,
             "<?xml version=\"1.0\" ?>\n"
@@ -534,7 +729,7 @@ int Firehose::FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t
     LTRACE("Firehose::FastCopy", "正在发送的数据包: \n%s", string_utils::to_hex_view((string) (char*) program_pkt));
     status = sport->Write((BYTE*) program_pkt, strlen(program_pkt));
 
-    while ((status = ReadStatus()) == ERROR_NOT_READY);
+    status = WaitStatus(rttCommand);
 
     if (status == ERROR_SUCCESS) {
         double st = time_utils::get_time();
@@ -554,6 +749,7 @@ int Firehose::FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t
                     if (status != ERROR_SUCCESS) {
                         break;
                     }
+                    bytesWritten += bytesToRead;
                     dwWriteOffset += dwBytesRead;
                 } else {
                     status = GetLastError();
@@ -561,10 +757,9 @@ int Firehose::FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t
                 }
 
             } else {
-                DWORD offset = 0;
-                while (offset < bytesToRead) {
-                    dwBytesRead = ReadData(&m_payload[offset], bytesToRead - offset, false);
-                    offset += dwBytesRead;
+                status = ReadRawData(m_payload, bytesToRead);
+                if (status != ERROR_SUCCESS) {
+                    break;
                 }
                 if (!WriteFile(hWrite, m_payload, bytesToRead, &dwBytesRead, NULL)) {
                     status = GetLastError();
@@ -585,7 +780,8 @@ int Firehose::FastCopy(HANDLE hRead, int64_t sectorRead, HANDLE hWrite, int64_t
     }
 
     if (status == ERROR_SUCCESS) {
-        status = ReadStatus();
+        // 写入后的最终响应要等设备刷新，读取后的只是确认
+        status = WaitStatus(hWrite == hDisk ? rttLong : rttCommand);
     }
     if (status != ERROR_SUCCESS) {
         LWARN("Firehose::FastCopy", "快速拷贝过程中出现错误, 状态: %s",
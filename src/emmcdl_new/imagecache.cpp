@@ -0,0 +1,144 @@
+#include "emmcdl_new/imagecache.h"
+#include "utils/logger.h"
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+std::mutex ImageCache::mtx;
+std::map<std::string, std::weak_ptr<MappedImage>> ImageCache::images;
+
+
+MappedImage::MappedImage() {
+    base = nullptr;
+    length = 0;
+    mtime = 0;
+#ifdef _WIN32
+    hFile = INVALID_HANDLE_VALUE;
+    hMapping = NULL;
+#else
+    fd = -1;
+#endif
+}
+
+
+MappedImage::~MappedImage() {
+    Unmap();
+}
+
+
+int MappedImage::Map(const string& path) {
+    Unmap();
+    filePath = path;
+#ifdef _WIN32
+    hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return GetLastError();
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize)) {
+        int status = GetLastError();
+        Unmap();
+        return status;
+    }
+    length = fileSize.QuadPart;
+    if (length == 0) return ERROR_SUCCESS;
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL) {
+        int status = GetLastError();
+        Unmap();
+        return status;
+    }
+    base = (const uint8_t*) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (base == nullptr) {
+        int status = GetLastError();
+        Unmap();
+        return status;
+    }
+#else
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return ERROR_OPEN_FAILED;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        Unmap();
+        return ERROR_OPEN_FAILED;
+    }
+    length = st.st_size;
+    if (length == 0) return ERROR_SUCCESS;
+    void* p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        Unmap();
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    base = (const uint8_t*) p;
+#endif
+    return ERROR_SUCCESS;
+}
+
+
+void MappedImage::Unmap() {
+#ifdef _WIN32
+    if (base) UnmapViewOfFile(base);
+    if (hMapping) CloseHandle(hMapping);
+    if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+    hMapping = NULL;
+    hFile = INVALID_HANDLE_VALUE;
+#else
+    if (base) munmap((void*) base, length);
+    if (fd >= 0) close(fd);
+    fd = -1;
+#endif
+    base = nullptr;
+    length = 0;
+}
+
+
+shared_ptr<MappedImage> ImageCache::Get(const string& path, int* status) {
+    error_code ec;
+    filesystem::path fsPath = filesystem::absolute(path, ec);
+    string key = ec ? path : fsPath.lexically_normal().string();
+    auto writeTime = filesystem::last_write_time(path, ec);
+    int64_t mtime = ec ? 0 : (int64_t) writeTime.time_since_epoch().count();
+    uint64_t fileSize = ec ? 0 : filesystem::file_size(path, ec);
+
+    lock_guard<mutex> lock(mtx);
+    // 顺便清理已经没有使用者的条目
+    for (auto i = images.begin(); i != images.end();) {
+        if (i->second.expired()) {
+            i = images.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    auto it = images.find(key);
+    if (it != images.end()) {
+        shared_ptr<MappedImage> cached = it->second.lock();
+        // 文件被替换过就重新映射，正在使用旧映射的会话不受影响
+        if (!cached) {
+            LDEBUG("ImageCache::Get", "映射已经没有使用者，重新映射: %s", key.c_str());
+        } else if (cached->mtime == mtime && cached->size() == fileSize) {
+            if (status) *status = ERROR_SUCCESS;
+            return cached;
+        } else {
+            LDEBUG("ImageCache::Get", "文件已改变，重新映射: %s", key.c_str());
+        }
+        images.erase(it);
+    }
+
+    auto image = make_shared<MappedImage>();
+    int ret = image->Map(path);
+    if (status) *status = ret;
+    if (ret != ERROR_SUCCESS) {
+        LWARN("ImageCache::Get", "映射文件失败: %s，错误代码: %d", path.c_str(), ret);
+        return nullptr;
+    }
+    image->mtime = mtime;
+    images[key] = image;
+    LDEBUG("ImageCache::Get", "已映射文件: %s，大小: %lld字节", key.c_str(), image->size());
+    return image;
+}
+
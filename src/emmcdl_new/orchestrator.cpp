@@ -0,0 +1,326 @@
+#include "emmcdl_new/orchestrator.h"
+#include "emmcdl_new/sahara.h"
+#include "emmcdl_new/ffu.h"
+#include "emmcdl_new/devmonitor.h"
+#include "emmcdl_new/sparse.h"
+#include "emmcdl_new/utils.h"
+#include "spddump/spd_dump.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <thread>
+
+using namespace std;
+
+
+#define MB  (1024.0 * 1024.0)
+#define GB  (1024.0 * 1024.0 * 1024.0)
+
+
+FlashReport FlashOrchestrator::Run(const vector<int>& ports, const FlashJob& job) {
+    FlashReport report;
+    report.devices.resize(ports.size());
+
+    LINFO("FlashOrchestrator::Run", "开始同时烧录%d个设备", (int) ports.size());
+    double start = time_utils::get_time();
+    double cpuStart = time_utils::get_cpu_time();
+    UsbScheduler scheduler;
+    // 反应器模式下工作线程只负责Sahara，镜像在所有烧录内核都运行之后由反应器写入
+    vector<shared_ptr<MappedImage>> images;
+    vector<FirehoseWrite> writes;
+    bool bReactor = job.bReactor && job.type == FLASH_JOB_RAWPROGRAM && CollectWrites(job, images, writes) == ERROR_SUCCESS;
+    if (job.bReactor && !bReactor)
+        LWARN("FlashOrchestrator::Run", "这个任务不能由反应器驱动，改为每个设备一个工作线程");
+    vector<thread> workers;
+    for (size_t i = 0; i < ports.size(); i++) {
+        DeviceFlashResult& d = report.devices[i];
+        d.port = ports[i];
+        UsbDeviceInfo info;
+        if (DeviceMonitor::Instance().FindByPort(ports[i], &info)) {
+            d.controller = info.controller;
+            d.portPath = info.portPath;
+        }
+        LDEBUG("FlashOrchestrator::Run", "COM%d: 主控制器\"%s\", 端口路径\"%s\"", d.port, d.controller.c_str(), d.portPath.c_str());
+        auto worker = job.type == FLASH_JOB_SPD ? &FlashOrchestrator::FlashOneSpd :
+            bReactor ? &FlashOrchestrator::BootOne : &FlashOrchestrator::FlashOne;
+        workers.emplace_back(worker, cref(job), &scheduler, ref(d));
+    }
+    for (auto& t : workers) t.join();
+    if (bReactor)
+        RunReactor(job, writes, report);
+    report.seconds = time_utils::get_time() - start;
+    report.cpuSeconds = time_utils::get_cpu_time() - cpuStart;
+
+    for (auto& d : report.devices) {
+        report.totalBytes += d.bytes;
+        if (d.status != ERROR_SUCCESS) report.failed++;
+    }
+    LogReport(report);
+    return report;
+}
+
+
+int FlashOrchestrator::LoadProgrammer(SerialPort& sport, const FlashJob& job, DeviceFlashResult& result) {
+    int status = sport.Open(result.port);
+    if (status != ERROR_SUCCESS) {
+        LWARN("FlashOrchestrator::LoadProgrammer", "COM%d打开失败: %s", result.port, getErrorDescription(status).c_str());
+        return status;
+    }
+    Sahara sh(&sport);
+    if (sh.ConnectToDevice(true, 0) != ERROR_SUCCESS)
+        LWARN("FlashOrchestrator::LoadProgrammer", "COM%d: 通过Sahara协议连接设备出错，将会尝试继续", result.port);
+    status = sh.LoadFlashProg(job.programmer);
+    if (status != ERROR_SUCCESS) {
+        LWARN("FlashOrchestrator::LoadProgrammer", "COM%d: 烧录内核加载失败: %s", result.port, getErrorDescription(status).c_str());
+        return status;
+    }
+    // 和emmcdl_main一样等烧录内核响应NOP，反应器模式下反应器按这里得到的端口号重新打开
+    Firehose fh(&sport);
+    status = fh.WaitReady(FH_READY_TIMEOUT_MS);
+    if (status != ERROR_SUCCESS)
+        LWARN("FlashOrchestrator::LoadProgrammer", "COM%d: 烧录内核没有就绪: %s", result.port, getErrorDescription(status).c_str());
+    result.port = sport.GetPortNum();
+    return status;
+}
+
+
+void FlashOrchestrator::FlashOne(const FlashJob& job, UsbScheduler* scheduler, DeviceFlashResult& result) {
+    double start = time_utils::get_time();
+    SerialPort sport;
+    result.status = LoadProgrammer(sport, job, result);
+    if (result.status != ERROR_SUCCESS) {
+        result.seconds = time_utils::get_time() - start;
+        return;
+    }
+
+    Firehose fh(&sport);
+    fh.SetDiskSectorSize(job.sectorSize);
+    if (job.bVerbose)
+        fh.EnableVerbose();
+    fh_configure_t cfg = job.cfg;
+    result.status = fh.ConnectToFlashProg(&cfg);
+    result.setupSeconds = time_utils::get_time() - start;
+    if (result.status == ERROR_SUCCESS) {
+        // 到这里为止都是轻量的交互，镜像传输才需要按主控制器排队
+        UsbPhaseTicket ticket = scheduler->Begin(result.controller, USB_PHASE_BULK);
+        result.queuedSeconds = ticket.waited;
+        double transferStart = time_utils::get_time();
+        if (job.type == FLASH_JOB_FFU) {
+            FFUImage ffu;
+            result.status = ffu.PreLoadImage(job.ffuFile);
+            if (result.status == ERROR_SUCCESS)
+                result.status = ffu.ProgramImage(&fh, 0);
+            ffu.CloseFFUFile();
+        } else {
+            result.status = ProgramRawFiles(fh, job);
+        }
+        scheduler->End(ticket, fh.GetBytesWritten(), time_utils::get_time() - transferStart);
+    }
+    result.bytes = fh.GetBytesWritten();
+    result.seconds = time_utils::get_time() - start;
+    result.latency = fh.DescribeLatency();
+    LINFO("FlashOrchestrator::FlashOne", "COM%d完成, 状态: %s", result.port, getErrorDescription(result.status).c_str());
+}
+
+
+void FlashOrchestrator::FlashOneSpd(const FlashJob& job, UsbScheduler* scheduler, DeviceFlashResult& result) {
+    double start = time_utils::get_time();
+    // 每个设备一个spd_dump会话，出错时只结束这个会话
+#if USE_LIBUSB
+    string port = result.portPath;      // libusb版本按USB端口路径选择设备
+#else
+    string port = to_string(result.port);
+#endif
+    vector<string> args = { "spd_dump", "--port", port, "--batch" };
+    args.insert(args.end(), job.spdArgs.begin(), job.spdArgs.end());
+    vector<char*> argv;
+    for (auto& a : args) argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+
+    // 展讯会话分不出准备和传输阶段，整个会话按主控制器排队
+    UsbPhaseTicket ticket = scheduler->Begin(result.controller, USB_PHASE_BULK);
+    result.queuedSeconds = ticket.waited;
+    double sessionStart = time_utils::get_time();
+    int ret = spddump_main((int) args.size(), argv.data());
+    scheduler->End(ticket, 0, time_utils::get_time() - sessionStart);
+    result.status = ret == 0 ? ERROR_SUCCESS : ERROR_GEN_FAILURE;
+    result.seconds = time_utils::get_time() - start;
+    LINFO("FlashOrchestrator::FlashOneSpd", "COM%d完成, 状态: %s", result.port, getErrorDescription(result.status).c_str());
+}
+
+
+void FlashOrchestrator::BootOne(const FlashJob& job, UsbScheduler* scheduler, DeviceFlashResult& result) {
+    double start = time_utils::get_time();
+    {
+        // 端口在这里关闭，之后由反应器以非阻塞方式重新打开
+        SerialPort sport;
+        result.status = LoadProgrammer(sport, job, result);
+    }
+    result.setupSeconds = result.seconds = time_utils::get_time() - start;
+}
+
+
+int FlashOrchestrator::CollectWrites(const FlashJob& job, vector<shared_ptr<MappedImage>>& images, vector<FirehoseWrite>& writes) {
+    uint64_t sectorSize = job.sectorSize > 0 ? job.sectorSize : 512;
+    for (auto& file : job.xmlFiles) {
+        Partition rawprg(0);
+        int status = rawprg.PreLoadImage(file);
+        if (status != ERROR_SUCCESS)
+            return status;
+        PartitionEntry pe;
+        string keyName, key;
+        while (rawprg.GetNextXMLKey(keyName, key) == ERROR_SUCCESS) {
+            status = rawprg.ParseXMLKey(key, &pe);
+            if (status == ERROR_SUCCESS && pe.eCmd == CMD_NOP)
+                continue;
+            // 反应器只会写普通的镜像，擦除、读取和其他命令仍由Partition::ProgramImage处理
+            if (status != ERROR_SUCCESS || pe.eCmd != CMD_PROGRAM || pe.filename == "ZERO") {
+                LDEBUG("FlashOrchestrator::CollectWrites", "%s中有反应器不支持的条目: %s", file.c_str(), key.c_str());
+                return ERROR_NOT_SUPPORTED;
+            }
+            SparseImage sparse;
+            if (sparse.PreLoadImage(pe.filename) == ERROR_SUCCESS) {
+                LDEBUG("FlashOrchestrator::CollectWrites", "%s是稀疏文件，反应器不支持", pe.filename.c_str());
+                return ERROR_NOT_SUPPORTED;
+            }
+            shared_ptr<MappedImage> image = ImageCache::Get(pe.filename, &status);
+            if (image == nullptr)
+                return status;
+            uint64_t offset = pe.offset == (uint64_t) -1 ? 0 : pe.offset * sectorSize;
+            if (offset > image->size())
+                return ERROR_INVALID_PARAMETER;
+            // 和ProgramPartitionEntry一样，写入的扇区数不超过文件实际大小
+            uint64_t size = image->size() - offset;
+            if (pe.num_sectors < (size + sectorSize - 1) / sectorSize)
+                size = pe.num_sectors * sectorSize;
+            if (size == 0)
+                continue;
+            writes.push_back({ image->data() + offset, size, (int64_t) pe.start_sector, pe.physical_partition_number });
+            images.push_back(image);
+        }
+    }
+    LDEBUG("FlashOrchestrator::CollectWrites", "反应器将写入%d个区域", (int) writes.size());
+    return ERROR_SUCCESS;
+}
+
+
+void FlashOrchestrator::RunReactor(const FlashJob& job, const vector<FirehoseWrite>& writes, FlashReport& report) {
+    size_t count = report.devices.size();
+    vector<io_handle_t> handles(count, INVALID_IO_HANDLE);
+    vector<unique_ptr<FirehoseProgramTask>> tasks(count);
+    uint64_t total = 0;
+    for (auto& w : writes) total += w.size;
+
+    double start = time_utils::get_time();
+    int status;
+    {
+        Reactor reactor;
+        for (size_t i = 0; i < count; i++) {
+            DeviceFlashResult& d = report.devices[i];
+            if (d.status != ERROR_SUCCESS) continue;
+            d.status = Reactor::OpenPort(d.port, &handles[i]);
+            if (d.status != ERROR_SUCCESS) {
+                LWARN("FlashOrchestrator::RunReactor", "COM%d打开失败: %s", d.port, getErrorDescription(d.status).c_str());
+                continue;
+            }
+            tasks[i].reset(new FirehoseProgramTask("COM" + to_string(d.port), job.cfg, job.sectorSize, writes));
+            d.status = reactor.Add(handles[i], tasks[i].get());
+        }
+        LINFO("FlashOrchestrator::RunReactor", "由一个反应器线程驱动%d个设备的Firehose会话", (int) reactor.Active());
+        status = reactor.Run();
+    }
+    double seconds = time_utils::get_time() - start;
+
+    for (size_t i = 0; i < count; i++) {
+        DeviceFlashResult& d = report.devices[i];
+        if (handles[i] != INVALID_IO_HANDLE)
+            Reactor::ClosePort(handles[i]);
+        if (tasks[i] == nullptr) continue;
+        d.bytes = tasks[i]->BytesWritten();
+        d.seconds = d.setupSeconds + seconds;
+        if (d.status == ERROR_SUCCESS) {
+            d.status = tasks[i]->Status();
+            // 反应器出错退出时，没有结束的任务也没有写完
+            if (d.status == ERROR_SUCCESS && d.bytes < total)
+                d.status = status != ERROR_SUCCESS ? status : ERROR_GEN_FAILURE;
+        }
+    }
+
+    // patch和活动分区的数据量很小，仍然用阻塞的Firehose写入
+    vector<thread> workers;
+    for (size_t i = 0; i < count; i++) {
+        if (tasks[i] != nullptr && report.devices[i].status == ERROR_SUCCESS)
+            workers.emplace_back(&FlashOrchestrator::PatchOne, cref(job), tasks[i]->MaxPayload(), ref(report.devices[i]));
+    }
+    for (auto& t : workers) t.join();
+    for (auto& d : report.devices)
+        LINFO("FlashOrchestrator::RunReactor", "COM%d完成, 状态: %s", d.port, getErrorDescription(d.status).c_str());
+}
+
+
+void FlashOrchestrator::PatchOne(const FlashJob& job, uint32_t maxPayload, DeviceFlashResult& result) {
+    double start = time_utils::get_time();
+    SerialPort sport;
+    result.status = sport.Open(result.port);
+    if (result.status == ERROR_SUCCESS) {
+        Firehose fh(&sport);
+        fh.SetDiskSectorSize(job.sectorSize);
+        if (job.bVerbose)
+            fh.EnableVerbose();
+        fh_configure_t cfg = job.cfg;
+        // 配置已经由FirehoseProgramTask完成，只需要确认烧录内核还在运行
+        result.status = fh.ResumeFlashProg(&cfg, maxPayload);
+        if (result.status == ERROR_SUCCESS)
+            result.status = ProgramRawFiles(fh, job, true);
+        result.latency = fh.DescribeLatency();
+    }
+    if (result.status != ERROR_SUCCESS)
+        LWARN("FlashOrchestrator::PatchOne", "COM%d: 写入patch失败: %s", result.port, getErrorDescription(result.status).c_str());
+    result.seconds += time_utils::get_time() - start;
+}
+
+
+int FlashOrchestrator::ProgramRawFiles(Firehose& fh, const FlashJob& job, bool bPatchesOnly) {
+    int status = ERROR_SUCCESS;
+    for (auto& file : job.xmlFiles) {
+        if (!bPatchesOnly) {
+            Partition rawprg(0);
+            status = rawprg.PreLoadImage(file);
+            if (status != ERROR_SUCCESS)
+                return status;
+            status = rawprg.ProgramImage(&fh);
+            if (status != ERROR_SUCCESS)
+                return status;
+        }
+
+        // 和EDownloadProgram一样，rawprogramN.xml旁边的patchN.xml也要写入
+        if (file.find("rawprogram") != string::npos) {
+            char szPatchFile[MAX_STRING_LEN];
+            strncpy_s(szPatchFile, file.c_str(), sizeof(szPatchFile));
+            StringReplace(szPatchFile, "rawprogram", "patch");
+            Partition patch(0);
+            if (patch.PreLoadImage(szPatchFile) == ERROR_SUCCESS)
+                patch.ProgramImage(&fh);
+        }
+    }
+    if (job.cfg.ActivePartition >= 0)
+        status = fh.SetActivePartition(job.cfg.ActivePartition);
+    return status;
+}
+
+
+void FlashOrchestrator::LogReport(const FlashReport& report) {
+    for (auto& d : report.devices) {
+        double transfer = d.seconds - d.setupSeconds - d.queuedSeconds;
+        LINFO("FlashOrchestrator", "COM%-3d [%s %s] %-24s 写入%9.1fMB, 准备%6.1f秒, 排队%6.1f秒, 传输%7.1f秒, %7.2fMB/s",
+            d.port, d.controller.c_str(), d.portPath.c_str(), getErrorDescription(d.status).c_str(), d.bytes / MB,
+            d.setupSeconds, d.queuedSeconds, transfer, transfer > 0 ? d.bytes / MB / transfer : 0.0);
+        if (!d.latency.empty())
+            LDEBUG("FlashOrchestrator", "COM%-3d 响应延迟: %s", d.port, d.latency.c_str());
+    }
+    double gb = report.totalBytes / GB;
+    LINFO("FlashOrchestrator", "总计: %d个设备 (失败%d个), 写入%.2fGB, 用时%.1f秒, 总吞吐量%.2fMB/s",
+        (int) report.devices.size(), report.failed, gb, report.seconds,
+        report.seconds > 0 ? report.totalBytes / MB / report.seconds : 0.0);
+    LINFO("FlashOrchestrator", "主机CPU时间%.2f秒, 每GB %.2f秒",
+        report.cpuSeconds, gb > 0 ? report.cpuSeconds / gb : 0.0);
+}
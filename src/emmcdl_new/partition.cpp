@@ -3,6 +3,7 @@
 #include "emmcdl_new/partition.h"
 #include "emmcdl_new/protocol.h"
 #include "emmcdl_new/sparse.h"
+#include "emmcdl_new/imagecache.h"
 #include "emmcdl_new/utils.h"
 #include "utils/string_utils.h"
 #include "utils/logger.h"
@@ -315,6 +316,7 @@ int Partition::ParseXMLKey(const string& line, PartitionEntry* pe) {
 
 int Partition::ProgramPartitionEntry(Protocol* proto, PartitionEntry pe, const string& key) {
     HANDLE hRead = INVALID_HANDLE_VALUE;
+    std::shared_ptr<MappedImage> image;
     bool bSparse = false;
     int status = ERROR_SUCCESS;
 
@@ -336,20 +338,31 @@ int Partition::ProgramPartitionEntry(Protocol* proto, PartitionEntry pe, const s
             LDEBUG("Partition::ProgramPartitionEntry", "当前filename不是ZERO且不是稀疏文件");
             // Open the file that we are supposed to dump
             status = ERROR_SUCCESS;
-            hRead = CreateFileA(pe.filename.c_str(),
-                GENERIC_READ,
-                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                NULL,
-                OPEN_EXISTING,
-                FILE_ATTRIBUTE_NORMAL,
-                NULL);
-            if (hRead == INVALID_HANDLE_VALUE) {
+            // 协议支持时从共享的映射读取，同时烧录多个设备时镜像只需要从磁盘读取一次
+            if (proto->SupportsImageCopy()) {
+                image = ImageCache::Get(pe.filename);
+            }
+            if (image == nullptr) {
+                hRead = CreateFileA(pe.filename.c_str(),
+                    GENERIC_READ,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                    NULL,
+                    OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL,
+                    NULL);
+            }
+            if (image == nullptr && hRead == INVALID_HANDLE_VALUE) {
                 status = GetLastError();
             } else {
                 // Update the number of sectors based on real file size, rounded to next sector offset
-                DWORD dwUpperFileSize = 0;
-                DWORD dwLowerFileSize = GetFileSize(hRead, &dwUpperFileSize);
-                int64_t dwTotalSize = dwLowerFileSize + ((int64_t) dwUpperFileSize << 32);
+                int64_t dwTotalSize;
+                if (image != nullptr) {
+                    dwTotalSize = (int64_t) image->size();
+                } else {
+                    DWORD dwUpperFileSize = 0;
+                    DWORD dwLowerFileSize = GetFileSize(hRead, &dwUpperFileSize);
+                    dwTotalSize = dwLowerFileSize + ((int64_t) dwUpperFileSize << 32);
+                }
                 dwTotalSize = (dwTotalSize + proto->GetDiskSectorSize() - 1) & (int64_t) ~(proto->GetDiskSectorSize() - 1);
                 dwTotalSize = dwTotalSize / proto->GetDiskSectorSize();
                 if (dwTotalSize <= (int64_t) pe.num_sectors) {
@@ -369,14 +382,19 @@ int Partition::ProgramPartitionEntry(Protocol* proto, PartitionEntry pe, const s
         LDEBUG("Partition::ProgramPartitionEntry", "开始使用FastCopy写入分区数据");
         LDEBUG("Partition::ProgramPartitionEntry", "参数：offset=%llu start_sector=%llu num_sectors=%llu",
             pe.offset, pe.start_sector, pe.num_sectors);
-        status = proto->FastCopy(hRead, pe.offset, proto->GetDiskHandle(), pe.start_sector, pe.num_sectors, pe.physical_partition_number);
+        if (image != nullptr) {
+            status = proto->FastCopyImage(image.get(), pe.offset, pe.start_sector, pe.num_sectors, pe.physical_partition_number);
+        } else {
+            status = proto->FastCopy(hRead, pe.offset, proto->GetDiskHandle(), pe.start_sector, pe.num_sectors, pe.physical_partition_number);
+        }
         if (status != ERROR_SUCCESS) {
             LWARN("Partition::ProgramPartitionEntry", "FastCopy写入分区数据失败，状态：%s",
             getErrorDescription(status).c_str());
         } else {
             LDEBUG("Partition::ProgramPartitionEntry", "FastCopy写入分区数据成功");
         }
-        CloseHandle(hRead);
+        if (hRead != INVALID_HANDLE_VALUE)
+            CloseHandle(hRead);
     }
     return status;
 }
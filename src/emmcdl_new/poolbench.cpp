@@ -0,0 +1,156 @@
+#include "emmcdl_new/poolbench.h"
+#include "emmcdl_new/utils.h"
+#include "datatypes/thread.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+
+// 每个任务启动一个Thread，按线程数分批，每批全部结束后再启动下一批
+static void RunThreads(int count, int threads, const function<void(int)>& job) {
+    for (int base = 0; base < count; base += threads) {
+        int n = min(threads, count - base);
+        vector<unique_ptr<Thread>> wave;
+        for (int i = 0; i < n; i++) {
+            wave.emplace_back(new Thread());
+            wave.back()->start([&job, base, i]() { job(base + i); });
+        }
+        for (auto& t : wave) t->join();
+    }
+}
+
+
+// 输出线程池的统计信息
+static void LogStats(const char* workload, const ThreadPool& pool) {
+    ThreadPoolStats stats = pool.stats();
+    uint64_t steals = 0;
+    double idle = 0;
+    for (auto& w : stats.workers) {
+        steals += w.steals;
+        idle += w.idleSeconds;
+    }
+    LINFO("PoolBench", "%s: 提交%llu个任务, 窃取%llu次, 等待线程帮忙执行%llu个, 工作线程共空闲%.3f秒",
+        workload, (unsigned long long) stats.submitted, (unsigned long long) steals,
+        (unsigned long long) stats.helped, idle);
+}
+
+
+uint64_t PoolBench::Hash(const uint8_t* data, size_t len) {
+    // FNV-1a，只是为了有一定的计算量
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+size_t PoolBench::Compress(const uint8_t* data, size_t len, uint8_t* out) {
+    // 简单的行程编码：(长度, 字节)，输出最多是输入的两倍
+    size_t o = 0;
+    for (size_t i = 0; i < len;) {
+        size_t run = 1;
+        while (i + run < len && run < 255 && data[i + run] == data[i]) run++;
+        out[o++] = (uint8_t) run;
+        out[o++] = data[i];
+        i += run;
+    }
+    return o;
+}
+
+
+int PoolBench::Run(int tasks, int threads) {
+    tasks = max(tasks, 1);
+    if (threads <= 0) threads = (int) max(1u, thread::hardware_concurrency());
+    LINFO("PoolBench::Run", "%d个独立哈希任务, %d个数据块的流水线, %d个工作线程", tasks, POOLBENCH_CHUNKS, threads);
+
+    const size_t chunkSize = POOLBENCH_CHUNK_SIZE;
+    vector<uint8_t> source(max((size_t) tasks * POOLBENCH_JOB_SIZE, chunkSize * POOLBENCH_CHUNKS));
+    for (size_t i = 0; i < source.size(); i++) source[i] = (uint8_t) ((i / 7) * 13);
+    bool bMatch = true;
+
+    // 独立的小任务
+    vector<uint64_t> hashThreads(tasks), hashPool(tasks);
+    auto hashJob = [&](vector<uint64_t>& out, int i) {
+        out[i] = Hash(source.data() + (size_t) i * POOLBENCH_JOB_SIZE, POOLBENCH_JOB_SIZE);
+    };
+    double start = time_utils::get_time();
+    RunThreads(tasks, threads, [&](int i) { hashJob(hashThreads, i); });
+    double threadSeconds = time_utils::get_time() - start;
+
+    {
+        ThreadPool pool(threads);
+        start = time_utils::get_time();
+        for (int i = 0; i < tasks; i++)
+            pool.submit([&, i]() { hashJob(hashPool, i); });
+        pool.wait();
+        double poolSeconds = time_utils::get_time() - start;
+        LINFO("PoolBench", "独立任务: Thread %.3f秒, 线程池 %.3f秒, 加速%.2f倍",
+            threadSeconds, poolSeconds, threadSeconds / max(poolSeconds, 0.000001));
+        LogStats("独立任务", pool);
+    }
+    if (hashThreads != hashPool) {
+        LERROR("PoolBench::Run", "独立任务的结果不一致");
+        bMatch = false;
+    }
+
+    // 流水线：哈希和压缩都依赖读取，写入依赖压缩
+    struct Chunk {
+        vector<uint8_t> buffer, packed, written;
+        uint64_t hash = 0;
+        size_t packedSize = 0;
+    };
+    auto read = [&](Chunk& c, int i) {
+        c.buffer.resize(chunkSize);
+        memcpy(c.buffer.data(), source.data() + (size_t) i * chunkSize, chunkSize);
+    };
+    auto hash = [&](Chunk& c) { c.hash = Hash(c.buffer.data(), c.buffer.size()); };
+    auto compress = [&](Chunk& c) {
+        c.packed.resize(chunkSize * 2);
+        c.packedSize = Compress(c.buffer.data(), c.buffer.size(), c.packed.data());
+    };
+    auto write = [&](Chunk& c) { c.written.assign(c.packed.begin(), c.packed.begin() + c.packedSize); };
+
+    vector<Chunk> chunksThreads(POOLBENCH_CHUNKS), chunksGraph(POOLBENCH_CHUNKS);
+    start = time_utils::get_time();
+    RunThreads(POOLBENCH_CHUNKS, threads, [&](int i) { read(chunksThreads[i], i); });
+    RunThreads(POOLBENCH_CHUNKS * 2, threads, [&](int i) {
+        if (i % 2) hash(chunksThreads[i / 2]);
+        else compress(chunksThreads[i / 2]);
+    });
+    RunThreads(POOLBENCH_CHUNKS, threads, [&](int i) { write(chunksThreads[i]); });
+    threadSeconds = time_utils::get_time() - start;
+
+    {
+        ThreadPool pool(threads);
+        TaskGraph graph;
+        for (int i = 0; i < POOLBENCH_CHUNKS; i++) {
+            Chunk& c = chunksGraph[i];
+            string name = "chunk" + to_string(i);
+            TaskGraph::NodeId r = graph.add(name + ".read", [&, i]() { read(c, i); });
+            graph.add(name + ".hash", [&]() { hash(c); }, { r });
+            TaskGraph::NodeId p = graph.add(name + ".compress", [&]() { compress(c); }, { r });
+            graph.add(name + ".write", [&]() { write(c); }, { p });
+        }
+        start = time_utils::get_time();
+        if (!graph.run(pool)) {
+            LERROR("PoolBench::Run", "流水线执行失败: %s", graph.error().c_str());
+            bMatch = false;
+        }
+        double graphSeconds = time_utils::get_time() - start;
+        LINFO("PoolBench", "流水线: Thread %.3f秒, 任务图 %.3f秒, 加速%.2f倍",
+            threadSeconds, graphSeconds, threadSeconds / max(graphSeconds, 0.000001));
+        LogStats("流水线", pool);
+    }
+    for (int i = 0; i < POOLBENCH_CHUNKS; i++) {
+        if (chunksThreads[i].hash != chunksGraph[i].hash || chunksThreads[i].written != chunksGraph[i].written) {
+            LERROR("PoolBench::Run", "第%d个数据块的流水线结果不一致", i);
+            bMatch = false;
+        }
+    }
+    return bMatch ? ERROR_SUCCESS : ERROR_GEN_FAILURE;
+}
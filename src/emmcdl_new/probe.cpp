@@ -0,0 +1,187 @@
+#include "emmcdl_new/probe.h"
+#include "emmcdl_new/sahara.h"
+#include "emmcdl_new/dload.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include "utils/usb_utils.h"
+#include "utils/string_utils.h"
+#include <thread>
+
+using namespace std;
+
+
+#define PROBE_LISTEN_MS     150     // 等待Sahara主动发送Hello的时间
+#define PROBE_REPLY_MS      200     // 每个主动探测等待响应的时间
+#define PROBE_GAP_MS        10      // 收到第一个字节后等待剩余数据的时间
+
+static const char FIREHOSE_NOP[] = "<?xml version=\"1.0\" ?><data><nop /></data>";
+
+// 主动探测的种类
+enum probe_kind_e {
+    PROBE_KIND_SPD_BAUD,
+    PROBE_KIND_HDLC_NOP,
+    PROBE_KIND_FIREHOSE_NOP
+};
+
+
+static bool NameContains(const string& name, const char* key) {
+    return name.find(key) != string::npos;
+}
+
+
+vector<ProbeSession> PortProbe::ProbeAll(int timeoutMs) {
+    vector<int> ports;
+    vector<string> names;
+    for (auto& info : usb_utils::GetCOMPorts()) {
+        ports.push_back(info.portNumber);
+        names.push_back(info.deviceName);
+    }
+    return Probe(ports, names, timeoutMs);
+}
+
+
+vector<ProbeSession> PortProbe::Probe(const vector<int>& ports, const vector<string>& names, int timeoutMs) {
+    vector<ProbeSession> sessions(ports.size());
+    double start = time_utils::get_time();
+    double deadline = start + timeoutMs / 1000.0;
+
+    vector<thread> workers;
+    for (size_t i = 0; i < ports.size(); i++) {
+        sessions[i].port = ports[i];
+        sessions[i].name = i < names.size() ? names[i] : string();
+        sessions[i].mode = PROBE_MODE_UNKNOWN;
+        sessions[i].status = ERROR_SUCCESS;
+        sessions[i].elapsed = 0;
+        sessions[i].bHelloRead = false;
+        workers.emplace_back(&PortProbe::ProbeOne, ref(sessions[i]), deadline);
+    }
+    for (auto& t : workers) t.join();
+
+    LINFO("PortProbe::Probe", "探测了%d个端口，耗时%.3f秒", (int) ports.size(), time_utils::get_time() - start);
+    for (auto& s : sessions) {
+        LDEBUG("PortProbe::Probe", "COM%d (%s): %s，%.3f秒", s.port, s.name.c_str(), ModeName(s.mode), s.elapsed);
+    }
+    return sessions;
+}
+
+
+const char* PortProbe::ModeName(probe_mode_e mode) {
+    switch (mode) {
+        case PROBE_MODE_SAHARA:   return "Sahara";
+        case PROBE_MODE_FIREHOSE: return "Firehose";
+        case PROBE_MODE_DLOAD:    return "Dload";
+        case PROBE_MODE_SPD:      return "SPD";
+        case PROBE_MODE_ERROR:    return "打开失败";
+        default:                  return "未知";
+    }
+}
+
+
+void PortProbe::ProbeOne(ProbeSession& session, double deadline) {
+    double start = time_utils::get_time();
+    auto sport = make_shared<SerialPort>();
+    session.status = sport->Open(session.port);
+    if (session.status != ERROR_SUCCESS) {
+        session.mode = PROBE_MODE_ERROR;
+        session.elapsed = time_utils::get_time() - start;
+        return;
+    }
+
+    BYTE buf[512];
+    // 先只监听，Sahara设备会自己发送Hello，不能往里面乱写东西
+    DWORD len = ReadUntil(sport.get(), buf, sizeof(buf), deadline, PROBE_LISTEN_MS);
+    if (len) {
+        session.mode = Classify(buf, len);
+        session.response = ByteArray(buf, len);
+        session.bHelloRead = session.mode == PROBE_MODE_SAHARA && ((cmd_hdr_t*) buf)->cmd == SAHARA_HELLO_REQ;
+    }
+
+    // 按端口名称决定探测顺序，展讯的端口只发波特率检测字节
+    vector<probe_kind_e> kinds;
+    if (NameContains(session.name, "SPRD") || NameContains(session.name, "SCI")) {
+        kinds = { PROBE_KIND_SPD_BAUD };
+    } else if (NameContains(session.name, "Qualcomm") || NameContains(session.name, "QDLoader") ||
+               NameContains(session.name, "9008")) {
+        kinds = { PROBE_KIND_HDLC_NOP, PROBE_KIND_FIREHOSE_NOP };
+    } else {
+        kinds = { PROBE_KIND_HDLC_NOP, PROBE_KIND_FIREHOSE_NOP, PROBE_KIND_SPD_BAUD };
+    }
+
+    for (size_t i = 0; i < kinds.size() && session.mode == PROBE_MODE_UNKNOWN; i++) {
+        if (time_utils::get_time() >= deadline) break;
+        int status;
+        switch (kinds[i]) {
+            case PROBE_KIND_SPD_BAUD: {
+                BYTE baud = 0x7e;
+                status = sport->Write(&baud, 1);
+                break;
+            }
+            case PROBE_KIND_HDLC_NOP: {
+                BYTE nop = CMD_NOP;
+                status = sport->WritePacket(&nop, 1);
+                break;
+            }
+            default:
+                status = sport->Write((const BYTE*) FIREHOSE_NOP, sizeof(FIREHOSE_NOP) - 1);
+                break;
+        }
+        if (status != ERROR_SUCCESS) break;
+        len = ReadUntil(sport.get(), buf, sizeof(buf), deadline, PROBE_REPLY_MS);
+        if (len) {
+            session.mode = Classify(buf, len);
+            session.response = ByteArray(buf, len);
+        }
+    }
+    session.elapsed = time_utils::get_time() - start;
+
+    if (session.mode == PROBE_MODE_SAHARA || session.mode == PROBE_MODE_FIREHOSE ||
+        session.mode == PROBE_MODE_DLOAD) {
+        sport->SetTimeout(1000);
+        session.sport = sport;
+    } else {
+        // 展讯工具用自己的通道打开端口，这里必须释放
+        sport->Close();
+    }
+}
+
+
+DWORD PortProbe::ReadUntil(SerialPort* sport, BYTE* buf, DWORD size, double deadline, int sliceMs) {
+    int remain = (int) ((deadline - time_utils::get_time()) * 1000);
+    if (remain <= 0) return 0;
+    sport->SetTimeout(min(sliceMs, remain));
+    DWORD total = size;
+    if (sport->Read(buf, &total) != ERROR_SUCCESS) return 0;
+    // Read收到第一个字节就会返回，再等一小会把同一个响应剩下的部分读完
+    sport->SetTimeout(PROBE_GAP_MS);
+    while (total && total < size) {
+        DWORD n = size - total;
+        if (sport->Read(buf + total, &n) != ERROR_SUCCESS || n == 0) break;
+        total += n;
+    }
+    return total;
+}
+
+
+probe_mode_e PortProbe::Classify(const BYTE* data, DWORD length) {
+    string text((const char*) data, length);
+    if (NameContains(text, "<?xml") || NameContains(text, "<response") || NameContains(text, "<log")) {
+        return PROBE_MODE_FIREHOSE;
+    }
+    if (length >= sizeof(cmd_hdr_t)) {
+        const cmd_hdr_t* hdr = (const cmd_hdr_t*) data;
+        if (hdr->cmd >= SAHARA_HELLO_REQ && hdr->cmd <= SAHARA_64BIT_MEMORY_READ_DATA &&
+            hdr->len >= sizeof(cmd_hdr_t) && hdr->len <= 0x1000) {
+            return PROBE_MODE_SAHARA;
+        }
+    }
+    // 展讯的响应: 7e 00 8x ...，类型是大端的0x80xx
+    if (length >= 3 && data[0] == ASYNC_HDLC_FLAG && data[1] == 0x00 && (data[2] & 0x80)) {
+        return PROBE_MODE_SPD;
+    }
+    // 高通的HDLC响应以0x7e结尾
+    if (data[length - 1] == ASYNC_HDLC_FLAG) {
+        return PROBE_MODE_DLOAD;
+    }
+    LDEBUG("PortProbe::Classify", "无法识别的响应:\n%s", string_utils::to_hex_view((const char*) data, length).c_str());
+    return PROBE_MODE_UNKNOWN;
+}
@@ -1,5 +1,7 @@
 
 #include "emmcdl_new/protocol.h"
+#include "emmcdl_new/asyncprotocol.h"
+#include "emmcdl_new/imagecache.h"
 #include "emmcdl_new/utils.h"
 #include "utils/logger.h"
 #include "utils/string_utils.h"
@@ -93,13 +95,61 @@ int Protocol::WriteGPT(std::string szPartName, std::string szBinFile) {
     return status;
 }
 
+int Protocol::VerifyImage(std::string szPartName, std::string szBinFile) {
+    PartitionEntry partEntry;
+    int status = LoadPartitionInfo(szPartName, &partEntry);
+    if (status != ERROR_SUCCESS)
+        return status;
+    std::shared_ptr<MappedImage> image = ImageCache::Get(szBinFile, &status);
+    if (image == nullptr)
+        return status;
+
+    // 和ProgramPartitionEntry一样，文件比分区大时只写入了分区大小
+    uint64_t total = std::min<uint64_t>(image->size(), partEntry.num_sectors * DISK_SECTOR_SIZE);
+    int64_t base = partEntry.start_sector * DISK_SECTOR_SIZE;
+    LINFO("Protocol::VerifyImage", "开始校验分区%s，共%llu字节", szPartName.c_str(), total);
+
+    // 设备线程读回下一块时，主机线程池比较上一块
+    AsyncProtocol async(this);
+    std::vector<ProtocolOp> ops;
+    for (uint64_t pos = 0; pos < total; pos += VERIFY_CHUNK_SIZE) {
+        if (ops.size() >= VERIFY_WINDOW && ops[ops.size() - VERIFY_WINDOW].Status() != ERROR_SUCCESS)
+            break;
+        uint64_t len = std::min<uint64_t>(total - pos, VERIFY_CHUNK_SIZE);
+        DWORD readBytes = (DWORD) ((len + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE * DISK_SECTOR_SIZE);
+        ops.push_back(async.ReadData(base + pos, readBytes, partEntry.physical_partition_number)
+            .Then([image, pos, len](const ProtocolResult& r) {
+                ProtocolResult out;
+                if (r.bytes < len || memcmp(r.data->data(), image->data() + pos, (size_t) len) != 0) {
+                    LWARN("Protocol::VerifyImage", "偏移0x%llx开始的%llu字节与文件不一致", pos, len);
+                    out.status = ERROR_INVALID_DATA;
+                }
+                return out;
+            }));
+    }
+    for (auto& op : ops) {
+        status = op.Status();
+        if (status != ERROR_SUCCESS) {
+            async.Cancel();
+            break;
+        }
+    }
+    if (status == ERROR_SUCCESS) {
+        LINFO("Protocol::VerifyImage", "分区%s校验通过", szPartName.c_str());
+    } else {
+        LWARN("Protocol::VerifyImage", "分区%s校验失败，状态：%s", szPartName.c_str(), getErrorDescription(status).c_str());
+    }
+    return status;
+}
+
 int Protocol::ReadGPT(bool show_result) {
     int status = ERROR_SUCCESS;
     DWORD bytesRead;
     gpt_header_t gpt_header;
     
     // 分配内存存储分区表条目
-    gpt_entries = (gpt_entry_t*) malloc(sizeof(gpt_entry_t) * 128);
+    if (gpt_entries == nullptr)
+        gpt_entries = (gpt_entry_t*) malloc(sizeof(gpt_entry_t) * GPT_CACHE_ENTRIES);
 
     if (gpt_entries == nullptr) {
         LERROR("Protocol::ReadGPT", "存储结果时内存分配失败");
@@ -146,6 +196,20 @@ int Protocol::ReadGPT(bool show_result) {
     return status;
 }
 
+void Protocol::SetGPTCache(const gpt_entry_t* entries) {
+    if (gpt_entries == nullptr)
+        gpt_entries = (gpt_entry_t*) malloc(sizeof(gpt_entry_t) * GPT_CACHE_ENTRIES);
+    if (gpt_entries == nullptr) {
+        LWARN("Protocol::SetGPTCache", "内存分配失败，不使用缓存的分区表");
+        return;
+    }
+    memcpy(gpt_entries, entries, sizeof(gpt_entry_t) * GPT_CACHE_ENTRIES);
+}
+
+const gpt_entry_t* Protocol::GetGPTCache(void) {
+    return gpt_entries;
+}
+
 uint64_t Protocol::GetNumDiskSectors() {
     return disk_size / DISK_SECTOR_SIZE;
 }
@@ -0,0 +1,558 @@
+#include "emmcdl_new/reactor.h"
+#include "emmcdl_new/utils.h"
+#include "emmcdl_new/devmonitor.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <algorithm>
+#include <deque>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+
+#define REACTOR_MAX_WAIT_MS     1000    // 没有定时器时每次等待的最长时间
+#define REACTOR_READS_PER_EVENT 4       // 每次就绪最多读取的次数，避免一个快速设备占住整个循环
+
+
+// 一个已注册的句柄和在它上面运行的任务
+struct ReactorChannel {
+    struct Segment {
+        const uint8_t* data;
+        size_t len;
+        vector<uint8_t> owned;          // Send复制的数据，SendRef时为空
+    };
+
+    io_handle_t handle = INVALID_IO_HANDLE;
+    ReactorTask* task = nullptr;
+    deque<Segment> out;                 // 等待发送的数据
+    size_t outPos = 0;                  // out.front()中已经发送的字节数
+    uint64_t timer = 0;                 // 当前超时的定时器，0表示没有
+    bool bDrained = false;              // 发送队列刚刚变空，需要回调OnDrained
+    bool bDone = false;
+#ifdef _WIN32
+    OVERLAPPED readOv = {};
+    OVERLAPPED writeOv = {};
+    bool bReadPending = false;
+    bool bWritePending = false;
+    vector<uint8_t> rxBuf;
+#else
+    bool bWantWrite = false;
+#endif
+};
+
+
+TimerWheel::TimerWheel(int tickMs, int slotCount) :
+    tickMs(max(tickMs, 1)), current(0), nextId(1), slots(max(slotCount, 1)) {
+    originMs = time_utils::get_time_ms();
+}
+
+
+uint64_t TimerWheel::Schedule(int delayMs, function<void()> cb) {
+    double now = time_utils::get_time_ms();
+    uint64_t due = (uint64_t) max(0.0, (now - originMs + max(delayMs, 0) + tickMs - 1) / tickMs);
+    // 已经处理过的刻度不会再被检查，最早也只能放到下一个刻度
+    if (due <= current) due = current + 1;
+    uint64_t id = nextId++;
+    slots[due % slots.size()].push_back({ id, due, move(cb) });
+    live.insert(id);
+    return id;
+}
+
+
+void TimerWheel::Cancel(uint64_t id) {
+    // 槽里的条目在轮到它时才清理
+    live.erase(id);
+}
+
+
+int TimerWheel::Advance(double nowMs) {
+    uint64_t target = (uint64_t) max(0.0, (nowMs - originMs) / tickMs);
+    if (target <= current) return 0;
+    // 落后超过一圈时，每个槽只需要检查一次
+    uint64_t steps = min<uint64_t>(target - current, slots.size());
+    vector<Timer> due;
+    for (uint64_t k = current + 1; k <= current + steps; k++) {
+        auto& slot = slots[k % slots.size()];
+        for (size_t i = 0; i < slot.size();) {
+            if (live.count(slot[i].id) == 0) {
+                slot[i] = move(slot.back());
+                slot.pop_back();
+            } else if (slot[i].tick <= target) {
+                live.erase(slot[i].id);
+                due.push_back(move(slot[i]));
+                slot[i] = move(slot.back());
+                slot.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+    current = target;
+    // 回调里可能会添加新的定时器，所以先全部取出再调用
+    for (auto& t : due) t.cb();
+    return (int) due.size();
+}
+
+
+int TimerWheel::NextTimeoutMs(double nowMs, int maxMs) const {
+    if (live.empty()) return maxMs;
+    double next = originMs + (double) (current + 1) * tickMs;
+    return (int) min<double>(maxMs, max(0.0, next - nowMs + 1));
+}
+
+
+void ReactorTask::Send(const void* data, size_t len) {
+    if (reactor != nullptr) reactor->Queue(channel, data, len, true);
+}
+
+
+void ReactorTask::SendRef(const void* data, size_t len) {
+    if (reactor != nullptr) reactor->Queue(channel, data, len, false);
+}
+
+
+void ReactorTask::ArmTimeout(int ms) {
+    if (reactor != nullptr) reactor->Arm(channel, ms);
+}
+
+
+void ReactorTask::CancelTimeout() {
+    if (reactor != nullptr) reactor->Disarm(channel);
+}
+
+
+task_state_e ReactorTask::Finish(int result) {
+    status = result;
+    return TASK_DONE;
+}
+
+
+Reactor::Reactor() : active(0), bStop(false) {
+#ifdef _WIN32
+    iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (iocp == NULL)
+        LERROR("Reactor::Reactor", "创建I/O完成端口失败: %s", getErrorDescription(GetLastError()).c_str());
+#else
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    rxBuf.resize(REACTOR_READ_CHUNK);
+    if (epfd < 0 || wakeFd < 0) {
+        LERROR("Reactor::Reactor", "创建epoll失败: %s", strerror(errno));
+    } else {
+        // data.ptr为空的事件表示Stop
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+#endif
+}
+
+
+Reactor::~Reactor() {
+#ifdef _WIN32
+    // 还在进行的重叠I/O会写入通道里的OVERLAPPED，必须等它们完成后才能释放
+    for (auto& ch : channels) {
+        if (ch->bReadPending || ch->bWritePending) CancelIoEx(ch->handle, NULL);
+    }
+    for (int tries = 0; tries < 50; tries++) {
+        bool bPending = false;
+        for (auto& ch : channels) bPending = bPending || ch->bReadPending || ch->bWritePending;
+        if (!bPending) break;
+        OVERLAPPED_ENTRY entries[REACTOR_MAX_EVENTS];
+        ULONG n = 0;
+        if (!GetQueuedCompletionStatusEx(iocp, entries, REACTOR_MAX_EVENTS, &n, 100, FALSE)) continue;
+        for (ULONG i = 0; i < n; i++) {
+            ReactorChannel* ch = (ReactorChannel*) entries[i].lpCompletionKey;
+            if (ch == nullptr) continue;
+            if (entries[i].lpOverlapped == &ch->readOv) ch->bReadPending = false;
+            if (entries[i].lpOverlapped == &ch->writeOv) ch->bWritePending = false;
+        }
+    }
+    if (iocp != NULL) ::CloseHandle(iocp);
+#else
+    if (wakeFd >= 0) close(wakeFd);
+    if (epfd >= 0) close(epfd);
+#endif
+}
+
+
+int Reactor::Add(io_handle_t handle, ReactorTask* task) {
+    if (handle == INVALID_IO_HANDLE || task == nullptr)
+        return ERROR_INVALID_PARAMETER;
+    unique_ptr<ReactorChannel> owned(new ReactorChannel());
+    ReactorChannel* ch = owned.get();
+    ch->handle = handle;
+    ch->task = task;
+#ifdef _WIN32
+    if (CreateIoCompletionPort(handle, iocp, (ULONG_PTR) ch, 0) == NULL) {
+        int status = GetLastError();
+        LERROR("Reactor::Add", "%s: 无法关联到I/O完成端口: %s", task->Name().c_str(), getErrorDescription(status).c_str());
+        return status;
+    }
+    ch->rxBuf.resize(REACTOR_READ_CHUNK);
+#else
+    int flags = fcntl(handle, F_GETFL);
+    if (flags < 0 || fcntl(handle, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LERROR("Reactor::Add", "%s: 无法设置为非阻塞模式: %s", task->Name().c_str(), strerror(errno));
+        return ERROR_INVALID_HANDLE;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = ch;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, handle, &ev) != 0) {
+        LERROR("Reactor::Add", "%s: 无法加入epoll: %s", task->Name().c_str(), strerror(errno));
+        return ERROR_INVALID_HANDLE;
+    }
+#endif
+    task->reactor = this;
+    task->channel = ch;
+    task->status = ERROR_SUCCESS;
+    channels.push_back(move(owned));
+    active++;
+    LDEBUG("Reactor::Add", "开始任务%s, 当前共%d个任务", task->Name().c_str(), (int) active);
+#ifdef _WIN32
+    PostRead(ch);
+    if (ch->bDone) return ch->task->Status();
+#endif
+    Settle(ch, task->Start());
+    return ERROR_SUCCESS;
+}
+
+
+int Reactor::Run() {
+#ifdef _WIN32
+    if (iocp == NULL) return ERROR_INVALID_HANDLE;
+    OVERLAPPED_ENTRY entries[REACTOR_MAX_EVENTS];
+#else
+    if (epfd < 0) return ERROR_INVALID_HANDLE;
+    epoll_event events[REACTOR_MAX_EVENTS];
+#endif
+    while (active > 0 && !bStop) {
+        double now = time_utils::get_time_ms();
+        timers.Advance(now);
+        if (active == 0 || bStop) break;
+        int wait = timers.NextTimeoutMs(now, REACTOR_MAX_WAIT_MS);
+#ifdef _WIN32
+        ULONG n = 0;
+        if (!GetQueuedCompletionStatusEx(iocp, entries, REACTOR_MAX_EVENTS, &n, wait, FALSE)) {
+            int status = GetLastError();
+            if (status == WAIT_TIMEOUT) continue;
+            LERROR("Reactor::Run", "等待I/O完成端口失败: %s", getErrorDescription(status).c_str());
+            return status;
+        }
+        for (ULONG i = 0; i < n; i++) {
+            ReactorChannel* ch = (ReactorChannel*) entries[i].lpCompletionKey;
+            if (ch == nullptr) continue;
+            DWORD bytes = 0;
+            bool bOk = GetOverlappedResult(ch->handle, entries[i].lpOverlapped, &bytes, FALSE) != FALSE;
+            OnCompletion(ch, entries[i].lpOverlapped, bytes, bOk);
+        }
+#else
+        int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, wait);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LERROR("Reactor::Run", "epoll_wait失败: %s", strerror(errno));
+            return ERROR_GEN_FAILURE;
+        }
+        for (int i = 0; i < n; i++) {
+            ReactorChannel* ch = (ReactorChannel*) events[i].data.ptr;
+            if (ch == nullptr) {
+                uint64_t v;
+                while (read(wakeFd, &v, sizeof(v)) > 0);
+                continue;
+            }
+            uint32_t ev = events[i].events;
+            if (!ch->bDone && (ev & EPOLLIN)) OnReadable(ch);
+            if (!ch->bDone && (ev & EPOLLOUT)) Settle(ch, TASK_RUNNING);
+            if (!ch->bDone && (ev & (EPOLLERR | EPOLLHUP)) && !(ev & EPOLLIN)) Fail(ch, ERROR_DEVICE_NOT_CONNECTED);
+        }
+#endif
+    }
+    return ERROR_SUCCESS;
+}
+
+
+void Reactor::Stop() {
+    bStop = true;
+#ifdef _WIN32
+    PostQueuedCompletionStatus(iocp, 0, 0, NULL);
+#else
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        // eventfd已经是满的，Run一定会醒来
+    }
+#endif
+}
+
+
+void Reactor::Queue(ReactorChannel* ch, const void* data, size_t len, bool bCopy) {
+    if (ch->bDone || len == 0) return;
+    ch->out.push_back({ (const uint8_t*) data, len, {} });
+    if (bCopy) {
+        auto& seg = ch->out.back();
+        seg.owned.assign((const uint8_t*) data, (const uint8_t*) data + len);
+        seg.data = seg.owned.data();
+    }
+    // 真正的发送在回调返回后的Settle里进行
+}
+
+
+void Reactor::Arm(ReactorChannel* ch, int ms) {
+    Disarm(ch);
+    ch->timer = timers.Schedule(ms, [this, ch]() {
+        ch->timer = 0;
+        if (!ch->bDone) Settle(ch, ch->task->OnTimeout());
+    });
+}
+
+
+void Reactor::Disarm(ReactorChannel* ch) {
+    if (ch->timer != 0) {
+        timers.Cancel(ch->timer);
+        ch->timer = 0;
+    }
+}
+
+
+void Reactor::Settle(ReactorChannel* ch, task_state_e state) {
+    // 每次回调之后：发送排队的数据，发送队列清空时继续回调OnDrained，直到任务需要等待为止
+    while (!ch->bDone) {
+        if (state == TASK_DONE) {
+            Complete(ch);
+            return;
+        }
+        Flush(ch);
+        if (ch->bDone) return;
+        if (!ch->out.empty()) {
+#ifndef _WIN32
+            WantWrite(ch, true);
+#endif
+            return;
+        }
+#ifndef _WIN32
+        WantWrite(ch, false);
+#endif
+        if (!ch->bDrained) return;
+        ch->bDrained = false;
+        state = ch->task->OnDrained();
+    }
+}
+
+
+void Reactor::Complete(ReactorChannel* ch) {
+    if (ch->bDone) return;
+    ch->bDone = true;
+    Disarm(ch);
+    ch->out.clear();
+#ifdef _WIN32
+    if (ch->bReadPending || ch->bWritePending) CancelIoEx(ch->handle, NULL);
+#else
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ch->handle, nullptr);
+#endif
+    active--;
+    LDEBUG("Reactor::Complete", "任务%s结束, 状态: %s, 剩余%d个任务",
+        ch->task->Name().c_str(), getErrorDescription(ch->task->Status()).c_str(), (int) active);
+}
+
+
+void Reactor::Fail(ReactorChannel* ch, int status) {
+    if (ch->bDone) return;
+    LWARN("Reactor::Fail", "任务%s的传输出错: %s", ch->task->Name().c_str(), getErrorDescription(status).c_str());
+    ch->task->status = status;
+    Complete(ch);
+}
+
+
+#ifdef _WIN32
+
+void Reactor::Flush(ReactorChannel* ch) {
+    // 同一时间只有一个写操作在进行，完成后由OnCompletion继续
+    if (ch->bWritePending || ch->out.empty()) return;
+    auto& seg = ch->out.front();
+    DWORD len = (DWORD) min<size_t>(seg.len - ch->outPos, 0x40000000);
+    memset(&ch->writeOv, 0, sizeof(ch->writeOv));
+    if (!WriteFile(ch->handle, seg.data + ch->outPos, len, NULL, &ch->writeOv) && GetLastError() != ERROR_IO_PENDING) {
+        Fail(ch, GetLastError());
+        return;
+    }
+    ch->bWritePending = true;
+}
+
+
+void Reactor::PostRead(ReactorChannel* ch) {
+    if (ch->bDone || ch->bReadPending) return;
+    memset(&ch->readOv, 0, sizeof(ch->readOv));
+    if (!ReadFile(ch->handle, ch->rxBuf.data(), (DWORD) ch->rxBuf.size(), NULL, &ch->readOv) && GetLastError() != ERROR_IO_PENDING) {
+        Fail(ch, GetLastError());
+        return;
+    }
+    // 即使立即完成，结果也会送到完成端口
+    ch->bReadPending = true;
+}
+
+
+void Reactor::OnCompletion(ReactorChannel* ch, OVERLAPPED* ov, DWORD bytes, bool bOk) {
+    int error = bOk ? ERROR_SUCCESS : GetLastError();
+    if (ov == &ch->readOv) {
+        ch->bReadPending = false;
+        if (ch->bDone) return;
+        if (!bOk) {
+            Fail(ch, error == ERROR_BROKEN_PIPE ? ERROR_DEVICE_NOT_CONNECTED : error);
+            return;
+        }
+        task_state_e state = TASK_RUNNING;
+        // 串口的读取超时到期时会以0字节完成，重新发起即可
+        if (bytes > 0) state = ch->task->OnData(ch->rxBuf.data(), bytes);
+        if (state == TASK_RUNNING && !ch->bDone) PostRead(ch);
+        Settle(ch, state);
+    } else if (ov == &ch->writeOv) {
+        ch->bWritePending = false;
+        if (ch->bDone) return;
+        if (!bOk) {
+            Fail(ch, error);
+            return;
+        }
+        ch->task->bytesSent += bytes;
+        ch->outPos += bytes;
+        if (ch->outPos >= ch->out.front().len) {
+            ch->out.pop_front();
+            ch->outPos = 0;
+            if (ch->out.empty()) ch->bDrained = true;
+        }
+        Settle(ch, TASK_RUNNING);
+    }
+}
+
+#else
+
+void Reactor::Flush(ReactorChannel* ch) {
+    while (!ch->out.empty()) {
+        auto& seg = ch->out.front();
+        ssize_t n = write(ch->handle, seg.data + ch->outPos, seg.len - ch->outPos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            Fail(ch, errno == EPIPE || errno == EIO ? ERROR_DEVICE_NOT_CONNECTED : ERROR_WRITE_FAULT);
+            return;
+        }
+        ch->task->bytesSent += n;
+        ch->outPos += n;
+        if (ch->outPos == seg.len) {
+            ch->out.pop_front();
+            ch->outPos = 0;
+            if (ch->out.empty()) ch->bDrained = true;
+        }
+    }
+}
+
+
+void Reactor::WantWrite(ReactorChannel* ch, bool bWant) {
+    if (ch->bWantWrite == bWant) return;
+    ch->bWantWrite = bWant;
+    epoll_event ev = {};
+    ev.events = EPOLLIN | (bWant ? EPOLLOUT : 0);
+    ev.data.ptr = ch;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, ch->handle, &ev);
+}
+
+
+void Reactor::OnReadable(ReactorChannel* ch) {
+    for (int i = 0; i < REACTOR_READS_PER_EVENT && !ch->bDone; i++) {
+        ssize_t n = read(ch->handle, rxBuf.data(), rxBuf.size());
+        if (n > 0) {
+            Settle(ch, ch->task->OnData(rxBuf.data(), (size_t) n));
+            if ((size_t) n < rxBuf.size()) return;
+        } else if (n == 0) {
+            Fail(ch, ERROR_DEVICE_NOT_CONNECTED);
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else {
+            Fail(ch, errno == EIO ? ERROR_DEVICE_NOT_CONNECTED : ERROR_READ_FAULT);
+        }
+    }
+}
+
+#endif
+
+
+int Reactor::OpenPort(int port, io_handle_t* handle) {
+    *handle = INVALID_IO_HANDLE;
+    if (port < 0) return ERROR_INVALID_PARAMETER;
+#ifdef _WIN32
+    wchar_t path[32];
+    swprintf_s(path, 32, L"\\\\.\\COM%d", port);
+    HANDLE h = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (h == INVALID_HANDLE_VALUE) return GetLastError();
+    // 有数据时立即返回，没有数据时一直等待，超时由时间轮负责
+    COMMTIMEOUTS timeouts = { MAXDWORD, MAXDWORD, MAXDWORD - 1, 0, 0 };
+    SetCommTimeouts(h, &timeouts);
+    *handle = h;
+#else
+    char path[32];
+    // 端口号的编号方式和DeviceMonitor一致
+    if (port >= DEVMON_ACM_PORT_BASE) {
+        snprintf(path, sizeof(path), "/dev/ttyACM%d", port - DEVMON_ACM_PORT_BASE);
+    } else {
+        snprintf(path, sizeof(path), "/dev/ttyUSB%d", port);
+    }
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return errno == EACCES ? ERROR_ACCESS_DENIED : ERROR_FILE_NOT_FOUND;
+    termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    *handle = fd;
+#endif
+    return ERROR_SUCCESS;
+}
+
+
+int Reactor::CreatePipe(io_handle_t* host, io_handle_t* device) {
+    *host = *device = INVALID_IO_HANDLE;
+#ifdef _WIN32
+    static std::atomic<int> counter(0);
+    char name[64];
+    sprintf_s(name, sizeof(name), "\\\\.\\pipe\\emmcdl_reactor_%lu_%d", GetCurrentProcessId(), counter++);
+    HANDLE server = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 1 << 20, 1 << 20, 0, NULL);
+    if (server == INVALID_HANDLE_VALUE) return GetLastError();
+    HANDLE client = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (client == INVALID_HANDLE_VALUE) {
+        int status = GetLastError();
+        ::CloseHandle(server);
+        return status;
+    }
+    *host = client;
+    *device = server;
+#else
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) return ERROR_NOT_ENOUGH_MEMORY;
+    *host = fds[0];
+    *device = fds[1];
+#endif
+    return ERROR_SUCCESS;
+}
+
+
+void Reactor::ClosePort(io_handle_t handle) {
+    if (handle == INVALID_IO_HANDLE) return;
+#ifdef _WIN32
+    ::CloseHandle(handle);
+#else
+    close(handle);
+#endif
+}
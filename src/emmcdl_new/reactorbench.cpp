@@ -0,0 +1,390 @@
+#include "emmcdl_new/reactorbench.h"
+#include "emmcdl_new/reactortasks.h"
+#include "emmcdl_new/utils.h"
+#include "spddump/common.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+#define MB                  (1024.0 * 1024.0)
+#define GB                  (1024.0 * 1024.0 * 1024.0)
+#define BENCH_SPD_ADDR      0x5500      // 模拟FDL1的加载地址
+
+
+// 模拟的Firehose烧录内核：应答configure和program，并收下program之后的原始数据
+class FirehoseTargetTask : public ReactorTask {
+public:
+    FirehoseTargetTask(int index) : index(index), rawRemain(0) {}
+
+    string Name() const override { return "FirehoseTarget#" + to_string(index); }
+    task_state_e Start() override { return TASK_RUNNING; }
+    task_state_e OnTimeout() override { return TASK_RUNNING; }
+
+    task_state_e OnData(const uint8_t* data, size_t len) override {
+        // 大块的原始数据直接计数，不经过pending
+        if (pending.empty() && rawRemain > 0) {
+            size_t n = (size_t) min<uint64_t>(len, rawRemain);
+            Consume(n);
+            data += n;
+            len -= n;
+        }
+        pending.append((const char*) data, len);
+        size_t pos = 0;
+        while (pos < pending.size()) {
+            if (rawRemain > 0) {
+                size_t n = (size_t) min<uint64_t>(pending.size() - pos, rawRemain);
+                Consume(n);
+                pos += n;
+                continue;
+            }
+            size_t end = pending.find("</data>", pos);
+            if (end == string::npos) break;
+            Handle(pending.substr(pos, end + 7 - pos));
+            pos = end + 7;
+        }
+        pending.erase(0, pos);
+        return TASK_RUNNING;
+    }
+
+private:
+    void Consume(size_t n) {
+        rawRemain -= n;
+        if (rawRemain == 0) Reply("<response value=\"ACK\" rawmode=\"false\" />");
+    }
+
+    void Handle(const string& xml) {
+        if (xml.find("<configure") != string::npos) {
+            string size = Attr(xml, "MaxPayloadSizeToTargetInBytes");
+            Reply("<response value=\"ACK\" MaxPayloadSizeToTargetInBytes=\"" + size + "\" />");
+        } else if (xml.find("<program") != string::npos) {
+            rawRemain = strtoull(Attr(xml, "SECTOR_SIZE_IN_BYTES").c_str(), nullptr, 0) *
+                        strtoull(Attr(xml, "num_partition_sectors").c_str(), nullptr, 0);
+            Reply("<response value=\"ACK\" rawmode=\"true\" />");
+        } else {
+            Reply("<response value=\"NAK\" />");
+        }
+    }
+
+    static string Attr(const string& xml, const string& key) {
+        size_t pos = xml.find(key + "=\"");
+        if (pos == string::npos) return "";
+        pos += key.size() + 2;
+        return xml.substr(pos, xml.find('"', pos) - pos);
+    }
+
+    void Reply(const string& response) {
+        string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n" + response + "\n</data>";
+        Send(xml.data(), xml.size());
+    }
+
+    int index;
+    uint64_t rawRemain;
+    string pending;
+};
+
+
+// 模拟的展讯BootROM：回应CHECK_BAUD，之后对每一帧都回复ACK。silentAfter >= 0时只应答这么多帧，模拟中途失去响应的设备
+class SpdTargetTask : public ReactorTask {
+public:
+    SpdTargetTask(int index, int silentAfter = -1) : index(index), silentAfter(silentAfter), bSynced(false) {}
+
+    string Name() const override { return "SpdTarget#" + to_string(index); }
+    task_state_e Start() override { return TASK_RUNNING; }
+    task_state_e OnTimeout() override { return TASK_RUNNING; }
+
+    task_state_e OnData(const uint8_t* data, size_t len) override {
+        if (!bSynced) {
+            // CHECK_BAUD之前的0x7E不是帧，不交给解码器
+            if (memchr(data, HDLC_HEADER, len) == nullptr) return TASK_RUNNING;
+            bSynced = true;
+            Reply(BSL_REP_VER, "SPRD3", 6);
+            return TASK_RUNNING;
+        }
+        codec.Feed(data, len);
+        SpdFrame f;
+        while (codec.Next(&f)) {
+            if (silentAfter == 0) continue;
+            if (silentAfter > 0) silentAfter--;
+            Reply(BSL_REP_ACK, nullptr, 0);
+        }
+        return TASK_RUNNING;
+    }
+
+private:
+    void Reply(int type, const void* payload, size_t len) {
+        SpdFrameCodec::Encode(type, payload, len, true, frame);
+        Send(frame.data(), frame.size());
+    }
+
+    int index;
+    int silentAfter;
+    bool bSynced;
+    SpdFrameCodec codec;
+    vector<uint8_t> frame;
+};
+
+
+// spdio_t的模拟传输，管道的另一端是反应器上的SpdTargetTask
+static int SpdSimSend(void* ctx, const uint8_t* buf, int len) {
+    io_handle_t handle = *(io_handle_t*) ctx;
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    DWORD n = 0;
+    if (!WriteFile(handle, buf, len, &n, &ov) && GetLastError() == ERROR_IO_PENDING)
+        GetOverlappedResult(handle, &ov, &n, TRUE);
+    CloseHandle(ov.hEvent);
+    return (int) n;
+#else
+    int done = 0;
+    while (done < len) {
+        ssize_t n = write(handle, buf + done, len - done);
+        if (n <= 0) break;
+        done += (int) n;
+    }
+    return done;
+#endif
+}
+
+static int SpdSimRecv(void* ctx, uint8_t* buf, int len, int timeout) {
+    io_handle_t handle = *(io_handle_t*) ctx;
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    DWORD n = 0;
+    if (!ReadFile(handle, buf, len, &n, &ov)) {
+        if (GetLastError() != ERROR_IO_PENDING) {
+            CloseHandle(ov.hEvent);
+            return -1;
+        }
+        if (WaitForSingleObject(ov.hEvent, timeout) != WAIT_OBJECT_0)
+            CancelIoEx(handle, &ov);
+        // 取消和完成可能同时发生，以实际结果为准
+        if (!GetOverlappedResult(handle, &ov, &n, TRUE))
+            n = 0;
+    }
+    CloseHandle(ov.hEvent);
+    return (int) n;
+#else
+    pollfd p = { handle, POLLIN, 0 };
+    int ready = poll(&p, 1, timeout);
+    if (ready <= 0) return ready;
+    ssize_t n = read(handle, buf, len);
+    return n > 0 ? (int) n : -1;
+#endif
+}
+
+
+// 一个spd_dump会话：在模拟的BootROM上下载一个FDL1，和spd_dump的fdl命令走同样的路径
+struct SpdSimSession {
+    int index = 0;
+    io_handle_t handle = INVALID_IO_HANDLE;
+    const uint8_t* image = nullptr;
+    uint32_t size = 0;
+    int result = 0;                     // spd_session_run的返回值
+    double cpuSeconds = 0;
+};
+
+static int SpdSimDownload(spdio_t* io, void* arg) {
+    SpdSimSession* s = (SpdSimSession*) arg;
+    io->flags |= FLAGS_TRANSCODE;
+    encode_msg(io, BSL_CMD_CHECK_BAUD, NULL, 1);
+    send_msg(io);
+    if (!recv_msg(io) || recv_type(io) != BSL_REP_VER)
+        ERR_EXIT("SPD#%d: no BSL_REP_VER\n", s->index);
+    encode_msg_nocpy(io, BSL_CMD_CONNECT, 0);
+    if (send_and_check(io))
+        ERR_EXIT("SPD#%d: CONNECT failed\n", s->index);
+    // 超时由send_and_check报告，出错时只结束这个会话
+    send_buf(io, BENCH_SPD_ADDR, 1, SPD_TASK_DEFAULT_STEP, (uint8_t*) s->image, s->size);
+    return 0;
+}
+
+
+int ReactorBench::Run(int devices, int megabytes, int threads) {
+    devices = max(devices, 1);
+    megabytes = max(megabytes, 1);
+    threads = max(threads, 1);
+    LINFO("ReactorBench::Run", "模拟%d个设备, 每个设备Firehose写入%dMB, 主机端%d个反应器线程", devices, megabytes, threads);
+
+    uint64_t fhBytes = (uint64_t) megabytes * 1024 * 1024;
+    ReactorBenchResult fh = RunProtocol(false, devices, fhBytes, threads);
+    LogResult("Firehose", fh);
+    uint64_t spdBytes = max<uint64_t>(fhBytes / REACTORBENCH_SPD_SHARE, SPD_TASK_DEFAULT_STEP);
+    ReactorBenchResult spd = RunProtocol(true, devices, spdBytes, threads);
+    LogResult("SPD", spd);
+    // 同样的下载由spd_dump会话执行，每个设备一个线程，和反应器对比每个设备的CPU开销
+    ReactorBenchResult spdThreads = RunSpdSessions(devices, spdBytes, false);
+    LogResult("SPD spd_dump", spdThreads);
+
+    // 同一进程中的多个spd_dump会话：一个设备失去响应时，只有它自己的会话失败
+    ReactorBenchResult sessions = RunSpdSessions(REACTORBENCH_SPD_SESSIONS, spdBytes, true);
+    LogResult("spd_dump", sessions);
+    bool bIsolated = sessions.failed == 1 && sessions.bytes == spdBytes * (REACTORBENCH_SPD_SESSIONS - 1);
+    if (!bIsolated)
+        LERROR("ReactorBench::Run", "spd_dump会话: 预期只有最后一个会话失败, 实际失败%d个", sessions.failed);
+    return fh.failed || spd.failed || spdThreads.failed || !bIsolated ? ERROR_GEN_FAILURE : ERROR_SUCCESS;
+}
+
+
+ReactorBenchResult ReactorBench::RunProtocol(bool bSpd, int devices, uint64_t bytesPerDevice, int threads) {
+    ReactorBenchResult result;
+    result.devices = devices;
+    result.threads = threads;
+
+    // 所有设备共享同一份镜像，和ImageCache的用法一致
+    vector<uint8_t> image((size_t) bytesPerDevice);
+    for (size_t i = 0; i < image.size(); i++) image[i] = (uint8_t) (i * 31 + 7);
+
+    vector<io_handle_t> hostEnds(devices, INVALID_IO_HANDLE), deviceEnds(devices, INVALID_IO_HANDLE);
+    vector<unique_ptr<Reactor>> hosts, targets;
+    for (int t = 0; t < threads; t++) {
+        hosts.emplace_back(new Reactor());
+        targets.emplace_back(new Reactor());
+    }
+    vector<unique_ptr<FirehoseProgramTask>> fhTasks;
+    vector<unique_ptr<SpdDownloadTask>> spdTasks;
+    vector<unique_ptr<ReactorTask>> targetTasks;
+    fh_configure_t cfg = { 4, "emmc", false, false, true, -1, 1024 * 1024 };
+
+    for (int i = 0; i < devices; i++) {
+        int status = Reactor::CreatePipe(&hostEnds[i], &deviceEnds[i]);
+        if (status != ERROR_SUCCESS) {
+            LERROR("ReactorBench::RunProtocol", "创建第%d个模拟设备失败: %s", i, getErrorDescription(status).c_str());
+            result.failed = devices - i;
+            devices = i;
+            break;
+        }
+        Reactor& host = *hosts[i % threads];
+        Reactor& target = *targets[i % threads];
+        if (bSpd) {
+            targetTasks.emplace_back(new SpdTargetTask(i));
+            target.Add(deviceEnds[i], targetTasks.back().get());
+            spdTasks.emplace_back(new SpdDownloadTask("SPD#" + to_string(i), BENCH_SPD_ADDR, image.data(), (uint32_t) image.size(), SPD_TASK_DEFAULT_STEP, true));
+            host.Add(hostEnds[i], spdTasks.back().get());
+        } else {
+            targetTasks.emplace_back(new FirehoseTargetTask(i));
+            target.Add(deviceEnds[i], targetTasks.back().get());
+            vector<FirehoseWrite> writes = { { image.data(), image.size(), 0, 0 } };
+            fhTasks.emplace_back(new FirehoseProgramTask("Firehose#" + to_string(i), cfg, 512, writes));
+            host.Add(hostEnds[i], fhTasks.back().get());
+        }
+    }
+
+    vector<thread> simulators, workers;
+    for (auto& r : targets) simulators.emplace_back([&r]() { r->Run(); });
+    vector<double> cpu(threads, 0);
+    double start = time_utils::get_time();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&hosts, &cpu, t]() {
+            // 只统计主机端线程，模拟设备的开销不算在内
+            double c0 = time_utils::get_thread_cpu_time();
+            hosts[t]->Run();
+            cpu[t] = time_utils::get_thread_cpu_time() - c0;
+        });
+    }
+    for (auto& w : workers) w.join();
+    result.seconds = time_utils::get_time() - start;
+    for (auto& r : targets) r->Stop();
+    for (auto& s : simulators) s.join();
+
+    for (double c : cpu) result.cpuSeconds += c;
+    for (auto& t : fhTasks) {
+        result.bytes += t->BytesWritten();
+        if (t->Status() != ERROR_SUCCESS) result.failed++;
+    }
+    for (auto& t : spdTasks) {
+        result.bytes += t->BytesWritten();
+        if (t->Status() != ERROR_SUCCESS) result.failed++;
+    }
+    // 先销毁反应器，再关闭它们还在使用的句柄
+    hosts.clear();
+    targets.clear();
+    for (int i = 0; i < devices; i++) {
+        Reactor::ClosePort(hostEnds[i]);
+        Reactor::ClosePort(deviceEnds[i]);
+    }
+    return result;
+}
+
+
+ReactorBenchResult ReactorBench::RunSpdSessions(int devices, uint64_t bytesPerDevice, bool bFailLast) {
+    ReactorBenchResult result;
+    result.devices = devices;
+    result.threads = devices;
+
+    vector<uint8_t> image((size_t) bytesPerDevice);
+    for (size_t i = 0; i < image.size(); i++) image[i] = (uint8_t) (i * 31 + 7);
+
+    Reactor target;
+    vector<unique_ptr<SpdTargetTask>> targetTasks;
+    vector<SpdSimSession> sessions(devices);
+    vector<io_handle_t> deviceEnds(devices, INVALID_IO_HANDLE);
+    for (int i = 0; i < devices; i++) {
+        SpdSimSession& s = sessions[i];
+        int status = Reactor::CreatePipe(&s.handle, &deviceEnds[i]);
+        if (status != ERROR_SUCCESS) {
+            LERROR("ReactorBench::RunSpdSessions", "创建第%d个模拟设备失败: %s", i, getErrorDescription(status).c_str());
+            result.failed = devices - i;
+            devices = i;
+            sessions.resize(devices);
+            break;
+        }
+        s.index = i;
+        s.image = image.data();
+        s.size = (uint32_t) image.size();
+        targetTasks.emplace_back(new SpdTargetTask(i, bFailLast && i == result.devices - 1 ? REACTORBENCH_SPD_SILENT_AFTER : -1));
+        target.Add(deviceEnds[i], targetTasks.back().get());
+    }
+
+    thread simulator([&target]() { target.Run(); });
+    vector<thread> workers;
+    double start = time_utils::get_time();
+    for (auto& s : sessions) {
+        workers.emplace_back([&s]() {
+            double c0 = time_utils::get_thread_cpu_time();
+            spdio_t* io = spdio_init(0);
+            io->sim_send = SpdSimSend;
+            io->sim_recv = SpdSimRecv;
+            io->sim_ctx = &s.handle;
+            s.result = spd_session_run(io, SpdSimDownload, &s);
+            spdio_free(io);
+            s.cpuSeconds = time_utils::get_thread_cpu_time() - c0;
+        });
+    }
+    for (auto& w : workers) w.join();
+    result.seconds = time_utils::get_time() - start;
+    target.Stop();
+    simulator.join();
+
+    for (auto& s : sessions) {
+        result.cpuSeconds += s.cpuSeconds;
+        if (s.result == 0) result.bytes += s.size;
+        else result.failed++;
+    }
+    for (int i = 0; i < devices; i++) {
+        Reactor::ClosePort(sessions[i].handle);
+        Reactor::ClosePort(deviceEnds[i]);
+    }
+    return result;
+}
+
+
+void ReactorBench::LogResult(const char* protocol, const ReactorBenchResult& result) {
+    double seconds = max(result.seconds, 0.000001);
+    LINFO("ReactorBench", "%s: %d个设备, %d个反应器线程, 失败%d个, 共%.1fMB, 用时%.2f秒, 总吞吐量%.1fMB/s",
+        protocol, result.devices, result.threads, result.failed, result.bytes / MB, result.seconds, result.bytes / MB / seconds);
+    LINFO("ReactorBench", "%s: 主机端CPU %.3f秒, 每个设备每秒%.3f毫秒, 每GB %.3f秒",
+        protocol, result.cpuSeconds, result.cpuSeconds * 1000 / max(result.devices, 1) / seconds,
+        result.bytes > 0 ? result.cpuSeconds / (result.bytes / GB) : 0.0);
+}
@@ -0,0 +1,385 @@
+#include "emmcdl_new/reactortasks.h"
+#include "emmcdl_new/utils.h"
+#include "spddump/common.h"
+#include "utils/logger.h"
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+
+// 取出xml中key="..."的值，Firehose的响应都是单行的属性
+static bool XmlAttr(const string& xml, const char* key, string* value) {
+    string pattern = string(key) + "=\"";
+    size_t pos = xml.find(pattern);
+    if (pos == string::npos) return false;
+    pos += pattern.size();
+    size_t end = xml.find('"', pos);
+    if (end == string::npos) return false;
+    *value = xml.substr(pos, end - pos);
+    return true;
+}
+
+
+FirehoseProgramTask::FirehoseProgramTask(const string& name, const fh_configure_t& cfg, int sectorSize,
+    const vector<FirehoseWrite>& writes) :
+    name(name), cfg(cfg), sectorSize(sectorSize > 0 ? sectorSize : 512), writes(writes) {
+    maxPayload = cfg.MaxPayloadSizeToTargetInBytes > 0 ? cfg.MaxPayloadSizeToTargetInBytes : 1024 * 1024;
+    writeIndex = 0;
+    rawQueued = rawTotal = 0;
+    bytesWritten = 0;
+    readyPolls = 0;
+    bNopQueued = false;
+    state = FH_TASK_READY;
+}
+
+
+task_state_e FirehoseProgramTask::Start() {
+    // 刚加载的烧录内核还在启动，先确认它能响应再配置
+    state = FH_TASK_READY;
+    return SendNop();
+}
+
+
+task_state_e FirehoseProgramTask::SendNop() {
+    // 设备还没读走上一个NOP时不再排队，免得启动后一下子收到一串响应
+    if (!bNopQueued) {
+        static const char nop[] = "<?xml version=\"1.0\" ?><data><nop /></data>";
+        Send(nop, sizeof(nop) - 1);
+        bNopQueued = true;
+    }
+    ArmTimeout(FH_READY_POLL_MS);
+    return TASK_RUNNING;
+}
+
+
+task_state_e FirehoseProgramTask::SendConfigure() {
+    char pkt[MAX_STRING_LEN];
+    snprintf(pkt, sizeof(pkt),
+        "<?xml version=\"1.0\" ?>\n"
+        "<data>\n"
+        "    <configure MemoryName=\"%s\" ZLPAwareHost=\"%d\" SkipStorageInit=\"%d\" SkipWrite=\"%d\" MaxPayloadSizeToTargetInBytes=\"%u\"/>\n"
+        "</data>\n",
+        cfg.MemoryName, cfg.ZLPAwareHost, cfg.SkipStorageInit, cfg.SkipWrite, maxPayload);
+    Send(pkt, strlen(pkt));
+    state = FH_TASK_CONFIGURE;
+    ArmTimeout(FH_TASK_TIMEOUT_MS);
+    return TASK_RUNNING;
+}
+
+
+task_state_e FirehoseProgramTask::NextWrite() {
+    if (writeIndex >= writes.size()) {
+        CancelTimeout();
+        LDEBUG("FirehoseProgramTask", "%s: 全部%d个区域写入完成, 共%llu字节", name.c_str(), (int) writes.size(), bytesWritten);
+        return Finish(ERROR_SUCCESS);
+    }
+    const FirehoseWrite& w = writes[writeIndex];
+    uint64_t sectors = (w.size + sectorSize - 1) / sectorSize;
+    char pkt[MAX_STRING_LEN];
+    if (w.startSector < 0) {
+        snprintf(pkt, sizeof(pkt),
+            "<?xml version=\"1.0\" ?>\n"
+            "<data>\n"
+            "    <program SECTOR_SIZE_IN_BYTES=\"%d\" num_partition_sectors=\"%llu\" physical_partition_number=\"%d\" start_sector=\"NUM_DISK_SECTORS%lld\"/>\n"
+            "</data>\n",
+            sectorSize, (unsigned long long) sectors, w.partNum, (long long) w.startSector);
+    } else {
+        snprintf(pkt, sizeof(pkt),
+            "<?xml version=\"1.0\" ?>\n"
+            "<data>\n"
+            "    <program SECTOR_SIZE_IN_BYTES=\"%d\" num_partition_sectors=\"%llu\" physical_partition_number=\"%d\" start_sector=\"%lld\"/>\n"
+            "</data>\n",
+            sectorSize, (unsigned long long) sectors, w.partNum, (long long) w.startSector);
+    }
+    Send(pkt, strlen(pkt));
+    rawQueued = 0;
+    rawTotal = sectors * sectorSize;
+    state = FH_TASK_PROGRAM;
+    ArmTimeout(FH_TASK_TIMEOUT_MS);
+    return TASK_RUNNING;
+}
+
+
+task_state_e FirehoseProgramTask::SendChunk() {
+    const FirehoseWrite& w = writes[writeIndex];
+    if (rawQueued >= rawTotal) {
+        // 数据都交给驱动了，等待设备写完后的响应
+        state = FH_TASK_FLUSH;
+        ArmTimeout(FH_TASK_FLUSH_TIMEOUT_MS);
+        return TASK_RUNNING;
+    }
+    uint64_t len = min<uint64_t>(rawTotal - rawQueued, maxPayload);
+    if (rawQueued + len <= w.size) {
+        // 直接从调用者的缓冲区（通常是映射的镜像）发送
+        SendRef(w.data + rawQueued, (size_t) len);
+    } else {
+        tail.assign((size_t) len, 0);
+        if (rawQueued < w.size)
+            memcpy(tail.data(), w.data + rawQueued, (size_t) (w.size - rawQueued));
+        SendRef(tail.data(), tail.size());
+    }
+    rawQueued += len;
+    // 超时以发送进度为准，设备消化得慢不等于没有响应
+    ArmTimeout(FH_TASK_TIMEOUT_MS);
+    return TASK_RUNNING;
+}
+
+
+task_state_e FirehoseProgramTask::OnDrained() {
+    bNopQueued = false;
+    if (state != FH_TASK_RAW) return TASK_RUNNING;
+    return SendChunk();
+}
+
+
+task_state_e FirehoseProgramTask::OnData(const uint8_t* data, size_t len) {
+    if (state == FH_TASK_READY || state == FH_TASK_SETTLE) {
+        // 启动日志和NOP的响应只说明烧录内核在运行，等端口静默之后再发送配置
+        state = FH_TASK_SETTLE;
+        ArmTimeout(FH_READY_QUIET_MS);
+        return TASK_RUNNING;
+    }
+    rx.append((const char*) data, len);
+    size_t end;
+    while ((end = rx.find("</data>")) != string::npos) {
+        string xml = rx.substr(0, end + 7);
+        rx.erase(0, end + 7);
+        if (xml.find("<response") != string::npos) {
+            task_state_e result = OnResponse(xml);
+            if (result == TASK_DONE) return result;
+        } else {
+            string value;
+            if (XmlAttr(xml, "value", &value))
+                LDEBUG("FirehoseProgramTask", "%s: 设备日志: %s", name.c_str(), value.c_str());
+        }
+    }
+    return TASK_RUNNING;
+}
+
+
+task_state_e FirehoseProgramTask::OnResponse(const string& xml) {
+    string value;
+    XmlAttr(xml, "value", &value);
+    bool bAck = value == "ACK";
+    switch (state) {
+    case FH_TASK_CONFIGURE: {
+        string size;
+        uint32_t deviceMax = XmlAttr(xml, "MaxPayloadSizeToTargetInBytes", &size) ? (uint32_t) strtoul(size.c_str(), nullptr, 0) : 0;
+        if (!bAck) {
+            // 和ConnectToFlashProg一样，设备嫌数据包太大时按它给出的大小重新配置
+            if (deviceMax > 0 && deviceMax < maxPayload) {
+                LDEBUG("FirehoseProgramTask", "%s: 最大数据包大小从%u降低为%u", name.c_str(), maxPayload, deviceMax);
+                maxPayload = deviceMax;
+                return SendConfigure();
+            }
+            LWARN("FirehoseProgramTask", "%s: 设备拒绝了配置", name.c_str());
+            return Finish(ERROR_INVALID_DATA);
+        }
+        if (deviceMax > 0 && deviceMax < maxPayload) maxPayload = deviceMax;
+        return NextWrite();
+    }
+    case FH_TASK_PROGRAM:
+        if (!bAck) {
+            LWARN("FirehoseProgramTask", "%s: 设备拒绝了第%d个写入命令", name.c_str(), (int) writeIndex);
+            return Finish(ERROR_INVALID_DATA);
+        }
+        state = FH_TASK_RAW;
+        return SendChunk();
+    case FH_TASK_RAW:
+        // Windows上读完成可能先于写完成被取出，数据都排队了就当作已经发送
+        if (rawQueued < rawTotal) {
+            LWARN("FirehoseProgramTask", "%s: 原始数据还没发送完就收到了响应: %s", name.c_str(), value.c_str());
+            return Finish(ERROR_INVALID_DATA);
+        }
+        // fallthrough
+    case FH_TASK_FLUSH:
+        if (!bAck) {
+            LWARN("FirehoseProgramTask", "%s: 第%d个区域写入失败", name.c_str(), (int) writeIndex);
+            return Finish(ERROR_WRITE_FAULT);
+        }
+        bytesWritten += writes[writeIndex].size;
+        writeIndex++;
+        return NextWrite();
+    }
+    return TASK_RUNNING;
+}
+
+
+task_state_e FirehoseProgramTask::OnTimeout() {
+    if (state == FH_TASK_SETTLE)
+        return SendConfigure();
+    if (state == FH_TASK_READY && ++readyPolls * FH_READY_POLL_MS < FH_READY_TIMEOUT_MS)
+        return SendNop();
+    static const char* states[] = { "等待烧录内核启动", "等待端口静默", "配置", "写入命令", "发送数据", "等待写入完成" };
+    LWARN("FirehoseProgramTask", "%s: %s阶段超时", name.c_str(), states[state]);
+    return Finish(ERROR_TIMEOUT);
+}
+
+
+void SpdFrameCodec::Encode(int type, const void* data, size_t len, bool bCrc16, vector<uint8_t>& out) {
+    // 和spd_dump的send_msg用同一个编码器，最坏情况下每个字节都要转义
+    spd_iov_t iov = { data, len };
+    out.resize(2 * (len + 6) + 2);
+    int n = spd_encode_iov(FLAGS_TRANSCODE | (bCrc16 ? FLAGS_CRC16 : 0), type, &iov, len ? 1 : 0, out.data());
+    out.resize(n);
+}
+
+
+void SpdFrameCodec::Feed(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t a = data[i];
+        if (a == HDLC_HEADER) {
+            // 两帧之间可能只有一个0x7E，它既是上一帧的结尾也是下一帧的开头
+            if (bInFrame && !raw.empty()) EndFrame();
+            bInFrame = true;
+            bEscape = false;
+        } else if (!bInFrame) {
+            continue;
+        } else if (a == HDLC_ESCAPE) {
+            bEscape = true;
+        } else {
+            raw.push_back(bEscape ? a ^ 0x20 : a);
+            bEscape = false;
+        }
+    }
+}
+
+
+void SpdFrameCodec::EndFrame() {
+    size_t n = raw.size();
+    size_t len = n >= 4 ? ((size_t) raw[2] << 8 | raw[3]) : 0;
+    if (n < 6 || len + 6 != n) {
+        dropped++;
+        raw.clear();
+        return;
+    }
+    unsigned chk = (unsigned) raw[n - 2] << 8 | raw[n - 1];
+    SpdFrame frame;
+    if (chk == spd_crc16(0, raw.data(), (unsigned) n - 2)) {
+        frame.bCrc16 = true;
+    } else if (chk == spd_checksum(0, raw.data(), (int) n - 2, CHK_ORIG)) {
+        frame.bCrc16 = false;
+    } else {
+        dropped++;
+        raw.clear();
+        return;
+    }
+    frame.type = raw[0] << 8 | raw[1];
+    frame.payload.assign(raw.begin() + 4, raw.end() - 2);
+    frames.push_back(move(frame));
+    raw.clear();
+}
+
+
+bool SpdFrameCodec::Next(SpdFrame* frame) {
+    if (frames.empty()) return false;
+    *frame = move(frames.front());
+    frames.pop_front();
+    return true;
+}
+
+
+SpdDownloadTask::SpdDownloadTask(const string& name, uint32_t addr, const uint8_t* data, uint32_t size,
+    unsigned step, bool bExec) :
+    name(name), addr(addr), data(data), size(size), step(step ? step : SPD_TASK_DEFAULT_STEP), bExec(bExec) {
+    bCrc16 = true;
+    offset = inFlight = 0;
+    retries = 0;
+    lastType = -1;
+    state = SPD_TASK_CHECK_BAUD;
+}
+
+
+task_state_e SpdDownloadTask::Start() {
+    // CHECK_BAUD只是一个0x7E，BootROM据此确定波特率并回复BSL_REP_VER
+    uint8_t baud = HDLC_HEADER;
+    Send(&baud, 1);
+    state = SPD_TASK_CHECK_BAUD;
+    ArmTimeout(SPD_TASK_BAUD_RETRY_MS);
+    return TASK_RUNNING;
+}
+
+
+task_state_e SpdDownloadTask::SendFrame(int type, const void* payload, size_t len) {
+    SpdFrameCodec::Encode(type, payload, len, bCrc16, frame);
+    Send(frame.data(), frame.size());
+    lastType = type;
+    ArmTimeout(SPD_TASK_TIMEOUT_MS);
+    return TASK_RUNNING;
+}
+
+
+task_state_e SpdDownloadTask::OnData(const uint8_t* bytes, size_t len) {
+    codec.Feed(bytes, len);
+    SpdFrame f;
+    while (codec.Next(&f)) {
+        if (OnFrame(f) == TASK_DONE) return TASK_DONE;
+    }
+    return TASK_RUNNING;
+}
+
+
+task_state_e SpdDownloadTask::OnFrame(const SpdFrame& f) {
+    if (f.type == BSL_REP_LOG) {
+        LDEBUG("SpdDownloadTask", "%s: 设备日志: %s", name.c_str(), string(f.payload.begin(), f.payload.end()).c_str());
+        return TASK_RUNNING;
+    }
+    if (state == SPD_TASK_CHECK_BAUD) {
+        if (f.type != BSL_REP_VER) return TASK_RUNNING;
+        // BootROM使用CRC16，FDL使用校验和，以它的回复为准
+        bCrc16 = f.bCrc16;
+        LDEBUG("SpdDownloadTask", "%s: BSL_REP_VER: %s", name.c_str(), string(f.payload.begin(), f.payload.end()).c_str());
+        state = SPD_TASK_CONNECT;
+        return SendFrame(BSL_CMD_CONNECT, nullptr, 0);
+    }
+    if (f.type != BSL_REP_ACK) {
+        LWARN("SpdDownloadTask", "%s: 命令0x%02x的回复是0x%02x而不是ACK", name.c_str(), lastType, f.type);
+        return Finish(ERROR_INVALID_DATA);
+    }
+    switch (state) {
+    case SPD_TASK_CONNECT: {
+        uint8_t payload[8];
+        WRITE32_BE(payload, addr);
+        WRITE32_BE(payload + 4, size);
+        state = SPD_TASK_START;
+        return SendFrame(BSL_CMD_START_DATA, payload, sizeof(payload));
+    }
+    case SPD_TASK_MIDST:
+        offset += inFlight;
+        inFlight = 0;
+        // fallthrough
+    case SPD_TASK_START:
+        if (offset < size) {
+            inFlight = min<uint32_t>(size - offset, step);
+            state = SPD_TASK_MIDST;
+            return SendFrame(BSL_CMD_MIDST_DATA, data + offset, inFlight);
+        }
+        state = SPD_TASK_END;
+        return SendFrame(BSL_CMD_END_DATA, nullptr, 0);
+    case SPD_TASK_END:
+        if (bExec) {
+            state = SPD_TASK_EXEC;
+            return SendFrame(BSL_CMD_EXEC_DATA, nullptr, 0);
+        }
+        // fallthrough
+    case SPD_TASK_EXEC:
+        CancelTimeout();
+        LDEBUG("SpdDownloadTask", "%s: 已发送%u字节到0x%x", name.c_str(), size, addr);
+        return Finish(ERROR_SUCCESS);
+    default:
+        return TASK_RUNNING;
+    }
+}
+
+
+task_state_e SpdDownloadTask::OnTimeout() {
+    if (state == SPD_TASK_CHECK_BAUD && ++retries < SPD_TASK_BAUD_RETRIES) {
+        uint8_t baud = HDLC_HEADER;
+        Send(&baud, 1);
+        ArmTimeout(SPD_TASK_BAUD_RETRY_MS);
+        return TASK_RUNNING;
+    }
+    LWARN("SpdDownloadTask", "%s: 命令0x%02x没有回复 (已确认%u/%u字节)", name.c_str(), lastType, offset, size);
+    return Finish(ERROR_TIMEOUT);
+}
@@ -24,6 +24,10 @@
 #include "utils/logger.h"
 #include "emmcdl_new/utils.h"
 #include "utils/string_utils.h"
+#include "utils/time_utils.h"
+#include "emmcdl_new/imagecache.h"
+#include "emmcdl_new/saharadump.h"
+#include "emmcdl_new/devmonitor.h"
 
 Sahara::Sahara(SerialPort* port, HANDLE hLogFile) {
     sport = port;
@@ -187,6 +191,12 @@ int Sahara::ModeSwitch(int mode) {
     return status;
 }
 
+void Sahara::LogImageTiming(uint64_t id, uint64_t bytes, double start) {
+    double elapsed = time_utils::get_time() - start;
+    LINFO("Sahara::LoadFlashProg", "镜像%lld上传完成: %lld字节，耗时%.3fs，速度%.2fKB/s",
+        id, bytes, elapsed, elapsed > 0 ? bytes / 1024.0 / elapsed : 0.0);
+}
+
 int Sahara::LoadFlashProg(const std::string& szFlashPrg) {
     read_data_t read_data_req = {0};
     read_data_64_t read_data64_req = {0};
@@ -194,21 +204,18 @@ int Sahara::LoadFlashProg(const std::string& szFlashPrg) {
     image_end_t read_img_end = {0 };
     DWORD status = ERROR_SUCCESS;
     DWORD bytesRead = sizeof(read_data64_req);
-    DWORD totalBytes = 0, read_data_offset = 0, read_data_len = 0;
-    BYTE dataBuf[8192];
-
-    HANDLE hFlashPrg = CreateFileA(szFlashPrg.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        NULL,
-        OPEN_EXISTING,
-        0,
-        NULL);
-    if (hFlashPrg == INVALID_HANDLE_VALUE) {
+    uint64_t totalBytes = 0, read_data_offset = 0, read_data_len = 0;
+    uint64_t imageId = (uint64_t) -1, imageBytes = 0;
+    double imageStart = 0;
+
+    // 烧录内核映射一次之后所有会话和设备共用，每个请求直接从映射里发出去
+    std::shared_ptr<MappedImage> image = ImageCache::Get(szFlashPrg);
+    if (!image) {
         return ERROR_OPEN_FAILED;
     }
 
-    LDEBUG("Sahara::LoadFlashProg", "成功打开烧录内核文件: \"%s\"", szFlashPrg.c_str());
+    LDEBUG("Sahara::LoadFlashProg", "成功打开烧录内核文件: \"%s\"，大小: %lld字节", szFlashPrg.c_str(), image->size());
+    double startTime = time_utils::get_time();
 
     for (;;) {
 
@@ -217,16 +224,19 @@ int Sahara::LoadFlashProg(const std::string& szFlashPrg) {
         status = sport->Read((BYTE*) &read_cmd_hdr, &bytesRead);
 
         // Check if it is a 32-bit or 64-bit read
+        uint64_t id;
         if (read_cmd_hdr.cmd == SAHARA_64BIT_MEMORY_READ_DATA) {
             memset(&read_data64_req, 0, sizeof(read_data64_req));
             bytesRead = sizeof(read_data64_req);
             status = sport->Read((BYTE*) &read_data64_req, &bytesRead);
-            read_data_offset = (uint32_t) read_data64_req.data_offset;
-            read_data_len = (uint32_t) read_data64_req.data_len;
+            id = read_data64_req.id;
+            read_data_offset = read_data64_req.data_offset;
+            read_data_len = read_data64_req.data_len;
         } else if (read_cmd_hdr.cmd == SAHARA_READ_DATA) {
             memset(&read_data_req, 0, sizeof(read_data_req));
             bytesRead = sizeof(read_data_req);
             status = sport->Read((BYTE*) &read_data_req, &bytesRead);
+            id = read_data_req.id;
             read_data_offset = read_data_req.data_offset;
             read_data_len = read_data_req.data_len;
         } else {
@@ -234,27 +244,32 @@ int Sahara::LoadFlashProg(const std::string& szFlashPrg) {
             break;
         }
 
-        if (SetFilePointer(hFlashPrg, read_data_offset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-            LWARN("Sahara::LoadFlashProg", "更新烧录内核文件指针偏移失败");
-            CloseHandle(hFlashPrg);
-            return GetLastError();
+        if (id != imageId) {
+            if (imageId != (uint64_t) -1) LogImageTiming(imageId, imageBytes, imageStart);
+            imageId = id;
+            imageBytes = 0;
+            imageStart = time_utils::get_time();
         }
 
-        if (!ReadFile(hFlashPrg, dataBuf, read_data_len, &bytesRead, NULL)) {
-            LWARN("Sahara::LoadFlashProg", "从烧录内核文件读取数据失败");
-            CloseHandle(hFlashPrg);
-            return GetLastError();
+        if (read_data_offset > image->size() || read_data_len > image->size() - read_data_offset) {
+            LWARN("Sahara::LoadFlashProg", "设备请求的范围超出了烧录内核文件: 偏移%lld，长度%lld，文件大小%lld",
+                read_data_offset, read_data_len, image->size());
+            return ERROR_INVALID_DATA;
         }
 
-        if (sport->Write(dataBuf, bytesRead) != ERROR_SUCCESS) {
+        // 请求多长就一次写多长，不经过中间缓冲区
+        status = sport->Write(image->data() + read_data_offset, (DWORD) read_data_len);
+        if (status != ERROR_SUCCESS) {
             LWARN("Sahara::LoadFlashProg", "向设备写入数据时失败");
-            CloseHandle(hFlashPrg);
-            return GetLastError();
+            return status;
         }
-        totalBytes += bytesRead;
+        totalBytes += read_data_len;
+        imageBytes += read_data_len;
     }
 
-    CloseHandle(hFlashPrg);
+    if (imageId != (uint64_t) -1) LogImageTiming(imageId, imageBytes, imageStart);
+    double elapsed = time_utils::get_time() - startTime;
+    LDEBUG("Sahara::LoadFlashProg", "烧录内核发送完成，共%lld字节，耗时%.3fs", totalBytes, elapsed);
 
     if (read_cmd_hdr.cmd != SAHARA_END_TRANSFER) {
         LWARN("Sahara::LoadFlashProg", "预期收到SAHARA_END_TRANSFER命令 (%d)，但实际收到了%d", SAHARA_END_TRANSFER, read_cmd_hdr.cmd);
@@ -283,9 +298,10 @@ int Sahara::LoadFlashProg(const std::string& szFlashPrg) {
         return ERROR_WRITE_FAULT;
     }
 
+    // 烧录内核启动时有的设备会重新枚举，由调用者用Firehose::WaitReady跟随端口并确认烧录内核就绪
+    DeviceMonitor::Instance().MarkModeSwitch(sport->GetPortNum(), "Sahara加载烧录内核");
     sport->SetTimeout(500);
-    Sleep(500);
-    return status;
+    return ERROR_SUCCESS;
 }
 
 bool Sahara::CheckDevice(void) {
@@ -298,6 +314,15 @@ bool Sahara::CheckDevice(void) {
     return (hello_req.cmd == SAHARA_HELLO_REQ);
 }
 
+int Sahara::CollectMemoryDump(const std::string& outDir, int writers) {
+    SerialSaharaLink link(sport);
+    SaharaMemDump dump(&link);
+    dump.SetWriterCount(writers);
+    int status = dump.Run(outDir, true);
+    sport->SetTimeout(1000);
+    return status;
+}
+
 int Sahara::ConnectToDevice(bool bReadHello, int mode) {
     hello_req_t hello_req = { 0 };
     int status = ERROR_SUCCESS;
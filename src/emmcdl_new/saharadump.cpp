@@ -0,0 +1,386 @@
+#include "emmcdl_new/saharadump.h"
+#include "emmcdl_new/sahara.h"
+#include "emmcdl_new/utils.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include "utils/string_utils.h"
+#include <filesystem>
+
+using namespace std;
+
+
+// 内存表里的字符串不一定以0结尾
+static string FixedString(const char* s, size_t maxLen) {
+    size_t len = 0;
+    while (len < maxLen && s[len]) len++;
+    return string(s, len);
+}
+
+
+// 文件名只保留安全的字符，避免设备给出的名字跑到输出目录外面
+static string SafeFileName(const string& name, size_t index) {
+    string out;
+    for (char c : name) {
+        if (isalnum((unsigned char) c) || c == '.' || c == '_' || c == '-') out += c;
+    }
+    if (out.empty() || out == "." || out == "..") {
+        char buf[32];
+        sprintf(buf, "region_%02d.bin", (int) index);
+        return buf;
+    }
+    return out;
+}
+
+
+SaharaMemDump::SaharaMemDump(SaharaLink* port) {
+    link = port;
+    bMode64 = false;
+    dwChunkSize = MEMDUMP_DEFAULT_CHUNK;
+    nWriters = MEMDUMP_DEFAULT_WRITERS;
+    queuedBytes = 0;
+    bStopWriters = false;
+    writeError = ERROR_SUCCESS;
+    if (!link) {
+        LERROR("SaharaMemDump::SaharaMemDump", "传输接口指针为空");
+        throw std::invalid_argument("传输接口指针不能为空");
+    }
+}
+
+
+SaharaMemDump::~SaharaMemDump() {
+    StopWriters();
+}
+
+
+void SaharaMemDump::SetChunkSize(uint32_t bytes) {
+    dwChunkSize = max<uint32_t>(bytes, MEMDUMP_MIN_CHUNK);
+}
+
+
+void SaharaMemDump::SetWriterCount(int count) {
+    nWriters = max(count, 1);
+}
+
+
+int SaharaMemDump::Run(const string& outDir, bool bReadHello) {
+    int status = Handshake(bReadHello);
+    if (status != ERROR_SUCCESS) return status;
+
+    error_code ec;
+    filesystem::create_directories(outDir, ec);
+    if (ec) {
+        LWARN("SaharaMemDump::Run", "无法创建输出目录: %s", outDir.c_str());
+        return ERROR_PATH_NOT_FOUND;
+    }
+
+    double start = time_utils::get_time();
+    uint64_t total = 0;
+    StartWriters();
+    for (size_t i = 0; i < regions.size(); i++) {
+        status = DumpRegion(i, outDir);
+        if (status != ERROR_SUCCESS) break;
+        total += regions[i].length;
+    }
+    // 等待所有数据落盘后再统计结果
+    StopWriters();
+    if (status == ERROR_SUCCESS && writeError != ERROR_SUCCESS) status = writeError;
+
+    double elapsed = time_utils::get_time() - start;
+    if (status == ERROR_SUCCESS) {
+        LINFO("SaharaMemDump::Run", "内存转储完成，共%d个区域，%lld字节，耗时%.2f秒，平均%.2fMB/s",
+            (int) regions.size(), total, elapsed, elapsed > 0 ? total / elapsed / 1048576.0 : 0.0);
+        ResetTarget();
+    } else {
+        LWARN("SaharaMemDump::Run", "内存转储中断，错误代码: %s。已写入的数据会在下次运行时继续",
+            getErrorDescription(status).c_str());
+    }
+    return status;
+}
+
+
+int SaharaMemDump::Handshake(bool bReadHello) {
+    hello_req_t hello_req = { 0 };
+    DWORD bytesRead = sizeof(hello_req);
+    int status;
+
+    if (bReadHello) {
+        link->SetTimeout(1000);
+        status = link->Read((BYTE*) &hello_req, &bytesRead);
+        if (status != ERROR_SUCCESS || bytesRead < sizeof(cmd_hdr_t) || hello_req.cmd != SAHARA_HELLO_REQ) {
+            LWARN("SaharaMemDump::Handshake", "未收到设备的Sahara协议Hello数据包, 状态: %s",
+                getErrorDescription(status).c_str());
+            return ERROR_INVALID_HANDLE;
+        }
+        if (hello_req.mode != SAHARA_MODE_MEMORY_DEBUG) {
+            LWARN("SaharaMemDump::Handshake", "设备不在内存调试模式，当前模式: %d", hello_req.mode);
+        }
+    }
+
+    hello_req.cmd = SAHARA_HELLO_RSP;
+    hello_req.len = 0x30;
+    hello_req.version = 2;
+    hello_req.version_min = 1;
+    hello_req.max_cmd_len = 0;
+    hello_req.mode = SAHARA_MODE_MEMORY_DEBUG;
+    status = link->Write((BYTE*) &hello_req, sizeof(hello_req));
+    if (status != ERROR_SUCCESS) {
+        LWARN("SaharaMemDump::Handshake", "向设备发送Hello响应失败, 状态: %s",
+            getErrorDescription(status).c_str());
+        return status;
+    }
+
+    // 设备会回复32位或64位的内存调试数据包
+    memory_debug_64_t dbg = { 0 };
+    bytesRead = sizeof(dbg);
+    link->SetTimeout(2000);
+    status = link->Read((BYTE*) &dbg, &bytesRead);
+    if (status != ERROR_SUCCESS || bytesRead < sizeof(cmd_hdr_t)) {
+        LWARN("SaharaMemDump::Handshake", "未收到内存调试数据包, 状态: %s",
+            getErrorDescription(status).c_str());
+        return status != ERROR_SUCCESS ? status : ERROR_READ_FAULT;
+    }
+
+    uint64_t tableAddr, tableLen;
+    if (dbg.cmd == SAHARA_64BIT_MEMORY_DEBUG && bytesRead >= sizeof(memory_debug_64_t)) {
+        bMode64 = true;
+        tableAddr = dbg.table_addr;
+        tableLen = dbg.table_len;
+    } else if (dbg.cmd == SAHARA_MEMORY_DEBUG && bytesRead >= sizeof(memory_debug_t)) {
+        memory_debug_t* dbg32 = (memory_debug_t*) &dbg;
+        bMode64 = false;
+        tableAddr = dbg32->table_addr;
+        tableLen = dbg32->table_len;
+    } else {
+        LWARN("SaharaMemDump::Handshake", "收到了意外的数据包，cmd = %d:\n%s", dbg.cmd,
+            string_utils::to_hex_view((char*) &dbg, bytesRead).c_str());
+        return ERROR_INVALID_DATA;
+    }
+    LDEBUG("SaharaMemDump::Handshake", "%s内存调试模式，内存表地址: 0x%llx，长度: %lld",
+        bMode64 ? "64位" : "32位", tableAddr, tableLen);
+    return ReadMemoryTable(tableAddr, tableLen);
+}
+
+
+int SaharaMemDump::ReadMemoryTable(uint64_t tableAddr, uint64_t tableLen) {
+    size_t entrySize = bMode64 ? sizeof(dload_debug_type_64_t) : sizeof(dload_debug_type_t);
+    if (tableLen == 0 || tableLen % entrySize != 0 || tableLen > 0x10000) {
+        LWARN("SaharaMemDump::ReadMemoryTable", "内存表长度不正确: %lld", tableLen);
+        return ERROR_INVALID_DATA;
+    }
+
+    vector<BYTE> table((size_t) tableLen);
+    int status = ReadMemory(tableAddr, &table[0], (uint32_t) tableLen);
+    if (status != ERROR_SUCCESS) {
+        LWARN("SaharaMemDump::ReadMemoryTable", "读取内存表失败, 状态: %s",
+            getErrorDescription(status).c_str());
+        return status;
+    }
+
+    regions.clear();
+    for (size_t off = 0; off < tableLen; off += entrySize) {
+        MemRegion r = {};
+        if (bMode64) {
+            dload_debug_type_64_t* e = (dload_debug_type_64_t*) &table[off];
+            r.base = e->mem_base;
+            r.length = e->length;
+            r.savePref = e->save_pref;
+            r.desc = FixedString(e->desc, sizeof(e->desc));
+            r.filename = FixedString(e->filename, sizeof(e->filename));
+        } else {
+            dload_debug_type_t* e = (dload_debug_type_t*) &table[off];
+            r.base = e->mem_base;
+            r.length = e->length;
+            r.savePref = e->save_pref;
+            r.desc = FixedString(e->desc, sizeof(e->desc));
+            r.filename = FixedString(e->filename, sizeof(e->filename));
+        }
+        r.filename = SafeFileName(r.filename, regions.size());
+        r.status = ERROR_SUCCESS;
+        LDEBUG("SaharaMemDump::ReadMemoryTable", "区域%d: %s (%s)，地址: 0x%llx，长度: %lld",
+            (int) regions.size(), r.filename.c_str(), r.desc.c_str(), r.base, r.length);
+        regions.push_back(r);
+    }
+    LINFO("SaharaMemDump::ReadMemoryTable", "内存表中共有%d个区域", (int) regions.size());
+    return ERROR_SUCCESS;
+}
+
+
+int SaharaMemDump::ReadMemory(uint64_t addr, BYTE* buf, uint32_t len) {
+    int status;
+    if (bMode64) {
+        memory_read_64_t req = { SAHARA_64BIT_MEMORY_READ, sizeof(req), addr, len };
+        status = link->Write((BYTE*) &req, sizeof(req));
+    } else {
+        if (addr + len > 0x100000000ULL) return ERROR_INVALID_PARAMETER;
+        memory_read_t req = { SAHARA_MEMORY_READ, sizeof(req), (DWORD) addr, len };
+        status = link->Write((BYTE*) &req, sizeof(req));
+    }
+    if (status != ERROR_SUCCESS) return status;
+
+    // 设备直接返回原始数据，可能分成多次到达
+    uint32_t received = 0;
+    while (received < len) {
+        DWORD bytesRead = len - received;
+        status = link->Read(buf + received, &bytesRead);
+        if (status != ERROR_SUCCESS) return status;
+        if (bytesRead == 0) return ERROR_TIMEOUT;
+        received += bytesRead;
+    }
+    return ERROR_SUCCESS;
+}
+
+
+int SaharaMemDump::DumpRegion(size_t index, const string& outDir) {
+    MemRegion& r = regions[index];
+    string path = (filesystem::path(outDir) / r.filename).string();
+
+    // 已有文件时从文件末尾继续，超出长度的文件说明不是同一次转储，重新开始
+    error_code ec;
+    uint64_t existing = filesystem::exists(path, ec) ? filesystem::file_size(path, ec) : 0;
+    if (ec || existing > r.length) existing = 0;
+    if (existing == r.length && r.length != 0) {
+        LINFO("SaharaMemDump::DumpRegion", "区域%s已完整转储，跳过", r.filename.c_str());
+        r.done = r.length;
+        return ERROR_SUCCESS;
+    }
+
+    FILE* fp = fopen(path.c_str(), existing ? "ab" : "wb");
+    if (!fp) {
+        LWARN("SaharaMemDump::DumpRegion", "无法打开输出文件: %s", path.c_str());
+        r.status = ERROR_OPEN_FAILED;
+        return r.status;
+    }
+    setvbuf(fp, NULL, _IOFBF, 0x100000);
+    r.done = existing;
+    if (existing) {
+        LINFO("SaharaMemDump::DumpRegion", "区域%s从偏移%lld继续转储", r.filename.c_str(), existing);
+    }
+
+    int writer = (int) (index % writers.size());
+    uint64_t offset = existing;
+    uint32_t chunk = dwChunkSize;
+    int retries = 0;
+    int status = ERROR_SUCCESS;
+    double start = time_utils::get_time();
+
+    while (offset < r.length && writeError == ERROR_SUCCESS) {
+        uint32_t len = (uint32_t) min<uint64_t>(chunk, r.length - offset);
+        WriteBlock block = { fp, vector<BYTE>(len), &r };
+        status = ReadMemory(r.base + offset, &block.data[0], len);
+        if (status != ERROR_SUCCESS) {
+            // 读取失败时把请求减半重试，清掉可能残留的数据
+            if (++retries > MEMDUMP_MAX_RETRY) break;
+            chunk = max<uint32_t>(chunk / 2, MEMDUMP_MIN_CHUNK);
+            LDEBUG("SaharaMemDump::DumpRegion", "读取0x%llx失败(%s)，改为每次读取%d字节后重试",
+                r.base + offset, getErrorDescription(status).c_str(), chunk);
+            BYTE drain[0x1000];
+            DWORD n;
+            link->SetTimeout(100);
+            do {
+                n = sizeof(drain);
+            } while (link->Read(drain, &n) == ERROR_SUCCESS && n > 0);
+            link->SetTimeout(2000);
+            status = ERROR_SUCCESS;
+            continue;
+        }
+        retries = 0;
+        offset += len;
+        QueueBlock(writer, move(block));
+    }
+
+    // 文件在写入线程处理完这个区域的最后一个块后关闭
+    QueueBlock(writer, { fp, vector<BYTE>(), nullptr });
+
+    r.seconds = time_utils::get_time() - start;
+    if (status == ERROR_SUCCESS && writeError != ERROR_SUCCESS) status = writeError;
+    r.status = status;
+    uint64_t bytes = offset - existing;
+    if (status == ERROR_SUCCESS) {
+        LINFO("SaharaMemDump::DumpRegion", "区域%s: %lld字节，耗时%.2f秒，%.2fMB/s",
+            r.filename.c_str(), bytes, r.seconds, r.seconds > 0 ? bytes / r.seconds / 1048576.0 : 0.0);
+    } else {
+        LWARN("SaharaMemDump::DumpRegion", "区域%s在偏移%lld处转储失败, 状态: %s",
+            r.filename.c_str(), offset, getErrorDescription(status).c_str());
+    }
+    return status;
+}
+
+
+int SaharaMemDump::ResetTarget() {
+    cmd_hdr_t reset = { SAHARA_RESET_REQ, sizeof(reset) };
+    int status = link->Write((BYTE*) &reset, sizeof(reset));
+    if (status != ERROR_SUCCESS) return status;
+    cmd_hdr_t rsp = { 0 };
+    DWORD bytesRead = sizeof(rsp);
+    link->SetTimeout(1000);
+    link->Read((BYTE*) &rsp, &bytesRead);
+    if (rsp.cmd != SAHARA_RESET_RSP) {
+        LDEBUG("SaharaMemDump::ResetTarget", "未收到重置响应");
+    }
+    return ERROR_SUCCESS;
+}
+
+
+void SaharaMemDump::StartWriters() {
+    StopWriters();
+    bStopWriters = false;
+    queuedBytes = 0;
+    writeError = ERROR_SUCCESS;
+    writers = vector<WriterQueue>(nWriters);
+    for (int i = 0; i < nWriters; i++) {
+        writers[i].worker = thread(&SaharaMemDump::WriterLoop, this, i);
+    }
+}
+
+
+void SaharaMemDump::StopWriters() {
+    {
+        lock_guard<mutex> lock(mtx);
+        bStopWriters = true;
+    }
+    cvWork.notify_all();
+    for (auto& w : writers) {
+        if (w.worker.joinable()) w.worker.join();
+    }
+    writers.clear();
+}
+
+
+void SaharaMemDump::QueueBlock(int writer, WriteBlock&& block) {
+    unique_lock<mutex> lock(mtx);
+    // 写入跟不上时让读取等一等，限制占用的内存
+    cvSpace.wait(lock, [this] { return queuedBytes < MEMDUMP_MAX_QUEUED; });
+    queuedBytes += block.data.size();
+    writers[writer].blocks.push_back(move(block));
+    cvWork.notify_all();
+}
+
+
+void SaharaMemDump::WriterLoop(int index) {
+    WriterQueue& q = writers[index];
+    for (;;) {
+        WriteBlock block;
+        {
+            unique_lock<mutex> lock(mtx);
+            cvWork.wait(lock, [&] { return bStopWriters || !q.blocks.empty(); });
+            if (q.blocks.empty()) return;
+            block = move(q.blocks.front());
+            q.blocks.pop_front();
+        }
+        if (block.region == nullptr) {
+            fclose(block.fp);
+        } else if (writeError == ERROR_SUCCESS) {
+            if (fwrite(block.data.data(), 1, block.data.size(), block.fp) != block.data.size()) {
+                LWARN("SaharaMemDump::WriterLoop", "写入区域%s失败", block.region->filename.c_str());
+                writeError = ERROR_WRITE_FAULT;
+            } else {
+                block.region->done += block.data.size();
+            }
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            queuedBytes -= block.data.size();
+        }
+        cvSpace.notify_all();
+    }
+}
@@ -1,6 +1,7 @@
 
 #include "emmcdl_new/serialport.h"
 #include "emmcdl_new/utils.h"
+#include "emmcdl_new/devmonitor.h"
 #include "utils/logger.h"
 #include "utils/time_utils.h"
 
@@ -11,55 +12,55 @@ SerialPort::SerialPort() {
     timeout_ms = 1000;  // 1 second default timeout for packets to send/rcv
     HDLCBuf = (BYTE*) malloc(MAX_PACKET_SIZE);
     baHDLCBuf.resize(MAX_PACKET_SIZE);
+    bBinaryLog = false;
+    dwBinaryLogSampleEvery = 1;
+#ifdef EMMCDL_USE_LIBUSB
+    usb = nullptr;
+#endif
 }
 
 
 SerialPort::~SerialPort() {
     if (hPort != INVALID_HANDLE_VALUE) CloseHandle(hPort);
+#ifdef EMMCDL_USE_LIBUSB
+    delete usb;
+#endif
     if (HDLCBuf) free(HDLCBuf);
 }
 
 
-int SerialPort::EnableBinaryLog(bool enable, string path, DWORD sz1, DWORD sz2) {
+int SerialPort::EnableBinaryLog(bool enable, string path, DWORD sz1, DWORD sz2, DWORD sample) {
     dwBinaryLogSizeLimit = sz2;
     dwLogRecordThershold = sz1;
+    dwBinaryLogSampleEvery = sample;
     bBinaryLog = enable;
     sLogDirName = path;
+    if (!enable) {
+        if (capture) capture->Stop();
+        capture.reset();
+    } else if (IsOpen()) {
+        StartBinaryLog();
+    }
     return ERROR_SUCCESS;
 }
 
 
-// TODO: 在调用之前就判断文件大小需不需要记录以节约性能
-//       可以的话可以再加个重载版本（传BYTE*和长度）
-void SerialPort::WriteBinaryLog(std::string logTitle, std::string fileName, const ByteArray& data) {
+void SerialPort::StartBinaryLog() {
     if (!bBinaryLog) return;
     // 如果不存在文件夹就创建一个
     if (!std::filesystem::exists(sLogDirName)) {
         std::filesystem::create_directories(sLogDirName);
     }
-    LTRACE("SerialPort::WriteBinaryLog", "COM%d的串口日志: %s", portNum, logTitle.c_str());
-    DWORD dSize = data.size();
-    string content;
-    if (dSize > dwLogRecordThershold) {
-        content = "  <数据过长，" + to_string(dSize) + "bytes>";
-        return;
-    } else {
-        content = data.empty() ?  "  <无数据>" : data.to_hex_view();
+    // 每个端口只有一个文件，Read/Write时只往环形缓冲区里放数据
+    string fileName = sLogDirName + "/" + 
+        time_utils::get_formatted_time(fmt::format("COM{}_%Y%m%d_%H%M%S.pcap", portNum));
+    if (!capture) capture = make_shared<PortCapture>();
+    if (capture->Start(fileName, portNum, dwBinaryLogSizeLimit, dwBinaryLogSampleEvery, dwLogRecordThershold) != ERROR_SUCCESS) {
+        capture.reset();
     }
-    LTRACE("SerialPort::WriteBinaryLog", content);
-    if (dSize < dwBinaryLogSizeLimit) {
-        FILE* fp = fopen((sLogDirName + "/" + fileName).c_str(), "a");
-        if (fp) {
-            fwrite(data.c_str(), 1, dSize, fp);
-            // 不要用fprintf，会把'\0'之后的所有内容都忽略掉
-            fclose(fp);
-        } else {
-            LWARN("SerialPort::WriteBinaryLog", "无法打开日志文件: %s", fileName.c_str());
-        }
-    }
-
 }
 
+
 int SerialPort::Open(int port) {
     TCHAR tPath[32];
     if (port < 0) {
@@ -85,6 +86,7 @@ int SerialPort::Open(int port) {
             uint32_t baudRate = dcb.BaudRate;
             LDEBUG("SerialPort::Open", "COM%d打开成功，波特率：%d", port, baudRate);
         }
+        StartBinaryLog();
         return ERROR_SUCCESS;
     }
     int status = GetLastError();
@@ -94,12 +96,108 @@ int SerialPort::Open(int port) {
 }
 
 
+#ifdef EMMCDL_USE_LIBUSB
+int SerialPort::OpenUsb(uint16_t vid, uint16_t pid, int index) {
+    Close();
+    // 日志文件名里没有COM口号可用，用序号代替
+    portNum = index;
+    usb = new UsbTransport();
+    usb->SetTimeout(timeout_ms);
+    LDEBUG("SerialPort::OpenUsb", "通过libusb打开USB设备%04x:%04x#%d", vid, pid, index);
+    int status = usb->Open(vid, pid, index);
+    if (status != ERROR_SUCCESS) {
+        delete usb;
+        usb = nullptr;
+    } else {
+        StartBinaryLog();
+    }
+    return status;
+}
+#endif
+
+
+bool SerialPort::IsOpen() const {
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) return usb->IsOpen();
+#endif
+    return hPort != INVALID_HANDLE_VALUE;
+}
+
+
+int SerialPort::WaitReenumeration(int graceMs, int timeoutMs, uint16_t pid, const function<bool()>& ready) {
+#ifdef EMMCDL_USE_LIBUSB
+    // libusb没有设备监视，由调用者轮询设备是否就绪
+    if (usb) return ERROR_SUCCESS;
+#endif
+    DeviceMonitor& monitor = DeviceMonitor::Instance();
+    UsbDeviceInfo self;
+    if (!monitor.FindByPort(portNum, &self)) {
+        // 监视器不认识这个端口，由调用者轮询设备是否就绪
+        return ERROR_SUCCESS;
+    }
+
+    DeviceMatch match;
+    match.serial = self.serial;
+    double start = time_utils::get_time();
+    bool bGone;
+    if (ready) {
+        // ready本身最多阻塞一个轮询间隔，每次轮询之后检查设备是否已经断开
+        while (!(bGone = monitor.WaitForRemoval(match, 0)) && (time_utils::get_time() - start) * 1000 < graceMs) {
+            if (ready()) {
+                LDEBUG("SerialPort::WaitReenumeration", "COM%d在原端口上响应，耗时%.3f秒", portNum, time_utils::get_time() - start);
+                return ERROR_SUCCESS;
+            }
+        }
+    } else {
+        bGone = monitor.WaitForRemoval(match, graceMs);
+    }
+    if (!bGone) {
+        LDEBUG("SerialPort::WaitReenumeration", "COM%d在%d毫秒内没有重新枚举，继续使用原端口", portNum, graceMs);
+        return ERROR_SUCCESS;
+    }
+
+    Close();
+    match.pid = pid;
+    UsbDeviceInfo now;
+    if (!monitor.WaitForArrival(match, timeoutMs, &now, true)) {
+        LWARN("SerialPort::WaitReenumeration", "设备%s在%d毫秒内没有重新出现", self.serial.c_str(), timeoutMs);
+        return ERROR_TIMEOUT;
+    }
+    LINFO("SerialPort::WaitReenumeration", "设备已重新枚举为COM%d (%04x:%04x)，耗时%.3f秒",
+        now.port, now.vid, now.pid, time_utils::get_time() - start);
+    return Open(now.port);
+}
+
+
+void SerialPort::SetZlpAware(bool enable) {
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) usb->SetZlpAware(enable);
+#endif
+}
+
+
 bool SerialPort::GetPortStatus(COMSTAT& comStat, DWORD& errors) {
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        memset(&comStat, 0, sizeof(comStat));
+        comStat.cbInQue = usb->BytesAvailable();
+        errors = 0;
+        return true;
+    }
+#endif
     return ClearCommError(hPort, &errors, &comStat);
 }
 
 
 int SerialPort::Close() {
+    if (capture) capture->Stop();
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        usb->Close();
+        delete usb;
+        usb = nullptr;
+    }
+#endif
     if (hPort != INVALID_HANDLE_VALUE) {
         CloseHandle(hPort);
     }
@@ -111,6 +209,13 @@ int SerialPort::Close() {
 
 int SerialPort::Write(const ByteArray &data, DWORD max_length, DWORD* bytesWritten) {
     int status = ERROR_SUCCESS;
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        uint32_t written = 0;
+        status = usb->Write(data.c_str(), min((DWORD) data.size(), max_length), &written);
+        if (bytesWritten) *bytesWritten = written;
+    } else
+#endif
     if (!WriteFile(hPort,
                     data.c_str(), 
                     min((DWORD) data.size(), max_length),   
@@ -122,11 +227,7 @@ int SerialPort::Write(const ByteArray &data, DWORD max_length, DWORD* bytesWritt
             portNum,
             getErrorDescription(status).c_str());
     }
-    WriteBinaryLog("HOST to TARGET =====>", 
-        time_utils::get_formatted_time_with_frac(
-            time_utils::get_time(), 
-            fmt::format("COM{}_%Y%m%d_%H%M%S%f__FROM_HOST_ERRNO_{}.bin", portNum, status)),
-        data);
+    WriteBinaryLog(CAPTURE_HOST_TO_TARGET, status, data.c_str(), min((DWORD) data.size(), max_length));
     return status;
 }
 
@@ -138,33 +239,42 @@ int SerialPort::Read(ByteArray &data, DWORD max_length, DWORD* bytesRead) {
     data.clear();
     data.resize(bytesToRead);
     int status = ERROR_SUCCESS;
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        // 不按cbInQue截断，而是等到有数据到达（或者超时）为止，和COM口设置的超时行为一致
+        uint32_t len = min(max_length, (DWORD) MAX_PACKET_SIZE);
+        data.resize(len);
+        status = usb->Read(data.data(), &len);
+        data.resize(len);
+        if (bytesRead) *bytesRead = len;
+    } else
+#endif
     // Read data in from serial port
     if (!ReadFile(hPort, data.data(), bytesToRead, bytesRead, NULL)) {
         status = GetLastError();
         LWARN("SerialPort::Read", "从串口COM%d读取数据失败：%s", getErrorDescription(status).c_str());
     }
-    WriteBinaryLog("TARGET to HOST  <=====", 
-        time_utils::get_formatted_time_with_frac(
-            time_utils::get_time(), 
-            fmt::format("COM{}_%Y%m%d_%H%M%S%f__FROM_TARGET_ERRNO_{}.bin", portNum, status)),
-        data);
+    WriteBinaryLog(CAPTURE_TARGET_TO_HOST, status, data.c_str(), (DWORD) data.size());
     return status;
 }
 
 
 int SerialPort::Write(const BYTE* data, DWORD length) {
     int status = ERROR_SUCCESS;
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        uint32_t written = 0;
+        status = usb->Write(data, length, &written);
+        length = written;
+    } else
+#endif
     if (!WriteFile(hPort, data, length, &length, NULL)) {
         status = GetLastError();
         LWARN("SerialPort::Write", "向串口COM%d写入数据失败：%s", 
             portNum,
             getErrorDescription(status).c_str());
     }
-    WriteBinaryLog("HOST to TARGET  =====>", 
-        time_utils::get_formatted_time_with_frac(
-            time_utils::get_time(), 
-            fmt::format("COM{}_%Y%m%d_%H%M%S%f__FROM_HOST_ERRNO_{}.bin", portNum, status)),
-        ByteArray(data, length));
+    WriteBinaryLog(CAPTURE_HOST_TO_TARGET, status, data, length);
     return status;
 }
 
@@ -173,6 +283,13 @@ int SerialPort::Write(const BYTE* data, DWORD length) {
 int SerialPort::Read(BYTE* data, DWORD* length) {
     int status = ERROR_SUCCESS;
 
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        uint32_t len = *length;
+        status = usb->Read(data, &len);
+        *length = len;
+    } else
+#endif
     // Read data in from serial port
     if (!ReadFile(hPort, data, *length, length, NULL)) {
         status = GetLastError();
@@ -181,11 +298,7 @@ int SerialPort::Read(BYTE* data, DWORD* length) {
             getErrorDescription(status).c_str()
         );
     }
-    WriteBinaryLog("TARGET to HOST  <=====", 
-        time_utils::get_formatted_time_with_frac(
-            time_utils::get_time(), 
-            fmt::format("COM{}_%Y%m%d_%H%M%S%f__FROM_TARGET_ERRNO_{}.bin", portNum, status)),
-        ByteArray(data, *length));
+    WriteBinaryLog(CAPTURE_TARGET_TO_HOST, status, data, *length);
     return status;
 }
 
@@ -193,6 +306,9 @@ int SerialPort::Read(BYTE* data, DWORD* length) {
 
 
 int SerialPort::Flush() {
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) return usb->Flush();
+#endif
     ByteArray tmp;
     // Set timeout to 1ms to just flush any pending data then change back to default
     SetTimeout(1);
@@ -208,7 +324,7 @@ int SerialPort::SendSync(const ByteArray &out_buf, ByteArray &in_buf) {
     DWORD status = ERROR_SUCCESS;
     DWORD bytesOut = 0;
     DWORD bytesIn = 0;
-    if (hPort == INVALID_HANDLE_VALUE) {
+    if (!IsOpen()) {
         return ERROR_INVALID_HANDLE;
     }
     bytesOut = MAX_PACKET_SIZE;
@@ -246,22 +362,37 @@ int SerialPort::SendSync(const ByteArray &out_buf, ByteArray &in_buf) {
 }
 
 int SerialPort::SendSync(BYTE* out_buf, int out_length, BYTE* in_buf, int* in_length) {
+    // As long as hPort is valid write the data to the serial port and wait for response for timeout
+    int status = WritePacket(out_buf, out_length);
+    if (status != ERROR_SUCCESS) return status;
+    return ReadPacket(in_buf, in_length);
+}
+
+
+int SerialPort::WritePacket(const BYTE* out_buf, int out_length) {
     DWORD status = ERROR_SUCCESS;
     DWORD bytesOut = 0;
-    DWORD bytesIn = 0;
 
-    // As long as hPort is valid write the data to the serial port and wait for response for timeout
-    if (hPort == INVALID_HANDLE_VALUE) {
+    if (!IsOpen()) {
         return ERROR_INVALID_HANDLE;
     }
 
     // Do HDLC encoding then send out packet
     bytesOut = MAX_PACKET_SIZE;
-    status = HDLCEncodePacket(out_buf, out_length, HDLCBuf, (int*) &bytesOut);
+    status = HDLCEncodePacket((BYTE*) out_buf, out_length, HDLCBuf, (int*) &bytesOut);
 
-    // We know we have a good handle now so write out data and wait for response
-    status = Write(HDLCBuf, bytesOut);
-    if (status != ERROR_SUCCESS) return status;
+    // We know we have a good handle now so write out data
+    return Write(HDLCBuf, bytesOut);
+}
+
+
+int SerialPort::ReadPacket(BYTE* in_buf, int* in_length) {
+    DWORD status = ERROR_SUCCESS;
+    DWORD bytesIn = 0;
+
+    if (!IsOpen()) {
+        return ERROR_INVALID_HANDLE;
+    }
 
     // Keep looping through until we have received 0x7e with size > 1
     for (int i = 0;i < MAX_PACKET_SIZE;i++) {
@@ -290,6 +421,13 @@ int SerialPort::SendSync(BYTE* out_buf, int out_length, BYTE* in_buf, int* in_le
 
 
 int SerialPort::SetTimeout(int miliseconds) {
+#ifdef EMMCDL_USE_LIBUSB
+    if (usb) {
+        usb->SetTimeout(miliseconds);
+        timeout_ms = miliseconds;
+        return ERROR_SUCCESS;
+    }
+#endif
     COMMTIMEOUTS commTimeout;
     commTimeout.ReadTotalTimeoutConstant = miliseconds;
     commTimeout.ReadIntervalTimeout = MAXDWORD;
@@ -0,0 +1,95 @@
+#include "emmcdl_new/usbsched.h"
+#include "utils/logger.h"
+#include "utils/time_utils.h"
+#include <algorithm>
+
+using namespace std;
+
+
+#define THROUGHPUT_SMOOTHING    0.5     // 新测量值在平滑吞吐量中的权重
+
+
+UsbScheduler::UsbScheduler(int initialLimit, int maxLimit) :
+    initialLimit(max(initialLimit, 1)), maxLimit(max(maxLimit, 1)) {
+}
+
+
+UsbScheduler::Controller& UsbScheduler::Get(const string& controller) {
+    Controller& c = controllers[controller];
+    if (c.limit == 0) c.limit = min(initialLimit, maxLimit);
+    return c;
+}
+
+
+UsbPhaseTicket UsbScheduler::Begin(const string& controller, usb_phase_e phase) {
+    UsbPhaseTicket ticket = { controller, phase, 0, 0 };
+    // 轻量阶段几乎不占带宽，主控制器未知时也无从调度
+    if (phase != USB_PHASE_BULK || controller.empty()) return ticket;
+
+    double start = time_utils::get_time();
+    unique_lock<mutex> lock(mtx);
+    Controller& c = Get(controller);
+    if (c.active >= c.limit) {
+        LDEBUG("UsbScheduler::Begin", "主控制器%s上已有%d个传输（限制%d个），等待", controller.c_str(), c.active, c.limit);
+    }
+    c.waiting++;
+    cvFree.wait(lock, [&] { return c.active < c.limit; });
+    c.waiting--;
+    c.active++;
+    ticket.concurrency = c.active;
+    ticket.waited = time_utils::get_time() - start;
+    return ticket;
+}
+
+
+void UsbScheduler::End(const UsbPhaseTicket& ticket, uint64_t bytes, double seconds) {
+    if (ticket.phase != USB_PHASE_BULK || ticket.controller.empty()) return;
+    {
+        lock_guard<mutex> lock(mtx);
+        Controller& c = Get(ticket.controller);
+        // 传输期间并发数会变化，取开始和结束时的平均值
+        int n = max(1, (ticket.concurrency + c.active + 1) / 2);
+        c.active--;
+        if (bytes > 0 && seconds > 0) {
+            // 单个设备的速度乘以并发数，近似为主控制器的总吞吐量
+            double total = bytes / seconds * n;
+            auto it = c.throughput.find(n);
+            if (it == c.throughput.end()) {
+                c.throughput[n] = total;
+            } else {
+                it->second += (total - it->second) * THROUGHPUT_SMOOTHING;
+            }
+            Adjust(ticket.controller, c);
+        }
+    }
+    cvFree.notify_all();
+}
+
+
+void UsbScheduler::Adjust(const string& name, Controller& c) {
+    auto at = [&](int n) {
+        auto it = c.throughput.find(n);
+        return it == c.throughput.end() ? 0.0 : it->second;
+    };
+    int old = c.limit;
+    double current = at(c.limit);
+    double fewer = at(c.limit - 1);
+    double more = at(c.limit + 1);
+    if (c.limit > 1 && current > 0 && fewer > 0 && current < fewer * USBSCHED_MIN_GAIN) {
+        // 最后加上的那个传输没有带来足够的吞吐量，说明主控制器已经饱和
+        c.limit--;
+    } else if (c.limit < maxLimit && c.waiting > 0 && current > 0 && (more == 0 || more >= current * USBSCHED_MIN_GAIN)) {
+        // 有设备在排队，并且还没试过更多的并发，或者试过并且确实更快
+        c.limit++;
+    }
+    if (c.limit != old) {
+        LINFO("UsbScheduler::Adjust", "主控制器%s: %d个并发时%.1fMB/s, 限制从%d调整为%d",
+            name.c_str(), old, current / (1024.0 * 1024.0), old, c.limit);
+    }
+}
+
+
+int UsbScheduler::Limit(const string& controller) {
+    lock_guard<mutex> lock(mtx);
+    return Get(controller).limit;
+}
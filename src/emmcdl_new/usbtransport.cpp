@@ -0,0 +1,421 @@
+#include "emmcdl_new/usbtransport.h"
+#include "utils/logger.h"
+#include <algorithm>
+
+using namespace std;
+
+
+// 把libusb的传输状态转换成错误代码
+static int TransferStatusToError(int status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return ERROR_SUCCESS;
+        case LIBUSB_TRANSFER_TIMED_OUT: return ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_CANCELLED: return ERROR_OPERATION_ABORTED;
+        case LIBUSB_TRANSFER_NO_DEVICE: return ERROR_DEVICE_NOT_CONNECTED;
+        default:                        return ERROR_GEN_FAILURE;
+    }
+}
+
+// 把libusb的函数返回值转换成错误代码
+static int LibusbToError(int ret) {
+    switch (ret) {
+        case LIBUSB_SUCCESS:          return ERROR_SUCCESS;
+        case LIBUSB_ERROR_ACCESS:     return ERROR_ACCESS_DENIED;
+        case LIBUSB_ERROR_NO_DEVICE:  return ERROR_DEVICE_NOT_CONNECTED;
+        case LIBUSB_ERROR_NOT_FOUND:  return ERROR_FILE_NOT_FOUND;
+        case LIBUSB_ERROR_BUSY:       return ERROR_BUSY;
+        case LIBUSB_ERROR_TIMEOUT:    return ERROR_TIMEOUT;
+        case LIBUSB_ERROR_NO_MEM:     return ERROR_NOT_ENOUGH_MEMORY;
+        default:                      return ERROR_GEN_FAILURE;
+    }
+}
+
+
+UsbTransport::UsbTransport() {
+    ctx = nullptr;
+    hDev = nullptr;
+    iface = -1;
+    epIn = epOut = 0;
+    wMaxPacketSize = 512;
+    nInUrbs = USB_DEFAULT_IN_URBS;
+    nOutUrbs = USB_DEFAULT_OUT_URBS;
+    timeout_ms = 1000;
+    bZlpAware = true;
+    rxHead = rxCount = 0;
+    inPending = outPending = 0;
+    outError = ERROR_SUCCESS;
+    outDone = 0;
+    bDeviceGone = false;
+    bClosing = false;
+    bRunning = false;
+}
+
+
+UsbTransport::~UsbTransport() {
+    Close();
+}
+
+
+void UsbTransport::SetUrbCount(int inUrbs, int outUrbs) {
+    if (IsOpen()) {
+        LWARN("UsbTransport::SetUrbCount", "设备已打开，传输数量的修改不会生效");
+        return;
+    }
+    nInUrbs = max(1, inUrbs);
+    nOutUrbs = max(1, outUrbs);
+}
+
+
+int UsbTransport::SetTimeout(int miliseconds) {
+    timeout_ms = miliseconds;
+    return ERROR_SUCCESS;
+}
+
+
+int UsbTransport::FindEndpoints() {
+    libusb_device* dev = libusb_get_device(hDev);
+    libusb_config_descriptor* config = nullptr;
+    int ret = libusb_get_active_config_descriptor(dev, &config);
+    if (ret != LIBUSB_SUCCESS) return LibusbToError(ret);
+
+    // 找到第一个同时有bulk-IN和bulk-OUT端点的接口
+    int status = ERROR_FILE_NOT_FOUND;
+    for (int i = 0; i < config->bNumInterfaces && status != ERROR_SUCCESS; i++) {
+        for (int a = 0; a < config->interface[i].num_altsetting; a++) {
+            const libusb_interface_descriptor* desc = &config->interface[i].altsetting[a];
+            uint8_t in = 0, out = 0;
+            int mps = 0;
+            for (int e = 0; e < desc->bNumEndpoints; e++) {
+                const libusb_endpoint_descriptor* ep = &desc->endpoint[e];
+                if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK) continue;
+                if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+                    if (!in) in = ep->bEndpointAddress;
+                } else if (!out) {
+                    out = ep->bEndpointAddress;
+                    mps = ep->wMaxPacketSize;
+                }
+            }
+            if (in && out) {
+                iface = desc->bInterfaceNumber;
+                epIn = in;
+                epOut = out;
+                wMaxPacketSize = mps ? mps : 512;
+                status = ERROR_SUCCESS;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return status;
+}
+
+
+int UsbTransport::Open(uint16_t vid, uint16_t pid, int index) {
+    if (IsOpen()) Close();
+    int ret = libusb_init(&ctx);
+    if (ret != LIBUSB_SUCCESS) {
+        LERROR("UsbTransport::Open", "libusb初始化失败：%s", libusb_error_name(ret));
+        ctx = nullptr;
+        return LibusbToError(ret);
+    }
+
+    libusb_device** list = nullptr;
+    ssize_t cnt = libusb_get_device_list(ctx, &list);
+    int found = 0;
+    ret = LIBUSB_ERROR_NOT_FOUND;
+    for (ssize_t i = 0; i < cnt; i++) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS) continue;
+        if (desc.idVendor != vid || desc.idProduct != pid) continue;
+        if (found++ != index) continue;
+        ret = libusb_open(list[i], &hDev);
+        break;
+    }
+    if (list) libusb_free_device_list(list, 1);
+    if (ret != LIBUSB_SUCCESS) {
+        LERROR("UsbTransport::Open", "无法打开USB设备%04x:%04x#%d：%s", vid, pid, index, libusb_error_name(ret));
+        hDev = nullptr;
+        libusb_exit(ctx);
+        ctx = nullptr;
+        return LibusbToError(ret);
+    }
+
+    int status = FindEndpoints();
+    if (status != ERROR_SUCCESS) {
+        LERROR("UsbTransport::Open", "USB设备%04x:%04x#%d上没有找到bulk端点", vid, pid, index);
+        Close();
+        return status;
+    }
+    // qcserial之类的驱动可能已经占用了这个接口
+    libusb_set_auto_detach_kernel_driver(hDev, 1);
+    ret = libusb_claim_interface(hDev, iface);
+    if (ret != LIBUSB_SUCCESS) {
+        LERROR("UsbTransport::Open", "无法声明接口%d：%s", iface, libusb_error_name(ret));
+        iface = -1;
+        Close();
+        return LibusbToError(ret);
+    }
+
+    rxRing.clear();
+    rxRing.resize(max<size_t>(USB_RX_RING_SIZE, (size_t) (nInUrbs + 1) * USB_IN_URB_SIZE));
+    rxHead = rxCount = 0;
+    bDeviceGone = false;
+    bClosing = false;
+    bRunning = true;
+    eventThread = thread(&UsbTransport::EventLoop, this);
+
+    {
+        lock_guard<mutex> lock(mtx);
+        for (int i = 0; i < nInUrbs; i++) {
+            libusb_transfer* xfer = libusb_alloc_transfer(0);
+            uint8_t* buf = (uint8_t*) malloc(USB_IN_URB_SIZE);
+            if (!xfer || !buf) {
+                if (xfer) libusb_free_transfer(xfer);
+                if (buf) free(buf);
+                break;
+            }
+            libusb_fill_bulk_transfer(xfer, hDev, epIn, buf, USB_IN_URB_SIZE, InCallback, this, 0);
+            inXfers.push_back(xfer);
+            inBufs.push_back(buf);
+            SubmitIn(xfer);
+        }
+    }
+    if (inPending == 0) {
+        LERROR("UsbTransport::Open", "无法提交bulk-IN传输");
+        Close();
+        return ERROR_GEN_FAILURE;
+    }
+    LDEBUG("UsbTransport::Open", "USB设备%04x:%04x#%d打开成功，接口%d，IN=0x%02x，OUT=0x%02x，wMaxPacketSize=%d，IN队列%d个",
+        vid, pid, index, iface, epIn, epOut, wMaxPacketSize, inPending);
+    return ERROR_SUCCESS;
+}
+
+
+int UsbTransport::Close() {
+    if (bRunning) {
+        unique_lock<mutex> lock(mtx);
+        // 回调不再重新提交IN传输，然后取消所有在途的IN和OUT传输
+        bClosing = true;
+        for (libusb_transfer* xfer : inFlight) libusb_cancel_transfer(xfer);
+        for (libusb_transfer* xfer : outFlight) libusb_cancel_transfer(xfer);
+        // 回调都是在事件线程里跑的，等它把取消的传输都收回来再停线程
+        cvTx.wait_for(lock, chrono::milliseconds(2000), [this] { return inPending == 0 && outPending == 0; });
+        if (inPending || outPending) {
+            LWARN("UsbTransport::Close", "还有%d个IN传输和%d个OUT传输没有结束，它们仍归libusb所有，不会被释放", inPending, outPending);
+        }
+        lock.unlock();
+        bRunning = false;
+        if (eventThread.joinable()) eventThread.join();
+    }
+    FreeTransfers();
+    if (hDev) {
+        if (iface >= 0) libusb_release_interface(hDev, iface);
+        libusb_close(hDev);
+        hDev = nullptr;
+    }
+    iface = -1;
+    if (ctx) {
+        libusb_exit(ctx);
+        ctx = nullptr;
+    }
+    return ERROR_SUCCESS;
+}
+
+
+// 还在libusb手里的传输不能释放，只能留着；其余的IN传输和缓冲区都释放掉
+void UsbTransport::FreeTransfers() {
+    for (size_t i = 0; i < inXfers.size(); i++) {
+        if (find(inFlight.begin(), inFlight.end(), inXfers[i]) != inFlight.end()) continue;
+        libusb_free_transfer(inXfers[i]);
+        free(inBufs[i]);
+    }
+    inXfers.clear();
+    inBufs.clear();
+    parkedIn.clear();
+    inFlight.clear();
+    outFlight.clear();
+}
+
+
+void UsbTransport::EventLoop() {
+    timeval tv = {0, 100000};
+    while (bRunning) {
+        int ret = libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+        if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+            LWARN("UsbTransport::EventLoop", "处理USB事件出错：%s", libusb_error_name(ret));
+        }
+    }
+}
+
+
+// 调用前需要持有mtx
+int UsbTransport::SubmitIn(libusb_transfer* xfer) {
+    int ret = libusb_submit_transfer(xfer);
+    if (ret != LIBUSB_SUCCESS) {
+        LWARN("UsbTransport::SubmitIn", "提交bulk-IN传输失败：%s", libusb_error_name(ret));
+        if (ret == LIBUSB_ERROR_NO_DEVICE) bDeviceGone = true;
+        return LibusbToError(ret);
+    }
+    inPending++;
+    inFlight.push_back(xfer);
+    return ERROR_SUCCESS;
+}
+
+
+void LIBUSB_CALL UsbTransport::InCallback(libusb_transfer* xfer) {
+    UsbTransport* self = (UsbTransport*) xfer->user_data;
+    lock_guard<mutex> lock(self->mtx);
+    self->inPending--;
+    auto it = find(self->inFlight.begin(), self->inFlight.end(), xfer);
+    if (it != self->inFlight.end()) self->inFlight.erase(it);
+    switch (xfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED: {
+            // 零长度包只是表示一次传输结束，不需要往缓冲区里放东西
+            size_t cap = self->rxRing.size();
+            size_t tail = (self->rxHead + self->rxCount) % cap;
+            size_t len = xfer->actual_length;
+            size_t first = min(len, cap - tail);
+            memcpy(&self->rxRing[tail], xfer->buffer, first);
+            memcpy(&self->rxRing[0], xfer->buffer + first, len - first);
+            self->rxCount += len;
+            if (len) self->cvRx.notify_all();
+            break;
+        }
+        case LIBUSB_TRANSFER_CANCELLED:
+            self->cvTx.notify_all();
+            return;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            LWARN("UsbTransport::InCallback", "USB设备已断开");
+            self->bDeviceGone = true;
+            self->cvRx.notify_all();
+            self->cvTx.notify_all();
+            return;
+        default:
+            LWARN("UsbTransport::InCallback", "bulk-IN传输出错，状态：%d", xfer->status);
+            break;
+    }
+    if (!self->bRunning || self->bClosing) {
+        self->cvTx.notify_all();
+        return;
+    }
+    // 只有剩余空间足够容纳所有在途的传输时才继续提交，否则等Read腾出空间
+    size_t freeSpace = self->rxRing.size() - self->rxCount;
+    if (freeSpace >= (size_t) (self->inPending + 1) * USB_IN_URB_SIZE) {
+        self->SubmitIn(xfer);
+    } else {
+        self->parkedIn.push_back(xfer);
+    }
+}
+
+
+void LIBUSB_CALL UsbTransport::OutCallback(libusb_transfer* xfer) {
+    UsbTransport* self = (UsbTransport*) xfer->user_data;
+    lock_guard<mutex> lock(self->mtx);
+    self->outPending--;
+    auto it = find(self->outFlight.begin(), self->outFlight.end(), xfer);
+    if (it != self->outFlight.end()) self->outFlight.erase(it);
+    self->outDone += xfer->actual_length;
+    if (xfer->status != LIBUSB_TRANSFER_COMPLETED && self->outError == ERROR_SUCCESS) {
+        self->outError = TransferStatusToError(xfer->status);
+        if (xfer->status == LIBUSB_TRANSFER_NO_DEVICE) self->bDeviceGone = true;
+    }
+    self->cvTx.notify_all();
+}
+
+
+// 调用前需要持有mtx
+int UsbTransport::SubmitOut(const uint8_t* data, int length) {
+    libusb_transfer* xfer = libusb_alloc_transfer(0);
+    if (!xfer) return ERROR_NOT_ENOUGH_MEMORY;
+    // Write会等所有传输结束才返回，所以直接用调用者的缓冲区，不用再复制一份
+    libusb_fill_bulk_transfer(xfer, hDev, epOut, (unsigned char*) data, length, OutCallback, this, timeout_ms);
+    xfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
+    int ret = libusb_submit_transfer(xfer);
+    if (ret != LIBUSB_SUCCESS) {
+        libusb_free_transfer(xfer);
+        return LibusbToError(ret);
+    }
+    outPending++;
+    outFlight.push_back(xfer);
+    return ERROR_SUCCESS;
+}
+
+
+int UsbTransport::Write(const uint8_t* data, uint32_t length, uint32_t* bytesWritten) {
+    if (bytesWritten) *bytesWritten = 0;
+    if (!IsOpen()) return ERROR_INVALID_HANDLE;
+    unique_lock<mutex> lock(mtx);
+    if (bDeviceGone) return ERROR_DEVICE_NOT_CONNECTED;
+    outError = ERROR_SUCCESS;
+    outDone = 0;
+    int status = ERROR_SUCCESS;
+    for (uint32_t offset = 0; offset < length && outError == ERROR_SUCCESS; ) {
+        cvTx.wait(lock, [this] { return outPending < nOutUrbs || outError != ERROR_SUCCESS; });
+        if (outError != ERROR_SUCCESS) break;
+        int chunk = (int) min<uint32_t>(length - offset, USB_OUT_URB_SIZE);
+        status = SubmitOut(data + offset, chunk);
+        if (status != ERROR_SUCCESS) break;
+        offset += chunk;
+    }
+    // 长度刚好是包长整数倍时设备分不清传输是否结束，需要补一个零长度包
+    if (status == ERROR_SUCCESS && outError == ERROR_SUCCESS &&
+        bZlpAware && length > 0 && (length % wMaxPacketSize) == 0) {
+        status = SubmitOut(data, 0);
+    }
+    // OUT传输自带超时，这里只需要等它们全部结束
+    cvTx.wait(lock, [this] { return outPending == 0; });
+    if (status == ERROR_SUCCESS) status = outError;
+    if (bytesWritten) *bytesWritten = outDone;
+    if (status != ERROR_SUCCESS) {
+        LWARN("UsbTransport::Write", "bulk-OUT传输失败，已写入%d/%d字节，状态：%d", outDone, length, status);
+    }
+    return status;
+}
+
+
+int UsbTransport::Read(uint8_t* data, uint32_t* length) {
+    if (!IsOpen()) {
+        *length = 0;
+        return ERROR_INVALID_HANDLE;
+    }
+    unique_lock<mutex> lock(mtx);
+    cvRx.wait_for(lock, chrono::milliseconds(timeout_ms), [this] { return rxCount > 0 || bDeviceGone; });
+    if (rxCount == 0) {
+        *length = 0;
+        return bDeviceGone ? ERROR_DEVICE_NOT_CONNECTED : ERROR_SUCCESS;
+    }
+    size_t cap = rxRing.size();
+    size_t len = min<size_t>(*length, rxCount);
+    size_t first = min(len, cap - rxHead);
+    memcpy(data, &rxRing[rxHead], first);
+    memcpy(data + first, &rxRing[0], len - first);
+    rxHead = (rxHead + len) % cap;
+    rxCount -= len;
+    *length = (uint32_t) len;
+
+    // 腾出空间之后把之前停下来的IN传输重新提交
+    while (!bClosing && !parkedIn.empty() && cap - rxCount >= (size_t) (inPending + 1) * USB_IN_URB_SIZE) {
+        libusb_transfer* xfer = parkedIn.back();
+        parkedIn.pop_back();
+        if (SubmitIn(xfer) != ERROR_SUCCESS) break;
+    }
+    return ERROR_SUCCESS;
+}
+
+
+uint32_t UsbTransport::BytesAvailable() {
+    lock_guard<mutex> lock(mtx);
+    return (uint32_t) rxCount;
+}
+
+
+int UsbTransport::Flush() {
+    lock_guard<mutex> lock(mtx);
+    rxHead = rxCount = 0;
+    while (!bClosing && !parkedIn.empty()) {
+        libusb_transfer* xfer = parkedIn.back();
+        parkedIn.pop_back();
+        if (SubmitIn(xfer) != ERROR_SUCCESS) break;
+    }
+    return ERROR_SUCCESS;
+}
@@ -1,6 +1,5 @@
 #include "spddump/BMPlatform.h"
 #include <iostream>
-extern "C" { extern int m_bOpened; }
 
 CBMPlatformApp::CBMPlatformApp() {
 	// TODO: add construction code here,
@@ -102,14 +101,13 @@ BOOL CBootModeOpr::ConnectChannel(DWORD dwPort, ULONG ulMsgId, DWORD Receiver) {
 	ca.Com.dwPortNum = dwPort;
 	ca.Com.dwBaudRate = 115200;
 
-	m_bOpened = m_pChannel->Open(&ca);
-	if (m_bOpened) std::cout << "Successfully connected to port: " << dwPort << std::endl;
-	return m_bOpened;
+	BOOL bOpened = m_pChannel->Open(&ca);
+	if (bOpened) std::cout << "Successfully connected to port: " << dwPort << std::endl;
+	return bOpened;
 }
 
 BOOL CBootModeOpr::DisconnectChannel() {
 	m_pChannel->Close();
-	m_bOpened = 0;
 	return TRUE;
 }
 
@@ -1,6 +1,10 @@
 #include "spddump/common.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <string>
 #if !USE_LIBUSB
-DWORD curPort = 0;
 DWORD* FindPort(const char* USB_DL) {
 	const GUID GUID_DEVCLASS_PORTS = { 0x4d36e978, 0xe325, 0x11ce,{0xbf, 0xc1, 0x08, 0x00, 0x2b, 0xe1, 0x03, 0x18} };
 	HDEVINFO DeviceInfoSet;
@@ -51,13 +55,51 @@ DWORD* FindPort(const char* USB_DL) {
 	return ports;
 }
 #else
-libusb_device* curPort = NULL;
-libusb_device** FindPort(int pid) {
+// the port path of dev as "bus-port.port", it stays the same while the device re-enumerates
+static void usb_port_path(libusb_device* dev, char* buf, size_t size) {
+	uint8_t path[8];
+	int depth = libusb_get_port_numbers(dev, path, sizeof(path));
+	int n = snprintf(buf, size, "%d-", libusb_get_bus_number(dev));
+	for (int j = 0; j < depth && n < (int) size; j++)
+		n += snprintf(buf + n, size - n, j ? ".%d" : "%d", path[j]);
+}
+
+static std::mutex usb_bind_mtx;
+static std::map<std::string, spdio_t*> usb_bound;	// port path -> the session using it
+
+// reserves a port path for io: from then on it only opens the device on that port,
+// and the other sessions of the process leave that device alone. returns 0 if another session has it
+int usb_bind(spdio_t* io, const char* path) {
+	if (io->usb_path[0]) return !strcmp(io->usb_path, path);
+	std::lock_guard<std::mutex> lock(usb_bind_mtx);
+	spdio_t*& owner = usb_bound[path];
+	if (owner && owner != io) return 0;
+	owner = io;
+	snprintf(io->usb_path, sizeof(io->usb_path), "%s", path);
+	return 1;
+}
+
+// whether io may use dev, binds io to its port if it has none yet
+int usb_claim(spdio_t* io, libusb_device* dev) {
+	char path[sizeof(io->usb_path)];
+	usb_port_path(dev, path, sizeof(path));
+	return usb_bind(io, path);
+}
+
+void usb_unbind(spdio_t* io) {
+	if (!io->usb_path[0]) return;
+	std::lock_guard<std::mutex> lock(usb_bind_mtx);
+	auto it = usb_bound.find(io->usb_path);
+	if (it != usb_bound.end() && it->second == io) usb_bound.erase(it);
+	io->usb_path[0] = 0;
+}
+
+libusb_device** FindPort(libusb_context* ctx, int pid) {
 	libusb_device** devs;
 	int usb_cnt, count = 0;
 	libusb_device** ports = NULL;
 
-	usb_cnt = libusb_get_device_list(NULL, &devs);
+	usb_cnt = libusb_get_device_list(ctx, &devs);
 	if (usb_cnt < 0) {
 		DBG_LOG("Get device list error\n");
 		return NULL;
@@ -82,6 +124,10 @@ libusb_device** FindPort(int pid) {
 			ports = temp;
 			ports[count++] = dev;
 			libusb_ref_device(dev);
+			// devices on the same host controller share its bandwidth, log the topology to help with slow multi-device runs
+			char topo[32];
+			usb_port_path(dev, topo, sizeof(topo));
+			DBG_LOG("Found device %04x:%04x on port %s\n", desc.idVendor, desc.idProduct, topo);
 		}
 	}
 	libusb_free_device_list(devs, 1);
@@ -102,9 +148,6 @@ void usleep(unsigned int us) {
 }
 #endif
 
-extern int bListenLibusb;
-extern int m_bOpened;
-
 void print_mem(FILE* f, const uint8_t* buf, size_t len) {
 	size_t i; int a, j, n;
 	for (i = 0; i < len; i += 16) {
@@ -212,11 +255,6 @@ void find_endpoints(libusb_device_handle* dev_handle, int result[2]) {
 
 #define RECV_BUF_LEN (0x8000)
 
-char fn_partlist[40] = { 0 };
-char savepath[ARGV_LEN] = { 0 };
-DA_INFO_T Da_Info;
-partition_t gPartInfo;
-
 spdio_t* spdio_init(int flags) {
 	uint8_t* p; spdio_t* io;
 
@@ -232,33 +270,88 @@ spdio_t* spdio_init(int flags) {
 	io->untranscode_buf = p; p += 4 + 0x10000 + 4;
 	io->enc_buf = p;
 	io->timeout = 1000;
+	// recv_msg sends the chunk again after a timeout, so the ACK wait never drops below the
+	// old fixed values: a slow flash commit must not get a duplicate MIDST_DATA
+	io->rtt_cmd.Init("cmd", 15000, 15000, 60000);
+	io->rtt_long.Init("simg", 100000, 100000, 300000);
+	io->bListenLibusb = -1;
+	io->selected_ab = -1;
+	io->gpt_failed = 1;
+	io->recv_plen = 6;
+	io->read_window = DEFAULT_READ_WINDOW;
+	io->feed_depth = DEFAULT_FEED_DEPTH;
+	io->part_rmw = 2;
+#if USE_LIBUSB
+	io->recv_ring_slots = DEFAULT_RECV_RING;
+#endif
 	memset(io->recv_buf, 0, 8);
 	return io;
 }
 
 void spdio_free(spdio_t* io) {
 	if (!io) return;
+	if (io->verbose >= 1) {
+		if (io->rtt_cmd.samples) DBG_LOG("latency (%s): %s\n", io->rtt_cmd.name, io->rtt_cmd.Describe().c_str());
+		if (io->rtt_long.samples) DBG_LOG("latency (%s): %s\n", io->rtt_long.name, io->rtt_long.Describe().c_str());
+	}
 #if _WIN32
-	if (!bListenLibusb) {
+	if (!io->bListenLibusb) {
 		PostThreadMessage(io->iThread, WM_QUIT, 0, 0);
 		WaitForSingleObject(io->hThread, INFINITE);
 		CloseHandle(io->hThread);
 	}
 #endif
 #if USE_LIBUSB
-	if (bListenLibusb) stopUsbEventHandle();
+	recv_ring_stop(io);
+	if (io->bListenLibusb > 0) stopUsbEventHandle(io);
 	libusb_close(io->dev_handle);
-	libusb_exit(NULL);
+	usb_unbind(io);
+	if (io->ctx) libusb_exit(io->ctx);
 #else
-	call_DisconnectChannel(io->handle);
-	if (io->m_dwRecvThreadID) DestroyRecvThread(io);
-	call_Uninitialize(io->handle);
-	destroyClass(io->handle);
+	if (io->handle) {
+		call_DisconnectChannel(io->handle);
+		io->m_bOpened = 0;
+		if (io->m_dwRecvThreadID) DestroyRecvThread(io);
+		call_Uninitialize(io->handle);
+		destroyClass(io->handle);
+	}
 #endif
 	free(io->ptable);
+	free(io->pcache);
 	free(io);
 }
 
+struct spd_error_t {};
+
+// the session running on this thread
+static thread_local spdio_t* spd_session;
+
+void spd_err_exit(void) {
+	if (!spd_session) exit(1);
+	throw spd_error_t();
+}
+
+// runs fn(io, arg) as the session of io on this thread. an ERR_EXIT in it returns -1 from here
+// instead of ending the process, so one failing device does not stop the others.
+// threads of the failed command are stopped on the way out, its buffers and files are not freed.
+int spd_session_run(spdio_t* io, int (*fn)(spdio_t* io, void* arg), void* arg) {
+	spdio_t* outer = spd_session;
+	int ret;
+	spd_session = io;
+	try {
+		ret = fn(io, arg);
+	} catch (const spd_error_t&) {
+		// it pointed into the unwound stack
+		io->feed_keep = NULL;
+#if _WIN32
+		if (io->pause_on_exit) system("pause");
+#endif
+		ret = -1;
+	}
+	spd_session = outer;
+	return ret;
+}
+
 int spd_transcode(uint8_t* dst, uint8_t* src, int len) {
 	int i, a, n = 0;
 	for (i = 0; i < len; i++) {
@@ -296,9 +389,6 @@ unsigned spd_crc16(unsigned crc, const void* src, unsigned len) {
 	return crc;
 }
 
-#define CHK_FIXZERO 1
-#define CHK_ORIG 2
-
 unsigned spd_checksum(unsigned crc, const void* src, int len, int final) {
 	uint8_t* s = (uint8_t*) src;
 
@@ -317,90 +407,100 @@ unsigned spd_checksum(unsigned crc, const void* src, int len, int final) {
 	return crc;
 }
 
-void encode_msg(spdio_t* io, int type, const void* data, size_t len) {
-	uint8_t* p, * p0; unsigned chk;
+// frames a message whose payload is the concatenation of iov[0..cnt). the checksum runs over the
+// views as they are, then with FLAGS_TRANSCODE they are escaped straight into out, otherwise
+// copied to out + 5 unless they are already there. returns the frame length.
+int spd_encode_iov(int flags, int type, const spd_iov_t* iov, int cnt, uint8_t* out) {
+	uint8_t head[4], tail[2], * p;
+	size_t len = 0, l;
+	unsigned chk;
+	int i, n = 0;
 
+	for (i = 0; i < cnt; i++) len += iov[i].len;
 	if (len > 0xffff)
 		ERR_EXIT("message too long\n");
+	WRITE16_BE(head, type);
+	WRITE16_BE(head + 2, len);
 
-	io->send_buf = io->enc_buf;
-	if (type == BSL_CMD_CHECK_BAUD) {
-		memset(io->enc_buf, HDLC_HEADER, len);
-		io->enc_len = len;
-		*(io->untranscode_buf + 1) = HDLC_HEADER;
-		return;
-	}
-
-	p = p0 = io->untranscode_buf + 1;
-	WRITE16_BE(p, type); p += 2;
-	WRITE16_BE(p, len); p += 2;
-	memcpy(p, data, len); p += len;
-
-	len = p - p0;
-	if (io->flags & FLAGS_CRC16)
-		chk = spd_crc16(0, p0, len);
-	else {
-		// if (len & 1) *p++ = 0;
-		chk = spd_checksum(0, p0, len, CHK_FIXZERO);
-	}
-	WRITE16_BE(p, chk); p += 2;
-
-	io->raw_len = len = p - p0;
-
-	if (io->flags & FLAGS_TRANSCODE) {
-		p = io->enc_buf;
-		*p++ = HDLC_HEADER;
-		len = spd_transcode(p, p0, len);
+	if (flags & FLAGS_CRC16) {
+		chk = spd_crc16(0, head, 4);
+		for (i = 0; i < cnt; i++) chk = spd_crc16(chk, iov[i].base, iov[i].len);
+	} else {
+		// 16-bit sums, a view may end in the middle of a word
+		uint8_t carry = 0; int odd = 0;
+		chk = spd_checksum(0, head, 4, 0);
+		for (i = 0; i < cnt; i++) {
+			p = (uint8_t*) iov[i].base; l = iov[i].len;
+			if (odd && l) { chk += p[0] << 8 | carry; p++; l--; odd = 0; }
+			chk = spd_checksum(chk, p, l & ~(size_t) 1, 0);
+			if (l & 1) { carry = p[l - 1]; odd = 1; }
+		}
+		chk = spd_checksum(chk, &carry, odd, CHK_FIXZERO);
+	}
+	WRITE16_BE(tail, chk);
+
+	out[n++] = HDLC_HEADER;
+	if (flags & FLAGS_TRANSCODE) {
+		n += spd_transcode(out + n, head, 4);
+		for (i = 0; i < cnt; i++) n += spd_transcode(out + n, (uint8_t*) iov[i].base, iov[i].len);
+		n += spd_transcode(out + n, tail, 2);
 	} else {
-		p = io->untranscode_buf;
-		*p++ = HDLC_HEADER;
-		io->send_buf = io->untranscode_buf;
+		// the payload first, a view may lie where the header goes
+		for (i = 0, n += 4; i < cnt; i++) {
+			if (out + n != iov[i].base) memmove(out + n, iov[i].base, iov[i].len);
+			n += iov[i].len;
+		}
+		memcpy(out + 1, head, 4);
+		memcpy(out + n, tail, 2); n += 2;
 	}
-	p[len] = HDLC_HEADER;
-	io->enc_len = len + 2;
+	out[n++] = HDLC_HEADER;
+	return n;
 }
 
-void encode_msg_nocpy(spdio_t* io, int type, size_t len) {
-	uint8_t* p, * p0; unsigned chk;
+void encode_msg_iov(spdio_t* io, int type, const spd_iov_t* iov, int cnt) {
+	size_t len = 0; int i;
+	for (i = 0; i < cnt; i++) len += iov[i].len;
+	io->send_buf = io->flags & FLAGS_TRANSCODE ? io->enc_buf : io->untranscode_buf;
+	io->enc_len = spd_encode_iov(io->flags, type, iov, cnt, io->send_buf);
+	io->raw_len = len + 6;
+	// send_msg logs type and size from here
+	WRITE16_BE(io->untranscode_buf + 1, type);
+	WRITE16_BE(io->untranscode_buf + 3, len);
+}
 
+void encode_msg(spdio_t* io, int type, const void* data, size_t len) {
 	if (len > 0xffff)
 		ERR_EXIT("message too long\n");
 
-	io->send_buf = io->enc_buf;
 	if (type == BSL_CMD_CHECK_BAUD) {
+		io->send_buf = io->enc_buf;
 		memset(io->enc_buf, HDLC_HEADER, len);
 		io->enc_len = len;
 		*(io->untranscode_buf + 1) = HDLC_HEADER;
 		return;
 	}
 
-	p = p0 = io->untranscode_buf + 1;
-	WRITE16_BE(p, type); p += 2;
-	WRITE16_BE(p, len); p += 2;
-	p += len;
-
-	len = p - p0;
-	if (io->flags & FLAGS_CRC16)
-		chk = spd_crc16(0, p0, len);
-	else {
-		// if (len & 1) *p++ = 0;
-		chk = spd_checksum(0, p0, len, CHK_FIXZERO);
-	}
-	WRITE16_BE(p, chk); p += 2;
+	spd_iov_t iov = { data, len };
+	encode_msg_iov(io, type, &iov, 1);
+}
 
-	io->raw_len = len = p - p0;
+// the payload is already in io->temp_buf, which is where it goes without transcoding
+void encode_msg_nocpy(spdio_t* io, int type, size_t len) {
+	encode_msg(io, type, io->temp_buf, len);
+}
 
-	if (io->flags & FLAGS_TRANSCODE) {
-		p = io->enc_buf;
-		*p++ = HDLC_HEADER;
-		len = spd_transcode(p, p0, len);
-	} else {
-		p = io->untranscode_buf;
-		*p++ = HDLC_HEADER;
-		io->send_buf = io->untranscode_buf;
-	}
-	p[len] = HDLC_HEADER;
-	io->enc_len = len + 2;
+// writes to the device, or the simulated one, returns the bytes written
+static int port_write(spdio_t* io, uint8_t* buf, int len) {
+	int ret;
+	if (io->sim_send) return io->sim_send(io->sim_ctx, buf, len);
+#if USE_LIBUSB
+	int err = libusb_bulk_transfer(io->dev_handle, io->endp_out, buf, len, &ret, io->timeout);
+	if (err < 0)
+		ERR_EXIT("usb_send failed : %s\n", libusb_error_name(err));
+#else
+	ret = call_Write(io->handle, buf, len);
+#endif
+	return ret;
 }
 
 int send_msg(spdio_t* io) {
@@ -408,10 +508,8 @@ int send_msg(spdio_t* io) {
 	if (!io->enc_len)
 		ERR_EXIT("empty message\n");
 
-	if (m_bOpened == -1) {
-		spdio_free(io);
+	if (io->m_bOpened == -1)
 		ERR_EXIT("device removed, exiting...\n");
-	}
 	if (io->verbose >= 2) {
 		DBG_LOG("send (%d):\n", io->enc_len);
 		print_mem(stderr, io->send_buf, io->enc_len);
@@ -424,35 +522,147 @@ int send_msg(spdio_t* io) {
 		} else DBG_LOG("send: unknown message\n");
 	}
 
-#if USE_LIBUSB
-	int err = libusb_bulk_transfer(io->dev_handle, io->endp_out, io->send_buf, io->enc_len, &ret, io->timeout);
-	if (err < 0)
-		ERR_EXIT("usb_send failed : %s\n", libusb_error_name(err));
-#else
-	ret = call_Write(io->handle, io->send_buf, io->enc_len);
-#endif
+	ret = port_write(io, io->send_buf, io->enc_len);
 	if (ret != io->enc_len)
 		ERR_EXIT("usb_send failed (%d / %d)\n", ret, io->enc_len);
 
 	return ret;
 }
 
+#if USE_LIBUSB
+// IN transfers are kept posted in a ring, so the device doesn't wait for the host to ask for the
+// next packet. transfers on one endpoint complete in the order they were submitted, so the slots
+// are consumed from a FIFO and each is posted again as soon as its data was copied out.
+// completions are handled here or on the hotplug thread, whichever holds the event lock.
+struct recv_ring_t {
+	struct libusb_transfer* xfer[MAX_RECV_RING];
+	int done[MAX_RECV_RING];	// set by recv_ring_cb
+	int fifo[MAX_RECV_RING];	// posted slots in submission order
+	int idle[MAX_RECV_RING];	// slots that failed to post, tried again on the next read
+	int count, first, posted, nidle, stuck;
+	uint8_t* bufs;
+	libusb_context* ctx;
+};
+
+static void LIBUSB_CALL recv_ring_cb(struct libusb_transfer* t) {
+	*(int*) t->user_data = 1;
+}
+
+static int recv_ring_post(spdio_t* io, int i) {
+	recv_ring_t* r = io->recv_ring;
+	r->done[i] = 0;
+	int err = libusb_submit_transfer(r->xfer[i]);
+	if (err == LIBUSB_ERROR_NO_DEVICE)
+		ERR_EXIT("connection closed\n");
+	if (err < 0) {
+		DBG_LOG("usb_recv: posting a transfer failed : %s\n", libusb_error_name(err));
+		r->idle[r->nidle++] = i;
+		return err;
+	}
+	r->fifo[(r->first + r->posted++) % r->count] = i;
+	return 0;
+}
+
+// waits until slot i completes or ms passed, ms <= 0 waits forever
+static int recv_ring_wait(recv_ring_t* r, int i, int ms) {
+	uint64_t deadline = GetTickCount64() + ms;
+	while (!r->done[i]) {
+		int64_t left = ms > 0 ? (int64_t) (deadline - GetTickCount64()) : 1000;
+		if (left <= 0) return 0;
+		struct timeval tv = { (long) (left / 1000), (long) (left % 1000 * 1000) };
+		int err = libusb_handle_events_timeout_completed(r->ctx, &tv, &r->done[i]);
+		if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+			DBG_LOG("libusb_handle_events failed : %s\n", libusb_error_name(err));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int recv_ring_start(spdio_t* io) {
+	int i, n = io->recv_ring_slots > MAX_RECV_RING ? MAX_RECV_RING : io->recv_ring_slots;
+	recv_ring_t* r = (recv_ring_t*) calloc(1, sizeof(recv_ring_t));
+	if (!r || !(r->bufs = (uint8_t*) malloc((size_t) n * RECV_BUF_LEN))) ERR_EXIT("malloc failed\n");
+	r->count = n;
+	r->ctx = io->ctx;
+	for (i = 0; i < n; i++) {
+		if (!(r->xfer[i] = libusb_alloc_transfer(0))) ERR_EXIT("libusb_alloc_transfer failed\n");
+		libusb_fill_bulk_transfer(r->xfer[i], io->dev_handle, io->endp_in,
+			r->bufs + (size_t) i * RECV_BUF_LEN, RECV_BUF_LEN, recv_ring_cb, &r->done[i], 0);
+	}
+	io->recv_ring = r;
+	for (i = 0; i < n; i++) recv_ring_post(io, i);
+	if (!r->posted) {
+		DBG_LOG("usb_recv: falling back to synchronous reads\n");
+		recv_ring_stop(io);
+		io->recv_ring_slots = 0;
+		return 0;
+	}
+	return 1;
+}
+
+// cancels the posted transfers, data they already received is dropped
+void recv_ring_stop(spdio_t* io) {
+	recv_ring_t* r = io->recv_ring;
+	int i, k;
+	if (!r) return;
+	io->recv_ring = NULL;
+	for (k = 0; k < r->posted; k++) libusb_cancel_transfer(r->xfer[r->fifo[(r->first + k) % r->count]]);
+	for (k = 0; k < r->posted; k++)
+		if (!recv_ring_wait(r, r->fifo[(r->first + k) % r->count], 1000)) r->stuck = 1;
+	// a transfer libusb still owns can't be freed, keep its memory rather than corrupt it
+	if (r->stuck) {
+		DBG_LOG("usb_recv: a transfer did not finish cancelling\n");
+		return;
+	}
+	for (i = 0; i < r->count; i++) libusb_free_transfer(r->xfer[i]);
+	free(r->bufs);
+	free(r);
+}
+
+// the next completed transfer into io->recv_buf, returns a libusb error code like libusb_bulk_transfer
+static int recv_ring_read(spdio_t* io, int* len) {
+	recv_ring_t* r = io->recv_ring;
+	while (r->nidle && !recv_ring_post(io, r->idle[--r->nidle]));
+	if (!r->posted) return LIBUSB_ERROR_IO;
+	int i = r->fifo[r->first];
+	if (!recv_ring_wait(r, i, io->timeout)) return LIBUSB_ERROR_TIMEOUT;
+	r->first = (r->first + 1) % r->count;
+	r->posted--;
+	struct libusb_transfer* t = r->xfer[i];
+	int status = t->status;
+	*len = t->actual_length;
+	if (status == LIBUSB_TRANSFER_COMPLETED) memcpy(io->recv_buf, t->buffer, *len);
+	if (status == LIBUSB_TRANSFER_NO_DEVICE) return LIBUSB_ERROR_NO_DEVICE;
+	recv_ring_post(io, i);
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED: return 0;
+	case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+	default: return LIBUSB_ERROR_IO;
+	}
+}
+#endif
+
 int recv_read_data(spdio_t* io) {
 	int len;
 
-	if (m_bOpened == -1) {
-		spdio_free(io);
+	if (io->m_bOpened == -1)
 		ERR_EXIT("device removed, exiting...\n");
-	}
+	if (io->sim_recv) len = io->sim_recv(io->sim_ctx, io->recv_buf, RECV_BUF_LEN, io->timeout);
 #if USE_LIBUSB
-	int err = libusb_bulk_transfer(io->dev_handle, io->endp_in, io->recv_buf, RECV_BUF_LEN, &len, io->timeout);
-	if (err == LIBUSB_ERROR_NO_DEVICE)
-		ERR_EXIT("connection closed\n");
-	else if (err < 0) {
-		DBG_LOG("usb_recv failed : %s\n", libusb_error_name(err)); return 0;
+	else {
+		int err;
+		if (io->recv_ring_slots > 0 && (io->recv_ring || recv_ring_start(io))) err = recv_ring_read(io, &len);
+		else err = libusb_bulk_transfer(io->dev_handle, io->endp_in, io->recv_buf, RECV_BUF_LEN, &len, io->timeout);
+		if (err == LIBUSB_ERROR_NO_DEVICE)
+			ERR_EXIT("connection closed\n");
+		else if (err < 0) {
+			DBG_LOG("usb_recv failed : %s\n", libusb_error_name(err)); return 0;
+		}
 	}
 #else
-	len = call_Read(io->handle, io->recv_buf, RECV_BUF_LEN, io->timeout);
+	else len = call_Read(io->handle, io->recv_buf, RECV_BUF_LEN, io->timeout);
 #endif
 	if (len < 0) {
 		DBG_LOG("usb_recv failed, ret = %d\n", len); return 0;
@@ -468,14 +678,13 @@ int recv_read_data(spdio_t* io) {
 
 int recv_transcode(spdio_t* io, const uint8_t* buf, int buf_len, int* plen) {
 	int a, pos = 0, nread = io->raw_len, head_found = 0;
-	static int esc = 0;
 	if (*plen == 6) nread = 0;
 	if (nread) head_found = 1;
 
 	while (pos < buf_len) {
 		a = buf[pos++];
 		if (io->flags & FLAGS_TRANSCODE) {
-			if (esc && a != (HDLC_HEADER ^ 0x20) &&
+			if (io->recv_esc && a != (HDLC_HEADER ^ 0x20) &&
 				a != (HDLC_ESCAPE ^ 0x20)) {
 				DBG_LOG("unexpected escaped byte (0x%02x)\n", a); return 0;
 			}
@@ -486,14 +695,14 @@ int recv_transcode(spdio_t* io, const uint8_t* buf, int buf_len, int* plen) {
 					DBG_LOG("received message too short\n"); return 0;
 				} else break;
 			} else if (a == HDLC_ESCAPE) {
-				esc = 0x20;
+				io->recv_esc = 0x20;
 			} else {
 				if (!head_found) continue;
 				if (nread >= *plen) {
 					DBG_LOG("received message too long\n"); return 0;
 				}
-				io->raw_buf[nread++] = a ^ esc;
-				esc = 0;
+				io->raw_buf[nread++] = a ^ io->recv_esc;
+				io->recv_esc = 0;
 			}
 		} else {
 			if (!head_found && a == HDLC_HEADER) {
@@ -517,7 +726,6 @@ int recv_transcode(spdio_t* io, const uint8_t* buf, int buf_len, int* plen) {
 	return nread;
 }
 
-extern int fdl1_loaded;
 int recv_check_crc(spdio_t* io) {
 	int a, nread = io->raw_len, plen = READ16_BE(io->raw_buf + 2) + 6;
 
@@ -530,13 +738,13 @@ int recv_check_crc(spdio_t* io) {
 	}
 
 	a = READ16_BE(io->raw_buf + plen - 2);
-	if (fdl1_loaded == 0 && !(io->flags & FLAGS_CRC16)) {
+	if (io->fdl1_loaded == 0 && !(io->flags & FLAGS_CRC16)) {
 		int chk1, chk2;
 		chk1 = spd_crc16(0, io->raw_buf, plen - 2);
 		if (a == chk1) io->flags |= FLAGS_CRC16;
 		else {
 			chk2 = spd_checksum(0, io->raw_buf, plen - 2, CHK_ORIG);
-			if (a == chk2) fdl1_loaded = 1;
+			if (a == chk2) io->fdl1_loaded = 1;
 			else {
 				DBG_LOG("bad checksum (0x%04x, expected 0x%04x or 0x%04x)\n", a, chk1, chk2);
 				return 0;
@@ -586,7 +794,6 @@ int recv_msg_async(spdio_t* io) {
 }
 #endif
 
-extern int fdl2_executed;
 int recv_msg(spdio_t* io) {
 	int ret;
 	for (;;) {
@@ -594,9 +801,9 @@ int recv_msg(spdio_t* io) {
 		else ret = recv_msg_orig(io);
 		// only retry in fdl2 stage
 		if (!ret) {
-			if (fdl2_executed) {
+			if (io->fdl2_executed) {
 			#if !USE_LIBUSB
-				if (io->raw_len) { call_Clear(io->handle); io->raw_len = 0; }
+				if (io->raw_len) { if (io->handle) call_Clear(io->handle); io->raw_len = 0; }
 			#endif
 				send_msg(io);
 				if (io->m_dwRecvThreadID) ret = recv_msg_async(io);
@@ -619,6 +826,15 @@ int recv_msg_timeout(spdio_t* io, int timeout) {
 	return ret;
 }
 
+// wait as long as the measured ACK latency suggests, at least the rtt's minimum
+int recv_msg_rtt(spdio_t* io, RttEstimator* rtt) {
+	uint64_t start = GetTickCount64();
+	int ret = recv_msg_timeout(io, rtt->TimeoutMs());
+	if (ret) rtt->Sample((double) (GetTickCount64() - start));
+	else rtt->OnTimeout();
+	return ret;
+}
+
 unsigned recv_type(spdio_t* io) {
 	//if (io->raw_len < 6) return -1;
 	return READ16_BE(io->raw_buf);
@@ -687,69 +903,380 @@ void send_buf(spdio_t* io,
 	}
 }
 
-size_t send_file(spdio_t* io, const char* fn,
-	uint32_t start_addr, int end_data, unsigned step,
-	unsigned src_offs, unsigned src_size) {
-	uint8_t* mem; size_t size = 0;
-	mem = loadfile(fn, &size, 0);
-	if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-	if ((uint64_t) size >> 32) ERR_EXIT("file too big\n");
-	if (size < src_offs) ERR_EXIT("required offset larger than file size\n");
-	size -= src_offs;
-	if (src_size) {
-		if (size < src_size) DBG_LOG("required size larger than file size\n");
-		else size = src_size;
-	}
-	send_buf(io, start_addr, end_data, step, mem + src_offs, size);
-	free(mem);
-	DBG_LOG("SEND %s to 0x%x\n", fn, start_addr);
-	return size;
-}
-
-FILE* my_fopen(const char* fn, const char* mode) {
-	if (savepath[0]) {
+FILE* my_fopen(spdio_t* io, const char* fn, const char* mode) {
+	if (io->savepath[0]) {
 		char fix_fn[1024];
 		char* ch;
-		if ((ch = strrchr(fn, '/'))) sprintf(fix_fn, "%s/%s", savepath, ch + 1);
-		else if ((ch = strrchr(fn, '\\'))) sprintf(fix_fn, "%s/%s", savepath, ch + 1);
-		else sprintf(fix_fn, "%s/%s", savepath, fn);
+		if ((ch = strrchr(fn, '/'))) sprintf(fix_fn, "%s/%s", io->savepath, ch + 1);
+		else if ((ch = strrchr(fn, '\\'))) sprintf(fix_fn, "%s/%s", io->savepath, ch + 1);
+		else sprintf(fix_fn, "%s/%s", io->savepath, fn);
 		return fopen(fix_fn, mode);
 	} else return fopen(fn, mode);
 }
 
-unsigned dump_flash(spdio_t* io,
-	uint32_t addr, uint32_t start, uint32_t len,
-	const char* fn, unsigned step) {
-	uint32_t n, offset, nread;
-	int ret;
-	FILE* fo = my_fopen(fn, "wb");
-	if (!fo) ERR_EXIT("fopen(dump) failed\n");
 
-	for (offset = start; offset < start + len; ) {
-		uint32_t* data = (uint32_t*) io->temp_buf;
-		n = start + len - offset;
-		if (n > step) n = step;
+#define READ_PROGRESS 1	// print the progress bar
+#define READ_THROTTLE 2	// adaptive flow control when io->fblk_size is set
 
-		WRITE32_BE(data, addr);
-		WRITE32_BE(data + 1, n);
-		WRITE32_BE(data + 2, offset);
+// encodes the request for [offset, offset + n) into io
+typedef void (*read_request_t)(spdio_t* io, uint64_t offset, uint32_t n, void* arg);
 
-		encode_msg_nocpy(io, BSL_CMD_READ_FLASH, 4 * 3);
-		send_msg(io);
-		ret = recv_msg(io);
-		if (!ret) ERR_EXIT("timeout reached\n");
-		if ((ret = recv_type(io)) != BSL_REP_READ_FLASH) {
-			DBG_LOG("unexpected response (0x%04x)\n", ret);
-			break;
+// writes dumped blocks to the file on its own thread, so fwrite overlaps the next USB round trip
+struct dump_writer_t {
+	FILE* fo;
+	uint8_t* bufs;
+	uint32_t* lens;
+	unsigned slot_size, nslots, head, count;
+	int failed, closing;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::thread thread;
+	~dump_writer_t();
+};
+
+static void dump_writer_run(dump_writer_t* w) {
+	std::unique_lock<std::mutex> lock(w->mtx);
+	for (;;) {
+		w->cv.wait(lock, [w] { return w->count || w->closing; });
+		if (!w->count) break;
+		uint8_t* p = w->bufs + (size_t) w->head * w->slot_size;
+		uint32_t n = w->lens[w->head];
+		lock.unlock();
+		int ok = fwrite(p, 1, n, w->fo) == n;
+		lock.lock();
+		if (!ok) w->failed = 1;
+		w->head = (w->head + 1) % w->nslots;
+		w->count--;
+		w->cv.notify_all();
+	}
+}
+
+static void dump_writer_start(dump_writer_t* w, FILE* fo, unsigned slot_size, unsigned nslots) {
+	w->fo = fo;
+	w->slot_size = slot_size;
+	w->nslots = nslots;
+	w->head = w->count = 0;
+	w->failed = w->closing = 0;
+	w->bufs = (uint8_t*) malloc((size_t) slot_size * nslots);
+	w->lens = (uint32_t*) malloc(nslots * sizeof(uint32_t));
+	if (!w->bufs || !w->lens) ERR_EXIT("malloc failed\n");
+	w->thread = std::thread(dump_writer_run, w);
+}
+
+// copies one block into the queue, waits while the queue is full
+static void dump_writer_push(dump_writer_t* w, const uint8_t* src, uint32_t n) {
+	std::unique_lock<std::mutex> lock(w->mtx);
+	w->cv.wait(lock, [w] { return w->count < w->nslots; });
+	unsigned slot = (w->head + w->count) % w->nslots;
+	lock.unlock();
+	memcpy(w->bufs + (size_t) slot * w->slot_size, src, n);
+	lock.lock();
+	w->lens[slot] = n;
+	w->count++;
+	w->cv.notify_all();
+}
+
+// flushes the queue, returns nonzero if any fwrite failed
+static int dump_writer_finish(dump_writer_t* w) {
+	{
+		std::lock_guard<std::mutex> lock(w->mtx);
+		w->closing = 1;
+	}
+	w->cv.notify_all();
+	w->thread.join();
+	free(w->bufs);
+	free(w->lens);
+	return w->failed;
+}
+
+// an ERR_EXIT unwinds past a running writer, its thread must not outlive it
+dump_writer_t::~dump_writer_t() {
+	if (thread.joinable()) dump_writer_finish(this);
+}
+
+// message parser that keeps the bytes after a message in recv_buf,
+// since with several requests in flight one USB transfer may hold more than one reply
+typedef struct {
+	int in_frame, esc, nread, plen;
+	int tail;	// the closing header of the last message has not been read yet
+} read_stream_t;
+
+static int recv_msg_stream(spdio_t* io, read_stream_t* s) {
+	for (;;) {
+		while (io->recv_pos < io->recv_len) {
+			int a = io->recv_buf[io->recv_pos++];
+			s->tail = 0;
+			if (a == HDLC_HEADER && (!s->in_frame || !s->nread || (io->flags & FLAGS_TRANSCODE))) {
+				if (s->in_frame && s->nread) {
+					DBG_LOG("received message too short\n"); return 0;
+				}
+				s->in_frame = 1; s->esc = 0; s->nread = 0; s->plen = 6;
+				continue;
+			}
+			if (!s->in_frame) continue;
+			if ((io->flags & FLAGS_TRANSCODE) && a == HDLC_ESCAPE) {
+				s->esc = 0x20;
+				continue;
+			}
+			if (s->esc && a != (HDLC_HEADER ^ 0x20) && a != (HDLC_ESCAPE ^ 0x20)) {
+				DBG_LOG("unexpected escaped byte (0x%02x)\n", a); return 0;
+			}
+			io->raw_buf[s->nread++] = a ^ s->esc;
+			s->esc = 0;
+			if (s->nread == 4) s->plen = READ16_BE(io->raw_buf + 2) + 6;
+			if (s->nread < 4 || s->nread < s->plen) continue;
+			// a complete message, the closing header is skipped as the next opening one
+			io->raw_len = s->nread;
+			s->in_frame = 0;
+			s->tail = 1;
+			if (!recv_check_crc(io)) return 0;
+			if (recv_type(io) != BSL_REP_LOG) return io->raw_len;
+			DBG_LOG("BSL_REP_LOG: ");
+			print_string(stderr, io->raw_buf + 4, READ16_BE(io->raw_buf + 2));
+		}
+		io->recv_pos = io->recv_len = 0;
+		if (!recv_read_data(io)) return 0;
+	}
+}
+
+// discards everything the device still sends, to resynchronize after a failed pipelined read
+static void recv_drain(spdio_t* io) {
+	int old = io->verbose;
+	io->verbose = 0;
+	while (recv_read_data(io));
+	io->verbose = old;
+#if !USE_LIBUSB
+	if (io->handle) call_Clear(io->handle);
+#endif
+	io->recv_pos = io->recv_len = 0;
+	io->raw_len = 0;
+}
+
+#define FLOW_MIN_PAUSE 20	// ms, first pause after a congestion sign
+#define FLOW_MAX_PAUSE 1000	// ms, the old fixed pause
+#define FLOW_MAX_RETRY 4	// failed batches in a row before giving up
+#define FLOW_SPIKE_SAMPLES 8	// replies to learn the normal latency before judging spikes
+
+// closed-loop throttle for weak FDLs, enabled by fblk_size.
+// a timeout, a transient error reply or a reply much slower than usual is a sign of congestion:
+// the window is halved and requests are spaced out by a pause that doubles on each sign.
+// every fblk_size bytes read without one, the pause is halved, then the window grows back by one.
+struct read_flow_t {
+	RttEstimator rtt;	// latency of one reply
+	uint64_t quiet;	// bytes read since the last congestion sign
+	unsigned pause;	// ms before each batch, 0: none
+	int window, max_window, retries;
+	unsigned backoffs;
+	uint64_t paused;	// ms spent pausing
+};
+
+static void read_flow_init(read_flow_t* fc, int window) {
+	memset(fc, 0, sizeof(*fc));
+	fc->rtt.Init("read", 0, 0, 0);
+	fc->window = fc->max_window = window;
+}
+
+static void read_flow_log(read_flow_t* fc, uint64_t offset, const char* what) {
+	DBG_LOG("\nflow control: %s at 0x%llx, window %d, pause %u ms\n",
+		what, (long long) offset, fc->window, fc->pause);
+}
+
+// the device is congested; returns 0 once the same batch failed too often
+static int read_flow_backoff(read_flow_t* fc, uint64_t offset, const char* what) {
+	fc->pause = fc->pause ? fc->pause * 2 : FLOW_MIN_PAUSE;
+	if (fc->pause > FLOW_MAX_PAUSE) fc->pause = FLOW_MAX_PAUSE;
+	if (fc->window > 1) fc->window /= 2;
+	fc->quiet = 0;
+	fc->backoffs++;
+	read_flow_log(fc, offset, what);
+	return ++fc->retries <= FLOW_MAX_RETRY;
+}
+
+// error replies that a busy FDL gives for a read it would serve later
+static int read_flow_transient(unsigned type) {
+	return type == BSL_REP_OPERATION_FAILED || type == BSL_REP_READ_FLASH_ERROR || type == BSL_REP_MALLOC_ERROR;
+}
+
+// a batch of count replies arrived in ms, quiet for nread bytes
+static void read_flow_ok(spdio_t* io, read_flow_t* fc, uint64_t offset, uint64_t ms, int count, uint64_t nread) {
+	double per = (double) ms / count;
+	int spike = fc->rtt.samples >= FLOW_SPIKE_SAMPLES &&
+		per > 2 * fc->rtt.srtt && per > fc->rtt.srtt + 4 * fc->rtt.rttvar + 10;
+	fc->rtt.Sample(per);
+	fc->retries = 0;
+	if (spike) {
+		char what[48];
+		snprintf(what, sizeof(what), "slow reply (%.0f ms)", per);
+		read_flow_backoff(fc, offset, what);
+		fc->retries = 0;
+		return;
+	}
+	fc->quiet += nread;
+	if (fc->quiet < io->fblk_size) return;
+	fc->quiet = 0;
+	if (fc->pause) {
+		fc->pause = fc->pause / 2 < FLOW_MIN_PAUSE ? 0 : fc->pause / 2;
+		read_flow_log(fc, offset, "ramp up");
+	} else if (fc->window < fc->max_window) {
+		fc->window++;
+		read_flow_log(fc, offset, "ramp up");
+	}
+}
+
+// reads [start, start + len) sending up to read_window requests back to back.
+// replies carry no offset and come back in order, so a request the FDL loses only shows up as a
+// missing reply at the end of its batch; a batch is written out only after all of its replies
+// arrived. if that fails the batch is read again one request at a time, and so is the rest.
+static uint64_t read_pipelined(spdio_t* io, uint64_t start, uint64_t len, unsigned step,
+	read_request_t request, void* arg, FILE* fo, int flags) {
+	uint64_t end = start + len, offset = start;
+	uint32_t n, nread;
+	int ret, i, count;
+	int window = io->read_window < 1 ? 1 : io->read_window > MAX_READ_WINDOW ? MAX_READ_WINDOW : io->read_window;
+	read_stream_t s = { 0 };
+	dump_writer_t w;
+
+	// the Windows receive thread has room for one reply only
+	if (io->m_dwRecvThreadID) window = 1;
+	read_flow_t fc;
+	int throttle = (flags & READ_THROTTLE) && io->fblk_size;
+	if (throttle) read_flow_init(&fc, window);
+	uint8_t* batch = (uint8_t*) malloc((size_t) step * window);
+	uint32_t* lens = (uint32_t*) malloc(window * sizeof(uint32_t));
+	if (!batch || !lens) ERR_EXIT("malloc failed\n");
+	dump_writer_start(&w, fo, step, window * 2);
+	io->recv_pos = io->recv_len = 0;
+
+	unsigned long long time_start = GetTickCount64();
+	while ((n = (uint32_t) (end - offset > step ? step : end - offset))) {
+		if (throttle) {
+			window = fc.window;
+			if (fc.pause) { usleep(fc.pause * 1000); fc.paused += fc.pause; }
+		}
+		uint64_t t0 = GetTickCount64();
+		if (window > 1) {
+			uint64_t pos = offset;
+			for (count = 0; count < window && pos < end; count++) {
+				lens[count] = (uint32_t) (end - pos > step ? step : end - pos);
+				request(io, pos, lens[count], arg);
+				send_msg(io);
+				pos += lens[count];
+			}
+			// every reply is received even after a short one, so nothing is left in flight
+			int last = count - 1, failed = 0;
+			for (i = 0; i < count; i++) {
+				if (!recv_msg_stream(io, &s)) { failed = 1; break; }
+				if ((ret = recv_type(io)) != BSL_REP_READ_FLASH ||
+					(nread = READ16_BE(io->raw_buf + 2)) > lens[i]) {
+					failed = ret != BSL_REP_READ_FLASH ? ret : 2;
+					break;
+				}
+				if (i > last) continue;
+				if (nread != lens[i]) last = i;
+				memcpy(batch + (size_t) i * step, io->raw_buf + 4, nread);
+				lens[i] = nread;
+			}
+			if (failed) {
+				recv_drain(io);
+				memset(&s, 0, sizeof(s));
+				if (throttle && (failed == 1 || read_flow_transient(failed))) {
+					char what[48];
+					if (failed == 1) strcpy(what, "timeout");
+					else snprintf(what, sizeof(what), "error reply 0x%04x", failed);
+					if (read_flow_backoff(&fc, offset, what)) continue;
+				}
+				DBG_LOG("\npipelined read failed at 0x%llx, falling back to one request at a time\n", (long long) offset);
+				DBG_LOG("(use `read_window N` to enable it again)\n");
+				window = io->read_window = 1;
+				if (throttle) { fc.window = fc.max_window = 1; fc.retries = 0; }
+				continue;
+			}
+			count = last + 1;
+		} else {
+			request(io, offset, n, arg);
+			send_msg(io);
+			ret = recv_msg(io);
+			if (!ret) {
+				if (throttle && read_flow_backoff(&fc, offset, "timeout")) { recv_drain(io); continue; }
+				ERR_EXIT("timeout reached\n");
+			}
+			if ((ret = recv_type(io)) != BSL_REP_READ_FLASH) {
+				if (throttle && read_flow_transient(ret)) {
+					char what[48];
+					snprintf(what, sizeof(what), "error reply 0x%04x", ret);
+					if (read_flow_backoff(&fc, offset, what)) continue;
+				}
+				DBG_LOG("unexpected response (0x%04x)\n", ret);
+				break;
+			}
+			nread = READ16_BE(io->raw_buf + 2);
+			if (n < nread)
+				ERR_EXIT("unexpected length\n");
+			memcpy(batch, io->raw_buf + 4, nread);
+			lens[0] = nread;
+			count = 1;
+		}
+		if (throttle) {
+			uint64_t total = 0;
+			for (i = 0; i < count; i++) total += lens[i];
+			read_flow_ok(io, &fc, offset, GetTickCount64() - t0, count, total);
+		}
+		for (i = 0; i < count; i++) {
+			n = (uint32_t) (end - offset > step ? step : end - offset);
+			nread = lens[i];
+			dump_writer_push(&w, batch + (size_t) i * step, nread);
+			if (flags & READ_PROGRESS) print_progress_bar(io, offset + nread - start, len, time_start);
+			offset += nread;
 		}
-		nread = READ16_BE(io->raw_buf + 2);
-		if (n < nread)
-			ERR_EXIT("unexpected length\n");
-		if (fwrite(io->raw_buf + 4, 1, nread, fo) != nread)
-			ERR_EXIT("fwrite(dump) failed\n");
-		offset += nread;
 		if (n != nread) break;
 	}
+	// recv_msg starts on a fresh transfer, don't leave the closing header for it
+	if (s.tail && io->recv_pos >= io->recv_len) recv_read_data(io);
+	if (throttle && (fc.backoffs || io->verbose))
+		DBG_LOG("\nflow control: %u backoffs, paused %llu ms, latency: %s\n",
+			fc.backoffs, (unsigned long long) fc.paused, fc.rtt.Describe().c_str());
+	free(batch);
+	free(lens);
+	if (dump_writer_finish(&w))
+		ERR_EXIT("fwrite(dump) failed\n");
+	return offset - start;
+}
+
+static void request_read_flash(spdio_t* io, uint64_t offset, uint32_t n, void* arg) {
+	uint32_t* data = (uint32_t*) io->temp_buf;
+	WRITE32_BE(data, *(uint32_t*) arg);
+	WRITE32_BE(data + 1, n);
+	WRITE32_BE(data + 2, (uint32_t) offset);
+	encode_msg_nocpy(io, BSL_CMD_READ_FLASH, 4 * 3);
+}
+
+static void request_read_mem(spdio_t* io, uint64_t offset, uint32_t n, void* arg) {
+	uint32_t* data = (uint32_t*) io->temp_buf;
+	(void) arg;
+	WRITE32_BE(data, (uint32_t) offset);
+	WRITE32_BE(data + 1, n);
+	WRITE32_BE(data + 2, 0); // unused
+	encode_msg_nocpy(io, BSL_CMD_READ_FLASH, 12);
+}
+
+static void request_read_midst(spdio_t* io, uint64_t offset, uint32_t n, void* arg) {
+	uint32_t* data = (uint32_t*) io->temp_buf;
+	uint32_t t32 = offset >> 32;
+	int mode64 = *(int*) arg;
+	WRITE32_LE(data, n);
+	WRITE32_LE(data + 1, offset);
+	WRITE32_LE(data + 2, t32);
+	encode_msg_nocpy(io, BSL_CMD_READ_MIDST, mode64 ? 12 : 8);
+}
+
+unsigned dump_flash(spdio_t* io,
+	uint32_t addr, uint32_t start, uint32_t len,
+	const char* fn, unsigned step) {
+	uint32_t offset;
+	FILE* fo = my_fopen(io, fn, "wb");
+	if (!fo) ERR_EXIT("fopen(dump) failed\n");
+
+	offset = start + (uint32_t) read_pipelined(io, start, len, step, request_read_flash, &addr, fo, 0);
 	DBG_LOG("Read Flash Done: 0x%08x+0x%x, target: 0x%x, read: 0x%x\n", addr, start, len, offset - start);
 	fclose(fo);
 	return offset;
@@ -757,36 +1284,11 @@ unsigned dump_flash(spdio_t* io,
 
 unsigned dump_mem(spdio_t* io,
 	uint32_t start, uint32_t len, const char* fn, unsigned step) {
-	uint32_t n, offset, nread;
-	int ret;
-	FILE* fo = my_fopen(fn, "wb");
+	uint32_t offset;
+	FILE* fo = my_fopen(io, fn, "wb");
 	if (!fo) ERR_EXIT("fopen(dump) failed\n");
 
-	for (offset = start; offset < start + len; ) {
-		uint32_t* data = (uint32_t*) io->temp_buf;
-		n = start + len - offset;
-		if (n > step) n = step;
-
-		WRITE32_BE(data, offset);
-		WRITE32_BE(data + 1, n);
-		WRITE32_BE(data + 2, 0); // unused
-
-		encode_msg_nocpy(io, BSL_CMD_READ_FLASH, 12);
-		send_msg(io);
-		ret = recv_msg(io);
-		if (!ret) ERR_EXIT("timeout reached\n");
-		if ((ret = recv_type(io)) != BSL_REP_READ_FLASH) {
-			DBG_LOG("unexpected response (0x%04x)\n", ret);
-			break;
-		}
-		nread = READ16_BE(io->raw_buf + 2);
-		if (n < nread)
-			ERR_EXIT("unexpected length\n");
-		if (fwrite(io->raw_buf + 4, 1, nread, fo) != nread)
-			ERR_EXIT("fwrite(dump) failed\n");
-		offset += nread;
-		if (n != nread) break;
-	}
+	offset = start + (uint32_t) read_pipelined(io, start, len, step, request_read_mem, NULL, fo, 0);
 	DBG_LOG("Read Mem Done: 0x%08x, target: 0x%x, read: 0x%x\n", start, len, offset - start);
 	fclose(fo);
 	return offset;
@@ -835,13 +1337,11 @@ unsigned long long GetTickCount64() {
 
 #define PROGRESS_BAR_WIDTH 40
 
-void print_progress_bar(uint64_t done, uint64_t total, unsigned long long time0) {
-	static int completed0 = 0;
-	static uint64_t done0 = 0;
+void print_progress_bar(spdio_t* io, uint64_t done, uint64_t total, unsigned long long time0) {
 	unsigned long long time = GetTickCount64();
-	if (completed0 == PROGRESS_BAR_WIDTH) { completed0 = 0; done0 = 0; }
+	if (io->progress_completed == PROGRESS_BAR_WIDTH) { io->progress_completed = 0; io->progress_done = 0; }
 	int completed = (int) (PROGRESS_BAR_WIDTH * done / (double) total);
-	if (completed != completed0) {
+	if (completed != io->progress_completed) {
 		int remaining = PROGRESS_BAR_WIDTH - completed;
 		DBG_LOG("[");
 		for (int i = 0; i < completed; i++) {
@@ -851,17 +1351,16 @@ void print_progress_bar(uint64_t done, uint64_t total, unsigned long long time0)
 			DBG_LOG(" ");
 		}
 		DBG_LOG("]%6.1f%% Speed:%6.2fMb/s\r", 100 * done / (double) total, (double) 1000 * done / (time - time0) / 1024 / 1024);
-		completed0 = completed;
-		done0 = done;
+		io->progress_completed = completed;
+		io->progress_done = done;
 	}
 }
 
-extern uint64_t fblk_size;
 uint64_t dump_partition(spdio_t* io,
 	const char* name, uint64_t start, uint64_t len,
 	const char* fn, unsigned step) {
-	uint32_t n, nread, t32; uint64_t offset, n64, saved_size = 0;
-	int ret, mode64 = (start + len) >> 32;
+	uint64_t offset;
+	int mode64 = (start + len) >> 32;
 	char name_tmp[36];
 
 	if (!strcmp(name, "super")) dump_partition(io, "metadata", 0, check_partition(io, "metadata", 1), "metadata.bin", step);
@@ -882,41 +1381,10 @@ uint64_t dump_partition(spdio_t* io,
 		return 0;
 	}
 
-	FILE* fo = my_fopen(fn, "wb");
+	FILE* fo = my_fopen(io, fn, "wb");
 	if (!fo) ERR_EXIT("fopen(dump) failed\n");
 
-	unsigned long long time_start = GetTickCount64();
-	for (offset = start; (n64 = start + len - offset); ) {
-		uint32_t* data = (uint32_t*) io->temp_buf;
-		n = (uint32_t) (n64 > step ? step : n64);
-
-		WRITE32_LE(data, n);
-		WRITE32_LE(data + 1, offset);
-		t32 = offset >> 32;
-		WRITE32_LE(data + 2, t32);
-
-		encode_msg_nocpy(io, BSL_CMD_READ_MIDST, mode64 ? 12 : 8);
-		send_msg(io);
-		ret = recv_msg(io);
-		if (!ret) ERR_EXIT("timeout reached\n");
-		if ((ret = recv_type(io)) != BSL_REP_READ_FLASH) {
-			DBG_LOG("unexpected response (0x%04x)\n", ret);
-			break;
-		}
-		nread = READ16_BE(io->raw_buf + 2);
-		if (n < nread)
-			ERR_EXIT("unexpected length\n");
-		if (fwrite(io->raw_buf + 4, 1, nread, fo) != nread)
-			ERR_EXIT("fwrite(dump) failed\n");
-		print_progress_bar(offset + nread - start, len, time_start);
-		offset += nread;
-		if (n != nread) break;
-
-		if (fblk_size) {
-			saved_size += nread;
-			if (saved_size >= fblk_size) { usleep(1000000); saved_size = 0; }
-		}
-	}
+	offset = start + read_pipelined(io, start, len, step, request_read_midst, &mode64, fo, READ_PROGRESS | READ_THROTTLE);
 	DBG_LOG("\nRead Part Done: %s+0x%llx, target: 0x%llx, read: 0x%llx\n",
 		name, (long long) start, (long long) len,
 		(long long) (offset - start));
@@ -927,6 +1395,50 @@ uint64_t dump_partition(spdio_t* io,
 	return offset - start;
 }
 
+#if USE_LIBUSB
+static uint64_t recv_bench_pass(spdio_t* io, const char* name, uint64_t size, unsigned step, double* secs) {
+	uint64_t n;
+	int mode64 = size >> 32;
+	FILE* fo = tmpfile();
+	if (!fo) ERR_EXIT("tmpfile failed\n");
+
+	select_partition(io, name, size, mode64, BSL_CMD_READ_START);
+	if (send_and_check(io)) n = 0;
+	else {
+		uint64_t time_start = GetTickCount64();
+		n = read_pipelined(io, 0, size, step, request_read_midst, &mode64, fo, 0);
+		*secs = (GetTickCount64() - time_start) / 1000.0;
+	}
+	fclose(fo);
+	encode_msg_nocpy(io, BSL_CMD_READ_END, 0);
+	send_and_check(io);
+	return n;
+}
+
+// dumps the same range with synchronous reads and then with the receive ring
+uint64_t recv_bench(spdio_t* io, const char* name, uint64_t size, unsigned step) {
+	int k, saved = io->recv_ring_slots, slots = saved > 0 ? saved : DEFAULT_RECV_RING;
+	uint64_t n[2] = { 0 };
+	double secs[2] = { 0 }, rate[2] = { 0 };
+
+	for (k = 0; k < 2; k++) {
+		recv_ring_stop(io);
+		io->recv_ring_slots = k ? slots : 0;
+		n[k] = recv_bench_pass(io, name, size, step, &secs[k]);
+		if (!n[k]) { DBG_LOG("recv_bench: reading %s failed\n", name); break; }
+		rate[k] = n[k] / 1048576.0 / (secs[k] > 0.001 ? secs[k] : 0.001);
+		DBG_LOG("recv_bench %s, %s: 0x%llx bytes in %.2fs, %.2f MB/s\n", name,
+			k ? "receive ring" : "synchronous", (long long) n[k], secs[k], rate[k]);
+	}
+	recv_ring_stop(io);
+	io->recv_ring_slots = saved;
+	if (rate[0] > 0 && rate[1] > 0)
+		DBG_LOG("recv_bench: %d posted transfers are %.2fx the synchronous reads (read_window %d, blk_size %u)\n",
+			slots, rate[1] / rate[0], io->read_window, step);
+	return n[1];
+}
+#endif
+
 uint64_t read_pactime(spdio_t* io) {
 	uint32_t n, offset = 0x81400, len = 8;
 	int ret; uint32_t* data = (uint32_t*) io->temp_buf;
@@ -1030,9 +1542,8 @@ int scan_xml_partitions(spdio_t* io, const char* fn, uint8_t* buf, size_t buf_si
 #define SECTOR_SIZE 512
 #define MAX_SECTORS 32
 
-extern int selected_ab;
-int gpt_info(partition_t* ptable, const char* fn_xml, int* part_count_ptr) {
-	FILE* fp = my_fopen("pgpt.bin", "rb");
+int gpt_info(spdio_t* io, partition_t* ptable, const char* fn_xml, int* part_count_ptr) {
+	FILE* fp = my_fopen(io, "pgpt.bin", "rb");
 	if (fp == NULL) {
 		return -1;
 	}
@@ -1060,8 +1571,8 @@ int gpt_info(partition_t* ptable, const char* fn_xml, int* part_count_ptr) {
 		fclose(fp);
 		return -1;
 	} else {
-		if (sector_index == 1) Da_Info.dwStorageType = 0x102;
-		else Da_Info.dwStorageType = 0x103;
+		if (sector_index == 1) io->Da_Info.dwStorageType = 0x102;
+		else io->Da_Info.dwStorageType = 0x103;
 	}
 	int real_SECTOR_SIZE = SECTOR_SIZE * sector_index;
 	efi_entry* entries = (efi_entry*) malloc(header.number_of_partition_entries * sizeof(efi_entry));
@@ -1075,7 +1586,7 @@ int gpt_info(partition_t* ptable, const char* fn_xml, int* part_count_ptr) {
 		DBG_LOG("only read %d/%d\n", bytes_read, (int) (header.number_of_partition_entries * sizeof(efi_entry)));
 	FILE* fo = NULL;
 	if (strcmp(fn_xml, "-")) {
-		fo = my_fopen(fn_xml, "wb");
+		fo = my_fopen(io, fn_xml, "wb");
 		if (!fo) ERR_EXIT("fopen failed\n");
 		fprintf(fo, "<Partitions>\n");
 	}
@@ -1099,9 +1610,9 @@ int gpt_info(partition_t* ptable, const char* fn_xml, int* part_count_ptr) {
 			if (i + 1 == n) fprintf(fo, "0x%x\"/>\n", ~0);
 			else fprintf(fo, "%lld\"/>\n", ((*(ptable + i)).size >> 20));
 		}
-		if (!selected_ab) {
+		if (!io->selected_ab) {
 			size_t namelen = strlen((*(ptable + i)).name);
-			if (namelen > 2 && 0 == strcmp((*(ptable + i)).name + namelen - 2, "_a")) selected_ab = 1;
+			if (namelen > 2 && 0 == strcmp((*(ptable + i)).name + namelen - 2, "_a")) io->selected_ab = 1;
 		}
 	}
 	if (fo) {
@@ -1116,23 +1627,22 @@ int gpt_info(partition_t* ptable, const char* fn_xml, int* part_count_ptr) {
 	return 0;
 }
 
-extern int gpt_failed;
 partition_t* partition_list(spdio_t* io, const char* fn, int* part_count_ptr) {
 	long size;
 	unsigned i, n = 0;
-	int ret; FILE* fo = NULL; uint8_t* p;
+	int ret, exact = 1; FILE* fo = NULL; uint8_t* p;
 	partition_t* ptable = (partition_t*) malloc(128 * sizeof(partition_t));
 	if (ptable == NULL) return NULL;
 
 	DBG_LOG("Reading Partition List\n");
-	if (selected_ab < 0) select_ab(io);
+	if (io->selected_ab < 0) select_ab(io);
 	int verbose = io->verbose;
 	io->verbose = 0;
 	size = dump_partition(io, "user_partition", 0, 32 * 1024, "pgpt.bin", 4096);
 	io->verbose = verbose;
 	if (32 * 1024 == size)
-		gpt_failed = gpt_info(ptable, fn, part_count_ptr);
-	if (gpt_failed) {
+		io->gpt_failed = gpt_info(io, ptable, fn, part_count_ptr);
+	if (io->gpt_failed) {
 		remove("pgpt.bin");
 		encode_msg_nocpy(io, BSL_CMD_READ_PARTITION, 0);
 		send_msg(io);
@@ -1141,24 +1651,24 @@ partition_t* partition_list(spdio_t* io, const char* fn, int* part_count_ptr) {
 		ret = recv_type(io);
 		if (ret != BSL_REP_READ_PARTITION) {
 			DBG_LOG("unexpected response (0x%04x)\n", ret);
-			gpt_failed = -1;
+			io->gpt_failed = -1;
 			free(ptable);
 			return NULL;
 		}
 		size = READ16_BE(io->raw_buf + 2);
 		if (size % 0x4c) {
 			DBG_LOG("not divisible by struct size (0x%04lx)\n", size);
-			gpt_failed = -1;
+			io->gpt_failed = -1;
 			free(ptable);
 			return NULL;
 		}
-		FILE* fpkt = my_fopen("sprdpart.bin", "wb");
+		FILE* fpkt = my_fopen(io, "sprdpart.bin", "wb");
 		if (!fpkt) ERR_EXIT("fopen failed\n");
 		fwrite(io->raw_buf + 4, 1, size, fpkt);
 		fclose(fpkt);
 		n = size / 0x4c;
 		if (strcmp(fn, "-")) {
-			fo = my_fopen(fn, "wb");
+			fo = my_fopen(io, fn, "wb");
 			if (!fo) ERR_EXIT("fopen failed\n");
 			fprintf(fo, "<Partitions>\n");
 		}
@@ -1169,8 +1679,8 @@ partition_t* partition_list(spdio_t* io, const char* fn, int* part_count_ptr) {
 			size = READ32_LE(p + 0x48);
 			while (!(size >> divisor)) divisor--;
 		}
-		if (divisor == 10) Da_Info.dwStorageType = 0x102;
-		else Da_Info.dwStorageType = 0x103;
+		if (divisor == 10) io->Da_Info.dwStorageType = 0x102;
+		else io->Da_Info.dwStorageType = 0x103;
 		p = io->raw_buf + 4;
 		DBG_LOG("  0 %36s     256KB\n", "splloader");
 		for (i = 0; i < n; i++, p += 0x4c) {
@@ -1184,9 +1694,9 @@ partition_t* partition_list(spdio_t* io, const char* fn, int* part_count_ptr) {
 				if (i + 1 == n) fprintf(fo, "0x%x\"/>\n", ~0);
 				else fprintf(fo, "%lld\"/>\n", ((*(ptable + i)).size >> 20));
 			}
-			if (!selected_ab) {
+			if (!io->selected_ab) {
 				size_t namelen = strlen((*(ptable + i)).name);
-				if (namelen > 2 && 0 == strcmp((*(ptable + i)).name + namelen - 2, "_a")) selected_ab = 1;
+				if (namelen > 2 && 0 == strcmp((*(ptable + i)).name + namelen - 2, "_a")) io->selected_ab = 1;
 			}
 		}
 		if (fo) {
@@ -1194,18 +1704,21 @@ partition_t* partition_list(spdio_t* io, const char* fn, int* part_count_ptr) {
 			fclose(fo);
 		}
 		*part_count_ptr = n;
+		exact = 0;
 		DBG_LOG("unable to get standard gpt table\n");
 		DBG_LOG("sprd partition list packet saved to sprdpart.bin\n");
-		gpt_failed = 0;
+		io->gpt_failed = 0;
 	}
 	if (*part_count_ptr) {
 		if (strcmp(fn, "-")) DBG_LOG("partition list saved to %s\n", fn);
 		DBG_LOG("Total number of partitions: %d\n", *part_count_ptr);
-		if (Da_Info.dwStorageType == 0x102) DBG_LOG("Storage is emmc\n");
-		else if (Da_Info.dwStorageType == 0x103) DBG_LOG("Storage is ufs\n");
+		if (io->Da_Info.dwStorageType == 0x102) DBG_LOG("Storage is emmc\n");
+		else if (io->Da_Info.dwStorageType == 0x103) DBG_LOG("Storage is ufs\n");
+		// the sprd packet only has the size of the last partition as "the rest"
+		part_cache_fill(io, ptable, *part_count_ptr, exact);
 		return ptable;
 	} else {
-		gpt_failed = -1;
+		io->gpt_failed = -1;
 		free(ptable);
 		return NULL;
 	}
@@ -1216,7 +1729,8 @@ void repartition(spdio_t* io, const char* fn) {
 	int n = scan_xml_partitions(io, fn, buf, 0xffff);
 	// print_mem(stderr, io->temp_buf, n * 0x4c);
 	encode_msg_nocpy(io, BSL_CMD_REPARTITION, n * 0x4c);
-	if (!send_and_check(io)) gpt_failed = 0;
+	if (!send_and_check(io)) io->gpt_failed = 0;
+	part_cache_clear(io);
 }
 
 void erase_partition(spdio_t* io, const char* name) {
@@ -1244,11 +1758,300 @@ void erase_partition(spdio_t* io, const char* name) {
 	io->timeout = timeout0;
 }
 
+
+static double now_us() {
+	return (double) std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one chunk of the image, read (and for BSL_CMD_MIDST_DATA, encoded) ahead of the sender
+typedef struct {
+	uint8_t* raw;	// raw data, or the message before transcoding
+	uint8_t* enc;	// the transcoded message
+	uint8_t* buf;	// what to send
+	uint32_t n;		// image bytes in the chunk
+	int len;		// bytes to send
+} feed_chunk_t;
+
+#define FEED_KEEP_MAX (32 << 20)	// larger images are read again for each partition
+
+// reads the image on its own thread into a ring of feed_depth chunks, so disk reads and
+// encoding overlap the USB transfer. each phase is timed to show the bottleneck.
+// a kept feeder has a slot for every chunk instead, so the image can be sent again.
+struct file_feeder_t {
+	FILE* fi;
+	const char* fn;	// kept feeders only
+	uint64_t len, next;
+	unsigned step, depth, head, count;
+	int flags, encode, failed, closing;
+	feed_chunk_t* slots = NULL;	// NULL: not started
+	double read_us, encode_us;	// reader thread
+	double wait_us, usb_us, ack_us;	// sender
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::thread thread;
+	~file_feeder_t();
+};
+
+// the data is read to c->raw + 5, which is already its place in an untranscoded message
+static void feed_encode(int flags, feed_chunk_t* c) {
+	spd_iov_t iov = { c->raw + 5, c->n };
+	c->buf = flags & FLAGS_TRANSCODE ? c->enc : c->raw;
+	c->len = spd_encode_iov(flags, BSL_CMD_MIDST_DATA, &iov, 1, c->buf);
+}
+
+static void feeder_run(file_feeder_t* f) {
+	std::unique_lock<std::mutex> lock(f->mtx);
+	while (f->next < f->len) {
+		f->cv.wait(lock, [f] { return f->count < f->depth || f->closing; });
+		if (f->closing) break;
+		feed_chunk_t* c = &f->slots[(f->head + f->count) % f->depth];
+		uint64_t n64 = f->len - f->next;
+		c->n = (uint32_t) (n64 > f->step ? f->step : n64);
+		f->next += c->n;
+		lock.unlock();
+		double t0 = now_us();
+		int ok = fread(f->encode ? c->raw + 5 : c->raw, 1, c->n, f->fi) == c->n;
+		double t1 = now_us();
+		if (ok && f->encode) feed_encode(f->flags, c);
+		else {
+			c->buf = c->raw;
+			c->len = c->n;
+		}
+		lock.lock();
+		f->read_us += t1 - t0;
+		f->encode_us += now_us() - t1;
+		if (!ok) {
+			f->failed = 1;
+			f->cv.notify_all();
+			break;
+		}
+		f->count++;
+		f->cv.notify_all();
+	}
+}
+
+static void feeder_init(file_feeder_t* f, FILE* fi, uint64_t len, unsigned step, int encode, spdio_t* io, unsigned depth) {
+	unsigned i;
+	f->fi = fi;
+	f->len = len;
+	f->next = 0;
+	f->step = step;
+	f->depth = depth;
+	f->head = f->count = 0;
+	f->flags = io->flags;
+	f->encode = encode;
+	f->failed = f->closing = 0;
+	f->read_us = f->encode_us = f->wait_us = f->usb_us = f->ack_us = 0;
+	f->slots = (feed_chunk_t*) calloc(f->depth, sizeof(feed_chunk_t));
+	if (!f->slots) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < f->depth; i++) {
+		f->slots[i].raw = (uint8_t*) malloc(step + 8);
+		if (!f->slots[i].raw) ERR_EXIT("malloc failed\n");
+		if (encode && (io->flags & FLAGS_TRANSCODE)) {
+			f->slots[i].enc = (uint8_t*) malloc((step + 6) * 2 + 2);
+			if (!f->slots[i].enc) ERR_EXIT("malloc failed\n");
+		}
+	}
+	f->thread = std::thread(feeder_run, f);
+}
+
+// encode: send BSL_CMD_MIDST_DATA messages with the flags of io, otherwise raw data
+static void feeder_start(file_feeder_t* f, FILE* fi, uint64_t len, unsigned step, int encode, spdio_t* io) {
+	feeder_init(f, fi, len, step, encode, io,
+		io->feed_depth < 1 ? 1 : io->feed_depth > MAX_FEED_DEPTH ? MAX_FEED_DEPTH : io->feed_depth);
+}
+
+// like feeder_start, but no chunk is refilled, see feeder_rewind
+static void feeder_start_kept(file_feeder_t* f, const char* fn, FILE* fi, uint64_t len, unsigned step, int encode, spdio_t* io) {
+	f->fn = fn;
+	feeder_init(f, fi, len, step, encode, io, (unsigned) ((len + step - 1) / step));
+}
+
+// waits until a kept feeder has read the whole image, so the file can be closed
+static void feeder_join(file_feeder_t* f) {
+	if (f->thread.joinable()) f->thread.join();
+	f->fi = NULL;
+}
+
+// serves the chunks of a kept feeder again if they are the ones the next write needs
+static int feeder_rewind(file_feeder_t* f, const char* fn, uint64_t len, unsigned step, int encode, int flags) {
+	feeder_join(f);
+	if (f->failed || f->next != f->len || strcmp(f->fn, fn) ||
+		f->len != len || f->step != step || f->encode != encode || f->flags != flags) return 0;
+	f->head = 0;
+	f->count = f->depth;
+	f->read_us = f->encode_us = f->wait_us = f->usb_us = f->ack_us = 0;
+	return 1;
+}
+
+// changes one byte of a kept image, for a copy that differs from the file
+static void feeder_patch(file_feeder_t* f, uint64_t offset, uint8_t value) {
+	if (!f->slots || offset >= f->len) return;
+	feeder_join(f);
+	feed_chunk_t* c = &f->slots[offset / f->step];
+	(f->encode ? c->raw + 5 : c->raw)[offset % f->step] = value;
+	if (f->encode) feed_encode(f->flags, c);
+}
+
+// the next chunk in order, waits for the reader thread
+static feed_chunk_t* feeder_next(file_feeder_t* f) {
+	double t0 = now_us();
+	std::unique_lock<std::mutex> lock(f->mtx);
+	f->cv.wait(lock, [f] { return f->count || f->failed; });
+	if (!f->count) ERR_EXIT("fread(load) failed\n");
+	f->wait_us += now_us() - t0;
+	return &f->slots[f->head];
+}
+
+// the chunk returned by feeder_next has been sent, its slot can be refilled
+static void feeder_release(file_feeder_t* f) {
+	std::lock_guard<std::mutex> lock(f->mtx);
+	f->head = (f->head + 1) % f->depth;
+	f->count--;
+	f->cv.notify_all();
+}
+
+static void feeder_finish(file_feeder_t* f) {
+	unsigned i;
+	{
+		std::lock_guard<std::mutex> lock(f->mtx);
+		f->closing = 1;
+	}
+	f->cv.notify_all();
+	if (f->thread.joinable()) f->thread.join();
+	for (i = 0; i < f->depth; i++) {
+		free(f->slots[i].raw);
+		free(f->slots[i].enc);
+	}
+	free(f->slots);
+	f->slots = NULL;
+}
+
+// an ERR_EXIT unwinds past a running feeder, its thread must not outlive it
+file_feeder_t::~file_feeder_t() {
+	if (slots) feeder_finish(this);
+}
+
+// the feeder for writing fn to a partition. while io->feed_keep is set, the chunks are kept there
+// and reused by the next write of the same image, so it is read and encoded only once
+static file_feeder_t* load_feeder(spdio_t* io, file_feeder_t* local, const char* fn, FILE* fi,
+	uint64_t len, unsigned step, int encode) {
+	file_feeder_t* k = io->feed_keep;
+	if (k && k->slots) {
+		if (feeder_rewind(k, fn, len, step, encode, io->flags)) {
+			DBG_LOG("reusing the %u chunks already read from %s\n", k->depth, fn);
+			return k;
+		}
+		feeder_finish(k);
+	}
+	if (!k || !len || len > FEED_KEEP_MAX) {
+		feeder_start(local, fi, len, step, encode, io);
+		return local;
+	}
+	feeder_start_kept(k, fn, fi, len, step, encode, io);
+	return k;
+}
+
+static void load_feeder_done(spdio_t* io, file_feeder_t* f) {
+	if (f == io->feed_keep) feeder_join(f);
+	else feeder_finish(f);
+}
+
+static void feeder_report(file_feeder_t* f, uint64_t bytes) {
+	double mb = bytes / 1024.0 / 1024;
+#define PHASE(us) (us) / 1e6, (us) > 0 ? mb / ((us) / 1e6) : 0.0
+	DBG_LOG("file read %.2fs (%.1fMB/s), encode %.2fs (%.1fMB/s), usb write %.2fs (%.1fMB/s), device ack %.2fs (%.1fMB/s), waited for file %.2fs\n",
+		PHASE(f->read_us), PHASE(f->encode_us), PHASE(f->usb_us), PHASE(f->ack_us), f->wait_us / 1e6);
+#undef PHASE
+}
+
+// sends one pre-encoded chunk, like send_msg. it stays what recv_msg resends on a timeout
+// until the next message, so the slot must not be released before the reply.
+static void feed_send(spdio_t* io, feed_chunk_t* c) {
+	int ret;
+	io->send_buf = c->buf;
+	io->enc_len = c->len;
+	io->raw_len = c->n + 6;
+	WRITE16_BE(io->untranscode_buf + 1, BSL_CMD_MIDST_DATA);
+	WRITE16_BE(io->untranscode_buf + 3, c->n);
+	if (io->m_bOpened == -1)
+		ERR_EXIT("device removed, exiting...\n");
+	if (io->verbose >= 2) {
+		DBG_LOG("send (%d):\n", c->len);
+		print_mem(stderr, c->buf, c->len);
+	} else if (io->verbose >= 1)
+		DBG_LOG("send: type = 0x%02x, size = %d\n", BSL_CMD_MIDST_DATA, c->n);
+	ret = port_write(io, c->buf, c->len);
+	if (ret != c->len)
+		ERR_EXIT("usb_send failed (%d / %d)\n", ret, c->len);
+}
+
+// like send_and_check for a chunk from the feeder
+static int feed_and_check(spdio_t* io, feed_chunk_t* c) {
+	int ret;
+	feed_send(io, c);
+	ret = recv_msg(io);
+	if (!ret) ERR_EXIT("timeout reached\n");
+	ret = recv_type(io);
+	if (ret != BSL_REP_ACK) {
+		DBG_LOG("unexpected response (0x%04x)\n", ret);
+		return -1;
+	}
+	return 0;
+}
+
+// same messages as send_buf, but the file is read ahead in feed_depth chunks while they are
+// sent, so the first chunk goes out at once and memory does not grow with the file
+size_t send_file(spdio_t* io, const char* fn,
+	uint32_t start_addr, int end_data, unsigned step,
+	unsigned src_offs, unsigned src_size) {
+	uint32_t* data = (uint32_t*) io->temp_buf;
+	uint64_t size; uint32_t i, n;
+	FILE* fi; file_feeder_t f;
+
+	fi = fopen(fn, "rb");
+	if (!fi) ERR_EXIT("fopen(\"%s\") failed\n", fn);
+	fseeko(fi, 0, SEEK_END);
+	size = ftello(fi);
+	if (!size) ERR_EXIT("\"%s\" is empty\n", fn);
+	if (size >> 32) ERR_EXIT("file too big\n");
+	if (size < src_offs) ERR_EXIT("required offset larger than file size\n");
+	size -= src_offs;
+	if (src_size) {
+		if (size < src_size) DBG_LOG("required size larger than file size\n");
+		else size = src_size;
+	}
+	fseeko(fi, src_offs, SEEK_SET);
+
+	WRITE32_BE(data, start_addr);
+	WRITE32_BE(data + 1, size);
+	encode_msg_nocpy(io, BSL_CMD_START_DATA, 4 * 2);
+	if (!send_and_check(io)) {
+		feeder_start(&f, fi, size, step, 1, io);
+		for (i = 0; i < size; i += n) {
+			feed_chunk_t* c = feeder_next(&f);
+			n = c->n;
+			if (feed_and_check(io, c)) break;
+			feeder_release(&f);
+		}
+		feeder_finish(&f);
+		if (i == size && end_data) {
+			encode_msg_nocpy(io, BSL_CMD_END_DATA, 0);
+			send_and_check(io);
+		}
+	}
+	fclose(fi);
+	DBG_LOG("SEND %s to 0x%x\n", fn, start_addr);
+	return size;
+}
+
 void load_partition(spdio_t* io, const char* name,
 	const char* fn, unsigned step) {
 	uint64_t offset, len, n64;
-	unsigned mode64, n, step0 = step; int ret;
+	unsigned mode64, n; int ret, raw = 0;
 	FILE* fi;
+	file_feeder_t local, *f;
 
 	if (strstr(name, "runtimenv")) { erase_partition(io, name); return; }
 	if (!strcmp(name, "calinv")) { return; } //skip calinv
@@ -1271,81 +2074,70 @@ void load_partition(spdio_t* io, const char* name,
 
 	unsigned long long time_start = GetTickCount64();
 #if !USE_LIBUSB
-	if (Da_Info.bSupportRawData) {
-		if (Da_Info.bSupportRawData > 1) {
-			encode_msg_nocpy(io, BSL_CMD_MIDST_RAW_START2, 0);
-			if (send_and_check(io)) { Da_Info.bSupportRawData = 0; goto fallback_load; }
-		}
-		step = Da_Info.dwFlushSize << 10;
-		uint8_t* rawbuf = (uint8_t*) malloc(step + 1);
-		if (!rawbuf) ERR_EXIT("malloc failed\n");
-
-		for (offset = 0; (n64 = len - offset); offset += n) {
-			n = (unsigned) (n64 > step ? step : n64);
-			if (Da_Info.bSupportRawData == 1) {
-				uint32_t* data = (uint32_t*) io->temp_buf;
-				uint32_t t32 = offset >> 32;
-				WRITE32_LE(data, offset);
-				WRITE32_LE(data + 1, t32);
-				WRITE32_LE(data + 2, n);
-				encode_msg_nocpy(io, BSL_CMD_MIDST_RAW_START, 12);
-				if (send_and_check(io)) {
-					if (offset) break;
-					else { free(rawbuf); step = step0; Da_Info.bSupportRawData = 0; goto fallback_load; }
-				}
+	if (io->Da_Info.bSupportRawData > 1) {
+		encode_msg_nocpy(io, BSL_CMD_MIDST_RAW_START2, 0);
+		if (send_and_check(io)) io->Da_Info.bSupportRawData = 0;
+	}
+	raw = io->Da_Info.bSupportRawData != 0;
+#endif
+	if (raw) f = load_feeder(io, &local, fn, fi, len, io->Da_Info.dwFlushSize << 10, 0);
+	else f = load_feeder(io, &local, fn, fi, len, step, 1);
+
+	for (offset = 0; (n64 = len - offset); offset += n) {
+		feed_chunk_t* c = feeder_next(f);
+		n = c->n;
+		if (raw && io->Da_Info.bSupportRawData == 1) {
+			uint32_t* data = (uint32_t*) io->temp_buf;
+			uint32_t t32 = offset >> 32;
+			WRITE32_LE(data, offset);
+			WRITE32_LE(data + 1, t32);
+			WRITE32_LE(data + 2, n);
+			encode_msg_nocpy(io, BSL_CMD_MIDST_RAW_START, 12);
+			if (send_and_check(io)) {
+				if (offset) break;
+				// no raw data after all, start over with BSL_CMD_MIDST_DATA
+				load_feeder_done(io, f);
+				fseeko(fi, 0, SEEK_SET);
+				io->Da_Info.bSupportRawData = 0;
+				raw = 0;
+				f = load_feeder(io, &local, fn, fi, len, step, 1);
+				n = 0;
+				continue;
 			}
-			if (fread(rawbuf, 1, n, fi) != n)
-				ERR_EXIT("fread(load) failed\n");
-		#if USE_LIBUSB
-			int err = libusb_bulk_transfer(io->dev_handle, io->endp_out, rawbuf, n, &ret, io->timeout); //libusb will fail with rawbuf
-			if (err < 0) ERR_EXIT("usb_send failed : %s\n", libusb_error_name(err));
-		#else
-			ret = call_Write(io->handle, rawbuf, n);
-		#endif
+		}
+		double t0 = now_us();
+#if !USE_LIBUSB
+		if (raw) {
+			ret = port_write(io, c->buf, n);
 			if (io->verbose >= 1) DBG_LOG("send (%d)\n", n);
 			if (ret != (int) n)
 				ERR_EXIT("usb_send failed (%d / %d)\n", ret, n);
-			if (is_simg) ret = recv_msg_timeout(io, 100000);
-			else ret = recv_msg_timeout(io, 15000);
-			if (!ret) {
-				if (n == n64) ERR_EXIT("signature verification of \"%s\" failed or timeout reached\n", name);
-				else ERR_EXIT("timeout reached\n");
-			}
-			if ((ret = recv_type(io)) != BSL_REP_ACK) {
-				DBG_LOG("unexpected response (0x%04x)\n", ret);
-				break;
-			}
-			print_progress_bar(offset + n, len, time_start);
+		} else
+#endif
+		feed_send(io, c);
+		double t1 = now_us();
+		// the last chunk includes signature verification, which is not a round trip
+		if (n == n64) ret = recv_msg_timeout(io, is_simg ? 100000 : 15000);
+		else ret = recv_msg_rtt(io, is_simg ? &io->rtt_long : &io->rtt_cmd);
+		feeder_release(f);
+		f->usb_us += t1 - t0;
+		f->ack_us += now_us() - t1;
+		if (!ret) {
+			if (n == n64) ERR_EXIT("signature verification of \"%s\" failed or timeout reached\n", name);
+			else ERR_EXIT("timeout reached\n");
 		}
-		free(rawbuf);
-	} else {
-	#endif
-	fallback_load:
-		for (offset = 0; (n64 = len - offset); offset += n) {
-			n = (unsigned) (n64 > step ? step : n64);
-			if (fread(io->temp_buf, 1, n, fi) != n)
-				ERR_EXIT("fread(load) failed\n");
-			encode_msg_nocpy(io, BSL_CMD_MIDST_DATA, n);
-			send_msg(io);
-			if (is_simg) ret = recv_msg_timeout(io, 100000);
-			else ret = recv_msg_timeout(io, 15000);
-			if (!ret) {
-				if (n == n64) ERR_EXIT("signature verification of \"%s\" failed or timeout reached\n", name);
-				else ERR_EXIT("timeout reached\n");
-			}
-			if ((ret = recv_type(io)) != BSL_REP_ACK) {
-				DBG_LOG("unexpected response (0x%04x)\n", ret);
-				break;
-			}
-			print_progress_bar(offset + n, len, time_start);
+		if ((ret = recv_type(io)) != BSL_REP_ACK) {
+			DBG_LOG("unexpected response (0x%04x)\n", ret);
+			break;
 		}
-	#if !USE_LIBUSB
+		print_progress_bar(io, offset + n, len, time_start);
 	}
-#endif
+	load_feeder_done(io, f);
 	fclose(fi);
 	encode_msg_nocpy(io, BSL_CMD_END_DATA, 0);
 	if (!send_and_check(io)) DBG_LOG("\nWrite Part Done: %s, target: 0x%llx, written: 0x%llx\n",
 		name, (long long) len, (long long) offset);
+	feeder_report(f, offset);
 }
 
 void load_partition_force(spdio_t* io, const int id, const char* fn, unsigned step) {
@@ -1367,6 +2159,7 @@ void load_partition_force(spdio_t* io, const int id, const char* fn, unsigned st
 	}
 	encode_msg_nocpy(io, BSL_CMD_REPARTITION, io->part_count * 0x4c);
 	if (send_and_check(io)) return; //repart failed
+	part_cache_clear(io);
 	load_partition(io, name, fn, step);
 	buf = io->temp_buf;
 	for (i = 0; i < io->part_count; i++) {
@@ -1478,7 +2271,7 @@ void load_nv_partition(spdio_t* io, const char* name,
 		memcpy(io->temp_buf, &mem[offset], n);
 		encode_msg_nocpy(io, BSL_CMD_MIDST_DATA, n);
 		send_msg(io);
-		ret = recv_msg_timeout(io, 15000);
+		ret = recv_msg_rtt(io, &io->rtt_cmd);
 		if (!ret) ERR_EXIT("timeout reached\n");
 		if ((ret = recv_type(io)) != BSL_REP_ACK) {
 			DBG_LOG("unexpected response (0x%04x)\n", ret);
@@ -1491,6 +2284,126 @@ void load_nv_partition(spdio_t* io, const char* name,
 		name, (long long) len, (long long) offset);
 }
 
+// sizes and existence of partitions found so far in this session, so check_partition probes
+// each partition once. with `part_cache 1` it is also saved per chip UID and loaded on the next run.
+part_cache_t* part_cache_find(spdio_t* io, const char* name) {
+	int i;
+	for (i = 0; i < io->pcache_count; i++)
+		if (!strcmp(io->pcache[i].name, name)) return &io->pcache[i];
+	return NULL;
+}
+
+static void part_cache_save(spdio_t* io) {
+	int i;
+	if (!io->pcache_fn[0]) return;
+	FILE* fo = fopen(io->pcache_fn, "w");
+	if (!fo) { DBG_LOG("fopen(%s) failed\n", io->pcache_fn); return; }
+	for (i = 0; i < io->pcache_count; i++)
+		fprintf(fo, "%s %d 0x%llx\n", io->pcache[i].name, io->pcache[i].exists, (long long) io->pcache[i].size);
+	fclose(fo);
+}
+
+// size 0 means only existence is known
+static void part_cache_set(spdio_t* io, const char* name, int exists, long long size) {
+	part_cache_t* e = part_cache_find(io, name);
+	if (!e) {
+		if (strlen(name) >= sizeof(e->name)) return;
+		if (!(io->pcache_count % 32)) {
+			part_cache_t* p = (part_cache_t*) realloc(io->pcache, (io->pcache_count + 32) * sizeof(part_cache_t));
+			if (!p) ERR_EXIT("malloc failed\n");
+			io->pcache = p;
+		}
+		e = &io->pcache[io->pcache_count++];
+		strcpy(e->name, name);
+	} else if (e->exists == exists && e->size == size) return;
+	e->exists = exists;
+	e->size = size;
+}
+
+void part_cache_put(spdio_t* io, const char* name, int exists, long long size) {
+	part_cache_set(io, name, exists, size);
+	part_cache_save(io);
+}
+
+// the partition table was read or changed
+void part_cache_fill(spdio_t* io, const partition_t* ptable, int count, int exact) {
+	int i;
+	for (i = 0; i < count; i++)
+		part_cache_set(io, ptable[i].name, 1, exact || i + 1 < count ? ptable[i].size : 0);
+	part_cache_save(io);
+}
+
+void part_cache_clear(spdio_t* io) {
+	io->pcache_count = 0;
+	part_cache_save(io);
+}
+
+// a saved entry agrees with the partition table of the device, names the table does not have can not be checked.
+// the sprd packet only gives "the rest" as the size of the last partition, so that size is not compared
+static int part_cache_check(spdio_t* io, const char* name, int exists, long long size) {
+	int i;
+	for (i = 0; i < io->part_count; i++) {
+		if (strcmp(io->ptable[i].name, name)) continue;
+		return exists && (!size || i + 1 == io->part_count || size == io->ptable[i].size);
+	}
+	return 1;
+}
+
+int part_cache_bind(spdio_t* io) {
+	char uid[64], name[36];
+	int ret, i, n, exists, stale;
+	long long size;
+	part_cache_t* saved = NULL;
+
+	encode_msg_nocpy(io, BSL_CMD_READ_CHIP_UID, 0);
+	send_msg(io);
+	ret = recv_msg(io);
+	if (!ret) ERR_EXIT("timeout reached\n");
+	if ((ret = recv_type(io)) != BSL_REP_READ_CHIP_UID) {
+		DBG_LOG("unexpected response (0x%04x)\n", ret);
+		return -1;
+	}
+	n = READ16_BE(io->raw_buf + 2);
+	if (!n) return -1;
+	for (i = 0; i < n && i * 2 + 2 < (int) sizeof(uid); i++)
+		sprintf(uid + i * 2, "%02x", io->raw_buf[4 + i]);
+
+	// the saved entries are only used if they agree with the table on the device,
+	// read before pcache_fn is set so that part_cache_fill does not overwrite the file
+	if (io->gpt_failed == 1) io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
+	if (io->savepath[0]) snprintf(io->pcache_fn, sizeof(io->pcache_fn), "%s/partcache_%s.txt", io->savepath, uid);
+	else snprintf(io->pcache_fn, sizeof(io->pcache_fn), "partcache_%s.txt", uid);
+	FILE* fi = fopen(io->pcache_fn, "r");
+	if (fi) {
+		stale = !io->part_count;
+		for (n = 0; fscanf(fi, "%35s %d %lli", name, &exists, &size) == 3; n++) {
+			if (!part_cache_check(io, name, exists, size)) stale = 1;
+			if (!(n % 32)) {
+				part_cache_t* p = (part_cache_t*) realloc(saved, (n + 32) * sizeof(part_cache_t));
+				if (!p) { free(saved); fclose(fi); ERR_EXIT("malloc failed\n"); }
+				saved = p;
+			}
+			strcpy(saved[n].name, name);
+			saved[n].exists = exists;
+			saved[n].size = size;
+		}
+		fclose(fi);
+		if (!io->part_count) DBG_LOG("partition table not available, %s discarded\n", io->pcache_fn);
+		else if (stale) DBG_LOG("%s does not match the partition table, discarded\n", io->pcache_fn);
+		else {
+			// entries the table already filled in keep the table's values
+			for (i = 0; i < n; i++) {
+				part_cache_t* e = part_cache_find(io, saved[i].name);
+				if (!e || (e->exists && !e->size)) part_cache_set(io, saved[i].name, saved[i].exists, saved[i].size);
+			}
+			DBG_LOG("loaded %d cached partitions from %s\n", n, io->pcache_fn);
+		}
+		free(saved);
+	}
+	part_cache_save(io);
+	return 0;
+}
+
 void find_partition_size_new(spdio_t* io, const char* name, unsigned long long* offset_ptr) {
 	int ret;
 	char* name_tmp = (char*) malloc(strlen(name) + 5 + 1);
@@ -1527,9 +2440,9 @@ uint64_t check_partition(spdio_t* io, const char* name, int need_size) {
 	int ret, i, end = 20;
 	char name_tmp[36];
 
-	if (selected_ab > 0 && strcmp(name, "uboot") == 0) return 0;
+	if (io->selected_ab > 0 && strcmp(name, "uboot") == 0) return 0;
 	if (strstr(name, "fixnv")) {
-		if (selected_ab > 0) {
+		if (io->selected_ab > 0) {
 			size_t namelen = strlen(name);
 			if (strcmp(name + namelen - 2, "_a") && strcmp(name + namelen - 2, "_b")) return 0;
 		}
@@ -1546,9 +2459,16 @@ uint64_t check_partition(spdio_t* io, const char* name, int need_size) {
 		name = name_tmp;
 	}
 
-	if (selected_ab > 0) {
+	part_cache_t* e = part_cache_find(io, name);
+	if (e && (!e->exists || !need_size || e->size)) {
+		if (!e->exists) return 0;
+		return need_size ? e->size : 1;
+	}
+
+	if (io->selected_ab > 0) {
 		find_partition_size_new(io, name, &offset);
 		if (offset) {
+			part_cache_put(io, name, 1, offset);
 			if (need_size) return offset;
 			else return 1;
 		}
@@ -1558,6 +2478,7 @@ uint64_t check_partition(spdio_t* io, const char* name, int need_size) {
 	if (send_and_check(io)) {
 		encode_msg_nocpy(io, BSL_CMD_READ_END, 0);
 		send_and_check(io);
+		part_cache_put(io, name, 0, 0);
 		return 0;
 	}
 
@@ -1574,7 +2495,10 @@ uint64_t check_partition(spdio_t* io, const char* name, int need_size) {
 	else ret = 0;
 	encode_msg_nocpy(io, BSL_CMD_READ_END, 0);
 	send_and_check(io);
-	if (0 == ret || 0 == need_size) return ret;
+	if (0 == ret || 0 == need_size) {
+		part_cache_put(io, name, ret, 0);
+		return ret;
+	}
 
 	int incrementing = 1;
 	select_partition(io, name, 0xffffffff, 0, BSL_CMD_READ_START);
@@ -1630,10 +2554,11 @@ uint64_t check_partition(spdio_t* io, const char* name, int need_size) {
 			}
 		}
 	}
-	if (end == 10) Da_Info.dwStorageType = 0x101;
+	if (end == 10) io->Da_Info.dwStorageType = 0x101;
 	DBG_LOG("partition_size_pc: %s, 0x%llx\n", name, offset);
 	encode_msg_nocpy(io, BSL_CMD_READ_END, 0);
 	send_and_check(io);
+	part_cache_put(io, name, 1, offset);
 	return offset;
 }
 
@@ -1646,60 +2571,60 @@ void get_partition_info(spdio_t* io, const char* name, int need_size) {
 	if (isdigit(name[0])) {
 		i = atoi(name);
 		if (i == 0) {
-			strcpy(gPartInfo.name, "splloader");
-			gPartInfo.size = 256 * 1024;
+			strcpy(io->gPartInfo.name, "splloader");
+			io->gPartInfo.size = 256 * 1024;
 			io->verbose = verbose;
 			return;
 		}
-		if (gpt_failed == 1) io->ptable = partition_list(io, fn_partlist, &io->part_count);
+		if (io->gpt_failed == 1) io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
 		if (i > io->part_count) {
 			DBG_LOG("part not exist\n");
-			gPartInfo.size = 0;
+			io->gPartInfo.size = 0;
 			io->verbose = verbose;
 			return;
 		}
-		strcpy(gPartInfo.name, (*(io->ptable + i - 1)).name);
-		gPartInfo.size = (*(io->ptable + i - 1)).size;
+		strcpy(io->gPartInfo.name, (*(io->ptable + i - 1)).name);
+		io->gPartInfo.size = (*(io->ptable + i - 1)).size;
 		io->verbose = verbose;
 		return;
 	}
 
 	if (!strncmp(name, "splloader", 9)) {
-		strcpy(gPartInfo.name, name);
-		gPartInfo.size = 256 * 1024;
+		strcpy(io->gPartInfo.name, name);
+		io->gPartInfo.size = 256 * 1024;
 		io->verbose = verbose;
 		return;
 	}
 	if (io->part_count) {
-		if (selected_ab > 0) snprintf(name_ab, sizeof(name_ab), "%s_%c", name, 96 + selected_ab);
+		if (io->selected_ab > 0) snprintf(name_ab, sizeof(name_ab), "%s_%c", name, 96 + io->selected_ab);
 		for (i = 0; i < io->part_count; i++) {
 			if (!strcmp(name, (*(io->ptable + i)).name)) break;
-			if (selected_ab > 0 && !strcmp(name_ab, (*(io->ptable + i)).name)) {
+			if (io->selected_ab > 0 && !strcmp(name_ab, (*(io->ptable + i)).name)) {
 				name = name_ab;
 				break;
 			}
 		}
 		if (i < io->part_count) {
-			strcpy(gPartInfo.name, name);
-			gPartInfo.size = (*(io->ptable + i)).size;
-		} else gPartInfo.size = 0;
+			strcpy(io->gPartInfo.name, name);
+			io->gPartInfo.size = (*(io->ptable + i)).size;
+		} else io->gPartInfo.size = 0;
 		io->verbose = verbose;
 		return;
 	}
 
-	if (selected_ab < 0) select_ab(io);
-	gPartInfo.size = check_partition(io, name, need_size);
-	if (!gPartInfo.size && selected_ab > 0) {
-		snprintf(name_ab, sizeof(name_ab), "%s_%c", name, 96 + selected_ab);
-		gPartInfo.size = check_partition(io, name_ab, need_size);
+	if (io->selected_ab < 0) select_ab(io);
+	io->gPartInfo.size = check_partition(io, name, need_size);
+	if (!io->gPartInfo.size && io->selected_ab > 0) {
+		snprintf(name_ab, sizeof(name_ab), "%s_%c", name, 96 + io->selected_ab);
+		io->gPartInfo.size = check_partition(io, name_ab, need_size);
 		name = name_ab;
 	}
-	if (!gPartInfo.size) {
+	if (!io->gPartInfo.size) {
 		DBG_LOG("part not exist\n");
 		io->verbose = verbose;
 		return;
 	}
-	strcpy(gPartInfo.name, name);
+	strcpy(io->gPartInfo.name, name);
 	io->verbose = verbose;
 }
 
@@ -1806,23 +2731,23 @@ void dump_partitions(spdio_t* io, const char* fn, int* nand_info, unsigned step)
 		if (!strncmp(partitions[i].name, "userdata", 8)) continue;
 
 		get_partition_info(io, partitions[i].name, 0);
-		if (!gPartInfo.size) continue;
-		if (!strncmp(partitions[i].name, "splloader", 9)) gPartInfo.size = 256 * 1024;
-		else if (0xffffffff == partitions[i].size) gPartInfo.size = check_partition(io, gPartInfo.name, 1);
+		if (!io->gPartInfo.size) continue;
+		if (!strncmp(partitions[i].name, "splloader", 9)) io->gPartInfo.size = 256 * 1024;
+		else if (0xffffffff == partitions[i].size) io->gPartInfo.size = check_partition(io, io->gPartInfo.name, 1);
 		else if (ubi) {
 			int block = (int) (partitions[i].size * (1024 / nand_info[2]) + partitions[i].size * (1024 / nand_info[2]) / (512 / nand_info[1]) + 1);
-			gPartInfo.size = 1024 * (nand_info[2] - 2 * nand_info[0]) * block;
-		} else gPartInfo.size = partitions[i].size << 20;
+			io->gPartInfo.size = 1024 * (nand_info[2] - 2 * nand_info[0]) * block;
+		} else io->gPartInfo.size = partitions[i].size << 20;
 
 		char dfile[40];
 		snprintf(dfile, sizeof(dfile), "%s.bin", partitions[i].name);
-		dump_partition(io, gPartInfo.name, 0, gPartInfo.size, dfile, step);
+		dump_partition(io, io->gPartInfo.name, 0, io->gPartInfo.size, dfile, step);
 	}
-	if (selected_ab > 0) { DBG_LOG("saving slot info\n"); dump_partition(io, "misc", 0, 1048576, "misc.bin", step); }
+	if (io->selected_ab > 0) { DBG_LOG("saving slot info\n"); dump_partition(io, "misc", 0, 1048576, "misc.bin", step); }
 
-	if (savepath[0]) {
+	if (io->savepath[0]) {
 		DBG_LOG("saving dump list\n");
-		FILE* fo = my_fopen(fn, "wb");
+		FILE* fo = my_fopen(io, fn, "wb");
 		if (fo) { fwrite(src, 1, size, fo); fclose(fo); } else DBG_LOG("create dump list failed, skipping.\n");
 	}
 	free(src);
@@ -1925,33 +2850,33 @@ void load_partitions(spdio_t* io, const char* path, unsigned step, int force_ab)
 	}
 	closedir(dir);
 #endif
-	if (selected_ab < 0) select_ab(io);
-	int selected_ab_bak = selected_ab;
+	if (io->selected_ab < 0) select_ab(io);
+	int selected_ab_bak = io->selected_ab;
 	bootloader_control* abc = NULL;
 	size_t misclen = 0;
-	if (force_ab && (force_ab & VAB)) selected_ab = force_ab;
+	if (force_ab && (force_ab & VAB)) io->selected_ab = force_ab;
 	else {
 		if (miscname[0]) {
 			uint8_t* mem = loadfile(miscname, &misclen, 0);
 			if (misclen >= 0x820) {
 				abc = (bootloader_control*) (mem + 0x800);
-				if (abc->nb_slot != 2) selected_ab = 0;
-				if (ab_compare_slots(&abc->slot_info[1], &abc->slot_info[0]) < 0) selected_ab = 2;
-				else selected_ab = 1;
+				if (abc->nb_slot != 2) io->selected_ab = 0;
+				if (ab_compare_slots(&abc->slot_info[1], &abc->slot_info[0]) < 0) io->selected_ab = 2;
+				else io->selected_ab = 1;
 			}
 			free(mem);
 		}
-		if (!selected_ab) {
-			if (VAB & 1) selected_ab = 1;
-			else if (VAB & 2) selected_ab = 2;
-			else if (selected_ab_bak > 0) selected_ab = selected_ab_bak;
+		if (!io->selected_ab) {
+			if (VAB & 1) io->selected_ab = 1;
+			else if (VAB & 2) io->selected_ab = 2;
+			else if (selected_ab_bak > 0) io->selected_ab = selected_ab_bak;
 		}
 	}
-	if (selected_ab) DBG_LOG("Flashing to slot %c.\n", 96 + selected_ab);
+	if (io->selected_ab) DBG_LOG("Flashing to slot %c.\n", 96 + io->selected_ab);
 	for (int i = 0; i < partition_count; i++) {
 		fn = partitions[i].name;
 		namelen = strlen(fn);
-		if (selected_ab == 1 && namelen > 2 && 0 == strcmp(fn + namelen - 2, "_b")) { partitions[i].written_flag = 1; continue; } else if (selected_ab == 2 && namelen > 2 && 0 == strcmp(fn + namelen - 2, "_a")) { partitions[i].written_flag = 1; continue; }
+		if (io->selected_ab == 1 && namelen > 2 && 0 == strcmp(fn + namelen - 2, "_b")) { partitions[i].written_flag = 1; continue; } else if (io->selected_ab == 2 && namelen > 2 && 0 == strcmp(fn + namelen - 2, "_a")) { partitions[i].written_flag = 1; continue; }
 		if (!strcmp(fn, "splloader") ||
 			!strcmp(fn, "uboot_a") ||
 			!strcmp(fn, "uboot_b") ||
@@ -1963,17 +2888,17 @@ void load_partitions(spdio_t* io, const char* path, unsigned step, int force_ab)
 		}
 		if (strcmp(fn, "uboot") == 0 || strcmp(fn, "vbmeta") == 0) {
 			get_partition_info(io, fn, 0);
-			if (!gPartInfo.size) continue;
+			if (!io->gPartInfo.size) continue;
 
-			load_partition_unify(io, gPartInfo.name, partitions[i].file_path, step);
+			load_partition_unify(io, io->gPartInfo.name, partitions[i].file_path, step);
 			partitions[i].written_flag = 1;
 			continue;
 		}
 		if (strncmp(fn, "vbmeta_", 7) == 0) {
 			get_partition_info(io, fn, 0);
-			if (!gPartInfo.size) continue;
+			if (!io->gPartInfo.size) continue;
 
-			load_partition_unify(io, gPartInfo.name, partitions[i].file_path, step);
+			load_partition_unify(io, io->gPartInfo.name, partitions[i].file_path, step);
 			partitions[i].written_flag = 1;
 			continue;
 		}
@@ -1983,10 +2908,10 @@ void load_partitions(spdio_t* io, const char* path, unsigned step, int force_ab)
 		if (!partitions[i].written_flag) {
 			fn = partitions[i].name;
 			get_partition_info(io, fn, 0);
-			if (!gPartInfo.size) continue;
-			if (!strcmp(gPartInfo.name, "metadata")) { metadata_in_dump = 1; metadata_id = i; continue; }
-			if (!strcmp(gPartInfo.name, "super")) { super_in_dump = 1; super_id = i; continue; }
-			load_partition_unify(io, gPartInfo.name, partitions[i].file_path, step);
+			if (!io->gPartInfo.size) continue;
+			if (!strcmp(io->gPartInfo.name, "metadata")) { metadata_in_dump = 1; metadata_id = i; continue; }
+			if (!strcmp(io->gPartInfo.name, "super")) { super_in_dump = 1; super_id = i; continue; }
+			load_partition_unify(io, io->gPartInfo.name, partitions[i].file_path, step);
 		}
 	}
 	if (super_in_dump) {
@@ -1995,9 +2920,9 @@ void load_partitions(spdio_t* io, const char* path, unsigned step, int force_ab)
 		else erase_partition(io, "metadata");
 	}
 	free(partitions);
-	if (selected_ab == 1) set_active(io, "a");
-	else if (selected_ab == 2) set_active(io, "b");
-	selected_ab = selected_ab_bak;
+	if (io->selected_ab == 1) set_active(io, "a");
+	else if (io->selected_ab == 2) set_active(io, "b");
+	io->selected_ab = selected_ab_bak;
 }
 
 void get_Da_Info(spdio_t* io) {
@@ -2011,13 +2936,13 @@ void get_Da_Info(spdio_t* io) {
 				memcpy(tmp, io->raw_buf + len, sizeof(tmp));
 
 				len += sizeof(tmp);
-				if (tmp[0] == 0) Da_Info.bDisableHDLC = *(uint32_t*) (io->raw_buf + len);
-				else if (tmp[0] == 2) Da_Info.bSupportRawData = *(uint8_t*) (io->raw_buf + len);
-				else if (tmp[0] == 3) Da_Info.dwFlushSize = *(uint32_t*) (io->raw_buf + len);
-				else if (tmp[0] == 6) Da_Info.dwStorageType = *(uint32_t*) (io->raw_buf + len);
+				if (tmp[0] == 0) io->Da_Info.bDisableHDLC = *(uint32_t*) (io->raw_buf + len);
+				else if (tmp[0] == 2) io->Da_Info.bSupportRawData = *(uint8_t*) (io->raw_buf + len);
+				else if (tmp[0] == 3) io->Da_Info.dwFlushSize = *(uint32_t*) (io->raw_buf + len);
+				else if (tmp[0] == 6) io->Da_Info.dwStorageType = *(uint32_t*) (io->raw_buf + len);
 				len += tmp[1];
 			}
-		} else memcpy(&Da_Info, io->raw_buf + 4, io->raw_len - 6);
+		} else memcpy(&io->Da_Info, io->raw_buf + 4, io->raw_len - 6);
 	}
 	DBG_LOG("FDL2: incompatible partition\n");
 }
@@ -2040,7 +2965,7 @@ void select_ab(spdio_t* io) {
 	if (send_and_check(io)) {
 		encode_msg_nocpy(io, BSL_CMD_READ_END, 0);
 		send_and_check(io);
-		selected_ab = 0;
+		io->selected_ab = 0;
 		return;
 	}
 
@@ -2056,12 +2981,12 @@ void select_ab(spdio_t* io) {
 	encode_msg_nocpy(io, BSL_CMD_READ_END, 0);
 	send_and_check(io);
 
-	if (abc == NULL) { selected_ab = 0; return; }
-	if (abc->nb_slot != 2) { selected_ab = 0; return; }
-	if (ab_compare_slots(&abc->slot_info[1], &abc->slot_info[0]) < 0) selected_ab = 2;
-	else selected_ab = 1;
+	if (abc == NULL) { io->selected_ab = 0; return; }
+	if (abc->nb_slot != 2) { io->selected_ab = 0; return; }
+	if (ab_compare_slots(&abc->slot_info[1], &abc->slot_info[0]) < 0) io->selected_ab = 2;
+	else io->selected_ab = 1;
 
-	if (selected_ab > 0 && check_partition(io, "uboot_a", 0) == 0) selected_ab = 0;
+	if (io->selected_ab > 0 && check_partition(io, "uboot_a", 0) == 0) io->selected_ab = 0;
 }
 
 void dm_disable(spdio_t* io, unsigned step) {
@@ -2120,21 +3045,154 @@ uint32_t crc32(uint32_t crc_in, const uint8_t* buf, int size) {
 	return crc ^ ~0U;
 }
 
+#define RMW_BLOCK 0x1000
+
+// whether len bytes of file a from offs_a are the same as file b from its start
+static int file_range_equal(const char* a, uint64_t offs_a, const char* b, uint64_t len) {
+	uint8_t buf_a[4096], buf_b[4096];
+	size_t n; int same = 0;
+	FILE* fa = fopen(a, "rb"), * fb = fopen(b, "rb");
+	if (fa && fb && !fseeko(fa, offs_a, SEEK_SET)) {
+		for (same = 1; same && len; len -= n) {
+			n = len > sizeof(buf_a) ? sizeof(buf_a) : len;
+			same = fread(buf_a, 1, n, fa) == n && fread(buf_b, 1, n, fb) == n && !memcmp(buf_a, buf_b, n);
+		}
+	}
+	if (fa) fclose(fa);
+	if (fb) fclose(fb);
+	return same;
+}
+
+static void part_fix_fn(spdio_t* io, char* fix_fn, const char* name, const char* suffix) {
+	if (io->savepath[0]) sprintf(fix_fn, "%s/%s%s", io->savepath, name, suffix);
+	else sprintf(fix_fn, "%s%s", name, suffix);
+}
+
+// copies the first len bytes of file src to dst
+static int file_copy_prefix(const char* src, const char* dst, uint64_t len) {
+	uint8_t buf[4096];
+	size_t n; int ok = 0;
+	FILE* fi = fopen(src, "rb"), * fo = fopen(dst, "wb");
+	if (fi && fo)
+		for (ok = 1; ok && len; len -= n) {
+			n = len > sizeof(buf) ? sizeof(buf) : len;
+			ok = fread(buf, 1, n, fi) == n && fwrite(buf, 1, n, fo) == n;
+		}
+	if (fi) fclose(fi);
+	if (fo) fclose(fo);
+	return ok;
+}
+
+// the end of the patched blocks if only [0, end) may be written, 0 if not.
+// UBI volumes are replaced as a whole, NV partitions are sent with their own header
+static uint64_t part_prefix_end(spdio_t* io, size_t offset, size_t length) {
+	uint64_t end = (offset + length + RMW_BLOCK - 1) / RMW_BLOCK * RMW_BLOCK;
+	if (io->Da_Info.dwStorageType == 0x101 || strstr(io->gPartInfo.name, "nv1")) return 0;
+	return end < (uint64_t) io->gPartInfo.size ? end : 0;
+}
+
+// whether the FDL keeps the rest of a partition when START_DATA is given less than its size is
+// not known until it has been tried. fix_fn holds the whole patched partition: only its prefix is
+// written, then the patched blocks and the block after them are read back. if anything differs,
+// the whole partition is written from fix_fn as before and prefix patching is not used again.
+// returns -1 if the whole partition has to be rewritten.
+static int part_probe_prefix(spdio_t* io, const char* fix_fn, size_t offset, size_t length, unsigned step) {
+	char name[36], prefix_fn[1024], check_fn[1024];
+	partition_t part = io->gPartInfo;
+	uint64_t end = part_prefix_end(io, offset, length), start, len;
+	int ret = -1;
+
+	if (io->part_rmw < 2 || io->rmw_probed || !end) return -1;
+	strcpy(name, part.name);
+	part_fix_fn(io, prefix_fn, name, ".prefix.bin");
+	part_fix_fn(io, check_fn, name, ".check.bin");
+	start = offset / RMW_BLOCK * RMW_BLOCK;
+	len = end - start + (part.size - end < RMW_BLOCK ? part.size - end : RMW_BLOCK);
+	if (file_copy_prefix(fix_fn, prefix_fn, end)) {
+		DBG_LOG("patching %s: writing 0x%llx of 0x%llx bytes to check whether the FDL keeps the rest\n",
+			name, (long long) end, (long long) part.size);
+		load_partition_unify(io, name, prefix_fn, step);
+		if (dump_partition(io, name, start, len, check_fn, step) == len &&
+			file_range_equal(fix_fn, start, check_fn, len)) {
+			DBG_LOG("probe: %s ok, only the patched part of partitions is written from now on\n", name);
+			io->rmw_probed = 1;
+			ret = 0;
+		} else {
+			DBG_LOG("probe: %s differs, this FDL does not keep the rest of a partition. rewriting the whole partition\n", name);
+			io->rmw_probed = -1;
+		}
+		remove(check_fn);
+	}
+	remove(prefix_fn);
+	io->gPartInfo = part;
+	return ret;
+}
+
+// START_DATA always writes from the start of the partition, so the least that can be sent is
+// everything up to the end of the last patched block. only that much is read, patched and
+// written, the rest of the partition is left as it is (as with an image smaller than the
+// partition). part_rmw 1 trusts the FDL for that, part_rmw 2 only after part_probe_prefix
+// succeeded, and reads back the patched blocks and the block after them.
+// returns -1 if the whole partition has to be rewritten instead.
+static int part_patch_prefix(spdio_t* io, const char* fix_fn, size_t offset, uint8_t* mem, size_t length, unsigned step) {
+	char name[36], tail_fn[1024], check_fn[1024];
+	partition_t part = io->gPartInfo;	// load_partition_unify looks up _bak in it
+	uint64_t size = part.size, end = part_prefix_end(io, offset, length), start, tail = 0;
+	int ret = -1;
+	FILE* fi;
+
+	if (io->part_rmw < 1 || (io->part_rmw >= 2 && io->rmw_probed != 1) || !end) return -1;
+	strcpy(name, part.name);
+	part_fix_fn(io, tail_fn, name, ".tail.bin");
+	part_fix_fn(io, check_fn, name, ".check.bin");
+
+	if (io->part_rmw >= 2) {
+		tail = size - end < RMW_BLOCK ? size - end : RMW_BLOCK;
+		if (dump_partition(io, name, end, tail, tail_fn, step) != tail) goto done;
+	}
+	if (end != dump_partition(io, name, 0, end, fix_fn, step)) goto done;
+	if (!(fi = fopen(fix_fn, "rb+"))) goto done;
+	if (fseeko(fi, offset, SEEK_SET) || fwrite(mem, 1, length, fi) != length) ERR_EXIT("fwrite failed\n");
+	fclose(fi);
+	DBG_LOG("patching %s: writing 0x%llx of 0x%llx bytes\n", name, (long long) end, (long long) size);
+	load_partition_unify(io, name, fix_fn, step);
+	ret = 0;
+
+	if (io->part_rmw >= 2) {
+		start = offset / RMW_BLOCK * RMW_BLOCK;
+		if (dump_partition(io, name, start, end - start, check_fn, step) != end - start ||
+			!file_range_equal(fix_fn, start, check_fn, end - start)) {
+			// the old way writes the whole partition
+			DBG_LOG("verify: patched blocks of %s differ, rewriting the whole partition\n", name);
+			ret = -1;
+		} else if (dump_partition(io, name, end, tail, check_fn, step) != tail ||
+			!file_range_equal(tail_fn, 0, check_fn, tail)) {
+			// the probe passed, so this is unexpected. do not do it again
+			DBG_LOG("verify: %s changed after 0x%llx, this FDL does not keep the rest of a partition. patching is turned off\n",
+				name, (long long) end);
+			io->rmw_probed = -1;
+		} else DBG_LOG("verify: %s ok\n", name);
+		remove(check_fn);
+	}
+done:
+	remove(tail_fn);
+	if (ret) remove(fix_fn);
+	io->gPartInfo = part;
+	return ret;
+}
+
 void w_mem_to_part_offset(spdio_t* io, const char* name, size_t offset, uint8_t* mem, size_t length, unsigned step) {
 	get_partition_info(io, name, 1);
-	if (!gPartInfo.size) { DBG_LOG("part not exist\n"); return; } else if (gPartInfo.size > 0xffffffff) { DBG_LOG("part too large\n"); return; }
-
-	char dfile[40];
-	snprintf(dfile, sizeof(dfile), "%s.bin", name);
+	if (!io->gPartInfo.size) { DBG_LOG("part not exist\n"); return; } else if (io->gPartInfo.size > 0xffffffff) { DBG_LOG("part too large\n"); return; }
 
 	char fix_fn[1024];
-	if (savepath[0]) sprintf(fix_fn, "%s/%s", savepath, dfile);
-	else strcpy(fix_fn, dfile);
+	part_fix_fn(io, fix_fn, name, ".bin");
 
 	FILE* fi;
+	if (offset && !part_patch_prefix(io, fix_fn, offset, mem, length, step)) return;
 	if (offset == 0) fi = fopen(fix_fn, "wb");
 	else {
-		if (gPartInfo.size != (long long) dump_partition(io, gPartInfo.name, 0, gPartInfo.size, fix_fn, step)) {
+		if (io->gPartInfo.size != (long long) dump_partition(io, io->gPartInfo.name, 0, io->gPartInfo.size, fix_fn, step)) {
 			remove(fix_fn);
 			return;
 		}
@@ -2144,7 +3202,8 @@ void w_mem_to_part_offset(spdio_t* io, const char* name, size_t offset, uint8_t*
 	if (fseek(fi, offset, SEEK_SET) != 0) ERR_EXIT("fseek failed\n");
 	if (fwrite(mem, 1, length, fi) != length) ERR_EXIT("fwrite failed\n");
 	fclose(fi);
-	load_partition_unify(io, gPartInfo.name, fix_fn, step);
+	if (offset && !part_probe_prefix(io, fix_fn, offset, length, step)) return;
+	load_partition_unify(io, io->gPartInfo.name, fix_fn, step);
 }
 
 // 1 main written and _bak not written, 2 both written
@@ -2152,8 +3211,8 @@ int load_partition_unify(spdio_t* io, const char* name, const char* fn, unsigned
 	char name0[36], name1[40];
 	unsigned size0, size1;
 	if (strstr(name, "fixnv1")) { load_nv_partition(io, name, fn, 4096); return 1; }
-	if (selected_ab > 0 ||
-		Da_Info.dwStorageType == 0x101 ||
+	if (io->selected_ab > 0 ||
+		io->Da_Info.dwStorageType == 0x101 ||
 		io->part_count == 0 ||
 		strncmp(name, "splloader", 9) == 0) {
 		load_partition(io, name, fn, step);
@@ -2164,28 +3223,36 @@ int load_partition_unify(spdio_t* io, const char* name, const char* fn, unsigned
 	if (strlen(name0) >= sizeof(name0) - 4) { load_partition(io, name0, fn, step); return 1; }
 	snprintf(name1, sizeof(name1), "%s_bak", name0);
 	get_partition_info(io, name1, 1);
-	if (!gPartInfo.size) { load_partition(io, name0, fn, step); return 1; }
-	size1 = gPartInfo.size;
+	if (!io->gPartInfo.size) { load_partition(io, name0, fn, step); return 1; }
+	size1 = io->gPartInfo.size;
 	size0 = check_partition(io, name0, 1);
 
+	// the _bak copy is sent from the chunks read for the main partition
+	file_feeder_t keep;
+	keep.slots = NULL;
+	if (size0 == size1) io->feed_keep = &keep;
 	for (int i = 0; i < io->part_count; i++)
 		if (!strcmp(name0, (*(io->ptable + i)).name)) {
 			load_partition_force(io, i, fn, step);
 			break;
 		}
+	int ret = 1;
 	if (size0 == size1) {
+		ret = 2;
 		if (!strcmp(name0, "vbmeta")) {
 			char ch = '\0';
 			FILE* fi = fopen(fn, "rb+");
-			if (!fi) { DBG_LOG("fopen %s failed\n", fn); return 1; }
-			if (fseek(fi, 0x7B, SEEK_SET) != 0) { DBG_LOG("fseek failed\n"); fclose(fi); return 1; }
-			if (fwrite(&ch, 1, 1, fi) != 1) { DBG_LOG("fwrite failed\n"); fclose(fi); return 1; }
-			fclose(fi);
+			if (!fi) { DBG_LOG("fopen %s failed\n", fn); ret = 1; }
+			else if (fseek(fi, 0x7B, SEEK_SET) != 0) { DBG_LOG("fseek failed\n"); ret = 1; }
+			else if (fwrite(&ch, 1, 1, fi) != 1) { DBG_LOG("fwrite failed\n"); ret = 1; }
+			if (fi) fclose(fi);
+			if (ret == 2) feeder_patch(&keep, 0x7B, ch);
 		}
-		load_partition(io, name1, fn, step);
-		return 2;
+		if (ret == 2) load_partition(io, name1, fn, step);
 	}
-	return 1;
+	io->feed_keep = NULL;
+	if (keep.slots) feeder_finish(&keep);
+	return ret;
 }
 
 void set_active(spdio_t* io, const char* arg) {
@@ -2208,11 +3275,9 @@ void set_active(spdio_t* io, const char* arg) {
 #if _WIN32
 const _TCHAR CLASS_NAME[] = _T("Sample Window Class");
 
-HWND g_hWnd;
-
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
-	static BOOL interface_checked = FALSE;
-	static BOOL is_diag = FALSE;
+	spdio_t* io = (spdio_t*) GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	if (!io) return DefWindowProc(hWnd, message, wParam, lParam);
 	switch (message) {
 		case WM_DEVICECHANGE:
 			if (DBT_DEVICEARRIVAL == wParam || DBT_DEVICEREMOVECOMPLETE == wParam) {
@@ -2224,40 +3289,40 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 						pDevInf = (PDEV_BROADCAST_DEVICEINTERFACE) pHdr;
 					#if USE_LIBUSB
 						if (DBT_DEVICEREMOVECOMPLETE == wParam) {
-							libusb_device** currentports = FindPort(0);
-							if (currentports == NULL) m_bOpened = -1;
+							libusb_device** currentports = FindPort(io->ctx, 0);
+							if (currentports == NULL) io->m_bOpened = -1;
 							else {
 								libusb_device** port = currentports;
 								while (*port != NULL) {
-									if (curPort == *port) break;
+									if (io->curPort == *port) break;
 									port++;
 								}
-								if (*port == NULL) m_bOpened = -1;
+								if (*port == NULL) io->m_bOpened = -1;
 								libusb_free_device_list(currentports, 1);
 								currentports = NULL;
 							}
 						}
 					#else
-						if (my_strstr(pDevInf->dbcc_name, _T("VID_1782&PID_4D00"))) interface_checked = TRUE;
+						if (my_strstr(pDevInf->dbcc_name, _T("VID_1782&PID_4D00"))) io->interface_checked = TRUE;
 						else if (my_strstr(pDevInf->dbcc_name, _T("VID_1782&PID_4D03"))) {
-							interface_checked = TRUE;
-							is_diag = TRUE;
+							io->interface_checked = TRUE;
+							io->is_diag = TRUE;
 						}
 					#endif
 						break;
 					#if !USE_LIBUSB
 					case DBT_DEVTYP_PORT:
-						if (interface_checked) {
+						if (io->interface_checked) {
 							pDevPort = (PDEV_BROADCAST_PORT) pHdr;
 							DWORD changedPort = my_strtoul(pDevPort->dbcp_name + 3, NULL, 0);
 							if (DBT_DEVICEARRIVAL == wParam) {
-								if (!curPort) {
-									if (is_diag) {
+								if (!io->curPort) {
+									if (io->is_diag) {
 										DWORD* currentports = FindPort("SPRD DIAG");
 										if (currentports) {
 											for (DWORD* port = currentports; *port != 0; port++) {
 												if (changedPort == *port) {
-													curPort = changedPort;
+													io->curPort = changedPort;
 													break;
 												}
 											}
@@ -2265,14 +3330,14 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 											currentports = NULL;
 										}
 									} else {
-										curPort = changedPort;
+										io->curPort = changedPort;
 									}
 								}
 							} else {
-								if (curPort == changedPort) m_bOpened = -1; // no need to judge changedPort for DBT_DEVICEREMOVECOMPLETE
+								if (io->curPort == changedPort) io->m_bOpened = -1; // no need to judge changedPort for DBT_DEVICEREMOVECOMPLETE
 							}
-							interface_checked = FALSE;
-							is_diag = FALSE;
+							io->interface_checked = FALSE;
+							io->is_diag = FALSE;
 						}
 						break;
 					#endif
@@ -2283,21 +3348,25 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 	return DefWindowProc(hWnd, message, wParam, lParam);
 }
 
+// lpParam: the spdio_t the window reports device changes to
 DWORD WINAPI ThrdFunc(LPVOID lpParam) {
+	HWND hWnd;
 	WNDCLASS wc = { 0 };
 	wc.lpfnWndProc = WndProc;
 	wc.hInstance = GetModuleHandle(NULL);
 	wc.lpszClassName = CLASS_NAME;
-	if (0 == RegisterClass(&wc)) return -1;
+	// registered once per process, each device has its own window
+	if (0 == RegisterClass(&wc) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS) return -1;
 
-	g_hWnd = CreateWindowEx(0, CLASS_NAME, _T(""), WS_OVERLAPPEDWINDOW,
+	hWnd = CreateWindowEx(0, CLASS_NAME, _T(""), WS_OVERLAPPEDWINDOW,
 		CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT,
 		NULL, // Parent window
 		NULL, // Menu
 		GetModuleHandle(NULL), // Instance handle
 		NULL // Additional application data
 	);
-	if (g_hWnd == NULL) return -1;
+	if (hWnd == NULL) return -1;
+	SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR) lpParam);
 
 	DEV_BROADCAST_DEVICEINTERFACE NotificationFilter;
 #if USE_LIBUSB
@@ -2309,7 +3378,7 @@ DWORD WINAPI ThrdFunc(LPVOID lpParam) {
 	NotificationFilter.dbcc_size = sizeof(DEV_BROADCAST_DEVICEINTERFACE);
 	NotificationFilter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
 	NotificationFilter.dbcc_classguid = GUID_DEVINTERFACE;
-	if (RegisterDeviceNotification(g_hWnd, &NotificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE) == NULL) return -1;
+	if (RegisterDeviceNotification(hWnd, &NotificationFilter, DEVICE_NOTIFY_WINDOW_HANDLE) == NULL) return -1;
 
 	MSG msg;
 	while (GetMessage(&msg, NULL, 0, 0)) {
@@ -2330,8 +3399,9 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 	while (done != 1) {
 		DBG_LOG("Waiting for boot_diag/cali_diag/dl_diag connection (%ds)\n", ms / 1000);
 		for (int i = 0; ; i++) {
-			if (curPort) {
-				if (!call_ConnectChannel(io->handle, curPort, WM_RCV_CHANNEL_DATA, io->m_dwRecvThreadID)) ERR_EXIT("Connection failed\n");
+			if (io->curPort) {
+				io->m_bOpened = call_ConnectChannel(io->handle, io->curPort, WM_RCV_CHANNEL_DATA, io->m_dwRecvThreadID);
+				if (!io->m_bOpened) ERR_EXIT("Connection failed\n");
 				break;
 			}
 			if (100 * i >= ms) ERR_EXIT("find port failed\n");
@@ -2360,7 +3430,7 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 				if (a == chk1) io->flags |= FLAGS_CRC16;
 				else {
 					chk2 = spd_checksum(0, io->recv_buf + 1, bytes_read - 4, CHK_ORIG);
-					if (a == chk2) fdl1_loaded = 1;
+					if (a == chk2) io->fdl1_loaded = 1;
 					else ERR_EXIT("bad checksum (0x%04x, expected 0x%04x or 0x%04x)\n", a, chk1, chk2);
 				}
 				return;
@@ -2387,7 +3457,7 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 				if (a == chk1) io->flags |= FLAGS_CRC16;
 				else {
 					chk2 = spd_checksum(0, io->recv_buf + 1, bytes_read - 4, CHK_ORIG);
-					if (a == chk2) fdl1_loaded = 1;
+					if (a == chk2) io->fdl1_loaded = 1;
 					else ERR_EXIT("bad checksum (0x%04x, expected 0x%04x or 0x%04x)\n", a, chk1, chk2);
 				}
 				if (io->recv_buf[2] == BSL_REP_VER) { if (io->recv_buf[9] < '4') return; } else return;
@@ -2410,11 +3480,11 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 			}
 		}
 		for (int i = 0; ; i++) {
-			if (m_bOpened == -1) {
+			if (io->m_bOpened == -1) {
 				call_DisconnectChannel(io->handle);
 				io->recv_buf[2] = 0;
-				curPort = 0;
-				m_bOpened = 0;
+				io->curPort = 0;
+				io->m_bOpened = 0;
 				if (done == -1) done = 1;
 				break;
 			}
@@ -2430,7 +3500,6 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 
 DWORD WINAPI RcvDataThreadProc(LPVOID lpParam) {
 	spdio_t* io = (spdio_t*) lpParam;
-	static int plen = 6;
 
 	MSG msg;
 	PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
@@ -2444,10 +3513,10 @@ DWORD WINAPI RcvDataThreadProc(LPVOID lpParam) {
 					DBG_LOG("recv (%d):\n", (int) msg.lParam);
 					print_mem(stderr, (const uint8_t*) msg.wParam, (int) msg.lParam);
 				}
-				if (recv_transcode(io, (const uint8_t*) msg.wParam, (int) msg.lParam, &plen)) {
-					if (plen == io->raw_len) {
+				if (recv_transcode(io, (const uint8_t*) msg.wParam, (int) msg.lParam, &io->recv_plen)) {
+					if (io->recv_plen == io->raw_len) {
 						if (recv_check_crc(io)) {
-							plen = 6;
+							io->recv_plen = 6;
 							SetEvent(io->m_hOprEvent);
 						}
 					}
@@ -2510,62 +3579,62 @@ void DestroyRecvThread(spdio_t* io) {
 }
 #else
 #ifndef _MSC_VER
-pthread_t gUsbEventThrd;
-libusb_hotplug_callback_handle gHotplugCbHandle = 0;
-
 // SPRD DIAG, bInterfaceNumber 0
 // SPRD LOG, bInterfaceNumber 1
 // Since find_endpoints() ignored bInterfaceNumber 1, 0x4d03 works in HotplugCbFunc()
+// every session has its own context, callback and event thread. the other sessions see the same
+// arrivals, so a session only takes a device on its own port, or a port no session uses yet
 int HotplugCbFunc(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event, void* user_data) {
-	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) { if (!curPort) curPort = device; } else { if (curPort == device) m_bOpened = -1; }
+	spdio_t* io = (spdio_t*) user_data;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) { if (!io->curPort && usb_claim(io, device)) io->curPort = device; } else { if (io->curPort == device) io->m_bOpened = -1; }
 	return 0;
 }
 
 void* UsbThrdFunc(void* param) {
-	int ret;
-	while (bListenLibusb) {
-		ret = libusb_handle_events(NULL);
+	spdio_t* io = (spdio_t*) param; int ret;
+	while (io->bListenLibusb) {
+		ret = libusb_handle_events(io->ctx);
 		if (ret < 0)
 			DBG_LOG("libusb_handle_events() failed: %s\n", libusb_error_name(ret));
 	}
 	return NULL;
 }
 
-void startUsbEventHandle(void) {
+void startUsbEventHandle(spdio_t* io) {
 	int ret = libusb_hotplug_register_callback(
-		NULL,
+		io->ctx,
 		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
 		LIBUSB_HOTPLUG_NO_FLAGS,
 		0x1782,
 		LIBUSB_HOTPLUG_MATCH_ANY,
 		LIBUSB_HOTPLUG_MATCH_ANY,
 		HotplugCbFunc,
-		NULL,
-		&gHotplugCbHandle);
+		io,
+		&io->hHotplugCb);
 	if (ret != LIBUSB_SUCCESS) ERR_EXIT("libusb_hotplug_register_callback failed, error: %d\n", ret);
 
-	ret = pthread_create(&gUsbEventThrd, NULL, UsbThrdFunc, NULL);
+	ret = pthread_create(&io->hUsbEventThrd, NULL, UsbThrdFunc, io);
 	if (ret != 0) {
-		libusb_hotplug_deregister_callback(NULL, gHotplugCbHandle);
+		libusb_hotplug_deregister_callback(io->ctx, io->hHotplugCb);
 		ERR_EXIT("Failed to create thread, error: %d\n", ret);
 	}
 
-	bListenLibusb = 1;
+	io->bListenLibusb = 1;
 }
 
-void stopUsbEventHandle(void) {
-	bListenLibusb = 0;
-	libusb_hotplug_deregister_callback(NULL, gHotplugCbHandle);
+void stopUsbEventHandle(spdio_t* io) {
+	io->bListenLibusb = 0;
+	libusb_hotplug_deregister_callback(io->ctx, io->hHotplugCb);
 
-	int ret = pthread_join(gUsbEventThrd, NULL);
+	int ret = pthread_join(io->hUsbEventThrd, NULL);
 	if (ret != 0) DBG_LOG("Failed to join thread, error: %d\n", ret);
 }
 #else
-void startUsbEventHandle(void) {
+void startUsbEventHandle(spdio_t* io) {
 	DBG_LOG("startUsbEventHandle() is not supported in MSVC. Please use MSYS2 if you need it.\n");
 }
 
-void stopUsbEventHandle(void) {
+void stopUsbEventHandle(spdio_t* io) {
 	DBG_LOG("stopUsbEventHandle() is not supported in MSVC. Please use MSYS2 if you need it.\n");
 }
 #endif
@@ -2573,12 +3642,14 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 	int err, bytes_written, bytes_read;
 	if (bootmode >= 0x80) ERR_EXIT("mode not exist\n");
 	int done = 0;
+	// the handshake below reads endp_in directly
+	recv_ring_stop(io);
 
 	while (done != 1) {
 		DBG_LOG("Waiting for boot_diag/cali_diag/dl_diag connection (%ds)\n", ms / 1000);
 		for (int i = 0; ; i++) {
-			if (curPort) {
-				if (libusb_open(curPort, &io->dev_handle) < 0) ERR_EXIT("Connection failed\n");
+			if (io->curPort) {
+				if (libusb_open(io->curPort, &io->dev_handle) < 0) ERR_EXIT("Connection failed\n");
 				call_Initialize_libusb(io);
 				break;
 			}
@@ -2615,7 +3686,7 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 				if (a == chk1) io->flags |= FLAGS_CRC16;
 				else {
 					chk2 = spd_checksum(0, io->recv_buf + 1, bytes_read - 4, CHK_ORIG);
-					if (a == chk2) fdl1_loaded = 1;
+					if (a == chk2) io->fdl1_loaded = 1;
 					else ERR_EXIT("bad checksum (0x%04x, expected 0x%04x or 0x%04x)\n", a, chk1, chk2);
 				}
 				return;
@@ -2649,7 +3720,7 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 				if (a == chk1) io->flags |= FLAGS_CRC16;
 				else {
 					chk2 = spd_checksum(0, io->recv_buf + 1, bytes_read - 4, CHK_ORIG);
-					if (a == chk2) fdl1_loaded = 1;
+					if (a == chk2) io->fdl1_loaded = 1;
 					else ERR_EXIT("bad checksum (0x%04x, expected 0x%04x or 0x%04x)\n", a, chk1, chk2);
 				}
 				if (io->recv_buf[2] == BSL_REP_VER) { if (io->recv_buf[9] < '4') return; } else return;
@@ -2678,11 +3749,12 @@ void ChangeMode(spdio_t* io, int ms, int bootmode, int at) {
 			}
 		}
 		for (int i = 0; ; i++) {
-			if (m_bOpened == -1) {
+			if (io->m_bOpened == -1) {
+				recv_ring_stop(io);
 				libusb_close(io->dev_handle);
 				io->recv_buf[2] = 0;
-				curPort = 0;
-				m_bOpened = 0;
+				io->curPort = 0;
+				io->m_bOpened = 0;
 				if (done == -1) done = 1;
 				break;
 			}
@@ -2704,6 +3776,6 @@ void call_Initialize_libusb(spdio_t* io) {
 	int ret = libusb_control_transfer(io->dev_handle, 0x21, 34, 0x601, 0, NULL, 0, io->timeout);
 	if (ret < 0) ERR_EXIT("libusb_control_transfer failed : %s\n", libusb_error_name(ret));
 	DBG_LOG("libusb_control_transfer ok\n");
-	m_bOpened = 1;
+	io->m_bOpened = 1;
 }
 #endif
@@ -40,6 +40,10 @@ void print_help(void) {
 		"\t--kickto <mode>\n"
 		"\t\tConnects the device using a custom route boot_diag -> custom_diag. Supported modes are 0-127.\n"
 		"\t\t(mode 0 is `kickto 2` on ums9621, mode 1 = cali_diag, mode 2 = dl_diag; not all devices support mode 2).\n"
+		"\t--port <port>\n"
+		"\t\tOnly uses the device on this port: the COM port number, or the USB port path (like 1-2.3) in libusb builds.\n"
+		"\t--batch\n"
+		"\t\tExits after the commands on the command line instead of showing the prompt.\n"
 		"\t-?|-h|--help\n"
 		"\t\tShow help and usage information\n"
 	);
@@ -72,6 +76,26 @@ void print_help(void) {
 		"\t\t(rawdata relays on u-boot/lk, so don't set it manually.\n"
 		"\tblk_size byte\n\t\t(fdl2 stage only)\n"
 		"\t\tSets the block size, with a maximum of 65535 bytes. This option helps speed up `r`, `w`,`read_part(s)` and `write_part(s)` commands.\n"
+		"\tread_window count\n\t\t(fdl2 stage only)\n"
+		"\t\tSets how many read requests `r`, `read_part(s)`, `read_flash` and `read_mem` keep in flight, default is 4, maximum is 16.\n"
+		"\t\t1 waits for each reply before sending the next request; this is used automatically if the FDL mishandles queued requests.\n"
+		"\tfblk_size mb\n\t\t(fdl2 stage only)\n"
+		"\t\tEnables flow control for `r` and `read_part(s)` on FDLs that choke on long dumps. Timeouts, busy replies and unusually slow replies\n"
+		"\t\tshrink the read window and add a pause between requests, both are relaxed again after every `mb` MiB read without trouble.\n"
+		"\tpart_cache {0,1,clear}\n\t\t(fdl2 stage only)\n"
+		"\t\tPartition sizes and existence are probed once per session. 1 also saves them to partcache_<chip uid>.txt in the save dir\n"
+		"\t\tand loads them on later runs if they agree with the partition table,\n"
+		"\t\t0 stops saving, clear forgets them (needed if the partition table was changed by another tool).\n"
+		"\tfeed_depth count\n"
+		"\t\tSets how many blocks `w` and `write_part(s)` read from the image ahead of the device, default is 4, maximum is 64.\n"
+		"\trecv_ring count\n\t\t(libusb builds only)\n"
+		"\t\tSets how many USB reads are kept posted ahead of the data, default is 4, maximum is 16. 0 waits for each read like older versions.\n"
+		"\trecv_bench part_name size\n\t\t(fdl2 stage only, libusb builds only)\n"
+		"\t\tReads the start of a partition twice, with synchronous reads and with `recv_ring`, and compares the throughput. Nothing is saved.\n"
+		"\tpatch_mode {0,1,2}\n\t\t(fdl2 stage only)\n"
+		"\t\tHow `wof`, `wov` and `set_active` patch a partition. 0 reads and rewrites the whole partition,\n"
+		"\t\t1 only the part up to the patched blocks, trusting the FDL to keep the rest of the partition.\n"
+		"\t\t2 (default) the same, once the first patch showed that the FDL keeps the rest, and reads back the patched blocks and the block after them.\n"
 		"\tr all|part_name|part_id\n"
 		"\t\tWhen the partition table is available:\n"
 		"\t\t\tr all: full backup (excludes blackbox, cache, userdata)\n"
@@ -123,21 +147,27 @@ void print_help(void) {
 }
 
 #define REOPEN_FREQ 2
-extern char fn_partlist[40];
-extern char savepath[ARGV_LEN];
-extern DA_INFO_T Da_Info;
-extern partition_t gPartInfo;
-int bListenLibusb = -1;
-int gpt_failed = 1;
-int m_bOpened = 0;
-int fdl1_loaded = 0;
-int fdl2_executed = 0;
-int selected_ab = -1;
-uint64_t fblk_size = 0;
 
+typedef struct {
+	int argc;
+	char **argv;
+} spd_args_t;
 
+static int spddump_session(spdio_t *io, void *arg);
+
+// an error ends the session of this call only, so several can run on their own threads
 int spddump_main(int argc, char **argv) {
-	spdio_t *io = NULL; int ret, i, in_quote;
+	spd_args_t args = { argc, argv };
+	spdio_t *io = spdio_init(0);
+	int ret = spd_session_run(io, spddump_session, &args);
+	spdio_free(io);
+	return ret < 0 ? 1 : ret;
+}
+
+static int spddump_session(spdio_t *io, void *arg) {
+	int argc = ((spd_args_t *)arg)->argc;
+	char **argv = ((spd_args_t *)arg)->argv;
+	int ret, i, in_quote;
 	int wait = 30 * REOPEN_FREQ;
 	int argcount = 0, stage = -1, nand_id = DEFAULT_NAND_ID;
 	int nand_info[3];
@@ -147,18 +177,15 @@ int spddump_main(int argc, char **argv) {
 	char str1[(ARGC_MAX - 1) * ARGV_LEN];
 	char **str2;
 	char *execfile;
-	int bootmode = -1, at = 0, async = 1;
+	int bootmode = -1, at = 0, async = 1, batch = 0;
 #if !USE_LIBUSB
-	extern DWORD curPort;
 	DWORD *ports;
 #else
-	extern libusb_device *curPort;
 	libusb_device **ports;
 #endif
 	execfile = (char*) malloc(ARGV_LEN);
 	if (!execfile) ERR_EXIT("malloc failed\n");
 
-	io = spdio_init(0);
 #if USE_LIBUSB
 #ifdef __ANDROID__
 	int xfd = -1; // This store termux gived fd
@@ -167,7 +194,7 @@ int spddump_main(int argc, char **argv) {
 	struct libusb_device_descriptor desc;
 	libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
 #endif
-	ret = libusb_init(NULL);
+	ret = libusb_init(&io->ctx);
 	if (ret < 0)
 		ERR_EXIT("libusb_init failed: %s\n", libusb_error_name(ret));
 #else
@@ -175,7 +202,7 @@ int spddump_main(int argc, char **argv) {
 	call_Initialize(io->handle);
 #endif
 	// DBG_LOG("branch:%s, sha1:%s\n", GIT_VER, GIT_SHA1);
-	sprintf(fn_partlist, "partition_%lld.xml", (long long)time(NULL));
+	sprintf(io->fn_partlist, "partition_%lld.xml", (long long)time(NULL));
 	while (argc > 1) {
 		if (!strcmp(argv[1], "--wait")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
@@ -220,6 +247,19 @@ int spddump_main(int argc, char **argv) {
 			async = 0;
 			argc -= 1; argv += 1;
 		}
+		else if (!strcmp(argv[1], "--port")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+#if USE_LIBUSB
+			if (!usb_bind(io, argv[2])) ERR_EXIT("port %s is used by another session\n", argv[2]);
+#else
+			io->curPort = strtoul(argv[2], NULL, 0);
+#endif
+			argc -= 2; argv += 2;
+		}
+		else if (!strcmp(argv[1], "--batch")) {
+			batch = 1;
+			argc -= 1; argv += 1;
+		}
 		else break;
 	}
 #if defined(_MYDEBUG) && defined(USE_LIBUSB)
@@ -227,18 +267,18 @@ int spddump_main(int argc, char **argv) {
 #endif
 	if (stage == 99) { bootmode = -1; at = 0; }
 #ifdef __ANDROID__
-	bListenLibusb = 0;
+	io->bListenLibusb = 0;
 	DBG_LOG("Try to convert termux transfered usb port fd.\n");
 	// handle
 	if (xfd < 0)
 		ERR_EXIT("Example: termux-usb -e \"./spd_dump --usb-fd\" /dev/bus/usb/xxx/xxx\n"
 			"run on android need provide --usb-fd\n");
 
-	if (libusb_wrap_sys_device(NULL, (intptr_t)xfd, &io->dev_handle))
+	if (libusb_wrap_sys_device(io->ctx, (intptr_t)xfd, &io->dev_handle))
 		ERR_EXIT("libusb_wrap_sys_device exit unconditionally!\n");
 
-	curPort = libusb_get_device(io->dev_handle);
-	if (libusb_get_device_descriptor(curPort, &desc))
+	io->curPort = libusb_get_device(io->dev_handle);
+	if (libusb_get_device_descriptor(io->curPort, &desc))
 		ERR_EXIT("libusb_get_device exit unconditionally!");
 
 	DBG_LOG("Vendor ID: %04x\nProduct ID: %04x\n", desc.idVendor, desc.idProduct);
@@ -248,31 +288,31 @@ int spddump_main(int argc, char **argv) {
 	call_Initialize_libusb(io);
 #else
 #if !USE_LIBUSB
-	bListenLibusb = 0;
+	io->bListenLibusb = 0;
 	if (at || bootmode >= 0) {
-		io->hThread = CreateThread(NULL, 0, ThrdFunc, NULL, 0, &io->iThread);
+		io->hThread = CreateThread(NULL, 0, ThrdFunc, io, 0, &io->iThread);
 		if (io->hThread == NULL) return -1;
 		ChangeMode(io, wait / REOPEN_FREQ * 1000, bootmode, at);
 		wait = 30 * REOPEN_FREQ;
 		stage = -1;
 	}
 #else
-	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) { DBG_LOG("hotplug unsupported on this platform\n"); bListenLibusb = 0; bootmode = -1; at = 0; }
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) { DBG_LOG("hotplug unsupported on this platform\n"); io->bListenLibusb = 0; bootmode = -1; at = 0; }
 	if (at || bootmode >= 0) {
-		startUsbEventHandle();
+		startUsbEventHandle(io);
 		ChangeMode(io, wait / REOPEN_FREQ * 1000, bootmode, at);
 		wait = 30 * REOPEN_FREQ;
 		stage = -1;
 	}
-	if (bListenLibusb < 0) startUsbEventHandle();
+	if (io->bListenLibusb < 0) startUsbEventHandle(io);
 #endif
 #if _WIN32
-	if (!bListenLibusb) {
-		if (io->hThread == NULL) io->hThread = CreateThread(NULL, 0, ThrdFunc, NULL, 0, &io->iThread);
+	if (!io->bListenLibusb) {
+		if (io->hThread == NULL) io->hThread = CreateThread(NULL, 0, ThrdFunc, io, 0, &io->iThread);
 		if (io->hThread == NULL) return -1;
 	}
 #if !USE_LIBUSB
-	if (!m_bOpened && async) {
+	if (!io->m_bOpened && async) {
 		if (FALSE == CreateRecvThread(io)) {
 			io->m_dwRecvThreadID = 0;
 			DBG_LOG("Create Receive Thread Fail.\n");
@@ -280,50 +320,55 @@ int spddump_main(int argc, char **argv) {
 	}
 #endif
 #endif
-	if (!m_bOpened) {
+	if (!io->m_bOpened) {
 		DBG_LOG("Waiting for dl_diag connection (%ds)\n", wait / REOPEN_FREQ);
 		for (i = 0; ; i++) {
 #if USE_LIBUSB
-			if (bListenLibusb) {
-				if (curPort) {
-					if (libusb_open(curPort, &io->dev_handle) >= 0) call_Initialize_libusb(io);
+			if (io->bListenLibusb) {
+				if (io->curPort) {
+					if (libusb_open(io->curPort, &io->dev_handle) >= 0) call_Initialize_libusb(io);
 					else ERR_EXIT("Connection failed\n");
 					break;
 				}
 			}
 			if (!(i % 4)) {
-				if ((ports = FindPort(0x4d00))) {
+				if ((ports = FindPort(io->ctx, 0x4d00))) {
+					int bound = io->usb_path[0] != 0;
 					for (libusb_device **port = ports; *port != NULL; port++) {
+						// devices of the other sessions in this process are skipped
+						if (!usb_claim(io, *port)) continue;
 						if (libusb_open(*port, &io->dev_handle) >= 0) {
 							call_Initialize_libusb(io);
-							curPort = *port;
+							io->curPort = *port;
 							break;
 						}
+						if (!bound) usb_unbind(io);
 					}
 					libusb_free_device_list(ports, 1);
 					ports = NULL;
-					if (m_bOpened) break;
+					if (io->m_bOpened) break;
 				}
 			}
 			if (i >= wait)
 				ERR_EXIT("libusb_open_device failed\n");
 #else
-			if (io->verbose) DBG_LOG("CurTime: %.1f, CurPort: %d\n", (float)i / REOPEN_FREQ, curPort);
-			if (curPort) {
-				if (!call_ConnectChannel(io->handle, curPort, WM_RCV_CHANNEL_DATA, io->m_dwRecvThreadID)) ERR_EXIT("Connection failed\n");
+			if (io->verbose) DBG_LOG("CurTime: %.1f, CurPort: %d\n", (float)i / REOPEN_FREQ, io->curPort);
+			if (io->curPort) {
+				io->m_bOpened = call_ConnectChannel(io->handle, io->curPort, WM_RCV_CHANNEL_DATA, io->m_dwRecvThreadID);
+				if (!io->m_bOpened) ERR_EXIT("Connection failed\n");
 				break;
 			}
 			if (!(i % 4)) {
 				if ((ports = FindPort("SPRD U2S Diag"))) {
 					for (DWORD *port = ports; *port != 0; port++) {
-						if (call_ConnectChannel(io->handle, *port, WM_RCV_CHANNEL_DATA, io->m_dwRecvThreadID)) {
-							curPort = *port;
+						if ((io->m_bOpened = call_ConnectChannel(io->handle, *port, WM_RCV_CHANNEL_DATA, io->m_dwRecvThreadID))) {
+							io->curPort = *port;
 							break;
 						}
 					}
 					free(ports);
 					ports = NULL;
-					if (m_bOpened) break;
+					if (io->m_bOpened) break;
 				}
 			}
 			if (i >= wait)
@@ -333,6 +378,7 @@ int spddump_main(int argc, char **argv) {
 		}
 	}
 #endif
+	io->pause_on_exit = io->m_bOpened == 1;
 	io->flags |= FLAGS_TRANSCODE;
 	if (stage != -1) {
 		io->flags &= ~FLAGS_CRC16;
@@ -349,7 +395,7 @@ int spddump_main(int argc, char **argv) {
 		}
 		else if (io->recv_buf[2] == BSL_REP_VERIFY_ERROR ||
 			io->recv_buf[2] == BSL_REP_UNSUPPORTED_COMMAND) {
-			if (!fdl1_loaded) {
+			if (!io->fdl1_loaded) {
 				ret = io->recv_buf[2];
 				io->recv_buf[2] = 0;
 			}
@@ -362,29 +408,29 @@ int spddump_main(int argc, char **argv) {
 		}
 		if (ret == BSL_REP_ACK || ret == BSL_REP_VER || ret == BSL_REP_VERIFY_ERROR) {
 			if (ret == BSL_REP_VER) {
-				if (fdl1_loaded == 1) {
+				if (io->fdl1_loaded == 1) {
 					DBG_LOG("CHECK_BAUD FDL1\n");
-					if (!memcmp(io->raw_buf + 4, "SPRD4", 5)) fdl2_executed = -1;
+					if (!memcmp(io->raw_buf + 4, "SPRD4", 5)) io->fdl2_executed = -1;
 				}
 				else {
 					DBG_LOG("CHECK_BAUD bootrom\n");
-					if (!memcmp(io->raw_buf + 4, "SPRD4", 5)) { fdl1_loaded = -1; fdl2_executed = -1; }
+					if (!memcmp(io->raw_buf + 4, "SPRD4", 5)) { io->fdl1_loaded = -1; io->fdl2_executed = -1; }
 				}
 				DBG_LOG("BSL_REP_VER: ");
 				print_string(stderr, io->raw_buf + 4, READ16_BE(io->raw_buf + 2));
 
 				encode_msg_nocpy(io, BSL_CMD_CONNECT, 0);
-				if (send_and_check(io)) exit(1);
+				if (send_and_check(io)) spd_err_exit();
 			}
 			else if (ret == BSL_REP_VERIFY_ERROR) {
 				encode_msg_nocpy(io, BSL_CMD_CONNECT, 0);
-				if (fdl1_loaded != 1) {
-					if (send_and_check(io)) exit(1);
+				if (io->fdl1_loaded != 1) {
+					if (send_and_check(io)) spd_err_exit();
 				}
 				else { i = -1; continue; }
 			}
 
-			if (fdl1_loaded == 1) {
+			if (io->fdl1_loaded == 1) {
 				DBG_LOG("CMD_CONNECT FDL1\n");
 				if (keep_charge) {
 					encode_msg_nocpy(io, BSL_CMD_KEEP_CHARGE, 0);
@@ -400,7 +446,7 @@ int spddump_main(int argc, char **argv) {
 				io->flags &= ~FLAGS_TRANSCODE;
 				DBG_LOG("DISABLE_TRANSCODE\n");
 			}
-			fdl2_executed = 1;
+			io->fdl2_executed = 1;
 			break;
 		}
 		else if (i == 4) {
@@ -410,17 +456,18 @@ int spddump_main(int argc, char **argv) {
 	}
 
 	char **save_argv = NULL;
-	if (fdl1_loaded == -1) argc += 2;
-	if (fdl2_executed == -1) argc += 1;
+	if (io->fdl1_loaded == -1) argc += 2;
+	if (io->fdl2_executed == -1) argc += 1;
 	while (1) {
+		if (argc <= 1 && batch) break;
 		if (argc > 1) {
 			str2 = (char **)malloc(argc * sizeof(char *));
-			if (fdl1_loaded == -1) {
+			if (io->fdl1_loaded == -1) {
 				save_argv = argv;
 				str2[1] = "loadfdl";
 				str2[2] = "0x0";
 			}
-			else if (fdl2_executed == -1) {
+			else if (io->fdl2_executed == -1) {
 				if (!save_argv) save_argv = argv;
 				str2[1] = "exec";
 			}
@@ -438,9 +485,9 @@ int spddump_main(int argc, char **argv) {
 			argcount = 0;
 			in_quote = 0;
 
-			if (fdl2_executed > 0)
+			if (io->fdl2_executed > 0)
 				DBG_LOG("FDL2 >");
-			else if (fdl1_loaded > 0)
+			else if (io->fdl1_loaded > 0)
 				DBG_LOG("FDL1 >");
 			else
 				DBG_LOG("BROM >");
@@ -550,13 +597,13 @@ int spddump_main(int argc, char **argv) {
 				addr = strtoul(str2[3], NULL, 0);
 			}
 
-			if (fdl2_executed > 0) {
+			if (io->fdl2_executed > 0) {
 				DBG_LOG("FDL2 ALREADY EXECUTED, SKIP\n");
 				argc -= argchange; argv += argchange;
 				continue;
 			}
-			else if (fdl1_loaded > 0) {
-				if (fdl2_executed != -1) {
+			else if (io->fdl1_loaded > 0) {
+				if (io->fdl2_executed != -1) {
 					fi = fopen(fn, "r");
 					if (fi == NULL) { DBG_LOG("File does not exist.\n"); argc -= argchange; argv += argchange; continue; }
 					else fclose(fi);
@@ -564,7 +611,7 @@ int spddump_main(int argc, char **argv) {
 				}
 			}
 			else {
-				if (fdl1_loaded != -1) {
+				if (io->fdl1_loaded != -1) {
 					fi = fopen(fn, "r");
 					if (fi == NULL) { DBG_LOG("File does not exist.\n"); argc -= argchange; argv += argchange; continue; }
 					else fclose(fi);
@@ -575,7 +622,7 @@ int spddump_main(int argc, char **argv) {
 							n = gapsize - i;
 							if (n > 528) n = 528;
 							encode_msg_nocpy(io, BSL_CMD_MIDST_DATA, n);
-							if (send_and_check(io)) exit(1);
+							if (send_and_check(io)) spd_err_exit();
 						}
 						fi = fopen(execfile, "rb");
 						if (fi) {
@@ -586,7 +633,7 @@ int spddump_main(int argc, char **argv) {
 							fclose(fi);
 						}
 						encode_msg_nocpy(io, BSL_CMD_MIDST_DATA, execsize);
-						if (send_and_check(io)) exit(1);
+						if (send_and_check(io)) spd_err_exit();
 						free(execfile);
 					}
 					else {
@@ -597,13 +644,13 @@ int spddump_main(int argc, char **argv) {
 						}
 						else {
 							encode_msg_nocpy(io, BSL_CMD_EXEC_DATA, 0);
-							if (send_and_check(io)) exit(1);
+							if (send_and_check(io)) spd_err_exit();
 						}
 					}
 				}
 				else {
 					encode_msg_nocpy(io, BSL_CMD_EXEC_DATA, 0);
-					if (send_and_check(io)) exit(1);
+					if (send_and_check(io)) spd_err_exit();
 				}
 				DBG_LOG("EXEC FDL1\n");
 				if (addr == 0x5500 || addr == 0x65000800) {
@@ -627,7 +674,7 @@ int spddump_main(int argc, char **argv) {
 
 				DBG_LOG("BSL_REP_VER: ");
 				print_string(stderr, io->raw_buf + 4, READ16_BE(io->raw_buf + 2));
-				if (!memcmp(io->raw_buf + 4, "SPRD4", 5)) fdl2_executed = -1;
+				if (!memcmp(io->raw_buf + 4, "SPRD4", 5)) io->fdl2_executed = -1;
 
 #if FDL1_DUMP_MEM
 				//read dump mem
@@ -635,7 +682,7 @@ int spddump_main(int argc, char **argv) {
 				char *pdump;
 				char chdump;
 				FILE *fdump;
-				fdump = my_fopen("memdump.bin", "wb");
+				fdump = my_fopen(io, "memdump.bin", "wb");
 				encode_msg(io, BSL_CMD_CHECK_BAUD, NULL, 1);
 				while (1) {
 					send_msg(io);
@@ -658,7 +705,7 @@ int spddump_main(int argc, char **argv) {
 #endif
 
 				encode_msg_nocpy(io, BSL_CMD_CONNECT, 0);
-				if (send_and_check(io)) exit(1);
+				if (send_and_check(io)) spd_err_exit();
 				DBG_LOG("CMD_CONNECT FDL1\n");
 #if !USE_LIBUSB
 				if (baudrate) {
@@ -675,19 +722,19 @@ int spddump_main(int argc, char **argv) {
 					encode_msg_nocpy(io, BSL_CMD_KEEP_CHARGE, 0);
 					if (!send_and_check(io)) DBG_LOG("KEEP_CHARGE FDL1\n");
 				}
-				fdl1_loaded = 1;
+				io->fdl1_loaded = 1;
 			}
 			argc -= argchange; argv += argchange;
 
 		}
 		else if (!strcmp(str2[1], "exec")) {
-			if (fdl2_executed > 0) {
+			if (io->fdl2_executed > 0) {
 				DBG_LOG("FDL2 ALREADY EXECUTED, SKIP\n");
 				argc -= 1; argv += 1;
 				continue;
 			}
-			else if (fdl1_loaded > 0) {
-				memset(&Da_Info, 0, sizeof(Da_Info));
+			else if (io->fdl1_loaded > 0) {
+				memset(&io->Da_Info, 0, sizeof(io->Da_Info));
 				encode_msg_nocpy(io, BSL_CMD_EXEC_DATA, 0);
 				send_msg(io);
 				// Feature phones respond immediately,
@@ -707,22 +754,22 @@ int spddump_main(int argc, char **argv) {
 				if (ret) {
 					ret = recv_type(io);
 					if (ret != BSL_REP_READ_FLASH_INFO) DBG_LOG("unexpected response (0x%04x)\n", ret);
-					else Da_Info.dwStorageType = 0x101;
+					else io->Da_Info.dwStorageType = 0x101;
 					// need more samples to cover BSL_REP_READ_MCP_TYPE packet to nand_id/nand_info
 					// for nand_id 0x15, packet is 00 9b 00 0c 00 00 00 00 00 02 00 00 00 00 08 00
 				}
-				if (Da_Info.bDisableHDLC) {
+				if (io->Da_Info.bDisableHDLC) {
 					encode_msg_nocpy(io, BSL_CMD_DISABLE_TRANSCODE, 0);
 					if (!send_and_check(io)) {
 						io->flags &= ~FLAGS_TRANSCODE;
 						DBG_LOG("DISABLE_TRANSCODE\n");
 					}
 				}
-				if (Da_Info.bSupportRawData) {
+				if (io->Da_Info.bSupportRawData) {
 					blk_size = 0xf800;
-					io->ptable = partition_list(io, fn_partlist, &io->part_count);
-					if (fdl2_executed) {
-						Da_Info.bSupportRawData = 0;
+					io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
+					if (io->fdl2_executed) {
+						io->Da_Info.bSupportRawData = 0;
 						DBG_LOG("DISABLE_WRITE_RAW_DATA in SPRD4\n");
 					}
 					else {
@@ -730,22 +777,22 @@ int spddump_main(int argc, char **argv) {
 						if (!send_and_check(io)) DBG_LOG("ENABLE_WRITE_RAW_DATA\n");
 					}
 				}
-				else if (highspeed || Da_Info.dwStorageType == 0x103) {
+				else if (highspeed || io->Da_Info.dwStorageType == 0x103) {
 					blk_size = 0xf800;
-					io->ptable = partition_list(io, fn_partlist, &io->part_count);
+					io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
 				}
-				else if (Da_Info.dwStorageType == 0x102) {
-					io->ptable = partition_list(io, fn_partlist, &io->part_count);
+				else if (io->Da_Info.dwStorageType == 0x102) {
+					io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
 				}
-				else if (Da_Info.dwStorageType == 0x101) DBG_LOG("Storage is nand\n");
-				if (gpt_failed != 1) {
-					if (selected_ab == 2) DBG_LOG("Device is using slot b\n");
-					else if (selected_ab == 1) DBG_LOG("Device is using slot a\n");
+				else if (io->Da_Info.dwStorageType == 0x101) DBG_LOG("Storage is nand\n");
+				if (io->gpt_failed != 1) {
+					if (io->selected_ab == 2) DBG_LOG("Device is using slot b\n");
+					else if (io->selected_ab == 1) DBG_LOG("Device is using slot a\n");
 					else {
 						DBG_LOG("Device is not using VAB\n");
-						if (Da_Info.bSupportRawData) {
-							DBG_LOG("RAW_DATA level is %u, but DISABLED for stability, you can set it manually\n", (unsigned)Da_Info.bSupportRawData);
-							Da_Info.bSupportRawData = 0;
+						if (io->Da_Info.bSupportRawData) {
+							DBG_LOG("RAW_DATA level is %u, but DISABLED for stability, you can set it manually\n", (unsigned)io->Da_Info.bSupportRawData);
+							io->Da_Info.bSupportRawData = 0;
 						}
 					}
 				}
@@ -754,7 +801,7 @@ int spddump_main(int argc, char **argv) {
 					nand_info[1] = 32 / (uint8_t)pow(2, (nand_id >> 2) & 3); //spare area size
 					nand_info[2] = 64 * (uint8_t)pow(2, (nand_id >> 4) & 3); //block size
 				}
-				fdl2_executed = 1;
+				io->fdl2_executed = 1;
 			}
 			argc -= 1; argv += 1;
 #if !USE_LIBUSB
@@ -762,21 +809,21 @@ int spddump_main(int argc, char **argv) {
 		else if (!strcmp(str2[1], "baudrate")) {
 			if (argcount > 2) {
 				baudrate = strtoul(str2[2], NULL, 0);
-				if (fdl2_executed) call_SetProperty(io->handle, 0, 100, (LPCVOID)&baudrate);
+				if (io->fdl2_executed) call_SetProperty(io->handle, 0, 100, (LPCVOID)&baudrate);
 			}
 			DBG_LOG("baudrate is %u\n", baudrate);
 			argc -= 2; argv += 2;
 #endif
 		}
 		else if (!strcmp(str2[1], "path")) {
-			if (argcount > 2) strcpy(savepath, str2[2]);
-			DBG_LOG("save dir is %s\n", savepath);
+			if (argcount > 2) strcpy(io->savepath, str2[2]);
+			DBG_LOG("save dir is %s\n", io->savepath);
 			argc -= 2; argv += 2;
 
 		}
 		else if (!strncmp(str2[1], "exec_addr", 9)) {
 			FILE *fi;
-			if (0 == fdl1_loaded && argcount > 2) {
+			if (0 == io->fdl1_loaded && argcount > 2) {
 				exec_addr = strtoul(str2[2], NULL, 0);
 				sprintf(execfile, "custom_exec_no_verify_%x.bin", exec_addr);
 				fi = fopen(execfile, "r");
@@ -790,7 +837,7 @@ int spddump_main(int argc, char **argv) {
 		else if (!strncmp(str2[1], "loadexec", 8)) {
 			const char *fn; char *ch; FILE *fi;
 			if (argcount <= 2) { DBG_LOG("loadexec FILE\n"); argc = 1; continue; }
-			if (0 == fdl1_loaded) {
+			if (0 == io->fdl1_loaded) {
 				strcpy(execfile, str2[2]);
 
 				if ((ch = strrchr(execfile, '/'))) fn = ch + 1;
@@ -869,7 +916,7 @@ int spddump_main(int argc, char **argv) {
 			if (argcount <= 2) { DBG_LOG("size_part part_name\n"); argc = 1; continue; }
 
 			name = str2[2];
-			if (selected_ab < 0) select_ab(io);
+			if (io->selected_ab < 0) select_ab(io);
 			DBG_LOG("%lld\n", (long long)check_partition(io, name, 1));
 			argc -= 2; argv += 2;
 
@@ -889,7 +936,7 @@ int spddump_main(int argc, char **argv) {
 			if (argcount <= 2) { DBG_LOG("check_part part_name\n"); argc = 1; continue; }
 
 			name = str2[2];
-			if (selected_ab < 0) select_ab(io);
+			if (io->selected_ab < 0) select_ab(io);
 			DBG_LOG("%lld\n", (long long)check_partition(io, name, 0));
 			argc -= 2; argv += 2;
 
@@ -905,11 +952,11 @@ int spddump_main(int argc, char **argv) {
 
 			name = str2[2];
 			get_partition_info(io, name, 0);
-			if (!gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 5; argv += 5; continue; }
+			if (!io->gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 5; argv += 5; continue; }
 
-			if (0xffffffff == size) size = check_partition(io, gPartInfo.name, 1);
+			if (0xffffffff == size) size = check_partition(io, io->gPartInfo.name, 1);
 			if (offset + size < offset) { DBG_LOG("64-bit limit reached\n"); argc -= 5; argv += 5; continue; }
-			dump_partition(io, gPartInfo.name, offset, size, fn, blk_size ? blk_size : DEFAULT_BLK_SIZE);
+			dump_partition(io, io->gPartInfo.name, offset, size, fn, blk_size ? blk_size : DEFAULT_BLK_SIZE);
 			argc -= 5; argv += 5;
 
 		}
@@ -919,9 +966,9 @@ int spddump_main(int argc, char **argv) {
 			const char *list[] = { "vbmeta", "splloader", "uboot", "sml", "trustos", "teecfg", "boot", "recovery" };
 			if (argcount <= 2) { DBG_LOG("r all/all_lite/part_name/part_id\n"); argc = 1; continue; }
 			if (!strcmp(name, "preset_modem")) {
-				if (gpt_failed == 1) io->ptable = partition_list(io, fn_partlist, &io->part_count);
+				if (io->gpt_failed == 1) io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
 				if (!io->part_count) { DBG_LOG("Partition table not available\n"); argc -= 2; argv += 2; continue; }
-				if (selected_ab > 0) { DBG_LOG("saving slot info\n"); dump_partition(io, "misc", 0, 1048576, "misc.bin", blk_size); }
+				if (io->selected_ab > 0) { DBG_LOG("saving slot info\n"); dump_partition(io, "misc", 0, 1048576, "misc.bin", blk_size); }
 				for (i = 0; i < io->part_count; i++)
 					if (0 == strncmp("l_", (*(io->ptable + i)).name, 2) || 0 == strncmp("nr_", (*(io->ptable + i)).name, 3)) {
 						char dfile[40];
@@ -932,7 +979,7 @@ int spddump_main(int argc, char **argv) {
 				continue;
 			}
 			else if (!strcmp(name, "all")) {
-				if (gpt_failed == 1) io->ptable = partition_list(io, fn_partlist, &io->part_count);
+				if (io->gpt_failed == 1) io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
 				if (!io->part_count) { DBG_LOG("Partition table not available\n"); argc -= 2; argv += 2; continue; }
 				dump_partition(io, "splloader", 0, 256 * 1024, "splloader.bin", blk_size ? blk_size : DEFAULT_BLK_SIZE);
 				for (i = 0; i < io->part_count; i++) {
@@ -947,7 +994,7 @@ int spddump_main(int argc, char **argv) {
 				continue;
 			}
 			else if (!strcmp(name, "all_lite")) {
-				if (gpt_failed == 1) io->ptable = partition_list(io, fn_partlist, &io->part_count);
+				if (io->gpt_failed == 1) io->ptable = partition_list(io, io->fn_partlist, &io->part_count);
 				if (!io->part_count) { DBG_LOG("Partition table not available\n"); argc -= 2; argv += 2; continue; }
 				dump_partition(io, "splloader", 0, 256 * 1024, "splloader.bin", blk_size ? blk_size : DEFAULT_BLK_SIZE);
 				for (i = 0; i < io->part_count; i++) {
@@ -956,8 +1003,8 @@ int spddump_main(int argc, char **argv) {
 					if (!strncmp((*(io->ptable + i)).name, "blackbox", 8)) continue;
 					else if (!strncmp((*(io->ptable + i)).name, "cache", 5)) continue;
 					else if (!strncmp((*(io->ptable + i)).name, "userdata", 8)) continue;
-					if (selected_ab == 1 && namelen > 2 && 0 == strcmp((*(io->ptable + i)).name + namelen - 2, "_b")) continue;
-					else if (selected_ab == 2 && namelen > 2 && 0 == strcmp((*(io->ptable + i)).name + namelen - 2, "_a")) continue;
+					if (io->selected_ab == 1 && namelen > 2 && 0 == strcmp((*(io->ptable + i)).name + namelen - 2, "_b")) continue;
+					else if (io->selected_ab == 2 && namelen > 2 && 0 == strcmp((*(io->ptable + i)).name + namelen - 2, "_a")) continue;
 					snprintf(dfile, sizeof(dfile), "%s.bin", (*(io->ptable + i)).name);
 					dump_partition(io, (*(io->ptable + i)).name, 0, (*(io->ptable + i)).size, dfile, blk_size ? blk_size : DEFAULT_BLK_SIZE);
 				}
@@ -970,7 +1017,7 @@ int spddump_main(int argc, char **argv) {
 				}
 rloop:
 				get_partition_info(io, name, 1);
-				if (!gPartInfo.size) {
+				if (!io->gPartInfo.size) {
 					if (loop_count) { name = list[--loop_count]; goto rloop; }
 					DBG_LOG("part not exist\n");
 					argc -= 2; argv += 2;
@@ -978,10 +1025,10 @@ rloop:
 				}
 			}
 			char dfile[40];
-			if (isdigit(str2[2][0])) snprintf(dfile, sizeof(dfile), "%s.bin", gPartInfo.name);
+			if (isdigit(str2[2][0])) snprintf(dfile, sizeof(dfile), "%s.bin", io->gPartInfo.name);
 			else if (in_loop) snprintf(dfile, sizeof(dfile), "%s.bin", list[loop_count]);
 			else snprintf(dfile, sizeof(dfile), "%s.bin", name);
-			dump_partition(io, gPartInfo.name, 0, gPartInfo.size, dfile, blk_size ? blk_size : DEFAULT_BLK_SIZE);
+			dump_partition(io, io->gPartInfo.name, 0, io->gPartInfo.size, dfile, blk_size ? blk_size : DEFAULT_BLK_SIZE);
 			if (loop_count--) { name = list[loop_count]; goto rloop; }
 			argc -= 2; argv += 2;
 
@@ -999,11 +1046,11 @@ rloop:
 		}
 		else if (!strcmp(str2[1], "partition_list")) {
 			if (argcount <= 2) { DBG_LOG("partition_list FILE\n"); argc = 1; continue; }
-			if (gpt_failed == 1) io->ptable = partition_list(io, str2[2], &io->part_count);
+			if (io->gpt_failed == 1) io->ptable = partition_list(io, str2[2], &io->part_count);
 			if (!io->part_count) { DBG_LOG("Partition table not available\n"); argc -= 2; argv += 2; continue; }
 			else {
 				DBG_LOG("  0 %36s     256KB\n", "splloader");
-				FILE *fo = my_fopen(str2[2], "wb");
+				FILE *fo = my_fopen(io, str2[2], "wb");
 				if (!fo) ERR_EXIT("fopen failed\n");
 				fprintf(fo, "<Partitions>\n");
 				for (i = 0; i < io->part_count; i++) {
@@ -1038,7 +1085,7 @@ rloop:
 					argc -= 2; argv += 2;
 					continue;
 				}
-				strcpy(gPartInfo.name, "all");
+				strcpy(io->gPartInfo.name, "all");
 			}
 			else {
 				if (!skip_confirm)
@@ -1048,8 +1095,8 @@ rloop:
 					}
 				get_partition_info(io, name, 0);
 			}
-			if (!gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 2; argv += 2; continue; }
-			erase_partition(io, gPartInfo.name);
+			if (!io->gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 2; argv += 2; continue; }
+			erase_partition(io, io->gPartInfo.name);
 			argc -= 2; argv += 2;
 
 		}
@@ -1076,9 +1123,9 @@ rloop:
 					continue;
 				}
 			get_partition_info(io, name, 0);
-			if (!gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 3; argv += 3; continue; }
+			if (!io->gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 3; argv += 3; continue; }
 
-			load_partition_unify(io, gPartInfo.name, fn, blk_size ? blk_size : DEFAULT_BLK_SIZE);
+			load_partition_unify(io, io->gPartInfo.name, fn, blk_size ? blk_size : DEFAULT_BLK_SIZE);
 			argc -= 3; argv += 3;
 
 		}
@@ -1095,20 +1142,20 @@ rloop:
 			const char *fn; FILE *fi;
 			const char *name = str2[2];
 			if (argcount <= 3) { DBG_LOG("w_force part_name/part_id FILE\n"); argc = 1; continue; }
-			if (Da_Info.dwStorageType == 0x101) { DBG_LOG("w_force is not allowed on NAND(UBI) devices\n"); argc -= 3; argv += 3; continue; }
+			if (io->Da_Info.dwStorageType == 0x101) { DBG_LOG("w_force is not allowed on NAND(UBI) devices\n"); argc -= 3; argv += 3; continue; }
 			if (!io->part_count) { DBG_LOG("Partition table not available\n"); argc -= 3; argv += 3; continue; }
 			fn = str2[3];
 			fi = fopen(fn, "r");
 			if (fi == NULL) { DBG_LOG("File does not exist.\n"); argc -= 3; argv += 3; continue; }
 			else fclose(fi);
 			get_partition_info(io, name, 0);
-			if (!gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 3; argv += 3; continue; }
+			if (!io->gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 3; argv += 3; continue; }
 
-			if (!strncmp(gPartInfo.name, "splloader", 9)) { DBG_LOG("blacklist!\n"); argc -= 3; argv += 3; continue; }
+			if (!strncmp(io->gPartInfo.name, "splloader", 9)) { DBG_LOG("blacklist!\n"); argc -= 3; argv += 3; continue; }
 			else if (isdigit(str2[2][0])) load_partition_force(io, atoi(str2[2]) - 1, fn, blk_size ? blk_size : DEFAULT_BLK_SIZE);
 			else {
 				for (i = 0; i < io->part_count; i++)
-					if (!strcmp(gPartInfo.name, (*(io->ptable + i)).name)) {
+					if (!strcmp(io->gPartInfo.name, (*(io->ptable + i)).name)) {
 						load_partition_force(io, i, fn, blk_size ? blk_size : DEFAULT_BLK_SIZE);
 						break;
 					}
@@ -1161,10 +1208,61 @@ rloop:
 #endif
 			argc -= 2; argv += 2;
 
+		}
+		else if (!strcmp(str2[1], "read_window") || !strcmp(str2[1], "rw")) {
+			if (argcount <= 2) { DBG_LOG("read_window count\n\tmax is %d\n", MAX_READ_WINDOW); argc = 1; continue; }
+			io->read_window = strtol(str2[2], NULL, 0);
+			io->read_window = io->read_window < 1 ? 1 : io->read_window > MAX_READ_WINDOW ? MAX_READ_WINDOW : io->read_window;
+			argc -= 2; argv += 2;
+
+		}
+		else if (!strcmp(str2[1], "part_cache")) {
+			if (argcount <= 2) { DBG_LOG("part_cache {0,1,clear}\n"); argc = 1; continue; }
+			if (!strcmp(str2[2], "clear")) part_cache_clear(io);
+			else if (atoi(str2[2])) {
+				if (part_cache_bind(io)) DBG_LOG("chip uid unavailable, partition cache is not saved\n");
+			} else io->pcache_fn[0] = 0;
+			argc -= 2; argv += 2;
+
+		}
+		else if (!strcmp(str2[1], "feed_depth")) {
+			if (argcount <= 2) { DBG_LOG("feed_depth count\n\tmax is %d\n", MAX_FEED_DEPTH); argc = 1; continue; }
+			io->feed_depth = strtol(str2[2], NULL, 0);
+			io->feed_depth = io->feed_depth < 1 ? 1 : io->feed_depth > MAX_FEED_DEPTH ? MAX_FEED_DEPTH : io->feed_depth;
+			argc -= 2; argv += 2;
+
+		}
+#if USE_LIBUSB
+		else if (!strcmp(str2[1], "recv_ring")) {
+			if (argcount <= 2) { DBG_LOG("recv_ring count\n\tmax is %d, 0 reads synchronously\n", MAX_RECV_RING); argc = 1; continue; }
+			recv_ring_stop(io);
+			io->recv_ring_slots = strtol(str2[2], NULL, 0);
+			io->recv_ring_slots = io->recv_ring_slots < 0 ? 0 : io->recv_ring_slots > MAX_RECV_RING ? MAX_RECV_RING : io->recv_ring_slots;
+			argc -= 2; argv += 2;
+
+		}
+		else if (!strcmp(str2[1], "recv_bench")) {
+			uint64_t size;
+			if (argcount <= 3) { DBG_LOG("recv_bench part_name size\n"); argc = 1; continue; }
+			size = str_to_size_ubi(str2[3], nand_info);
+			get_partition_info(io, str2[2], 0);
+			if (!io->gPartInfo.size) { DBG_LOG("part not exist\n"); argc -= 3; argv += 3; continue; }
+			if (size > io->gPartInfo.size) size = io->gPartInfo.size;
+			recv_bench(io, io->gPartInfo.name, size, blk_size ? blk_size : DEFAULT_BLK_SIZE);
+			argc -= 3; argv += 3;
+
+		}
+#endif
+		else if (!strcmp(str2[1], "patch_mode")) {
+			if (argcount <= 2) { DBG_LOG("patch_mode {0,1,2}\n"); argc = 1; continue; }
+			io->part_rmw = atoi(str2[2]);
+			io->part_rmw = io->part_rmw < 0 ? 0 : io->part_rmw > 2 ? 2 : io->part_rmw;
+			argc -= 2; argv += 2;
+
 		}
 		else if (!strcmp(str2[1], "fblk_size") || !strcmp(str2[1], "fbs")) {
 			if (argcount <= 2) { DBG_LOG("fblk_size mb\n"); argc = 1; continue; }
-			fblk_size = strtoull(str2[2], NULL, 0) * 1024 * 1024;
+			io->fblk_size = strtoull(str2[2], NULL, 0) * 1024 * 1024;
 			argc -= 2; argv += 2;
 
 		}
@@ -1210,13 +1308,13 @@ rloop:
 		}
 		else if (!strcmp(str2[1], "rawdata")) {
 			if (argcount <= 2) { DBG_LOG("rawdata {0,1,2}\n"); argc = 1; continue; }
-			Da_Info.bSupportRawData = atoi(str2[2]);
+			io->Da_Info.bSupportRawData = atoi(str2[2]);
 			argc -= 2; argv += 2;
 
 		}
 		else if (!strcmp(str2[1], "slot")) {
 			if (argcount <= 2) { DBG_LOG("slot {0,1,2}\n"); argc = 1; continue; }
-			selected_ab = atoi(str2[2]);
+			io->selected_ab = atoi(str2[2]);
 			argc -= 2; argv += 2;
 
 		}
@@ -1269,7 +1367,7 @@ rloop:
 
 		}
 		else if (!strcmp(str2[1], "reset")) {
-			if (!fdl1_loaded) {
+			if (!io->fdl1_loaded) {
 				DBG_LOG("FDL NOT READY\n");
 				argc -= 1; argv += 1;
 				continue;
@@ -1279,7 +1377,7 @@ rloop:
 
 		}
 		else if (!strcmp(str2[1], "reboot-recovery")) {
-			if (!fdl1_loaded) {
+			if (!io->fdl1_loaded) {
 				DBG_LOG("FDL NOT READY\n");
 				argc -= 1; argv += 1;
 				continue;
@@ -1295,7 +1393,7 @@ rloop:
 
 		}
 		else if (!strcmp(str2[1], "reboot-fastboot")) {
-			if (!fdl1_loaded) {
+			if (!io->fdl1_loaded) {
 				DBG_LOG("FDL NOT READY\n");
 				argc -= 1; argv += 1;
 				continue;
@@ -1312,7 +1410,7 @@ rloop:
 
 		}
 		else if (!strcmp(str2[1], "poweroff")) {
-			if (!fdl1_loaded) {
+			if (!io->fdl1_loaded) {
 				DBG_LOG("FDL NOT READY\n");
 				argc -= 1; argv += 1;
 				continue;
@@ -1335,11 +1433,11 @@ rloop:
 			for (i = 1; i < argcount; i++)
 				free(str2[i]);
 		free(str2);
-		if (m_bOpened == -1) {
+		if (io->m_bOpened == -1) {
+			io->pause_on_exit = 0;
 			DBG_LOG("device removed, exiting...\n");
 			break;
 		}
 	}
-	spdio_free(io);
 	return 0;
 }
@@ -0,0 +1,54 @@
+#include "utils/rtt_estimator.h"
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+void RttEstimator::Init(const char* name, double initialMs, double minMs, double maxMs) {
+    *this = RttEstimator();
+    this->name = name;
+    this->initialMs = initialMs;
+    this->minMs = minMs;
+    this->maxMs = max(maxMs, minMs);
+}
+
+
+void RttEstimator::Sample(double ms) {
+    ms = max(ms, 0.0);
+    if (samples == 0) {
+        srtt = ms;
+        rttvar = ms / 2;
+    } else {
+        rttvar = 0.75 * rttvar + 0.25 * fabs(srtt - ms);
+        srtt = 0.875 * srtt + 0.125 * ms;
+    }
+    lastMs = ms;
+    peakMs = max(peakMs, ms);
+    samples++;
+    backoff = 0;
+}
+
+
+void RttEstimator::OnTimeout() {
+    timeouts++;
+    if (backoff < RTT_MAX_BACKOFF) backoff++;
+}
+
+
+int RttEstimator::TimeoutMs() const {
+    double rto = samples ? srtt + max(RTT_GRANULARITY_MS, 4 * rttvar) : initialMs;
+    rto *= (double) (1 << backoff);
+    if (maxMs > 0) rto = min(rto, maxMs);
+    rto = max(rto, minMs);
+    return (int) ceil(rto);
+}
+
+
+string RttEstimator::Describe() const {
+    char buf[160];
+    snprintf(buf, sizeof(buf), "SRTT=%.1fms RTTVAR=%.1fms 最大=%.1fms 超时=%dms 样本=%llu 超时次数=%llu",
+        srtt, rttvar, peakMs, TimeoutMs(), (unsigned long long) samples, (unsigned long long) timeouts);
+    return buf;
+}
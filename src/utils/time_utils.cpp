@@ -1,4 +1,10 @@
 #include "utils/time_utils.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
 
 
 using namespace std;
@@ -12,6 +18,35 @@ double time_utils::get_time_ms() {
     return (double) duration_cast<milliseconds>(high_resolution_clock::now().time_since_epoch()).count();
 }
 
+double time_utils::get_cpu_time() {
+#ifdef _WIN32
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    if (!GetProcessTimes(GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser)) return 0;
+    uint64_t kernel = ((uint64_t) ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+    uint64_t user = ((uint64_t) ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+    // FILETIME的单位是100纳秒
+    return (double) (kernel + user) / 1e7;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+double time_utils::get_thread_cpu_time() {
+#ifdef _WIN32
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    if (!GetThreadTimes(GetCurrentThread(), &ftCreate, &ftExit, &ftKernel, &ftUser)) return 0;
+    uint64_t kernel = ((uint64_t) ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+    uint64_t user = ((uint64_t) ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+    return (double) (kernel + user) / 1e7;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
 string strftime_expand(const string& fmt, const tm& tm) {
     size_t size = fmt.size() + 64;
     vector<char> buf(size);
@@ -4,6 +4,30 @@
 
 using namespace std;
 
+bool usb_utils::ParseLocationPath(const string& location, string* controller, string* portPath) {
+    size_t root = location.find("#USBROOT(");
+    if (root == string::npos) return false;
+    size_t end = location.find(')', root);
+    if (end == string::npos) return false;
+    *controller = location.substr(0, end + 1);
+    portPath->clear();
+    // 后面每一级都是 #USB(n)，复合设备的接口是 #USBMI(n)，不算端口
+    for (size_t pos = location.find("#USB(", end); pos != string::npos; pos = location.find("#USB(", pos + 1)) {
+        if (!portPath->empty()) *portPath += '.';
+        *portPath += to_string(atoi(location.c_str() + pos + 5));
+    }
+    return true;
+}
+
+
+string usb_utils::HubPath(const string& portPath) {
+    // Linux下的端口路径形如"1-2.3"，Windows下形如"2.3"，集线器都是去掉最后一级
+    size_t pos = portPath.find_last_of(".-");
+    if (pos == string::npos) return string();
+    return portPath.substr(0, pos);
+}
+
+
 // DeepSeek写的（
 vector<usb_utils::COMPortInfo> usb_utils::GetCOMPorts() {
     vector<COMPortInfo> comPorts;
@@ -67,7 +91,27 @@ vector<usb_utils::COMPortInfo> usb_utils::GetCOMPorts() {
                                 deviceName = deviceName.substr(0, lastChar + 1);
                             }
 
-                            comPorts.push_back({ portNum, deviceName });
+                            COMPortInfo info = { portNum, deviceName };
+                            // 实例ID里带有VID和PID，设备监视器靠它识别重新枚举的设备
+                            char instanceId[MAX_PATH] = { 0 };
+                            if (SetupDiGetDeviceInstanceIdA(hDevInfo, &devInfoData, instanceId,
+                                sizeof(instanceId), NULL)) {
+                                info.instanceId = instanceId;
+                                unsigned int vid = 0, pid = 0;
+                                const char* v = strstr(instanceId, "VID_");
+                                const char* p = strstr(instanceId, "PID_");
+                                if (v) sscanf(v + 4, "%4x", &vid);
+                                if (p) sscanf(p + 4, "%4x", &pid);
+                                info.vid = (uint16_t) vid;
+                                info.pid = (uint16_t) pid;
+                            }
+                            // 位置路径是多个字符串，第一个是PCI路径，调度器用它区分主控制器和集线器
+                            char location[1024] = { 0 };
+                            if (SetupDiGetDeviceRegistryPropertyA(hDevInfo, &devInfoData, SPDRP_LOCATION_PATHS,
+                                NULL, (PBYTE) location, sizeof(location) - 2, NULL)) {
+                                ParseLocationPath(location, &info.controller, &info.portPath);
+                            }
+                            comPorts.push_back(info);
                         } catch (const exception&) {
                             // 忽略无法转换为数字的端口号然后输出警告信息
                             // LWARN(...);